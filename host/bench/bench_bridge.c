@@ -0,0 +1,330 @@
+/* End-to-end cost of the bridge core for a Home Assistant traffic mix:
+ * MQTT command -> route -> parse -> mesh command -> (mocked) mesh -> shadow
+ * -> HA state publish, plus lamp status messages coming back from the mesh.
+ * Built once per table size (MAX_LAMPS = 20, 200, 2000). */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "bench_heap.h"
+#include "mock_io.h"
+#include "bridge.h"
+#include "lamp_registry.h"
+#include "light_fade.h"
+#include "light_scale.h"
+#include "mqtt_router.h"
+
+#define ITERATIONS  500000
+#define MSG_COUNT   4096
+// Lamps per group, or fewer if the table is small
+#define GROUP_SIZE  (MAX_LAMPS / MAX_GROUPS < 10 ? MAX_LAMPS / MAX_GROUPS : 10)
+#define LAMP_ADDR(i)    (0x0100 + (i))
+#define GROUP_ADDR(g)   (GROUP_ADDR_MIN + (g))
+
+// Clock of the announcement pacing, moved by hand in self_check()
+static int64_t s_now_us;
+
+int64_t esp_timer_get_time(void)
+{
+    return s_now_us;
+}
+
+typedef enum {
+    MSG_BRIGHTNESS,     /* Slider drags dominate */
+    MSG_ONOFF,
+    MSG_COLOR,          /* Colour with brightness */
+    MSG_COLOR_ONLY,     /* Colour wheel, keeps the lamp's brightness */
+    MSG_GROUP,          /* Brightness or on/off for a group */
+    MSG_STATUS,         /* Lamp status from the mesh (poll answers, wall switches) */
+} msg_kind_t;
+
+// Percent of the mix per kind
+static const int s_mix[] = {
+    [MSG_BRIGHTNESS] = 36,
+    [MSG_ONOFF] = 18,
+    [MSG_COLOR] = 10,
+    [MSG_COLOR_ONLY] = 6,
+    [MSG_GROUP] = 10,
+    [MSG_STATUS] = 20,
+};
+
+typedef struct {
+    msg_kind_t kind;
+    char topic[64];
+    int topic_len;
+    char payload[96];
+    int payload_len;
+    uint16_t addr;          /* MSG_STATUS */
+    lamp_shadow_t update;   /* MSG_STATUS */
+} bench_msg_t;
+
+static bench_msg_t s_msgs[MSG_COUNT];
+static uint32_t s_rng = 2463534242u;
+
+static uint32_t next_random(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "self-check failed: %s\n", what);
+        exit(1);
+    }
+}
+
+// Function to fill the registry the way lamp_nvs_init() does from the stored table
+static void setup_lamps(void)
+{
+    lamp_registry_init();
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        LampInfo lamp_info = {
+            .address = LAMP_ADDR(i),
+            // Every tenth lamp runs in acknowledged mode
+            .flags = i % 10 == 9 ? LAMP_FLAG_ACKED : 0,
+        };
+        snprintf(lamp_info.name, sizeof(lamp_info.name), "Lamp %04d", i);
+        lamp_registry_set(i, &lamp_info);
+    }
+    for (int g = 0; g < MAX_GROUPS; g++) {
+        GroupInfo group_info = { .address = GROUP_ADDR(g) };
+        snprintf(group_info.name, sizeof(group_info.name), "Group %d", g);
+        for (int m = 0; m < GROUP_SIZE; m++) {
+            group_set_member(&group_info, g * (MAX_LAMPS / MAX_GROUPS) + m, true);
+        }
+        lamp_registry_group_set(g, &group_info);
+    }
+}
+
+static msg_kind_t pick_kind(void)
+{
+    int roll = next_random() % 100;
+    for (int kind = 0; kind < (int)(sizeof(s_mix) / sizeof(s_mix[0])); kind++) {
+        if (roll < s_mix[kind]) {
+            return kind;
+        }
+        roll -= s_mix[kind];
+    }
+    return MSG_STATUS;
+}
+
+static void setup_messages(void)
+{
+    for (int i = 0; i < MSG_COUNT; i++) {
+        bench_msg_t *msg = &s_msgs[i];
+        int lamp = next_random() % MAX_LAMPS;
+        int brightness = next_random() % 101;
+        msg->kind = pick_kind();
+        if (msg->kind == MSG_GROUP) {
+            msg->topic_len = snprintf(msg->topic, sizeof(msg->topic), HA_TOPIC_PREFIX "Group_%d/set",
+                                      (int)(next_random() % MAX_GROUPS));
+        } else {
+            msg->topic_len = snprintf(msg->topic, sizeof(msg->topic), HA_TOPIC_PREFIX "Lamp_%04d/set", lamp);
+        }
+
+        switch (msg->kind) {
+        case MSG_BRIGHTNESS:
+        case MSG_GROUP:
+            msg->payload_len = snprintf(msg->payload, sizeof(msg->payload),
+                                        "{\"state\":\"ON\",\"brightness\":%d}", brightness);
+            break;
+        case MSG_ONOFF:
+            msg->payload_len = snprintf(msg->payload, sizeof(msg->payload),
+                                        "{\"state\":\"%s\"}", next_random() & 1 ? "ON" : "OFF");
+            break;
+        case MSG_COLOR:
+            msg->payload_len = snprintf(msg->payload, sizeof(msg->payload),
+                                        "{\"state\":\"ON\",\"brightness\":%d,\"color\":{\"h\":%.1f,\"s\":%.1f}}",
+                                        brightness, (next_random() % 3600) / 10.0, (next_random() % 1000) / 10.0);
+            break;
+        case MSG_COLOR_ONLY:
+            msg->payload_len = snprintf(msg->payload, sizeof(msg->payload),
+                                        "{\"state\":\"ON\",\"color\":{\"h\":%.1f,\"s\":%.1f}}",
+                                        (next_random() % 3600) / 10.0, (next_random() % 1000) / 10.0);
+            break;
+        case MSG_STATUS:
+            // Most status messages repeat what the bridge already knows
+            msg->addr = LAMP_ADDR(lamp);
+            msg->update.known = LAMP_SHADOW_ONOFF | LAMP_SHADOW_LIGHTNESS;
+            msg->update.lightness = (next_random() % 3) * 0x7FFF;
+            msg->update.onoff = msg->update.lightness > 0;
+            break;
+        }
+    }
+}
+
+static void run_message(const bench_msg_t *msg)
+{
+    if (msg->kind == MSG_STATUS) {
+        bridge_lamp_status(msg->addr, &msg->update);
+        return;
+    }
+    mqtt_route_t route;
+    mqtt_route(msg->topic, msg->topic_len, &route);
+    bridge_handle_command(&route, msg->payload, msg->payload_len, 0);
+    mock_mesh_drain();
+}
+
+static void self_check(void)
+{
+    bench_msg_t msg = { .kind = MSG_BRIGHTNESS };
+    msg.topic_len = snprintf(msg.topic, sizeof(msg.topic), HA_TOPIC_PREFIX "Lamp_0003/set");
+    msg.payload_len = snprintf(msg.payload, sizeof(msg.payload), "{\"state\":\"ON\",\"brightness\":37}");
+    run_message(&msg);
+    check(strcmp(mock_mqtt_last_topic(), HA_TOPIC_PREFIX "Lamp_0003/state") == 0, "state topic");
+    check(strcmp(mock_mqtt_last_payload(), "{\"state\":\"ON\",\"brightness\":37}") == 0, "state payload");
+
+    // Colour only keeps the brightness
+    msg.payload_len = snprintf(msg.payload, sizeof(msg.payload), "{\"color\":{\"h\":180,\"s\":50}}");
+    run_message(&msg);
+    check(strstr(mock_mqtt_last_payload(), "\"brightness\":37") != NULL, "kept brightness");
+
+    // A group command updates the group and every member
+    mock_io_take();
+    msg.topic_len = snprintf(msg.topic, sizeof(msg.topic), HA_TOPIC_PREFIX "Group_1/set");
+    msg.payload_len = snprintf(msg.payload, sizeof(msg.payload), "{\"state\":\"OFF\"}");
+    run_message(&msg);
+    mock_io_stats_t stats = mock_io_take();
+    check(stats.sent == 1 && stats.publishes == 1 + GROUP_SIZE, "group fan-out");
+
+    // An unchanged status is not published again
+    lamp_shadow_t update = { .known = LAMP_SHADOW_ONOFF, .onoff = 0 };
+    bridge_lamp_status(LAMP_ADDR(MAX_LAMPS / MAX_GROUPS), &update);
+    check(mock_io_take().publishes == 0, "unchanged status");
+
+    // Announcements are paced, and a second round finds every config unchanged
+    bridge_announce_all();
+    bridge_announce_pump();
+    check(mock_io_take().publishes == CONFIG_HA_ANNOUNCE_BURST, "announce burst");
+    while (bridge_announce_pump() != UINT32_MAX) {
+        s_now_us += 1000000 / CONFIG_HA_ANNOUNCE_RATE;
+    }
+    bridge_announce_stats_t first;
+    bridge_get_announce_stats(&first);
+    bridge_announce_all();
+    while (bridge_announce_pump() != UINT32_MAX) {
+        s_now_us += 1000000 / CONFIG_HA_ANNOUNCE_RATE;
+    }
+    bridge_announce_stats_t second;
+    bridge_get_announce_stats(&second);
+    check(first.configs > 0 && second.configs == first.configs &&
+          second.unchanged - first.unchanged == first.configs && second.pending == 0, "unchanged configs");
+    mock_io_take();
+
+    // With the outbox full a lamp keeps one pending state, sent with the latest values later
+    msg.topic_len = snprintf(msg.topic, sizeof(msg.topic), HA_TOPIC_PREFIX "Lamp_0003/set");
+    mock_mqtt_refuse(true);
+    for (int brightness = 10; brightness <= 50; brightness += 10) {
+        msg.payload_len = snprintf(msg.payload, sizeof(msg.payload),
+                                   "{\"state\":\"ON\",\"brightness\":%d}", brightness);
+        run_message(&msg);
+    }
+    bridge_announce_stats_t refused;
+    bridge_get_announce_stats(&refused);
+    check(refused.pending == 1 && refused.refused - second.refused == 1 && refused.replaced - second.replaced == 4,
+          "one pending state");
+    mock_mqtt_refuse(false);
+    mock_io_take();
+    while (bridge_announce_pump() != UINT32_MAX) {
+        s_now_us += 1000000 / CONFIG_HA_ANNOUNCE_RATE;
+    }
+    check(mock_io_take().publishes == 1 && strstr(mock_mqtt_last_payload(), "\"brightness\":50") != NULL,
+          "latest pending state");
+
+    // A refused removal is sent by the pump before the config queued after it
+    mock_mqtt_refuse(true);
+    bridge_remove_discovery(3, HA_TOPIC_PREFIX "Lamp_0003/config");
+    bridge_announce(3);
+    mock_mqtt_refuse(false);
+    bridge_get_announce_stats(&refused);
+    check(refused.removals_refused == 1 && refused.removals_pending == 1, "refused removal queued");
+    mock_io_take();
+    while (bridge_announce_pump() != UINT32_MAX) {
+        s_now_us += 1000000 / CONFIG_HA_ANNOUNCE_RATE;
+    }
+    bridge_get_announce_stats(&refused);
+    check(mock_io_take().publishes == 3 && refused.removals == 1 && refused.removals_pending == 0 &&
+          strstr(mock_mqtt_last_payload(), "\"state\"") != NULL, "removal retried before the config");
+
+    // A transition is the mesh Transition Time: 100 ms steps up to 6.2 s, then 1 s steps
+    check(light_transition_to_mesh(0.0f) == 0 && light_transition_to_mesh(2.0f) == 20 &&
+          light_transition_to_mesh(10.0f) == (1 << 6 | 10), "transition time");
+
+    // A lamp that ignores it is faded in at most CONFIG_LIGHT_FADE_MAX_STEPS steps,
+    // only the end is published
+    LampInfo lamp_info;
+    lamp_registry_get(5, &lamp_info);
+    lamp_info.flags |= LAMP_FLAG_FADE;
+    lamp_registry_set(5, &lamp_info);
+    msg.topic_len = snprintf(msg.topic, sizeof(msg.topic), HA_TOPIC_PREFIX "Lamp_0005/set");
+    msg.payload_len = snprintf(msg.payload, sizeof(msg.payload), "{\"state\":\"ON\",\"brightness\":100}");
+    run_message(&msg);
+    mock_io_take();
+    msg.payload_len = snprintf(msg.payload, sizeof(msg.payload),
+                               "{\"state\":\"ON\",\"brightness\":20,\"transition\":10}");
+    run_message(&msg);
+    while (bridge_fade_run() != UINT32_MAX) {
+        mock_mesh_drain();
+        s_now_us += 50000;
+    }
+    mock_mesh_drain();
+    mock_io_stats_t fade = mock_io_take();
+    check(fade.sent == CONFIG_LIGHT_FADE_MAX_STEPS && fade.publishes == 1 &&
+          strstr(mock_mqtt_last_payload(), "\"brightness\":20") != NULL, "bridge fade");
+
+    // Without a known state (not polled since a restart) the target is sent at once, not faded from a guess
+    lamp_shadow_clear(5);
+    light_fade_stats_t before;
+    light_fade_get_stats(&before);
+    msg.payload_len = snprintf(msg.payload, sizeof(msg.payload), "{\"brightness\":30,\"transition\":2}");
+    run_message(&msg);
+    light_fade_stats_t after;
+    light_fade_get_stats(&after);
+    mock_mesh_drain();
+    check(after.started == before.started && mock_io_take().sent == 1, "no fade from an unknown state");
+    lamp_info.flags &= ~LAMP_FLAG_FADE;
+    lamp_registry_set(5, &lamp_info);
+}
+
+static void bench_bridge(void)
+{
+    char name[40];
+    snprintf(name, sizeof(name), "bridge mix, %d lamps", MAX_LAMPS);
+
+    // One pass to fill the shadows and state caches, as after some uptime
+    for (int i = 0; i < MSG_COUNT; i++) {
+        run_message(&s_msgs[i]);
+    }
+    mock_io_take();
+    bench_heap_take();
+
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        run_message(&s_msgs[i % MSG_COUNT]);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_heap_stats_t heap = bench_heap_take();
+    mock_io_stats_t io = mock_io_take();
+
+    bench_alloc_stats_t allocs = { .allocs = heap.allocs, .bytes = heap.bytes };
+    bench_report(name, ITERATIONS, elapsed, allocs);
+    printf("%-28s %10zu peak heap bytes %6.2f publishes/msg %6.2f mesh cmds/msg %" PRIu64 " dropped\n", "",
+           heap.peak, (double)io.publishes / ITERATIONS, (double)io.sent / ITERATIONS, io.dropped);
+}
+
+int main(void)
+{
+    setup_lamps();
+    mock_io_init();
+    self_check();
+    setup_messages();
+    bench_bridge();
+    return 0;
+}
@@ -0,0 +1,115 @@
+/* Per-message cost of parsing Home Assistant light commands:
+ * ha_json_parse_light_cmd() against the cJSON tree the firmware used before. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "ha_json.h"
+#ifdef HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+#define ITERATIONS 1000000
+
+// Typical traffic: slider drags dominate, with some on/off and colour changes
+static const char *s_messages[] = {
+    "{\"state\":\"ON\",\"brightness\":37}",
+    "{\"state\":\"ON\",\"brightness\":38}",
+    "{\"state\":\"ON\",\"brightness\":40}",
+    "{\"state\":\"ON\"}",
+    "{\"state\":\"OFF\"}",
+    "{\"state\":\"ON\",\"color\":{\"h\":212.4,\"s\":78.2}}",
+    "{\"state\":\"ON\",\"brightness\":80,\"color\":{\"h\":30,\"s\":100},\"transition\":2}",
+    "{\"state\":\"ON\",\"effect\":\"none\",\"brightness\":55,\"transition\":0.5}",
+};
+#define MESSAGE_COUNT (sizeof(s_messages) / sizeof(s_messages[0]))
+
+static volatile float s_sink;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "self-check failed: %s\n", what);
+        exit(1);
+    }
+}
+
+static void self_check(void)
+{
+    ha_light_cmd_t cmd;
+    const char *msg = s_messages[6];
+    check(ha_json_parse_light_cmd(msg, strlen(msg), &cmd) == ESP_OK, "parse");
+    check(cmd.fields == (HA_CMD_STATE | HA_CMD_BRIGHTNESS | HA_CMD_COLOR | HA_CMD_TRANSITION), "fields");
+    check(cmd.on && cmd.brightness == 80 && cmd.hue == 30.0f && cmd.saturation == 100.0f, "values");
+    check(cmd.transition == 2.0f, "transition");
+    // Payloads are not NUL-terminated, a truncated buffer must be rejected
+    check(ha_json_parse_light_cmd(msg, strlen(msg) - 1, &cmd) != ESP_OK, "truncated");
+    msg = "{\"brightness\":1e99}";
+    check(ha_json_parse_light_cmd(msg, strlen(msg), &cmd) == ESP_OK && cmd.brightness == 255, "brightness clamp");
+    msg = "{\"state\":\"DIM\"}";
+    check(ha_json_parse_light_cmd(msg, strlen(msg), &cmd) == ESP_ERR_INVALID_ARG, "unknown state");
+}
+
+static void bench_ha_json(void)
+{
+    size_t lengths[MESSAGE_COUNT];
+    for (size_t i = 0; i < MESSAGE_COUNT; i++) {
+        lengths[i] = strlen(s_messages[i]);
+    }
+
+    bench_alloc_take();
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        ha_light_cmd_t cmd;
+        size_t n = i % MESSAGE_COUNT;
+        ha_json_parse_light_cmd(s_messages[n], lengths[n], &cmd);
+        s_sink = cmd.brightness + cmd.hue;
+    }
+    bench_report("ha_json_parse_light_cmd", ITERATIONS, bench_now_ns() - start, bench_alloc_take());
+}
+
+#ifdef HAVE_CJSON
+static void bench_cjson(void)
+{
+    cJSON_Hooks hooks = { .malloc_fn = bench_malloc, .free_fn = bench_free };
+    cJSON_InitHooks(&hooks);
+
+    size_t lengths[MESSAGE_COUNT];
+    for (size_t i = 0; i < MESSAGE_COUNT; i++) {
+        lengths[i] = strlen(s_messages[i]);
+    }
+
+    bench_alloc_take();
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        size_t n = i % MESSAGE_COUNT;
+        cJSON *json = cJSON_ParseWithLength(s_messages[n], lengths[n]);
+        cJSON *brightness = cJSON_GetObjectItemCaseSensitive(json, "brightness");
+        cJSON *color = cJSON_GetObjectItemCaseSensitive(json, "color");
+        float value = cJSON_IsNumber(brightness) ? brightness->valueint : 0;
+        if (color) {
+            cJSON *h = cJSON_GetObjectItemCaseSensitive(color, "h");
+            if (cJSON_IsNumber(h)) {
+                value += h->valuedouble;
+            }
+        }
+        s_sink = value;
+        cJSON_Delete(json);
+    }
+    bench_report("cJSON_ParseWithLength", ITERATIONS, bench_now_ns() - start, bench_alloc_take());
+}
+#endif
+
+int main(void)
+{
+    self_check();
+    bench_ha_json();
+#ifdef HAVE_CJSON
+    bench_cjson();
+#else
+    printf("cJSON baseline skipped (cJSON not found at configure time)\n");
+#endif
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* Per-publish cost of serializing Home Assistant light states:
+ * ha_state_format() into a reused buffer against building a cJSON object. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_util.h"
+#include "ha_state.h"
+#ifdef HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+#define ITERATIONS 1000000
+
+static const ha_light_state_t s_states[] = {
+    { .fields = HA_STATE_BRIGHTNESS, .on = true, .brightness = 37 },
+    { .fields = HA_STATE_BRIGHTNESS, .on = true, .brightness = 100 },
+    { .on = true },
+    { .on = false },
+    { .fields = HA_STATE_BRIGHTNESS | HA_STATE_COLOR, .on = true, .brightness = 80, .hue = 212.4f, .saturation = 78.2f },
+    { .fields = HA_STATE_BRIGHTNESS | HA_STATE_COLOR, .on = true, .brightness = 5, .hue = 30.0f, .saturation = 100.0f },
+};
+#define STATE_COUNT (sizeof(s_states) / sizeof(s_states[0]))
+
+static volatile size_t s_sink;
+
+static void self_check(void)
+{
+    char buf[HA_STATE_MAX_LEN];
+    const char *expected = "{\"state\":\"ON\",\"brightness\":80,\"color_mode\":\"hs\",\"color\":{\"h\":212.4,\"s\":78.2}}";
+    int len = ha_state_format(buf, sizeof(buf), &s_states[4]);
+    if (len != (int)strlen(expected) || strcmp(buf, expected) != 0) {
+        fprintf(stderr, "self-check failed: %s\n", buf);
+        exit(1);
+    }
+    ha_light_state_t worst = { .fields = HA_STATE_BRIGHTNESS | HA_STATE_COLOR, .brightness = 100, .hue = 359.9f, .saturation = 99.9f };
+    if (ha_state_format(buf, sizeof(buf), &worst) < 0 || ha_state_format(buf, 10, &worst) != -1) {
+        fprintf(stderr, "self-check failed: buffer bounds\n");
+        exit(1);
+    }
+}
+
+static void bench_ha_state(void)
+{
+    static char buffer[HA_STATE_MAX_LEN];
+    uint64_t bytes = 0;
+
+    bench_alloc_take();
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        int len = ha_state_format(buffer, sizeof(buffer), &s_states[i % STATE_COUNT]);
+        bytes += len;
+        s_sink = len;
+    }
+    bench_report("ha_state_format", ITERATIONS, bench_now_ns() - start, bench_alloc_take());
+    printf("%-28s %10.1f payload bytes/publish\n", "", (double)bytes / ITERATIONS);
+}
+
+#ifdef HAVE_CJSON
+static void bench_cjson(void)
+{
+    cJSON_Hooks hooks = { .malloc_fn = bench_malloc, .free_fn = bench_free };
+    cJSON_InitHooks(&hooks);
+    uint64_t bytes = 0;
+
+    bench_alloc_take();
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < ITERATIONS; i++) {
+        const ha_light_state_t *state = &s_states[i % STATE_COUNT];
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddItemToObject(root, "state", cJSON_CreateString(state->on ? "ON" : "OFF"));
+        if (state->fields & HA_STATE_BRIGHTNESS) {
+            cJSON_AddItemToObject(root, "brightness", cJSON_CreateNumber(state->brightness));
+        }
+        if (state->fields & HA_STATE_COLOR) {
+            cJSON *color = cJSON_CreateObject();
+            cJSON_AddItemToObject(root, "color", color);
+            cJSON_AddNumberToObject(color, "h", state->hue);
+            cJSON_AddNumberToObject(color, "s", state->saturation);
+        }
+        char *string = cJSON_PrintUnformatted(root);
+        bytes += strlen(string);
+        s_sink = bytes;
+        // The firmware never freed these, the benchmark does to stay alive
+        bench_free(string);
+        cJSON_Delete(root);
+    }
+    bench_report("cJSON_PrintUnformatted", ITERATIONS, bench_now_ns() - start, bench_alloc_take());
+    printf("%-28s %10.1f payload bytes/publish\n", "", (double)bytes / ITERATIONS);
+}
+#endif
+
+int main(void)
+{
+    self_check();
+    bench_ha_state();
+#ifdef HAVE_CJSON
+    bench_cjson();
+#else
+    printf("cJSON baseline skipped (cJSON not found at configure time)\n");
+#endif
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "bench_heap.h"
+#include <stddef.h>
+#include <string.h>
+
+// Each block carries its size in front, aligned like malloc's own blocks
+#define HEADER_SIZE sizeof(max_align_t)
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static bench_heap_stats_t s_heap;
+
+static void *account(void *block, size_t size)
+{
+    if (block == NULL) {
+        return NULL;
+    }
+    memcpy(block, &size, sizeof(size));
+    s_heap.allocs++;
+    s_heap.bytes += size;
+    s_heap.live += size;
+    if (s_heap.live > s_heap.peak) {
+        s_heap.peak = s_heap.live;
+    }
+    return (char *)block + HEADER_SIZE;
+}
+
+static void *header_of(void *ptr, size_t *size)
+{
+    void *block = (char *)ptr - HEADER_SIZE;
+    memcpy(size, block, sizeof(*size));
+    return block;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    return account(__real_malloc(size + HEADER_SIZE), size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    size_t total = count * size;
+    if (size != 0 && total / size != count) {
+        return NULL;
+    }
+    void *ptr = __wrap_malloc(total);
+    if (ptr) {
+        memset(ptr, 0, total);
+    }
+    return ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    size_t size;
+    void *block = header_of(ptr, &size);
+    s_heap.live -= size;
+    __real_free(block);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return __wrap_malloc(size);
+    }
+    size_t old_size;
+    void *block = header_of(ptr, &old_size);
+    void *moved = __real_realloc(block, size + HEADER_SIZE);
+    if (moved == NULL) {
+        return NULL;
+    }
+    s_heap.live -= old_size;
+    return account(moved, size);
+}
+
+bench_heap_stats_t bench_heap_take(void)
+{
+    bench_heap_stats_t stats = s_heap;
+    s_heap.allocs = 0;
+    s_heap.bytes = 0;
+    s_heap.peak = s_heap.live;
+    return stats;
+}
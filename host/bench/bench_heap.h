@@ -0,0 +1,21 @@
+#ifndef BENCH_HEAP_H
+#define BENCH_HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Heap accounting for whole programs: link with
+//   -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free
+// and every allocation of the code under test is counted, without hooks.
+
+typedef struct {
+    uint64_t allocs;        /* malloc/calloc/realloc calls */
+    uint64_t bytes;         /* Bytes requested */
+    size_t live;            /* Bytes currently allocated */
+    size_t peak;            /* Highest live since the last take */
+} bench_heap_stats_t;
+
+// Function to read the counters and start a new measurement (peak = live)
+bench_heap_stats_t bench_heap_take(void);
+
+#endif /* BENCH_HEAP_H */
@@ -0,0 +1,43 @@
+#include "bench_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static bench_alloc_stats_t s_allocs;
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void *bench_malloc(size_t size)
+{
+    s_allocs.allocs++;
+    s_allocs.bytes += size;
+    return malloc(size);
+}
+
+void bench_free(void *ptr)
+{
+    if (ptr) {
+        s_allocs.frees++;
+    }
+    free(ptr);
+}
+
+bench_alloc_stats_t bench_alloc_take(void)
+{
+    bench_alloc_stats_t stats = s_allocs;
+    s_allocs = (bench_alloc_stats_t){0};
+    return stats;
+}
+
+void bench_report(const char *name, uint64_t iterations, uint64_t elapsed_ns, bench_alloc_stats_t allocs)
+{
+    printf("%-28s %10.1f ns/msg %8.2f allocs/msg %10.1f bytes/msg\n", name,
+           (double)elapsed_ns / iterations,
+           (double)allocs.allocs / iterations,
+           (double)allocs.bytes / iterations);
+}
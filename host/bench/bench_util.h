@@ -0,0 +1,23 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;
+} bench_alloc_stats_t;
+
+// Function to get a monotonic timestamp in nanoseconds
+uint64_t bench_now_ns(void);
+// Counting malloc/free, hand them to the library under test (e.g. cJSON_InitHooks)
+void *bench_malloc(size_t size);
+void bench_free(void *ptr);
+// Function to read and reset the allocation counters
+bench_alloc_stats_t bench_alloc_take(void);
+// Function to print one result line
+void bench_report(const char *name, uint64_t iterations, uint64_t elapsed_ns, bench_alloc_stats_t allocs);
+
+#endif /* BENCH_UTIL_H */
@@ -0,0 +1,22 @@
+/* Host stand-in for the ESP-IDF esp_log.h: logging is compiled out, the
+ * benchmarks measure the bridge and not printf */
+
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+// Keeps the printf format checks and the arguments "used"
+static inline __attribute__((format(printf, 2, 3))) void host_log_none(const char *tag, const char *format, ...)
+{
+    (void)tag;
+    (void)format;
+}
+
+#define HOST_LOG_NONE(tag, format, ...) host_log_none(tag, format, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...) HOST_LOG_NONE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) HOST_LOG_NONE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) HOST_LOG_NONE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) HOST_LOG_NONE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) HOST_LOG_NONE(tag, format, ##__VA_ARGS__)
+
+#endif /* HOST_ESP_LOG_H */
@@ -0,0 +1,11 @@
+/* Host stand-in for the ESP-IDF esp_timer.h: the simulator's virtual clock */
+
+#ifndef HOST_ESP_TIMER_H
+#define HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+// Function to get the time since start in microseconds
+int64_t esp_timer_get_time(void);
+
+#endif /* HOST_ESP_TIMER_H */
@@ -0,0 +1,26 @@
+/* Host stand-in for the FreeRTOS queue API, implemented by the simulator
+ * (host/sim/sim_rtos.c) on a virtual clock */
+
+#ifndef HOST_FREERTOS_QUEUE_H
+#define HOST_FREERTOS_QUEUE_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    uint8_t *storage;
+    uint32_t item_size;
+    uint32_t length;
+    uint32_t head;
+    uint32_t count;
+} StaticQueue_t;
+
+typedef StaticQueue_t *QueueHandle_t;
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage, StaticQueue_t *buf);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+
+#endif /* HOST_FREERTOS_QUEUE_H */
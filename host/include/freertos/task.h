@@ -0,0 +1,17 @@
+/* Host stand-in for the FreeRTOS task API, implemented by the simulator
+ * (host/sim/sim_rtos.c): tasks are coroutines on a virtual clock */
+
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *arg);
+typedef void *TaskHandle_t;
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle);
+void vTaskDelay(TickType_t ticks);
+
+#endif /* HOST_FREERTOS_TASK_H */
@@ -0,0 +1,47 @@
+/* Host stand-in for the generated sdkconfig.h: the defaults of
+ * main/Kconfig.projbuild, each can be overridden with -D */
+
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+#ifndef CONFIG_MAX_LAMPS
+#define CONFIG_MAX_LAMPS 20
+#endif
+#ifndef CONFIG_MESH_TX_QUEUE_SIZE
+#define CONFIG_MESH_TX_QUEUE_SIZE 32
+#endif
+#ifndef CONFIG_MESH_ACK_MAX_INFLIGHT
+#define CONFIG_MESH_ACK_MAX_INFLIGHT 4
+#endif
+#ifndef CONFIG_MESH_ACK_MAX_RETRIES
+#define CONFIG_MESH_ACK_MAX_RETRIES 3
+#endif
+#ifndef CONFIG_MESH_ACK_BACKOFF_MS
+#define CONFIG_MESH_ACK_BACKOFF_MS 200
+#endif
+#ifndef CONFIG_MESH_POLL_INTERVAL_S
+#define CONFIG_MESH_POLL_INTERVAL_S 60
+#endif
+#ifndef CONFIG_MESH_POLL_BUDGET_PER_MIN
+#define CONFIG_MESH_POLL_BUDGET_PER_MIN 30
+#endif
+#ifndef CONFIG_MESH_POLL_MAX_OUTSTANDING
+#define CONFIG_MESH_POLL_MAX_OUTSTANDING 2
+#endif
+#ifndef CONFIG_HA_ANNOUNCE_RATE
+#define CONFIG_HA_ANNOUNCE_RATE 20
+#endif
+#ifndef CONFIG_HA_ANNOUNCE_BURST
+#define CONFIG_HA_ANNOUNCE_BURST 10
+#endif
+#ifndef CONFIG_LIGHT_FADE_STEP_MS
+#define CONFIG_LIGHT_FADE_STEP_MS 200
+#endif
+#ifndef CONFIG_LIGHT_FADE_MAX_STEPS
+#define CONFIG_LIGHT_FADE_MAX_STEPS 20
+#endif
+#ifndef CONFIG_LIGHT_FADE_MAX_ACTIVE
+#define CONFIG_LIGHT_FADE_MAX_ACTIVE 4
+#endif
+
+#endif /* HOST_SDKCONFIG_H */
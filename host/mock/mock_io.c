@@ -0,0 +1,129 @@
+#include "mock_io.h"
+#include <string.h>
+
+#include "bridge.h"
+#include "lamp_shadow.h"
+
+static mesh_cmd_t s_queue[MOCK_MESH_QUEUE_SIZE];
+static int s_head;
+static int s_count;
+static mock_io_stats_t s_stats;
+static char s_last_topic[128];
+static char s_last_payload[256];
+static int (*s_forward)(const char *topic, const char *data, int len, int retain);
+static bool s_refuse;
+
+static int mock_publish(const char *topic, const char *data, int len, int retain)
+{
+    if (s_refuse) {
+        return -1;
+    }
+    s_stats.publishes++;
+    s_stats.publish_bytes += len;
+    if (s_forward != NULL && s_forward(topic, data, len, retain) < 0) {
+        return -1;
+    }
+    strncpy(s_last_topic, topic, sizeof(s_last_topic) - 1);
+    if (len >= (int)sizeof(s_last_payload)) {
+        len = sizeof(s_last_payload) - 1;
+    }
+    memcpy(s_last_payload, data, len);
+    s_last_payload[len] = '\0';
+    return (int)s_stats.publishes;
+}
+
+static esp_err_t mock_submit(const mesh_cmd_t *cmd)
+{
+    if (s_count == MOCK_MESH_QUEUE_SIZE) {
+        s_stats.dropped++;
+        return ESP_ERR_NO_MEM;
+    }
+    s_queue[(s_head + s_count) % MOCK_MESH_QUEUE_SIZE] = *cmd;
+    s_count++;
+    s_stats.submitted++;
+    return ESP_OK;
+}
+
+// Function to build the status an acked lamp answers with
+static void lamp_status(const mesh_cmd_t *cmd, lamp_shadow_t *status)
+{
+    memset(status, 0, sizeof(*status));
+    switch (cmd->type) {
+    case MESH_CMD_ONOFF:
+        status->onoff = cmd->onoff;
+        status->known = LAMP_SHADOW_ONOFF;
+        break;
+    case MESH_CMD_HSL:
+        status->hue = cmd->hue;
+        status->saturation = cmd->saturation;
+        status->known = LAMP_SHADOW_COLOR;
+        /* fall through */
+    default:
+        status->lightness = cmd->lightness;
+        status->onoff = cmd->lightness > 0;
+        status->known |= LAMP_SHADOW_LIGHTNESS | LAMP_SHADOW_ONOFF;
+        break;
+    }
+}
+
+void mock_io_init(void)
+{
+    s_head = 0;
+    s_count = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_last_topic[0] = '\0';
+    s_last_payload[0] = '\0';
+    const bridge_io_t io = {
+        .publish = mock_publish,
+        .submit = mock_submit,
+    };
+    bridge_init(&io);
+}
+
+void mock_mqtt_refuse(bool refuse)
+{
+    s_refuse = refuse;
+}
+
+void mock_mqtt_forward(int (*publish)(const char *topic, const char *data, int len, int retain))
+{
+    s_forward = publish;
+}
+
+int mock_mesh_drain(void)
+{
+    int sent = 0;
+    while (s_count > 0) {
+        mesh_cmd_t cmd = s_queue[s_head];
+        s_head = (s_head + 1) % MOCK_MESH_QUEUE_SIZE;
+        s_count--;
+
+        bridge_resolve_cmd(&cmd);
+        if (cmd.flags & MESH_CMD_FLAG_ACKED) {
+            lamp_shadow_t status;
+            lamp_status(&cmd, &status);
+            bridge_lamp_status(cmd.addr, &status);
+        }
+        bridge_cmd_done(&cmd, true);
+        s_stats.sent++;
+        sent++;
+    }
+    return sent;
+}
+
+mock_io_stats_t mock_io_take(void)
+{
+    mock_io_stats_t stats = s_stats;
+    memset(&s_stats, 0, sizeof(s_stats));
+    return stats;
+}
+
+const char *mock_mqtt_last_topic(void)
+{
+    return s_last_topic;
+}
+
+const char *mock_mqtt_last_payload(void)
+{
+    return s_last_payload;
+}
@@ -0,0 +1,43 @@
+#ifndef MOCK_IO_H
+#define MOCK_IO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mesh_tx.h"
+
+/*
+ * Mocked MQTT client and mesh for the bridge core (bridge_io_t).
+ *
+ * MQTT publishes are counted and the last one is kept for checks. Mesh
+ * commands go into a FIFO like the one of the TX task; mock_mesh_drain()
+ * "sends" them: unacked commands are done right away, acked lamps answer
+ * with a status first, the way a real lamp would. Publishes can also be
+ * forwarded to a real broker (replay/bridge_host.c) or refused.
+ */
+
+#define MOCK_MESH_QUEUE_SIZE 32
+
+typedef struct {
+    uint64_t publishes;
+    uint64_t publish_bytes;
+    uint64_t submitted;
+    uint64_t dropped;       /* Queue full */
+    uint64_t sent;
+} mock_io_stats_t;
+
+// Function to reset the mocks and hand them to bridge_init()
+void mock_io_init(void);
+// Function to also hand every publish to a real client, its result is returned to the bridge
+void mock_mqtt_forward(int (*publish)(const char *topic, const char *data, int len, int retain));
+// Function to make publishes fail, like a full outbox or a lost connection
+void mock_mqtt_refuse(bool refuse);
+// Function to send everything queued, returns the number of commands sent
+int mock_mesh_drain(void);
+// Function to read and reset the counters
+mock_io_stats_t mock_io_take(void);
+// Function to get the topic and payload of the last publish ("" if none)
+const char *mock_mqtt_last_topic(void);
+const char *mock_mqtt_last_payload(void);
+
+#endif /* MOCK_IO_H */
@@ -0,0 +1,184 @@
+/* The bridge core on Linux against a real MQTT broker.
+ *
+ * Does what mqtt_event_handler() in main.c does for HA commands (route,
+ * bridge_handle_command) with the mesh mocked (mock_io: every command is
+ * sent and, for acked lamps, answered right away), and publishes the HA state
+ * to the broker. The lamps are taken from the command topics of a capture
+ * (mqtt_replay record), so a replay of it finds all of them.
+ *
+ *   ./build-host/bridge_host -b localhost -c living_room.txt
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_heap.h"
+#include "bridge_host.h"
+#include "capture.h"
+#include "mock_io.h"
+#include "mqtt_lite.h"
+#include "bridge.h"
+#include "lamp_registry.h"
+#include "latency.h"
+#include "mqtt_router.h"
+
+static mqtt_lite_t s_client;
+static volatile sig_atomic_t s_stop;
+static uint64_t s_received;
+static uint64_t s_rejected;
+
+int64_t esp_timer_get_time(void)
+{
+    return mqtt_lite_now_us();
+}
+
+static int host_publish(const char *topic, const char *data, int len, int retain)
+{
+    return mqtt_lite_publish(&s_client, topic, data, len, retain);
+}
+
+static void publish_stats(void)
+{
+    bench_heap_stats_t heap = bench_heap_take();
+    mock_io_stats_t io = mock_io_take();
+    char payload[160];
+    int len = snprintf(payload, sizeof(payload), BRIDGE_HOST_STATS_FORMAT, s_received, s_rejected, io.publishes,
+                       heap.peak, heap.allocs);
+    mqtt_lite_publish(&s_client, BRIDGE_HOST_STATS, payload, len, 0);
+    s_received = 0;
+    s_rejected = 0;
+}
+
+static void on_message(void *ctx, const char *topic, int topic_len, const char *data, int len)
+{
+    (void)ctx;
+    uint32_t t_recv = latency_now();
+    if (topic_len == (int)strlen(BRIDGE_HOST_STATS_GET) && memcmp(topic, BRIDGE_HOST_STATS_GET, topic_len) == 0) {
+        publish_stats();
+        return;
+    }
+    mqtt_route_t route;
+    if (mqtt_route(topic, topic_len, &route) != MQTT_ROUTE_LAMP_SET &&
+        route.type != MQTT_ROUTE_GROUP_SET) {
+        return;
+    }
+    s_received++;
+    if (bridge_handle_command(&route, data, len, t_recv) != ESP_OK) {
+        s_rejected++;
+    }
+    mock_mesh_drain();
+}
+
+// Function to register a lamp for every command topic in the capture, returns the count
+static int register_lamps(const char *path, bool acked)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    static const char set_suffix[] = "/set";
+    const size_t prefix_len = strlen(HA_TOPIC_PREFIX);
+    capture_msg_t msg;
+    int count = 0;
+    int result;
+    while ((result = capture_read(f, &msg)) != 0) {
+        size_t len = strlen(msg.topic);
+        if (result < 0 || len <= prefix_len + strlen(set_suffix) ||
+            strncmp(msg.topic, HA_TOPIC_PREFIX, prefix_len) != 0 ||
+            strcmp(msg.topic + len - strlen(set_suffix), set_suffix) != 0) {
+            continue;
+        }
+        // The slug is a valid lamp name that slugifies to itself
+        LampInfo lamp_info = {
+            .address = 0x0100 + count,
+            .flags = acked ? LAMP_FLAG_ACKED : 0,
+        };
+        snprintf(lamp_info.name, sizeof(lamp_info.name), "%.*s", (int)(len - prefix_len - strlen(set_suffix)),
+                 msg.topic + prefix_len);
+        if (lamp_registry_find_by_slug(lamp_info.name, strlen(lamp_info.name), NULL) >= 0) {
+            continue;
+        }
+        if (count == MAX_LAMPS) {
+            fprintf(stderr, "More than %d lamps in the capture, the rest is ignored\n", MAX_LAMPS);
+            break;
+        }
+        lamp_registry_set(count++, &lamp_info);
+    }
+    fclose(f);
+    return count;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_stop = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-b host[:port]] [-a] -c capture\n"
+                    "  -b  broker (localhost)\n"
+                    "  -a  all lamps in acknowledged mode\n"
+                    "  -c  capture to take the lamps from\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *broker = "localhost";
+    const char *capture = NULL;
+    bool acked = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:ac:")) != -1) {
+        switch (opt) {
+        case 'b': broker = optarg; break;
+        case 'a': acked = true; break;
+        case 'c': capture = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (capture == NULL) {
+        usage(argv[0]);
+    }
+
+    lamp_registry_init();
+    int lamps = register_lamps(capture, acked);
+    if (lamps <= 0) {
+        fprintf(stderr, "No lamp command topics in %s\n", capture);
+        return 1;
+    }
+    mock_io_init();
+    mock_mqtt_forward(host_publish);
+
+    char host[128];
+    int port;
+    mqtt_lite_parse_broker(broker, host, sizeof(host), &port);
+    if (mqtt_lite_connect(&s_client, host, port, "bridge_host") != 0 ||
+        mqtt_lite_subscribe(&s_client, HA_SET_SUBSCRIPTION, on_message, NULL) != 0 ||
+        mqtt_lite_subscribe(&s_client, BRIDGE_HOST_STATS_GET, on_message, NULL) != 0) {
+        fprintf(stderr, "Cannot connect to %s:%d\n", host, port);
+        return 1;
+    }
+    printf("bridge_host: %d lamps, connected to %s:%d\n", lamps, host, port);
+    fflush(stdout);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    bench_heap_take();
+    while (!s_stop) {
+        if (mqtt_lite_loop(&s_client, 500, on_message, NULL) < 0) {
+            fprintf(stderr, "Connection to the broker lost\n");
+            return 1;
+        }
+        // States a publish refused are pending in the bridge
+        bridge_announce_pump();
+    }
+    mqtt_lite_close(&s_client);
+    return 0;
+}
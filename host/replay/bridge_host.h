@@ -0,0 +1,12 @@
+#ifndef BRIDGE_HOST_H
+#define BRIDGE_HOST_H
+
+// bridge_host answers a message on BRIDGE_HOST_STATS_GET with its counters
+// since the last request on BRIDGE_HOST_STATS, then starts counting anew:
+//   received <n> rejected <n> publishes <n> heap_peak <bytes> allocs <n>
+#define BRIDGE_HOST_STATS       "bridge_host/stats"
+#define BRIDGE_HOST_STATS_GET   "bridge_host/stats/get"
+#define BRIDGE_HOST_STATS_FORMAT "received %" SCNu64 " rejected %" SCNu64 " publishes %" SCNu64 \
+                                 " heap_peak %zu allocs %" SCNu64
+
+#endif /* BRIDGE_HOST_H */
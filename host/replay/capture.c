@@ -0,0 +1,59 @@
+#include "capture.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+int capture_write(FILE *f, int64_t t_us, const char *topic, int topic_len, const char *data, int len)
+{
+    if (topic_len >= CAPTURE_TOPIC_MAX || memchr(topic, ' ', topic_len) || memchr(topic, '\n', topic_len) ||
+        len >= CAPTURE_PAYLOAD_MAX) {
+        return -1;
+    }
+    fprintf(f, "%" PRId64 " %.*s ", t_us, topic_len, topic);
+    for (int i = 0; i < len; i++) {
+        switch (data[i]) {
+        case '\\': fputs("\\\\", f); break;
+        case '\n': fputs("\\n", f); break;
+        case '\r': fputs("\\r", f); break;
+        default: fputc(data[i], f); break;
+        }
+    }
+    fputc('\n', f);
+    return 0;
+}
+
+int capture_read(FILE *f, capture_msg_t *msg)
+{
+    char line[CAPTURE_TOPIC_MAX + 2 * CAPTURE_PAYLOAD_MAX + 32];
+    do {
+        if (fgets(line, sizeof(line), f) == NULL) {
+            return 0;
+        }
+    } while (line[0] == '#' || line[0] == '\n');
+
+    char *end;
+    msg->t_us = strtoll(line, &end, 10);
+    if (end == line || *end != ' ') {
+        return -1;
+    }
+    char *topic = end + 1;
+    char *space = strchr(topic, ' ');
+    if (space == NULL || space - topic >= CAPTURE_TOPIC_MAX) {
+        return -1;
+    }
+    memcpy(msg->topic, topic, space - topic);
+    msg->topic[space - topic] = '\0';
+
+    int len = 0;
+    for (const char *p = space + 1; *p != '\0' && *p != '\n' && len < CAPTURE_PAYLOAD_MAX - 1; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+            msg->payload[len++] = *p == 'n' ? '\n' : *p == 'r' ? '\r' : *p;
+        } else {
+            msg->payload[len++] = *p;
+        }
+    }
+    msg->payload[len] = '\0';
+    msg->payload_len = len;
+    return 1;
+}
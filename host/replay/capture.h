@@ -0,0 +1,32 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Capture file of MQTT traffic, one message per line:
+ *
+ *   <us since the first message> <topic> <payload>
+ *
+ * Backslash, newline and carriage return in the payload are escaped as \\,
+ * \n and \r, so HA's JSON stays readable and the file can be edited or cut
+ * with the usual tools. Lines starting with # are comments.
+ */
+
+#define CAPTURE_TOPIC_MAX   128
+#define CAPTURE_PAYLOAD_MAX 1024
+
+typedef struct {
+    int64_t t_us;
+    char topic[CAPTURE_TOPIC_MAX];
+    char payload[CAPTURE_PAYLOAD_MAX];
+    int payload_len;
+} capture_msg_t;
+
+// Function to append a message, returns -1 if the topic has no room in the format
+int capture_write(FILE *f, int64_t t_us, const char *topic, int topic_len, const char *data, int len);
+// Function to read the next message: 1 if read, 0 at the end, -1 for a bad line (skipped)
+int capture_read(FILE *f, capture_msg_t *msg);
+
+#endif /* CAPTURE_H */
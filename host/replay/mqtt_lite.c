@@ -0,0 +1,300 @@
+#include "mqtt_lite.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MQTT_CONNECT        0x10
+#define MQTT_CONNACK        0x20
+#define MQTT_PUBLISH        0x30
+#define MQTT_SUBSCRIBE      0x82
+#define MQTT_SUBACK         0x90
+#define MQTT_PINGREQ        0xC0
+#define MQTT_DISCONNECT     0xE0
+
+#define KEEPALIVE_S         60
+#define CONNECT_TIMEOUT_MS  5000
+
+int64_t mqtt_lite_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void mqtt_lite_parse_broker(const char *broker, char *host, int host_size, int *port)
+{
+    const char *colon = strrchr(broker, ':');
+    int len = colon ? (int)(colon - broker) : (int)strlen(broker);
+    snprintf(host, host_size, "%.*s", len, broker);
+    *port = colon ? atoi(colon + 1) : 1883;
+}
+
+static int send_all(mqtt_lite_t *client, const uint8_t *buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = send(client->fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    client->last_tx_us = mqtt_lite_now_us();
+    return 0;
+}
+
+// Function to write the fixed header in front of a body of body_len bytes at
+// tx + 5, returns the offset where the packet starts
+static int fixed_header(mqtt_lite_t *client, uint8_t type, int body_len)
+{
+    uint8_t len_bytes[4];
+    int count = 0;
+    do {
+        len_bytes[count] = body_len % 128;
+        body_len /= 128;
+        if (body_len > 0) {
+            len_bytes[count] |= 0x80;
+        }
+        count++;
+    } while (body_len > 0);
+    int start = 5 - 1 - count;
+    client->tx[start] = type;
+    memcpy(&client->tx[start + 1], len_bytes, count);
+    return start;
+}
+
+static int put_string(uint8_t *buf, const char *str, int len)
+{
+    buf[0] = len >> 8;
+    buf[1] = len & 0xFF;
+    memcpy(buf + 2, str, len);
+    return len + 2;
+}
+
+static int send_packet(mqtt_lite_t *client, uint8_t type, int body_len)
+{
+    int start = fixed_header(client, type, body_len);
+    return send_all(client, &client->tx[start], 5 - start + body_len);
+}
+
+// Function to take the first complete packet out of the receive buffer.
+// Returns its length (0 if incomplete, -1 if it can never fit).
+static int next_packet(mqtt_lite_t *client, uint8_t *type, const uint8_t **body, int *body_len)
+{
+    int len = 0;
+    int shift = 0;
+    int pos = 1;
+    for (;; pos++) {
+        if (pos >= client->rx_len) {
+            return 0;
+        }
+        if (pos > 4) {
+            return -1;
+        }
+        len |= (client->rx[pos] & 0x7F) << shift;
+        shift += 7;
+        if (!(client->rx[pos] & 0x80)) {
+            break;
+        }
+    }
+    pos++;
+    if (pos + len > MQTT_LITE_RX_SIZE) {
+        return -1;
+    }
+    if (pos + len > client->rx_len) {
+        return 0;
+    }
+    *type = client->rx[0];
+    *body = &client->rx[pos];
+    *body_len = len;
+    return pos + len;
+}
+
+// Function to read what arrived and handle every complete packet, returns the
+// number of messages, -1 if disconnected. *seen gets the type of the last packet.
+static int receive(mqtt_lite_t *client, mqtt_lite_cb_t cb, void *ctx, uint8_t *seen)
+{
+    ssize_t n = recv(client->fd, client->rx + client->rx_len, MQTT_LITE_RX_SIZE - client->rx_len, 0);
+    if (n <= 0) {
+        return (n < 0 && errno == EINTR) ? 0 : -1;
+    }
+    client->rx_len += n;
+
+    int messages = 0;
+    for (;;) {
+        uint8_t type;
+        const uint8_t *body;
+        int body_len;
+        int packet_len = next_packet(client, &type, &body, &body_len);
+        if (packet_len < 0) {
+            return -1;
+        }
+        if (packet_len == 0) {
+            break;
+        }
+        *seen = type & 0xF0;
+        if ((type & 0xF0) == MQTT_PUBLISH && body_len >= 2) {
+            int topic_len = (body[0] << 8) | body[1];
+            // QoS 0 only: no packet id after the topic
+            if (2 + topic_len <= body_len && (type & 0x06) == 0) {
+                cb(ctx, (const char *)body + 2, topic_len, (const char *)body + 2 + topic_len,
+                   body_len - 2 - topic_len);
+                messages++;
+            }
+        }
+        client->rx_len -= packet_len;
+        memmove(client->rx, client->rx + packet_len, client->rx_len);
+    }
+    return messages;
+}
+
+int mqtt_lite_connect(mqtt_lite_t *client, const char *host, int port, const char *client_id)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+    client->fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && client->fd < 0; ai = ai->ai_next) {
+        client->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (client->fd >= 0 && connect(client->fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(client->fd);
+            client->fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (client->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client->keepalive_s = KEEPALIVE_S;
+    client->packet_id = 0;
+    client->rx_len = 0;
+
+    // Variable header: protocol name, level 4, clean session, keepalive; payload: client id
+    uint8_t *body = &client->tx[5];
+    int len = put_string(body, "MQTT", 4);
+    body[len++] = 4;
+    body[len++] = 0x02;
+    body[len++] = KEEPALIVE_S >> 8;
+    body[len++] = KEEPALIVE_S & 0xFF;
+    len += put_string(body + len, client_id, strlen(client_id));
+    if (send_packet(client, MQTT_CONNECT, len) != 0) {
+        mqtt_lite_close(client);
+        return -1;
+    }
+
+    struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+    while (client->rx_len < 4) {
+        if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) <= 0) {
+            mqtt_lite_close(client);
+            return -1;
+        }
+        ssize_t n = recv(client->fd, client->rx + client->rx_len, 4 - client->rx_len, 0);
+        if (n <= 0) {
+            mqtt_lite_close(client);
+            return -1;
+        }
+        client->rx_len += n;
+    }
+    // CONNACK: 0x20 0x02 flags return-code
+    bool accepted = client->rx[0] == MQTT_CONNACK && client->rx[3] == 0;
+    client->rx_len = 0;
+    if (!accepted) {
+        mqtt_lite_close(client);
+        return -1;
+    }
+    return 0;
+}
+
+int mqtt_lite_subscribe(mqtt_lite_t *client, const char *filter, mqtt_lite_cb_t cb, void *ctx)
+{
+    int filter_len = strlen(filter);
+    if (filter_len + 5 > MQTT_LITE_TX_SIZE - 5) {
+        return -1;
+    }
+    uint8_t *body = &client->tx[5];
+    client->packet_id = client->packet_id == 0xFFFF ? 1 : client->packet_id + 1;
+    body[0] = client->packet_id >> 8;
+    body[1] = client->packet_id & 0xFF;
+    int len = 2 + put_string(body + 2, filter, filter_len);
+    body[len++] = 0;
+    if (send_packet(client, MQTT_SUBSCRIBE, len) != 0) {
+        return -1;
+    }
+
+    int64_t deadline = mqtt_lite_now_us() + CONNECT_TIMEOUT_MS * 1000LL;
+    struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+    for (;;) {
+        int wait_ms = (int)((deadline - mqtt_lite_now_us()) / 1000);
+        if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) {
+            return -1;
+        }
+        uint8_t seen = 0;
+        if (receive(client, cb, ctx, &seen) < 0) {
+            return -1;
+        }
+        if (seen == MQTT_SUBACK) {
+            return 0;
+        }
+    }
+}
+
+int mqtt_lite_publish(mqtt_lite_t *client, const char *topic, const char *data, int len, int retain)
+{
+    int topic_len = strlen(topic);
+    if (client->fd < 0 || 2 + topic_len + len > MQTT_LITE_TX_SIZE - 5) {
+        return -1;
+    }
+    uint8_t *body = &client->tx[5];
+    int body_len = put_string(body, topic, topic_len);
+    memcpy(body + body_len, data, len);
+    return send_packet(client, MQTT_PUBLISH | (retain ? 0x01 : 0), body_len + len);
+}
+
+int mqtt_lite_loop(mqtt_lite_t *client, int timeout_ms, mqtt_lite_cb_t cb, void *ctx)
+{
+    if (client->fd < 0) {
+        return -1;
+    }
+    if (mqtt_lite_now_us() - client->last_tx_us > client->keepalive_s * 1000000LL / 2) {
+        if (send_packet(client, MQTT_PINGREQ, 0) != 0) {
+            return -1;
+        }
+    }
+    struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    if (ready == 0) {
+        return 0;
+    }
+    uint8_t seen = 0;
+    return receive(client, cb, ctx, &seen);
+}
+
+void mqtt_lite_close(mqtt_lite_t *client)
+{
+    if (client->fd >= 0) {
+        send_packet(client, MQTT_DISCONNECT, 0);
+        close(client->fd);
+        client->fd = -1;
+    }
+}
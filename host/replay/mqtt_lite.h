@@ -0,0 +1,45 @@
+#ifndef MQTT_LITE_H
+#define MQTT_LITE_H
+
+#include <stdint.h>
+
+/*
+ * Minimal MQTT 3.1.1 client for the host tools: one blocking TCP connection,
+ * clean session, QoS 0 publish and subscribe only. That is all the bridge
+ * uses towards Home Assistant, and it keeps the tools free of a client
+ * library dependency. Buffers are part of the struct, nothing is allocated.
+ */
+
+#define MQTT_LITE_RX_SIZE   16384
+#define MQTT_LITE_TX_SIZE   4096
+
+typedef struct {
+    int fd;
+    uint16_t keepalive_s;
+    uint16_t packet_id;
+    int64_t last_tx_us;
+    int rx_len;
+    uint8_t rx[MQTT_LITE_RX_SIZE];
+    uint8_t tx[MQTT_LITE_TX_SIZE];
+} mqtt_lite_t;
+
+// Function called for every received PUBLISH (topic and payload not NUL-terminated)
+typedef void (*mqtt_lite_cb_t)(void *ctx, const char *topic, int topic_len, const char *data, int len);
+
+// Function to connect to host:port and wait for the CONNACK, returns 0 or -1
+int mqtt_lite_connect(mqtt_lite_t *client, const char *host, int port, const char *client_id);
+// Function to subscribe (QoS 0) and wait for the SUBACK; messages arriving meanwhile go to cb
+int mqtt_lite_subscribe(mqtt_lite_t *client, const char *filter, mqtt_lite_cb_t cb, void *ctx);
+// Function to publish with QoS 0, returns 0 or -1
+int mqtt_lite_publish(mqtt_lite_t *client, const char *topic, const char *data, int len, int retain);
+// Function to wait up to timeout_ms for data and dispatch what arrived, also
+// sends the keepalive ping. Returns the number of messages or -1 if disconnected.
+int mqtt_lite_loop(mqtt_lite_t *client, int timeout_ms, mqtt_lite_cb_t cb, void *ctx);
+// Function to send DISCONNECT and close the socket
+void mqtt_lite_close(mqtt_lite_t *client);
+// Function to split "host[:port]", the port defaults to 1883
+void mqtt_lite_parse_broker(const char *broker, char *host, int host_size, int *port);
+// Function to get a monotonic timestamp in microseconds
+int64_t mqtt_lite_now_us(void);
+
+#endif /* MQTT_LITE_H */
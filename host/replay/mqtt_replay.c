@@ -0,0 +1,465 @@
+/* Capture and replay of Home Assistant command traffic.
+ *
+ *   mqtt_replay record [-b broker] [-t filter]... [-d seconds] -o capture.txt
+ *   mqtt_replay play [-b broker] [-s 1,10,100] [-w ms] capture.txt
+ *
+ * record stores the messages on the HA command topics with their arrival
+ * times (capture.h). play publishes them again with the original gaps divided
+ * by each speed factor, against a broker with bridge_host (or a real bridge)
+ * attached, and measures per command the time until the lamp's state topic
+ * answers. A state message answers every earlier command for its lamp that
+ * is at most the answer window (-w, 1 s) old. A command that did not change
+ * the state gets no answer of its own, so it is counted as "no state" rather
+ * than credited to the next change. bridge_host's own counters (received, rejected, heap peak) are
+ * fetched over BRIDGE_HOST_STATS around every run.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge_host.h"
+#include "capture.h"
+#include "mqtt_lite.h"
+#include "mqtt_router.h"
+
+#define MAX_SPEEDS          8
+#define MAX_FILTERS         8
+#define LAMP_HASH_SIZE      4096
+// A run is over once no state arrived for this long after the last command
+#define SETTLE_QUIET_MS     1000
+#define SETTLE_MAX_MS       10000
+#define STATS_TIMEOUT_MS    2000
+#define ANSWER_WINDOW_MS    1000
+
+static const char s_set_suffix[] = "/set";
+static const char s_state_suffix[] = "/state";
+
+static mqtt_lite_t s_client;
+static int64_t s_answer_window_us = ANSWER_WINDOW_MS * 1000LL;
+static volatile sig_atomic_t s_stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_stop = 1;
+}
+
+static void connect_broker(const char *broker, const char *client_id)
+{
+    char host[128];
+    int port;
+    mqtt_lite_parse_broker(broker, host, sizeof(host), &port);
+    if (mqtt_lite_connect(&s_client, host, port, client_id) != 0) {
+        fprintf(stderr, "Cannot connect to %s:%d\n", host, port);
+        exit(1);
+    }
+}
+
+/* record */
+
+typedef struct {
+    FILE *f;
+    int64_t t0;
+    uint64_t count;
+} recorder_t;
+
+static void on_record(void *ctx, const char *topic, int topic_len, const char *data, int len)
+{
+    recorder_t *rec = ctx;
+    int64_t now = mqtt_lite_now_us();
+    if (rec->count == 0) {
+        rec->t0 = now;
+    }
+    if (capture_write(rec->f, now - rec->t0, topic, topic_len, data, len) != 0) {
+        fprintf(stderr, "Skipped a message on %.*s\n", topic_len, topic);
+        return;
+    }
+    fflush(rec->f);
+    rec->count++;
+}
+
+static int cmd_record(int argc, char **argv)
+{
+    const char *broker = "localhost";
+    const char *output = NULL;
+    const char *filters[MAX_FILTERS];
+    int filter_count = 0;
+    double duration = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:d:o:")) != -1) {
+        switch (opt) {
+        case 'b': broker = optarg; break;
+        case 't':
+            if (filter_count < MAX_FILTERS) {
+                filters[filter_count++] = optarg;
+            }
+            break;
+        case 'd': duration = atof(optarg); break;
+        case 'o': output = optarg; break;
+        default: return 2;
+        }
+    }
+    if (output == NULL) {
+        return 2;
+    }
+    if (filter_count == 0) {
+        filters[filter_count++] = HA_SET_SUBSCRIPTION;
+    }
+
+    recorder_t rec = { .f = fopen(output, "w") };
+    if (rec.f == NULL) {
+        perror(output);
+        return 1;
+    }
+    fprintf(rec.f, "# mqtt_replay capture from %s\n", broker);
+    connect_broker(broker, "mqtt_replay_record");
+    for (int i = 0; i < filter_count; i++) {
+        if (mqtt_lite_subscribe(&s_client, filters[i], on_record, &rec) != 0) {
+            fprintf(stderr, "Cannot subscribe to %s\n", filters[i]);
+            return 1;
+        }
+    }
+    fprintf(stderr, "Recording to %s, Ctrl-C to stop\n", output);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    int64_t end = duration > 0 ? mqtt_lite_now_us() + (int64_t)(duration * 1e6) : INT64_MAX;
+    while (!s_stop && mqtt_lite_now_us() < end) {
+        if (mqtt_lite_loop(&s_client, 200, on_record, &rec) < 0) {
+            fprintf(stderr, "Connection to the broker lost\n");
+            break;
+        }
+    }
+    mqtt_lite_close(&s_client);
+    fclose(rec.f);
+    fprintf(stderr, "%" PRIu64 " messages recorded\n", rec.count);
+    return 0;
+}
+
+/* play */
+
+typedef struct {
+    capture_msg_t msg;
+    int lamp;               /* Lamp of a command topic, -1 for other topics */
+    int next_pending;       /* Next unanswered command of the same lamp */
+    int64_t sent_us;
+} replay_msg_t;
+
+typedef struct {
+    char slug[CAPTURE_TOPIC_MAX];
+    int pending_head;       /* Oldest unanswered command, -1 if none */
+    int pending_tail;
+} replay_lamp_t;
+
+typedef struct {
+    replay_msg_t *msgs;
+    int msg_count;
+    replay_lamp_t *lamps;
+    int lamp_count;
+    int16_t hash[LAMP_HASH_SIZE];   /* Index into lamps, -1 if empty */
+
+    // Current run
+    int64_t *latencies;
+    int answered;
+    int64_t last_answer_us;
+    bool stats_seen;
+    char stats[160];
+} replay_t;
+
+static uint32_t hash_slug(const char *slug, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)slug[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Function to find the lamp of a slug, or add it if add is set; -1 if not found or full
+static int lamp_lookup(replay_t *replay, const char *slug, int len, bool add)
+{
+    uint32_t pos = hash_slug(slug, len) & (LAMP_HASH_SIZE - 1);
+    while (replay->hash[pos] >= 0) {
+        const char *known = replay->lamps[replay->hash[pos]].slug;
+        if (strncmp(known, slug, len) == 0 && known[len] == '\0') {
+            return replay->hash[pos];
+        }
+        pos = (pos + 1) & (LAMP_HASH_SIZE - 1);
+    }
+    if (!add || replay->lamp_count == LAMP_HASH_SIZE / 2) {
+        return -1;
+    }
+    replay_lamp_t *lamp = &replay->lamps[replay->lamp_count];
+    snprintf(lamp->slug, sizeof(lamp->slug), "%.*s", len, slug);
+    replay->hash[pos] = replay->lamp_count;
+    return replay->lamp_count++;
+}
+
+// Function to get the slug of "homeassistant/light/<slug><suffix>", NULL if the topic is not one
+static const char *topic_slug(const char *topic, int topic_len, const char *suffix, int *slug_len)
+{
+    int prefix_len = strlen(HA_TOPIC_PREFIX);
+    int suffix_len = strlen(suffix);
+    if (topic_len <= prefix_len + suffix_len || strncmp(topic, HA_TOPIC_PREFIX, prefix_len) != 0 ||
+        memcmp(topic + topic_len - suffix_len, suffix, suffix_len) != 0) {
+        return NULL;
+    }
+    *slug_len = topic_len - prefix_len - suffix_len;
+    return topic + prefix_len;
+}
+
+static int load_capture(replay_t *replay, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    int capacity = 1024;
+    replay->msgs = malloc(capacity * sizeof(replay_msg_t));
+    replay->lamps = malloc(LAMP_HASH_SIZE / 2 * sizeof(replay_lamp_t));
+    memset(replay->hash, 0xFF, sizeof(replay->hash));
+    int result;
+    while ((result = capture_read(f, &replay->msgs[replay->msg_count].msg)) != 0) {
+        if (result < 0) {
+            continue;
+        }
+        replay_msg_t *msg = &replay->msgs[replay->msg_count];
+        int slug_len;
+        const char *slug = topic_slug(msg->msg.topic, strlen(msg->msg.topic), s_set_suffix, &slug_len);
+        msg->lamp = slug ? lamp_lookup(replay, slug, slug_len, true) : -1;
+        if (++replay->msg_count == capacity) {
+            capacity *= 2;
+            replay->msgs = realloc(replay->msgs, capacity * sizeof(replay_msg_t));
+        }
+    }
+    fclose(f);
+    replay->latencies = malloc((replay->msg_count + 1) * sizeof(int64_t));
+    return replay->msg_count;
+}
+
+static void on_play(void *ctx, const char *topic, int topic_len, const char *data, int len)
+{
+    replay_t *replay = ctx;
+    int64_t now = mqtt_lite_now_us();
+    if (topic_len == (int)strlen(BRIDGE_HOST_STATS) && memcmp(topic, BRIDGE_HOST_STATS, topic_len) == 0) {
+        snprintf(replay->stats, sizeof(replay->stats), "%.*s", len, data);
+        replay->stats_seen = true;
+        return;
+    }
+    int slug_len;
+    const char *slug = topic_slug(topic, topic_len, s_state_suffix, &slug_len);
+    int index = slug ? lamp_lookup(replay, slug, slug_len, false) : -1;
+    if (index < 0) {
+        return;
+    }
+    replay_lamp_t *lamp = &replay->lamps[index];
+    for (int i = lamp->pending_head; i >= 0; i = replay->msgs[i].next_pending) {
+        int64_t latency = now - replay->msgs[i].sent_us;
+        if (latency <= s_answer_window_us) {
+            replay->latencies[replay->answered++] = latency;
+            replay->last_answer_us = now;
+        }
+    }
+    lamp->pending_head = -1;
+}
+
+// Function to run the client until the deadline (or until done() is true)
+static void wait_until(replay_t *replay, int64_t deadline, bool (*done)(replay_t *replay))
+{
+    for (;;) {
+        int64_t now = mqtt_lite_now_us();
+        if (now >= deadline || (done && done(replay))) {
+            return;
+        }
+        int64_t wait_ms = (deadline - now) / 1000;
+        if (mqtt_lite_loop(&s_client, wait_ms > 100 ? 100 : (int)wait_ms, on_play, replay) < 0) {
+            fprintf(stderr, "Connection to the broker lost\n");
+            exit(1);
+        }
+    }
+}
+
+static bool stats_arrived(replay_t *replay)
+{
+    return replay->stats_seen;
+}
+
+// Function to fetch (and reset) the counters of bridge_host, false if it did not answer
+static bool fetch_stats(replay_t *replay)
+{
+    replay->stats_seen = false;
+    mqtt_lite_publish(&s_client, BRIDGE_HOST_STATS_GET, "", 0, 0);
+    wait_until(replay, mqtt_lite_now_us() + STATS_TIMEOUT_MS * 1000LL, stats_arrived);
+    return replay->stats_seen;
+}
+
+static int compare_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(const int64_t *sorted, int count, int percent)
+{
+    if (count == 0) {
+        return 0;
+    }
+    int rank = (count * percent + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0] / 1e3;
+}
+
+static void play_run(replay_t *replay, double speed, bool bridge_stats)
+{
+    for (int i = 0; i < replay->lamp_count; i++) {
+        replay->lamps[i].pending_head = -1;
+    }
+    replay->answered = 0;
+    int commands = 0;
+    int64_t max_lag = 0;
+    int64_t t0 = mqtt_lite_now_us();
+    replay->last_answer_us = t0;
+
+    for (int i = 0; i < replay->msg_count && !s_stop; i++) {
+        replay_msg_t *msg = &replay->msgs[i];
+        int64_t target = t0 + (int64_t)(msg->msg.t_us / speed);
+        wait_until(replay, target, NULL);
+        msg->sent_us = mqtt_lite_now_us();
+        if (msg->sent_us - target > max_lag) {
+            max_lag = msg->sent_us - target;
+        }
+        if (mqtt_lite_publish(&s_client, msg->msg.topic, msg->msg.payload, msg->msg.payload_len, 0) != 0) {
+            fprintf(stderr, "Publish failed\n");
+            exit(1);
+        }
+        if (msg->lamp < 0) {
+            continue;
+        }
+        // Append to the lamp's unanswered commands
+        replay_lamp_t *lamp = &replay->lamps[msg->lamp];
+        msg->next_pending = -1;
+        if (lamp->pending_head < 0) {
+            lamp->pending_head = i;
+        } else {
+            replay->msgs[lamp->pending_tail].next_pending = i;
+        }
+        lamp->pending_tail = i;
+        commands++;
+    }
+    int64_t last_sent = mqtt_lite_now_us();
+
+    // Settle: until the states stop coming
+    int64_t settle_end = last_sent + SETTLE_MAX_MS * 1000LL;
+    for (;;) {
+        int64_t quiet_end = (replay->last_answer_us > last_sent ? replay->last_answer_us : last_sent) +
+                            SETTLE_QUIET_MS * 1000LL;
+        int64_t until = quiet_end < settle_end ? quiet_end : settle_end;
+        if (mqtt_lite_now_us() >= until) {
+            break;
+        }
+        wait_until(replay, until, NULL);
+    }
+
+    uint64_t received = 0;
+    uint64_t rejected = 0;
+    uint64_t publishes = 0;
+    uint64_t allocs = 0;
+    size_t heap_peak = 0;
+    bool have_stats = bridge_stats && fetch_stats(replay) &&
+        sscanf(replay->stats, BRIDGE_HOST_STATS_FORMAT, &received, &rejected, &publishes, &heap_peak, &allocs) == 5;
+
+    qsort(replay->latencies, replay->answered, sizeof(int64_t), compare_i64);
+    double span = (replay->msgs[replay->msg_count - 1].msg.t_us - replay->msgs[0].msg.t_us) / speed / 1e6;
+    double elapsed = (replay->last_answer_us - t0) / 1e6;
+    printf("%5gx %8d %10.1f %11.1f %9.1f", speed, commands, span > 0 ? commands / span : 0.0,
+           elapsed > 0 ? replay->answered / elapsed : 0.0, max_lag / 1e3);
+    if (have_stats) {
+        printf(" %6" PRIu64 " %8" PRIu64, commands > (int)received ? commands - received : 0, rejected);
+    } else {
+        printf(" %6s %8s", "-", "-");
+    }
+    printf(" %8d %8.2f %8.2f %8.2f %8.2f", commands - replay->answered,
+           percentile_ms(replay->latencies, replay->answered, 50), percentile_ms(replay->latencies, replay->answered, 95),
+           percentile_ms(replay->latencies, replay->answered, 99), percentile_ms(replay->latencies, replay->answered, 100));
+    if (have_stats) {
+        printf(" %9zu B %6" PRIu64, heap_peak, allocs);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static int cmd_play(int argc, char **argv)
+{
+    const char *broker = "localhost";
+    double speeds[MAX_SPEEDS] = { 1, 10, 100 };
+    int speed_count = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:s:w:")) != -1) {
+        switch (opt) {
+        case 'b': broker = optarg; break;
+        case 'w': s_answer_window_us = atoi(optarg) * 1000LL; break;
+        case 's':
+            speed_count = 0;
+            for (char *tok = strtok(optarg, ","); tok && speed_count < MAX_SPEEDS; tok = strtok(NULL, ",")) {
+                speeds[speed_count] = atof(tok);
+                if (speeds[speed_count] > 0) {
+                    speed_count++;
+                }
+            }
+            break;
+        default: return 2;
+        }
+    }
+    if (optind != argc - 1 || speed_count == 0) {
+        return 2;
+    }
+
+    static replay_t replay;
+    if (load_capture(&replay, argv[optind]) <= 0) {
+        fprintf(stderr, "Nothing to replay in %s\n", argv[optind]);
+        return 1;
+    }
+    connect_broker(broker, "mqtt_replay_play");
+    if (mqtt_lite_subscribe(&s_client, HA_TOPIC_PREFIX "+/state", on_play, &replay) != 0 ||
+        mqtt_lite_subscribe(&s_client, BRIDGE_HOST_STATS, on_play, &replay) != 0) {
+        fprintf(stderr, "Cannot subscribe\n");
+        return 1;
+    }
+    // Reset the counters of bridge_host, if it is the bridge under test
+    bool bridge_stats = fetch_stats(&replay);
+    if (!bridge_stats) {
+        fprintf(stderr, "bridge_host does not answer on %s, running without its counters\n", BRIDGE_HOST_STATS_GET);
+    }
+
+    printf("%d messages, %d lamps, %.1f s\n\n", replay.msg_count, replay.lamp_count,
+           (replay.msgs[replay.msg_count - 1].msg.t_us - replay.msgs[0].msg.t_us) / 1e6);
+    printf("speed commands  offered/s sustained/s max lag ms  lost rejected no state   p50 ms   p95 ms   p99 ms   max ms"
+           "  heap peak allocs\n");
+    signal(SIGINT, on_signal);
+    for (int i = 0; i < speed_count && !s_stop; i++) {
+        play_run(&replay, speeds[i], bridge_stats);
+    }
+    mqtt_lite_close(&s_client);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int result = 2;
+    if (argc >= 2 && strcmp(argv[1], "record") == 0) {
+        result = cmd_record(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "play") == 0) {
+        result = cmd_play(argc - 1, argv + 1);
+    }
+    if (result == 2) {
+        fprintf(stderr, "usage: %s record [-b host[:port]] [-t filter]... [-d seconds] -o capture\n"
+                        "       %s play [-b host[:port]] [-s speed,...] [-w answer window ms] capture\n", argv[0], argv[0]);
+    }
+    return result;
+}
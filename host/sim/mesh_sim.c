@@ -0,0 +1,372 @@
+#include "mesh_sim.h"
+#include <string.h>
+
+#include "sim_rtos.h"
+
+#define MESH_SIM_MAX_LAMPS      2048
+#define MESH_SIM_MAX_GROUPS     8       /* Subscriptions per lamp */
+#define MESH_SIM_GROUP_MIN      0xC000
+// Window in which a repeated TID from the same client is the same transaction
+#define MESH_SIM_TID_WINDOW_US  6000000LL
+#define MESH_SIM_ADDR_NONE      -1
+
+typedef struct {
+    mesh_sim_lamp_t state;
+    uint32_t delay_us;          /* Mean answer delay of this lamp */
+    bool tid_valid;
+    uint8_t tid;
+    uint16_t tid_dst;
+    int64_t tid_at;
+    uint16_t groups[MESH_SIM_MAX_GROUPS];
+    uint8_t group_count;
+} sim_lamp_t;
+
+// Acked message of the client waiting for its answer
+typedef struct {
+    bool active;
+    uint32_t opcode;
+    uint32_t generation;        /* Ties the timeout event to this message */
+} sim_pending_t;
+
+typedef struct {
+    mesh_sim_msg_t msg;
+    int32_t lamp;
+} deliver_event_t;
+
+typedef struct {
+    mesh_sim_status_t status;
+    int32_t lamp;
+} answer_event_t;
+
+typedef struct {
+    uint16_t addr;
+    uint32_t generation;
+} timeout_event_t;
+
+static mesh_sim_config_t s_config;
+static mesh_sim_cb_t s_cb;
+static sim_lamp_t s_lamps[MESH_SIM_MAX_LAMPS];
+static int s_lamp_count;
+static int16_t s_by_addr[0x10000];
+static sim_pending_t s_pending[0x10000];
+static uint32_t s_generation;
+static int64_t s_air_free_at;
+static uint32_t s_rng;
+static mesh_sim_stats_t s_stats;
+
+static uint32_t next_random(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static bool lost(void)
+{
+    if (next_random() % 1000 < s_config.loss_permille) {
+        s_stats.lost++;
+        return true;
+    }
+    return false;
+}
+
+// Function to take the air for one message, returns false if the backlog is full
+static bool air_book(int64_t *arrival)
+{
+    int64_t now = sim_now();
+    int64_t airtime = 1000000LL / s_config.capacity;
+    int64_t start = s_air_free_at > now ? s_air_free_at : now;
+    if ((start - now) / airtime >= s_config.adv_buffers) {
+        return false;
+    }
+    s_air_free_at = start + airtime;
+    s_stats.air_us += airtime;
+    *arrival = start + airtime + s_config.latency_us;
+    return true;
+}
+
+static bool opcode_acked(uint32_t opcode)
+{
+    switch (opcode) {
+    case MESH_SIM_OP_GEN_ONOFF_SET_UNACK:
+    case MESH_SIM_OP_GEN_LEVEL_SET_UNACK:
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_SET_UNACK:
+    case MESH_SIM_OP_LIGHT_HSL_SET_UNACK:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static bool opcode_has_tid(uint32_t opcode)
+{
+    switch (opcode) {
+    case MESH_SIM_OP_GEN_ONOFF_GET:
+    case MESH_SIM_OP_GEN_LEVEL_GET:
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_GET:
+    case MESH_SIM_OP_LIGHT_HSL_GET:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Function to get the status opcode that answers a request
+static uint32_t status_opcode(uint32_t opcode)
+{
+    switch (opcode) {
+    case MESH_SIM_OP_GEN_ONOFF_GET:
+    case MESH_SIM_OP_GEN_ONOFF_SET:
+    case MESH_SIM_OP_GEN_ONOFF_SET_UNACK:
+        return MESH_SIM_OP_GEN_ONOFF_STATUS;
+    case MESH_SIM_OP_GEN_LEVEL_GET:
+    case MESH_SIM_OP_GEN_LEVEL_SET:
+    case MESH_SIM_OP_GEN_LEVEL_SET_UNACK:
+        return MESH_SIM_OP_GEN_LEVEL_STATUS;
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_GET:
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_SET:
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_SET_UNACK:
+        return MESH_SIM_OP_LIGHT_LIGHTNESS_STATUS;
+    default:
+        return MESH_SIM_OP_LIGHT_HSL_STATUS;
+    }
+}
+
+// Function to set Light Lightness Actual and what is bound to it
+static void lamp_set_lightness(mesh_sim_lamp_t *lamp, uint16_t lightness)
+{
+    lamp->lightness = lightness;
+    lamp->onoff = lightness > 0;
+    if (lightness > 0) {
+        lamp->last = lightness;
+    }
+}
+
+static void lamp_apply(mesh_sim_lamp_t *lamp, const mesh_sim_msg_t *msg)
+{
+    switch (msg->opcode) {
+    case MESH_SIM_OP_GEN_ONOFF_SET:
+    case MESH_SIM_OP_GEN_ONOFF_SET_UNACK:
+        // Generic OnOff restores Light Lightness Last
+        lamp_set_lightness(lamp, msg->onoff ? (lamp->last ? lamp->last : 0xFFFF) : 0);
+        break;
+    case MESH_SIM_OP_GEN_LEVEL_SET:
+    case MESH_SIM_OP_GEN_LEVEL_SET_UNACK:
+        lamp_set_lightness(lamp, (uint16_t)(msg->level + 32768));
+        break;
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_SET:
+    case MESH_SIM_OP_LIGHT_LIGHTNESS_SET_UNACK:
+        lamp_set_lightness(lamp, msg->lightness);
+        break;
+    case MESH_SIM_OP_LIGHT_HSL_SET:
+    case MESH_SIM_OP_LIGHT_HSL_SET_UNACK: {
+        // LEDVANCE: HSL lightness 50% is full brightness
+        uint32_t lightness = (uint32_t)msg->lightness * 2;
+        lamp->hue = msg->hue;
+        lamp->saturation = msg->saturation;
+        lamp_set_lightness(lamp, lightness > 0xFFFF ? 0xFFFF : lightness);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void lamp_status(const mesh_sim_lamp_t *lamp, uint32_t status_op, mesh_sim_status_t *status)
+{
+    *status = (mesh_sim_status_t) {
+        .status_op = status_op,
+        .onoff = lamp->onoff,
+        .level = (int16_t)(lamp->lightness - 32768),
+        .lightness = status_op == MESH_SIM_OP_LIGHT_HSL_STATUS ? lamp->lightness / 2 : lamp->lightness,
+        .hue = lamp->hue,
+        .saturation = lamp->saturation,
+    };
+}
+
+static void answer_rx_event(void *data)
+{
+    const answer_event_t *answer = data;
+    uint16_t addr = s_lamps[answer->lamp].state.addr;
+    sim_pending_t *pending = &s_pending[addr];
+
+    if (pending->active && status_opcode(pending->opcode) == answer->status.status_op) {
+        pending->active = false;
+        s_cb(MESH_SIM_EVT_STATUS, addr, pending->opcode, &answer->status);
+    } else {
+        s_cb(MESH_SIM_EVT_PUBLISH, addr, 0, &answer->status);
+    }
+}
+
+static void answer_tx_event(void *data)
+{
+    const answer_event_t *answer = data;
+    int64_t arrival;
+    if (!air_book(&arrival)) {
+        s_stats.lost++;
+        return;
+    }
+    s_stats.answers++;
+    if (!lost()) {
+        sim_at(arrival, answer_rx_event, answer, sizeof(*answer));
+    }
+}
+
+static void deliver_event(void *data)
+{
+    const deliver_event_t *deliver = data;
+    sim_lamp_t *lamp = &s_lamps[deliver->lamp];
+    const mesh_sim_msg_t *msg = &deliver->msg;
+    int64_t now = sim_now();
+
+    s_stats.received++;
+    if (opcode_has_tid(msg->opcode)) {
+        bool repeated = lamp->tid_valid && lamp->tid == msg->tid && lamp->tid_dst == msg->addr &&
+                        now - lamp->tid_at < MESH_SIM_TID_WINDOW_US;
+        lamp->tid_valid = true;
+        lamp->tid = msg->tid;
+        lamp->tid_dst = msg->addr;
+        lamp->tid_at = now;
+        if (repeated) {
+            s_stats.repeated++;
+        } else {
+            lamp_apply(&lamp->state, msg);
+        }
+    }
+    // Only messages to the lamp's own address are answered
+    if (!opcode_acked(msg->opcode) || msg->addr != lamp->state.addr) {
+        return;
+    }
+    answer_event_t answer = { .lamp = deliver->lamp };
+    lamp_status(&lamp->state, status_opcode(msg->opcode), &answer.status);
+    uint32_t jitter = s_config.jitter_us ? next_random() % (s_config.jitter_us + 1) : 0;
+    sim_at(now + lamp->delay_us + jitter, answer_tx_event, &answer, sizeof(answer));
+}
+
+static void timeout_event(void *data)
+{
+    const timeout_event_t *timeout = data;
+    sim_pending_t *pending = &s_pending[timeout->addr];
+    if (!pending->active || pending->generation != timeout->generation) {
+        return;
+    }
+    pending->active = false;
+    s_stats.timeouts++;
+    s_cb(MESH_SIM_EVT_TIMEOUT, timeout->addr, pending->opcode, NULL);
+}
+
+static void schedule_delivery(const mesh_sim_msg_t *msg, int lamp, int64_t arrival)
+{
+    if (lost()) {
+        return;
+    }
+    deliver_event_t deliver = { .msg = *msg, .lamp = lamp };
+    sim_at(arrival, deliver_event, &deliver, sizeof(deliver));
+}
+
+void mesh_sim_init(const mesh_sim_config_t *config, mesh_sim_cb_t cb)
+{
+    s_config = *config;
+    if (s_config.capacity == 0) {
+        s_config.capacity = 1;
+    }
+    s_cb = cb;
+    s_rng = config->seed ? config->seed : 1;
+    s_lamp_count = 0;
+    s_generation = 0;
+    s_air_free_at = 0;
+    memset(&s_stats, 0, sizeof(s_stats));
+    memset(s_pending, 0, sizeof(s_pending));
+    memset(s_by_addr, 0xff, sizeof(s_by_addr));
+}
+
+esp_err_t mesh_sim_add_lamp(uint16_t addr)
+{
+    if (s_lamp_count == MESH_SIM_MAX_LAMPS || addr == 0 || addr >= MESH_SIM_GROUP_MIN) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (s_by_addr[addr] != MESH_SIM_ADDR_NONE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    sim_lamp_t *lamp = &s_lamps[s_lamp_count];
+    memset(lamp, 0, sizeof(*lamp));
+    lamp->state.addr = addr;
+    lamp->state.last = 0xFFFF;
+    lamp->delay_us = s_config.lamp_delay_us / 2 + next_random() % (s_config.lamp_delay_us + 1);
+    s_by_addr[addr] = s_lamp_count++;
+    return ESP_OK;
+}
+
+esp_err_t mesh_sim_subscribe(uint16_t addr, uint16_t group)
+{
+    if (s_by_addr[addr] == MESH_SIM_ADDR_NONE) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    sim_lamp_t *lamp = &s_lamps[s_by_addr[addr]];
+    if (lamp->group_count == MESH_SIM_MAX_GROUPS) {
+        return ESP_ERR_NO_MEM;
+    }
+    lamp->groups[lamp->group_count++] = group;
+    return ESP_OK;
+}
+
+esp_err_t mesh_sim_send(const mesh_sim_msg_t *msg)
+{
+    sim_busy(s_config.call_us);
+    bool acked = opcode_acked(msg->opcode);
+    if (acked && s_pending[msg->addr].active) {
+        s_stats.busy++;
+        return ESP_FAIL;
+    }
+    int64_t arrival;
+    if (!air_book(&arrival)) {
+        s_stats.no_buffer++;
+        return ESP_ERR_NO_MEM;
+    }
+    s_stats.sent++;
+
+    if (acked) {
+        sim_pending_t *pending = &s_pending[msg->addr];
+        pending->active = true;
+        pending->opcode = msg->opcode;
+        pending->generation = ++s_generation;
+        timeout_event_t timeout = { .addr = msg->addr, .generation = pending->generation };
+        sim_at(sim_now() + s_config.timeout_us, timeout_event, &timeout, sizeof(timeout));
+    }
+
+    if (msg->addr >= MESH_SIM_GROUP_MIN) {
+        for (int i = 0; i < s_lamp_count; i++) {
+            for (int g = 0; g < s_lamps[i].group_count; g++) {
+                if (s_lamps[i].groups[g] == msg->addr) {
+                    schedule_delivery(msg, i, arrival);
+                    break;
+                }
+            }
+        }
+    } else if (s_by_addr[msg->addr] != MESH_SIM_ADDR_NONE) {
+        schedule_delivery(msg, s_by_addr[msg->addr], arrival);
+    }
+    return ESP_OK;
+}
+
+bool mesh_sim_lamp_get(uint16_t addr, mesh_sim_lamp_t *lamp)
+{
+    if (s_by_addr[addr] == MESH_SIM_ADDR_NONE) {
+        return false;
+    }
+    *lamp = s_lamps[s_by_addr[addr]].state;
+    return true;
+}
+
+void mesh_sim_lamp_set(const mesh_sim_lamp_t *lamp)
+{
+    if (s_by_addr[lamp->addr] != MESH_SIM_ADDR_NONE) {
+        s_lamps[s_by_addr[lamp->addr]].state = *lamp;
+    }
+}
+
+void mesh_sim_get_stats(mesh_sim_stats_t *stats)
+{
+    *stats = s_stats;
+}
@@ -0,0 +1,138 @@
+#ifndef MESH_SIM_H
+#define MESH_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Simulated mesh of LEDVANCE lamps.
+ *
+ * Each lamp runs the Generic OnOff, Generic Level, Light Lightness and Light
+ * HSL servers with the state bindings between them, including the LEDVANCE
+ * HSL lightness scale (50% HSL lightness is full brightness, see
+ * ble_mesh_send_gen_hsl_set()). A repeated TID from the same client within
+ * 6 s is treated as a retransmission: the state is not applied again, an
+ * acked message is still answered.
+ *
+ * mesh_sim_send() has the contract of esp_ble_mesh_generic_client_set_state
+ * and esp_ble_mesh_light_client_set_state/get_state: it returns once the
+ * message is queued for the air, answers and timeouts arrive later through
+ * the client callback, and only one acked message per destination may be
+ * outstanding. Refused sends (destination busy, no advertising buffer) are
+ * reported by the return value right away. The air is a single channel with a fixed capacity shared by
+ * requests and answers; every message may be lost on the way.
+ */
+
+// Mesh model opcodes (Mesh Model specification)
+#define MESH_SIM_OP_GEN_ONOFF_GET               0x8201
+#define MESH_SIM_OP_GEN_ONOFF_SET               0x8202
+#define MESH_SIM_OP_GEN_ONOFF_SET_UNACK         0x8203
+#define MESH_SIM_OP_GEN_ONOFF_STATUS            0x8204
+#define MESH_SIM_OP_GEN_LEVEL_GET               0x8205
+#define MESH_SIM_OP_GEN_LEVEL_SET               0x8206
+#define MESH_SIM_OP_GEN_LEVEL_SET_UNACK         0x8207
+#define MESH_SIM_OP_GEN_LEVEL_STATUS            0x8208
+#define MESH_SIM_OP_LIGHT_LIGHTNESS_GET         0x824B
+#define MESH_SIM_OP_LIGHT_LIGHTNESS_SET         0x824C
+#define MESH_SIM_OP_LIGHT_LIGHTNESS_SET_UNACK   0x824D
+#define MESH_SIM_OP_LIGHT_LIGHTNESS_STATUS      0x824E
+#define MESH_SIM_OP_LIGHT_HSL_GET               0x826D
+#define MESH_SIM_OP_LIGHT_HSL_SET               0x8276
+#define MESH_SIM_OP_LIGHT_HSL_SET_UNACK         0x8277
+#define MESH_SIM_OP_LIGHT_HSL_STATUS            0x8278
+
+typedef struct {
+    uint32_t capacity;          /* Messages per second the air carries (requests and answers) */
+    uint32_t adv_buffers;       /* Messages waiting for air time before a send fails */
+    uint32_t call_us;           /* Time the set_state/get_state call itself takes */
+    uint32_t latency_us;        /* Air and relay latency of a message */
+    uint32_t loss_permille;     /* Chance that a message is lost, per receiver */
+    uint32_t lamp_delay_us;     /* Mean answer delay; each lamp gets 50-150% of it */
+    uint32_t jitter_us;         /* Random extra answer delay, 0 to jitter_us */
+    uint32_t timeout_us;        /* Client timeout of acked messages */
+    uint32_t seed;
+} mesh_sim_config_t;
+
+// Defaults: ESP-IDF client timeout and advertising buffers, a mesh with a few relays
+#define MESH_SIM_CONFIG_DEFAULT() {     \
+    .capacity = 30,                     \
+    .adv_buffers = 60,                  \
+    .call_us = 1500,                    \
+    .latency_us = 30000,                \
+    .loss_permille = 20,                \
+    .lamp_delay_us = 40000,             \
+    .jitter_us = 30000,                 \
+    .timeout_us = 4000000,              \
+    .seed = 1,                          \
+}
+
+// A message as given to set_state/get_state
+typedef struct {
+    uint32_t opcode;
+    uint16_t addr;          /* Unicast or group address */
+    uint8_t tid;
+    uint8_t onoff;
+    int16_t level;
+    uint16_t lightness;     /* Light Lightness, or the HSL lightness for the HSL opcodes */
+    uint16_t hue;
+    uint16_t saturation;
+} mesh_sim_msg_t;
+
+typedef enum {
+    MESH_SIM_EVT_STATUS,    /* Answer to an acked message (opcode is the one sent) */
+    MESH_SIM_EVT_PUBLISH,   /* Status that matches nothing outstanding, e.g. a late answer */
+    MESH_SIM_EVT_TIMEOUT,   /* No answer to an acked message in time */
+} mesh_sim_event_t;
+
+// Status as reported by a lamp; status_op tells which fields are set
+typedef struct {
+    uint32_t status_op;
+    uint8_t onoff;
+    int16_t level;
+    uint16_t lightness;     /* Light Lightness, or the HSL lightness for MESH_SIM_OP_LIGHT_HSL_STATUS */
+    uint16_t hue;
+    uint16_t saturation;
+} mesh_sim_status_t;
+
+// Function called for client events, like the ESP-BLE-MESH client callbacks
+typedef void (*mesh_sim_cb_t)(mesh_sim_event_t event, uint16_t addr, uint32_t opcode, const mesh_sim_status_t *status);
+
+// State of a simulated lamp
+typedef struct {
+    uint16_t addr;
+    uint8_t onoff;
+    uint16_t lightness;     /* Light Lightness Actual, the brightness */
+    uint16_t last;          /* Light Lightness Last, restored by Generic OnOff */
+    uint16_t hue;
+    uint16_t saturation;
+} mesh_sim_lamp_t;
+
+typedef struct {
+    uint32_t sent;          /* Messages accepted from the client */
+    uint32_t busy;          /* Acked sends refused, one outstanding per address */
+    uint32_t no_buffer;     /* Sends refused, air time backlog full */
+    uint32_t received;      /* Messages a lamp received */
+    uint32_t repeated;      /* Received with a TID the lamp had just seen */
+    uint32_t lost;          /* Messages lost on the way (either direction) */
+    uint32_t answers;       /* Answers sent by lamps */
+    uint32_t timeouts;      /* Client timeouts */
+    uint64_t air_us;        /* Air time used */
+} mesh_sim_stats_t;
+
+// Function to set up the mesh, before any other call
+void mesh_sim_init(const mesh_sim_config_t *config, mesh_sim_cb_t cb);
+// Function to add a lamp, returns ESP_ERR_NO_MEM if the mesh is full
+esp_err_t mesh_sim_add_lamp(uint16_t addr);
+// Function to subscribe a lamp to a group address
+esp_err_t mesh_sim_subscribe(uint16_t addr, uint16_t group);
+// Function to send a message, see the contract above
+esp_err_t mesh_sim_send(const mesh_sim_msg_t *msg);
+// Function to copy the state of a lamp, returns false for an unknown address
+bool mesh_sim_lamp_get(uint16_t addr, mesh_sim_lamp_t *lamp);
+// Function to change a lamp like a wall switch or another app would, without telling anybody
+void mesh_sim_lamp_set(const mesh_sim_lamp_t *lamp);
+// Function to read the counters
+void mesh_sim_get_stats(mesh_sim_stats_t *stats);
+
+#endif /* MESH_SIM_H */
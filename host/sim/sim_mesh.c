@@ -0,0 +1,522 @@
+/* Load test of the bridge against a simulated lamp mesh.
+ *
+ * The firmware's own mesh TX task (queueing, coalescing, acked retries),
+ * poll scheduler, latency histograms and bridge core run unchanged on the
+ * virtual clock of sim_rtos; the send and client callback glue mirrors
+ * main.c. Home Assistant traffic is generated as user actions (slider drags,
+ * switches, colour wheel, group commands) arriving at random, and at the end
+ * every lamp is compared with the last state HA asked for.
+ *
+ *   ./build-host/sim_mesh --lamps 200 --rate 2 --duration 600 --loss 2
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_rtos.h"
+#include "mesh_sim.h"
+#include "bridge.h"
+#include "lamp_registry.h"
+#include "lamp_shadow.h"
+#include "latency.h"
+#include "light_scale.h"
+#include "mesh_poll.h"
+#include "mesh_tx.h"
+#include "mqtt_router.h"
+
+#define LAMP_ADDR(i)        (0x0100 + (i))
+#define GROUP_ADDR(g)       (GROUP_ADDR_MIN + (g))
+#define GROUP_SIZE          10
+// Time after the last action for retries and polls to settle
+#define SETTLE_US           (60 * 1000000LL)
+
+typedef enum {
+    ACTION_SLIDER,          /* Brightness slider drag: a burst of commands for one lamp */
+    ACTION_SWITCH,          /* On/off */
+    ACTION_COLOR,           /* Colour wheel drag, keeps the brightness */
+    ACTION_GROUP,           /* Slider drag or switch for a group */
+    ACTION_COUNT,
+} action_t;
+
+// Percent of the actions per kind
+static const int s_mix[ACTION_COUNT] = {
+    [ACTION_SLIDER] = 45,
+    [ACTION_SWITCH] = 30,
+    [ACTION_COLOR] = 10,
+    [ACTION_GROUP] = 15,
+};
+
+typedef enum {
+    CMD_BRIGHTNESS,
+    CMD_ONOFF,
+    CMD_COLOR,
+} cmd_kind_t;
+
+typedef struct {
+    int16_t target;         /* Lamp slot, or group slot if group */
+    uint8_t group;
+    uint8_t kind;           /* cmd_kind_t */
+    int16_t value;          /* Brightness 1-100, on/off, or hue 0-359 */
+    int16_t value2;         /* Saturation 0-100 */
+} cmd_event_t;
+
+// State HA asked for last, per lamp
+typedef struct {
+    bool commanded;
+    bool on;
+    int brightness;         /* -1 if never set */
+    int hue;                /* -1 if never set */
+    int saturation;
+} intent_t;
+
+typedef struct {
+    int lamps;
+    int groups;
+    int acked_percent;
+    double rate;
+    double duration;
+    bool poll;
+} options_t;
+
+static options_t s_opt = {
+    .lamps = MAX_LAMPS < 200 ? MAX_LAMPS : 200,
+    .groups = 4,
+    .acked_percent = 0,
+    .rate = 2.0,
+    .duration = 600.0,
+    .poll = true,
+};
+static mesh_sim_config_t s_mesh = MESH_SIM_CONFIG_DEFAULT();
+
+static intent_t s_intent[MAX_LAMPS];
+static uint32_t s_rng = 12345;
+static uint8_t s_tid;
+static uint64_t s_actions;
+static uint64_t s_commands;
+static uint64_t s_publishes;
+
+static uint32_t next_random(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static double next_uniform(void)
+{
+    return (next_random() + 0.5) / 4294967296.0;
+}
+
+/* Glue between the firmware modules and the simulated mesh, as in main.c */
+
+static esp_err_t sim_tx_send(mesh_cmd_t *cmd, mesh_tx_attempt_t *attempt)
+{
+    if (cmd->type >= MESH_CMD_TYPE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!attempt->retry) {
+        attempt->tid = s_tid++;
+    }
+    attempt->opcode = bridge_set_opcode(cmd);
+
+    mesh_sim_msg_t msg = { .opcode = attempt->opcode, .addr = cmd->addr, .tid = attempt->tid };
+    switch (cmd->type) {
+    case MESH_CMD_ONOFF:
+        msg.onoff = cmd->onoff;
+        break;
+    case MESH_CMD_LIGHTNESS:
+        msg.lightness = cmd->lightness;
+        break;
+    default:
+        bridge_resolve_cmd(cmd);
+        msg.hue = cmd->hue;
+        msg.saturation = cmd->saturation;
+        msg.lightness = cmd->lightness / 2;
+        break;
+    }
+    return mesh_sim_send(&msg);
+}
+
+static esp_err_t sim_poll_get(int index, uint16_t addr)
+{
+    lamp_shadow_t shadow;
+    lamp_shadow_get(index, &shadow);
+    mesh_sim_msg_t msg = {
+        .opcode = (shadow.known & LAMP_SHADOW_COLOR) ? MESH_SIM_OP_LIGHT_HSL_GET : MESH_SIM_OP_LIGHT_LIGHTNESS_GET,
+        .addr = addr,
+    };
+    return mesh_sim_send(&msg);
+}
+
+static bool is_get(uint32_t opcode)
+{
+    return opcode == MESH_SIM_OP_LIGHT_LIGHTNESS_GET || opcode == MESH_SIM_OP_LIGHT_HSL_GET;
+}
+
+static void sim_client_cb(mesh_sim_event_t event, uint16_t addr, uint32_t opcode, const mesh_sim_status_t *status)
+{
+    if (event == MESH_SIM_EVT_TIMEOUT) {
+        if (is_get(opcode)) {
+            mesh_poll_timed_out(addr);
+        } else {
+            mesh_tx_timed_out(addr, opcode);
+        }
+        return;
+    }
+
+    // Simulated lamps change state at once, there is never a transition
+    bridge_status_t msg = {
+        .status_op = status->status_op,
+        .present_onoff = status->onoff,
+        .present_lightness = status->lightness,
+        .hsl_lightness = status->lightness,
+        .hue = status->hue,
+        .saturation = status->saturation,
+    };
+    bridge_lamp_status_message(addr, &msg);
+    if (event != MESH_SIM_EVT_STATUS) {
+        return;
+    }
+    if (is_get(opcode)) {
+        mesh_poll_answered(addr);
+    } else {
+        mesh_tx_acked(addr, opcode);
+    }
+}
+
+static int sim_publish(const char *topic, const char *data, int len, int retain)
+{
+    (void)topic;
+    (void)data;
+    (void)len;
+    (void)retain;
+    return (int)++s_publishes;
+}
+
+/* Home Assistant traffic */
+
+static void intent_apply(int lamp, const cmd_event_t *cmd)
+{
+    intent_t *intent = &s_intent[lamp];
+    intent->commanded = true;
+    switch (cmd->kind) {
+    case CMD_ONOFF:
+        intent->on = cmd->value;
+        break;
+    case CMD_BRIGHTNESS:
+        intent->on = true;
+        intent->brightness = cmd->value;
+        break;
+    default:
+        intent->on = true;
+        intent->hue = cmd->value;
+        intent->saturation = cmd->value2;
+        break;
+    }
+}
+
+static void command_event(void *data)
+{
+    const cmd_event_t *cmd = data;
+    char topic[64];
+    char payload[96];
+    int topic_len;
+    int len;
+
+    if (cmd->group) {
+        topic_len = snprintf(topic, sizeof(topic), HA_TOPIC_PREFIX "Group_%d/set", cmd->target);
+    } else {
+        topic_len = snprintf(topic, sizeof(topic), HA_TOPIC_PREFIX "Lamp_%04d/set", cmd->target);
+    }
+    switch (cmd->kind) {
+    case CMD_ONOFF:
+        len = snprintf(payload, sizeof(payload), "{\"state\":\"%s\"}", cmd->value ? "ON" : "OFF");
+        break;
+    case CMD_BRIGHTNESS:
+        len = snprintf(payload, sizeof(payload), "{\"state\":\"ON\",\"brightness\":%d}", cmd->value);
+        break;
+    default:
+        len = snprintf(payload, sizeof(payload), "{\"state\":\"ON\",\"color\":{\"h\":%d,\"s\":%d}}",
+                       cmd->value, cmd->value2);
+        break;
+    }
+
+    mqtt_route_t route;
+    mqtt_route(topic, topic_len, &route);
+    if (bridge_handle_command(&route, payload, len, latency_now()) != ESP_OK) {
+        return;     /* Dropped, HA never got this far either */
+    }
+    s_commands++;
+    if (!cmd->group) {
+        intent_apply(cmd->target, cmd);
+        return;
+    }
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        intent_apply(cmd->target * GROUP_SIZE + i, cmd);
+    }
+}
+
+static action_t pick_action(void)
+{
+    int roll = next_random() % 100;
+    for (int action = 0; action < ACTION_COUNT; action++) {
+        if (roll < s_mix[action]) {
+            return action;
+        }
+        roll -= s_mix[action];
+    }
+    return ACTION_SWITCH;
+}
+
+// Function to queue the commands of a slider drag from one value towards another
+static void drag(int64_t start, cmd_event_t cmd, int steps, int64_t interval_us)
+{
+    int from = 1 + next_random() % 100;
+    int to = 1 + next_random() % 100;
+    for (int i = 0; i < steps; i++) {
+        cmd.value = from + (to - from) * (i + 1) / steps;
+        sim_at(start + i * interval_us, command_event, &cmd, sizeof(cmd));
+    }
+}
+
+static void action_event(void *data)
+{
+    (void)data;
+    int64_t now = sim_now();
+    cmd_event_t cmd = { .target = next_random() % s_opt.lamps };
+    action_t action = pick_action();
+    if (action == ACTION_GROUP && s_opt.groups == 0) {
+        action = ACTION_SLIDER;
+    }
+    s_actions++;
+
+    switch (action) {
+    case ACTION_SLIDER:
+        cmd.kind = CMD_BRIGHTNESS;
+        drag(now, cmd, 8, 80000);
+        break;
+    case ACTION_SWITCH:
+        cmd.kind = CMD_ONOFF;
+        cmd.value = next_random() & 1;
+        sim_at(now, command_event, &cmd, sizeof(cmd));
+        break;
+    case ACTION_COLOR:
+        cmd.kind = CMD_COLOR;
+        for (int i = 0; i < 6; i++) {
+            cmd.value = next_random() % 360;
+            cmd.value2 = 50 + next_random() % 51;
+            sim_at(now + i * 120000, command_event, &cmd, sizeof(cmd));
+        }
+        break;
+    default:
+        cmd.group = 1;
+        cmd.target = next_random() % s_opt.groups;
+        if (next_random() & 1) {
+            cmd.kind = CMD_ONOFF;
+            cmd.value = next_random() & 1;
+            sim_at(now, command_event, &cmd, sizeof(cmd));
+        } else {
+            cmd.kind = CMD_BRIGHTNESS;
+            drag(now, cmd, 4, 100000);
+        }
+        break;
+    }
+
+    // Poisson arrivals
+    int64_t next = now + (int64_t)(-log(next_uniform()) / s_opt.rate * 1e6);
+    if (next < (int64_t)(s_opt.duration * 1e6)) {
+        sim_at(next, action_event, NULL, 0);
+    }
+}
+
+/* Setup and report */
+
+static void setup(void)
+{
+    lamp_registry_init();
+    mesh_sim_init(&s_mesh, sim_client_cb);
+    for (int i = 0; i < s_opt.lamps; i++) {
+        LampInfo lamp_info = {
+            .address = LAMP_ADDR(i),
+            .flags = (i % 100) < s_opt.acked_percent ? LAMP_FLAG_ACKED : 0,
+        };
+        snprintf(lamp_info.name, sizeof(lamp_info.name), "Lamp %04d", i);
+        lamp_registry_set(i, &lamp_info);
+        mesh_sim_add_lamp(lamp_info.address);
+        s_intent[i] = (intent_t) { .brightness = -1, .hue = -1 };
+    }
+    for (int g = 0; g < s_opt.groups; g++) {
+        GroupInfo group_info = { .address = GROUP_ADDR(g) };
+        snprintf(group_info.name, sizeof(group_info.name), "Group %d", g);
+        for (int m = 0; m < GROUP_SIZE; m++) {
+            group_set_member(&group_info, g * GROUP_SIZE + m, true);
+            mesh_sim_subscribe(LAMP_ADDR(g * GROUP_SIZE + m), group_info.address);
+        }
+        lamp_registry_group_set(g, &group_info);
+    }
+
+    const bridge_io_t io = {
+        .publish = sim_publish,
+        .submit = mesh_tx_submit,
+    };
+    bridge_init(&io);
+    if (s_opt.poll) {
+        mesh_poll_init(sim_poll_get);
+        mesh_tx_set_idle_handler(mesh_poll_run);
+        mesh_tx_set_busy_check(mesh_poll_waiting);
+    }
+    if (mesh_tx_init(sim_tx_send, bridge_cmd_done) != ESP_OK) {
+        fprintf(stderr, "mesh_tx_init failed\n");
+        exit(1);
+    }
+}
+
+// Function to count the lamps that are not in the state HA asked for last
+static int count_mismatches(void)
+{
+    int mismatches = 0;
+    for (int i = 0; i < s_opt.lamps; i++) {
+        const intent_t *intent = &s_intent[i];
+        mesh_sim_lamp_t lamp;
+        if (!intent->commanded || !mesh_sim_lamp_get(LAMP_ADDR(i), &lamp)) {
+            continue;
+        }
+        bool ok = lamp.onoff == intent->on;
+        if (ok && intent->on && intent->brightness >= 0) {
+            int brightness = (int)roundf(light_mesh_to_percent(lamp.lightness));
+            ok = abs(brightness - intent->brightness) <= 1;
+        }
+        if (ok && intent->on && intent->hue >= 0) {
+            ok = fabsf(light_mesh_to_hue(lamp.hue) - intent->hue) <= 1.0f;
+        }
+        mismatches += !ok;
+    }
+    return mismatches;
+}
+
+static void report(void)
+{
+    mesh_tx_stats_t tx;
+    mesh_sim_stats_t air;
+    mesh_poll_stats_t poll;
+    mesh_tx_get_stats(&tx);
+    mesh_sim_get_stats(&air);
+    mesh_poll_get_stats(&poll);
+    double seconds = sim_now() / 1e6;
+
+    printf("%d lamps (%d%% acked), %d groups, %.2f actions/s for %.0f s, seed %u\n", s_opt.lamps,
+           s_opt.acked_percent, s_opt.groups, s_opt.rate, s_opt.duration, s_mesh.seed);
+    printf("mesh: %u msg/s, %u adv buffers, latency %.0f ms, loss %.1f%%, lamp delay %.0f ms, jitter %.0f ms, "
+           "timeout %.0f ms\n\n", s_mesh.capacity, s_mesh.adv_buffers, s_mesh.latency_us / 1e3,
+           s_mesh.loss_permille / 10.0, s_mesh.lamp_delay_us / 1e3, s_mesh.jitter_us / 1e3, s_mesh.timeout_us / 1e3);
+
+    printf("ha       %8" PRIu64 " actions %8" PRIu64 " commands %8" PRIu64 " state publishes\n",
+           s_actions, s_commands, s_publishes);
+    printf("mesh_tx  %8" PRIu32 " queued  %8" PRIu32 " coalesced %7" PRIu32 " dropped %7" PRIu32 " max depth\n",
+           tx.queued, tx.coalesced, tx.dropped, tx.max_depth);
+    printf("         %8" PRIu32 " sent    %8" PRIu32 " failed    %7" PRIu32 " retries %7" PRIu32 " delivered %"
+           PRIu32 " gave up\n", tx.sent, tx.failed, tx.retries, tx.delivered, tx.gave_up);
+    printf("air      %8" PRIu32 " sent    %8" PRIu32 " busy      %7" PRIu32 " no buf  %7" PRIu32 " lost\n",
+           air.sent, air.busy, air.no_buffer, air.lost);
+    printf("         %8" PRIu32 " answers %8" PRIu32 " timeouts  %7" PRIu32 " repeated TID  %5.1f%% air time\n",
+           air.answers, air.timeouts, air.repeated, 100.0 * air.air_us / 1e6 / seconds);
+    if (s_opt.poll) {
+        printf("poll     %8" PRIu32 " polls   %8" PRIu32 " answered  %7" PRIu32 " timeouts\n",
+               poll.polls, poll.answered, poll.timeouts);
+    }
+
+    printf("\nlatency ms       p50      p95      p99    count\n");
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        uint32_t count = latency_count(stage, -1);
+        if (count == 0) {
+            continue;
+        }
+        printf("%-10s %8.1f %8.1f %8.1f %8" PRIu32 "\n", latency_stage_name(stage),
+               latency_percentile(stage, -1, 50) / 1e3, latency_percentile(stage, -1, 95) / 1e3,
+               latency_percentile(stage, -1, 99) / 1e3, count);
+    }
+    printf("\nlamps not in the commanded state: %d\n", count_mismatches());
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --lamps N          lamps in the mesh (max %d)\n"
+        "  --groups N         groups of %d lamps (max %d)\n"
+        "  --acked PCT        percent of lamps in acknowledged mode\n"
+        "  --rate R           user actions per second\n"
+        "  --duration S       seconds of traffic\n"
+        "  --no-poll          no background state polling\n"
+        "  --capacity N       messages per second the mesh carries\n"
+        "  --adv-buffers N    messages waiting for air time before sends fail\n"
+        "  --latency MS       air and relay latency per message\n"
+        "  --loss PCT         message loss per receiver\n"
+        "  --lamp-delay MS    mean lamp answer delay (each lamp 50-150%%)\n"
+        "  --jitter MS        random extra answer delay\n"
+        "  --timeout MS       client timeout of acked messages\n"
+        "  --seed N           random seed (same seed, same run)\n",
+        name, MAX_LAMPS, GROUP_SIZE, MAX_GROUPS);
+    exit(2);
+}
+
+static void parse_options(int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "lamps", required_argument, NULL, 'n' },
+        { "groups", required_argument, NULL, 'g' },
+        { "acked", required_argument, NULL, 'a' },
+        { "rate", required_argument, NULL, 'r' },
+        { "duration", required_argument, NULL, 'd' },
+        { "no-poll", no_argument, NULL, 'P' },
+        { "capacity", required_argument, NULL, 'c' },
+        { "adv-buffers", required_argument, NULL, 'b' },
+        { "latency", required_argument, NULL, 'l' },
+        { "loss", required_argument, NULL, 'L' },
+        { "lamp-delay", required_argument, NULL, 'D' },
+        { "jitter", required_argument, NULL, 'j' },
+        { "timeout", required_argument, NULL, 't' },
+        { "seed", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 },
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': s_opt.lamps = atoi(optarg); break;
+        case 'g': s_opt.groups = atoi(optarg); break;
+        case 'a': s_opt.acked_percent = atoi(optarg); break;
+        case 'r': s_opt.rate = atof(optarg); break;
+        case 'd': s_opt.duration = atof(optarg); break;
+        case 'P': s_opt.poll = false; break;
+        case 'c': s_mesh.capacity = atoi(optarg); break;
+        case 'b': s_mesh.adv_buffers = atoi(optarg); break;
+        case 'l': s_mesh.latency_us = atof(optarg) * 1000; break;
+        case 'L': s_mesh.loss_permille = atof(optarg) * 10; break;
+        case 'D': s_mesh.lamp_delay_us = atof(optarg) * 1000; break;
+        case 'j': s_mesh.jitter_us = atof(optarg) * 1000; break;
+        case 't': s_mesh.timeout_us = atof(optarg) * 1000; break;
+        case 's': s_mesh.seed = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (s_opt.lamps < 1 || s_opt.lamps > MAX_LAMPS || s_opt.rate <= 0 || s_mesh.capacity == 0 ||
+        s_opt.groups < 0 || s_opt.groups > MAX_GROUPS || s_opt.groups * GROUP_SIZE > s_opt.lamps) {
+        usage(argv[0]);
+    }
+    s_rng ^= s_mesh.seed * 2654435761u;
+}
+
+int main(int argc, char **argv)
+{
+    parse_options(argc, argv);
+    setup();
+    sim_at(0, action_event, NULL, 0);
+    sim_run_until((int64_t)(s_opt.duration * 1e6) + SETTLE_US);
+    report();
+    return 0;
+}
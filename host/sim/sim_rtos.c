@@ -0,0 +1,269 @@
+#include "sim_rtos.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#define SIM_MAX_TASKS       4
+#define SIM_TASK_STACK      (256 * 1024)
+#define SIM_TICK_US         (1000000LL / configTICK_RATE_HZ)
+#define SIM_NEVER           INT64_MAX
+
+typedef struct {
+    int64_t at;
+    uint64_t seq;           /* Tie-break, keeps same-time events in order */
+    sim_event_fn_t fn;
+    uint8_t data[SIM_EVENT_DATA_SIZE];
+} sim_event_t;
+
+typedef struct {
+    ucontext_t ctx;
+    TaskFunction_t fn;
+    void *arg;
+    void *stack;
+    int64_t wake_at;        /* SIM_NEVER while blocked without timeout */
+    QueueHandle_t waiting;  /* Queue the task blocks on, NULL if none */
+} sim_task_t;
+
+static int64_t s_now;
+static uint64_t s_next_seq;
+
+// Binary min-heap of pending events
+static sim_event_t *s_events;
+static size_t s_event_count;
+static size_t s_event_capacity;
+
+static sim_task_t s_tasks[SIM_MAX_TASKS];
+static int s_task_count;
+static sim_task_t *s_current;
+static ucontext_t s_main_ctx;
+
+int64_t esp_timer_get_time(void)
+{
+    return s_now;
+}
+
+int64_t sim_now(void)
+{
+    return s_now;
+}
+
+bool sim_in_task(void)
+{
+    return s_current != NULL;
+}
+
+static bool event_before(const sim_event_t *a, const sim_event_t *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+void sim_at(int64_t at_us, sim_event_fn_t fn, const void *data, size_t len)
+{
+    if (len > SIM_EVENT_DATA_SIZE) {
+        fprintf(stderr, "sim: event data too large (%zu)\n", len);
+        abort();
+    }
+    if (s_event_count == s_event_capacity) {
+        s_event_capacity = s_event_capacity ? s_event_capacity * 2 : 1024;
+        s_events = realloc(s_events, s_event_capacity * sizeof(*s_events));
+        if (s_events == NULL) {
+            abort();
+        }
+    }
+    sim_event_t event = { .at = at_us < s_now ? s_now : at_us, .seq = s_next_seq++, .fn = fn };
+    if (len > 0) {
+        memcpy(event.data, data, len);
+    }
+    size_t pos = s_event_count++;
+    while (pos > 0 && event_before(&event, &s_events[(pos - 1) / 2])) {
+        s_events[pos] = s_events[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    s_events[pos] = event;
+}
+
+static sim_event_t pop_event(void)
+{
+    sim_event_t top = s_events[0];
+    sim_event_t last = s_events[--s_event_count];
+    size_t pos = 0;
+    for (;;) {
+        size_t child = 2 * pos + 1;
+        if (child >= s_event_count) {
+            break;
+        }
+        if (child + 1 < s_event_count && event_before(&s_events[child + 1], &s_events[child])) {
+            child++;
+        }
+        if (!event_before(&s_events[child], &last)) {
+            break;
+        }
+        s_events[pos] = s_events[child];
+        pos = child;
+    }
+    s_events[pos] = last;
+    return top;
+}
+
+// Function to give control back to the scheduler until the task is woken
+static void task_block(int64_t wake_at, QueueHandle_t queue)
+{
+    if (s_current == NULL) {
+        fprintf(stderr, "sim: blocking call outside a task\n");
+        abort();
+    }
+    sim_task_t *task = s_current;
+    task->wake_at = wake_at;
+    task->waiting = queue;
+    swapcontext(&task->ctx, &s_main_ctx);
+}
+
+// Blocking for n ticks ends at the n-th tick interrupt from now
+static int64_t ticks_to_wake(TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY) {
+        return SIM_NEVER;
+    }
+    return (s_now / SIM_TICK_US + ticks) * SIM_TICK_US;
+}
+
+static void task_entry(void)
+{
+    s_current->fn(s_current->arg);
+    fprintf(stderr, "sim: task returned\n");
+    abort();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle)
+{
+    (void)name;
+    (void)stack_size;
+    (void)priority;
+    if (s_task_count == SIM_MAX_TASKS) {
+        return pdFALSE;
+    }
+    sim_task_t *task = &s_tasks[s_task_count++];
+    task->fn = fn;
+    task->arg = arg;
+    task->stack = malloc(SIM_TASK_STACK);
+    task->wake_at = s_now;  /* Runs on the next scheduler pass */
+    task->waiting = NULL;
+    getcontext(&task->ctx);
+    task->ctx.uc_stack.ss_sp = task->stack;
+    task->ctx.uc_stack.ss_size = SIM_TASK_STACK;
+    task->ctx.uc_link = NULL;
+    makecontext(&task->ctx, task_entry, 0);
+    if (handle) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    task_block(ticks_to_wake(ticks), NULL);
+}
+
+void sim_busy(int64_t us)
+{
+    if (s_current == NULL || us <= 0) {
+        return;
+    }
+    task_block(s_now + us, NULL);
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage, StaticQueue_t *buf)
+{
+    *buf = (StaticQueue_t) { .storage = storage, .item_size = item_size, .length = length };
+    return buf;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    (void)ticks;    /* Only used without blocking */
+    if (queue->count == queue->length) {
+        return pdFALSE;
+    }
+    uint32_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->storage + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    for (int i = 0; i < s_task_count; i++) {
+        if (s_tasks[i].waiting == queue) {
+            s_tasks[i].wake_at = s_now;
+        }
+    }
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    if (queue->count == 0 && ticks > 0) {
+        task_block(ticks_to_wake(ticks), queue);
+    }
+    if (queue->count == 0) {
+        return pdFALSE;
+    }
+    memcpy(item, queue->storage + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    return queue->length - queue->count;
+}
+
+// Function to find the task that is due first, NULL if none is due by until
+static sim_task_t *next_task(int64_t until)
+{
+    sim_task_t *next = NULL;
+    for (int i = 0; i < s_task_count; i++) {
+        if (s_tasks[i].wake_at <= until && (next == NULL || s_tasks[i].wake_at < next->wake_at)) {
+            next = &s_tasks[i];
+        }
+    }
+    return next;
+}
+
+void sim_run_until(int64_t until_us)
+{
+    for (;;) {
+        int64_t event_at = s_event_count > 0 ? s_events[0].at : SIM_NEVER;
+        sim_task_t *task = next_task(event_at < until_us ? event_at : until_us);
+
+        // Events first: a task woken at the same time sees their effects
+        if (event_at <= until_us && (task == NULL || event_at <= task->wake_at)) {
+            sim_event_t event = pop_event();
+            s_now = event.at;
+            event.fn(event.data);
+            continue;
+        }
+        if (task == NULL) {
+            break;
+        }
+        if (task->wake_at > s_now) {
+            s_now = task->wake_at;
+        }
+        task->waiting = NULL;
+        task->wake_at = SIM_NEVER;
+        s_current = task;
+        swapcontext(&s_main_ctx, &task->ctx);
+        s_current = NULL;
+    }
+    if (until_us > s_now) {
+        s_now = until_us;
+    }
+}
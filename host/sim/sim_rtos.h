@@ -0,0 +1,35 @@
+#ifndef SIM_RTOS_H
+#define SIM_RTOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Virtual clock and scheduler of the simulator.
+ *
+ * Firmware tasks (xTaskCreate) run as coroutines and only switch when they
+ * block in xQueueReceive/vTaskDelay or spend time with sim_busy(), so a run
+ * is fully deterministic. Everything else happens in events, callbacks that
+ * run at a given virtual time from the main program. esp_timer_get_time()
+ * returns the virtual time, so the firmware's timeouts, backoffs and latency
+ * histograms all work on it.
+ */
+
+#define SIM_EVENT_DATA_SIZE 32
+
+typedef void (*sim_event_fn_t)(void *data);
+
+// Function to get the virtual time in microseconds
+int64_t sim_now(void);
+// Function to run fn at virtual time at_us with a copy of data (at most
+// SIM_EVENT_DATA_SIZE bytes). Events at the same time run in the order they were added.
+void sim_at(int64_t at_us, sim_event_fn_t fn, const void *data, size_t len);
+// Function to advance the clock to until_us, running due events and tasks in time order
+void sim_run_until(int64_t until_us);
+// Function for task code to take us of virtual time (e.g. a stack call); other tasks and events run meanwhile
+void sim_busy(int64_t us);
+// Function to check whether the caller runs in a simulated task
+bool sim_in_task(void);
+
+#endif /* SIM_RTOS_H */
@@ -0,0 +1,813 @@
+#include "bridge.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+
+#include "lamp_registry.h"
+#include "latency.h"
+#include "ha_discovery.h"
+#include "ha_json.h"
+#include "ha_state.h"
+#include "light_fade.h"
+#include "light_scale.h"
+
+#define TAG "BRIDGE"
+
+static bridge_io_t s_io;
+
+// ha_state_key() of the last published HA state per lamp and group, 0 if
+// none, indexed like mesh_cmd_t.index. Written from the TX task and the mesh
+// callbacks.
+static uint32_t s_state_key[MESH_TX_INDEX_COUNT];
+static portMUX_TYPE s_state_key_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Announcement queue: one bit per lamp and group for a pending config and a
+// pending state, plus the hash of the config last published (0 if none).
+// Set from the MQTT, HTTP and mesh TX tasks (a state the outbox refused),
+// drained by bridge_announce_pump(). The generation changes whenever a slot
+// is queued or removed; the pump only publishes a config and clears the bits
+// for the generation it rendered.
+#define ANNOUNCE_WORDS ((MESH_TX_INDEX_COUNT + 31) / 32)
+static uint32_t s_announce_config[ANNOUNCE_WORDS];
+static uint32_t s_announce_state[ANNOUNCE_WORDS];
+static uint32_t s_config_hash[MESH_TX_INDEX_COUNT];
+static uint8_t s_announce_gen[MESH_TX_INDEX_COUNT];
+static portMUX_TYPE s_announce_lock = portMUX_INITIALIZER_UNLOCKED;
+// Held around every retained config publish, so a removal and the pump
+// publishing a config rendered before it cannot overtake each other
+static SemaphoreHandle_t s_config_lock;
+static StaticSemaphore_t s_config_lock_buf;
+
+// Removal (empty retained config) the publish hook refused, retried by the
+// pump before any config so it cannot wipe a config published after it.
+// Only allocated on a refusal; the list is guarded by s_config_lock.
+typedef struct announce_removal {
+    struct announce_removal *next;
+    char topic[];
+} announce_removal_t;
+static announce_removal_t *s_removals;
+static uint32_t s_removal_count;
+
+// Token bucket of the pump, in us of credit; only touched by the pump
+#define ANNOUNCE_INTERVAL_US    (1000000LL / CONFIG_HA_ANNOUNCE_RATE)
+#define ANNOUNCE_BURST_US       (ANNOUNCE_INTERVAL_US * CONFIG_HA_ANNOUNCE_BURST)
+// Wait after a refused publish (MQTT disconnected or outbox full)
+#define ANNOUNCE_RETRY_MS       250
+static int64_t s_announce_credit = ANNOUNCE_BURST_US;
+static int64_t s_announce_refill;
+static int s_announce_cursor;
+static bridge_announce_stats_t s_announce_stats;
+
+// Held while a command cancels or replaces fades and is queued, and while
+// due fade steps are picked and queued, so a step picked before a newer
+// command is never queued after it (where it would overwrite the command)
+static SemaphoreHandle_t s_submit_lock;
+static StaticSemaphore_t s_submit_lock_buf;
+
+void bridge_init(const bridge_io_t *io)
+{
+    s_io = *io;
+    s_config_lock = xSemaphoreCreateMutexStatic(&s_config_lock_buf);
+    s_submit_lock = xSemaphoreCreateMutexStatic(&s_submit_lock_buf);
+}
+
+// Function to send a command to a lamp that ignores the mesh Transition Time
+// (LAMP_FLAG_FADE): with a transition as a bridge fade, else right away
+static esp_err_t fade_command(mesh_cmd_t *cmd, float transition)
+{
+    lamp_shadow_t shadow;
+    lamp_shadow_get(cmd->index, &shadow);
+    // After a fade to off the lamp's own last level is the dimmest step, so it
+    // is switched on at the level of the shadow instead
+    if (cmd->type == MESH_CMD_ONOFF && cmd->onoff) {
+        bool level = (shadow.known & LAMP_SHADOW_LIGHTNESS) && shadow.lightness > 0;
+        bool known_off = (shadow.known & LAMP_SHADOW_ONOFF) && !shadow.onoff;
+        if (level || (transition > 0.0f && known_off)) {
+            cmd->type = MESH_CMD_LIGHTNESS;
+            cmd->lightness = level ? shadow.lightness : 0xFFFF;
+        }
+    }
+    if (transition > 0.0f) {
+        // The steps need the target lightness now, not when the last one is sent
+        bridge_resolve_cmd(cmd);
+        uint32_t duration_ms = transition >= 37200.0f ? 37200000 : (uint32_t)(transition * 1000.0f);
+        if (light_fade_start(cmd, &shadow, duration_ms)) {
+            if (s_io.wake) {
+                s_io.wake();
+            }
+            return ESP_OK;
+        }
+    } else {
+        light_fade_cancel(cmd->index);
+    }
+    // No fade (unknown start, no free slot): the lamp may still honour the Transition Time
+    cmd->trans_time = light_transition_to_mesh(transition);
+    return s_io.submit(cmd);
+}
+
+// Function to queue a parsed command, stopping the fades it takes over.
+// Called with s_submit_lock held.
+static esp_err_t submit_command(const mqtt_route_t *route, mesh_cmd_t *mesh_cmd, float transition)
+{
+    bool is_group = route->type == MQTT_ROUTE_GROUP_SET;
+    if (!is_group && (route->lamp.flags & LAMP_FLAG_FADE)) {
+        return fade_command(mesh_cmd, transition);
+    }
+    if (light_fade_active()) {
+        // A newer command wins over a running fade, for a group over those of its members
+        if (is_group) {
+            for (int i = 0; i < MAX_LAMPS; i++) {
+                if (group_has_member(&route->group, i)) {
+                    light_fade_cancel(i);
+                }
+            }
+        } else {
+            light_fade_cancel(route->index);
+        }
+    }
+    mesh_cmd->trans_time = light_transition_to_mesh(transition);
+    return s_io.submit(mesh_cmd);
+}
+
+esp_err_t bridge_handle_command(const mqtt_route_t *route, const char *data, int len, uint32_t t_recv)
+{
+    if (route->type != MQTT_ROUTE_LAMP_SET && route->type != MQTT_ROUTE_GROUP_SET) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // A group is driven with a single message to its group address
+    bool is_group = route->type == MQTT_ROUTE_GROUP_SET;
+    const char *name = is_group ? route->group.name : route->lamp.name;
+    uint16_t addr = is_group ? route->group.address : route->lamp.address;
+    if (addr == 0) {
+        ESP_LOGE(TAG, "Lamp %s has no valid address", name);
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Parse received json data straight from the (not NUL-terminated) event buffer
+    ha_light_cmd_t cmd;
+    if (ha_json_parse_light_cmd(data, len, &cmd) != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid command: %.*s", len, data);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Only parse and queue here, the mesh TX task does the sending
+    mesh_cmd_t mesh_cmd = {
+        .addr = addr,
+        .index = is_group ? MESH_TX_GROUP_INDEX(route->index) : route->index,
+        .t_recv = t_recv,
+    };
+    // Nobody answers for a group address, groups are always unacked
+    if (!is_group && (route->lamp.flags & LAMP_FLAG_ACKED)) {
+        mesh_cmd.flags |= MESH_CMD_FLAG_ACKED;
+    }
+    if (cmd.fields & HA_CMD_COLOR) {
+        if (cmd.hue < 0.0f || cmd.hue > 360.0f || cmd.saturation < 0.0f || cmd.saturation > 100.0f ||
+            ((cmd.fields & HA_CMD_BRIGHTNESS) && (cmd.brightness < 0 || cmd.brightness > 100))) {
+            ESP_LOGE(TAG, "Invalid HSL values: H=%.1f S=%.1f L=%d", cmd.hue, cmd.saturation, cmd.brightness);
+            return ESP_ERR_INVALID_ARG;
+        }
+        mesh_cmd.type = MESH_CMD_HSL;
+        mesh_cmd.hue = light_hue_to_mesh(cmd.hue);
+        mesh_cmd.saturation = light_percent_to_mesh(cmd.saturation);
+        if (cmd.fields & HA_CMD_BRIGHTNESS) {
+            mesh_cmd.lightness = light_percent_to_mesh(cmd.brightness);
+        } else {
+            mesh_cmd.flags |= MESH_CMD_FLAG_KEEP_LIGHTNESS;
+        }
+    }
+    else if (cmd.fields & HA_CMD_BRIGHTNESS) {
+        mesh_cmd.type = MESH_CMD_LIGHTNESS;
+        mesh_cmd.lightness = light_percent_to_mesh(cmd.brightness);
+    }
+    else if (cmd.fields & HA_CMD_STATE) {
+        mesh_cmd.type = MESH_CMD_ONOFF;
+        mesh_cmd.onoff = cmd.on;
+    }
+    else {
+        return ESP_OK;
+    }
+
+    float transition = 0.0f;
+    if (cmd.fields & HA_CMD_TRANSITION) {
+        // An explicit 0 (or anything below one 100 ms step) means instant,
+        // not the lamp's default; a negative one is taken as 0
+        mesh_cmd.flags |= MESH_CMD_FLAG_TRANSITION;
+        transition = cmd.transition > 0.0f ? cmd.transition : 0.0f;
+    }
+    // Recorded here and not in mesh_tx_submit(), which the bridge task calls
+    // for fade steps as well: PARSE keeps the MQTT task as its only writer
+    latency_record(LATENCY_PARSE, -1, latency_now() - t_recv);
+    xSemaphoreTake(s_submit_lock, portMAX_DELAY);
+    esp_err_t err = submit_command(route, &mesh_cmd, transition);
+    xSemaphoreGive(s_submit_lock);
+    return err;
+}
+
+void bridge_resolve_cmd(mesh_cmd_t *cmd)
+{
+    if (cmd->flags & MESH_CMD_FLAG_KEEP_LIGHTNESS) {
+        // Colour only: keep this lamp's own brightness, full if it was never set
+        lamp_shadow_t shadow;
+        lamp_shadow_get(cmd->index, &shadow);
+        cmd->lightness = (shadow.known & LAMP_SHADOW_LIGHTNESS) ? shadow.lightness : 0xFFFF;
+        cmd->flags &= ~MESH_CMD_FLAG_KEEP_LIGHTNESS;
+    }
+}
+
+// Function to publish the shadow of a lamp or group, returns false if the publish was refused
+static bool state_publish(int index, const char *topic, bool force)
+{
+    lamp_shadow_t shadow;
+    lamp_shadow_get(index, &shadow);
+
+    ha_light_state_t state = { .on = shadow.onoff };
+    if (shadow.known & LAMP_SHADOW_LIGHTNESS) {
+        state.fields |= HA_STATE_BRIGHTNESS;
+        state.brightness = (uint8_t)roundf(light_mesh_to_percent(shadow.lightness));
+    }
+    if (shadow.known & LAMP_SHADOW_COLOR) {
+        state.fields |= HA_STATE_COLOR;
+        state.hue = light_mesh_to_hue(shadow.hue);
+        state.saturation = light_mesh_to_percent(shadow.saturation);
+    }
+
+    uint32_t key = ha_state_key(&state);
+    portENTER_CRITICAL(&s_state_key_lock);
+    bool changed = s_state_key[index] != key;
+    s_state_key[index] = key;
+    portEXIT_CRITICAL(&s_state_key_lock);
+    if (!changed && !force) {
+        return true;
+    }
+
+    char payload[HA_STATE_MAX_LEN];
+    int len = ha_state_format(payload, sizeof(payload), &state);
+    if (len < 0) {
+        ESP_LOGE(TAG, "State payload for %s does not fit", topic);
+        return true;
+    }
+    if (s_io.publish(topic, payload, len, 0) < 0) {
+        // Not sent (not connected or outbox full), the next attempt has to go out
+        portENTER_CRITICAL(&s_state_key_lock);
+        s_state_key[index] = 0;
+        portEXIT_CRITICAL(&s_state_key_lock);
+        return false;
+    }
+    return true;
+}
+
+void bridge_publish_state(int index, const char *topic, bool force)
+{
+    if (index < 0 || index >= MESH_TX_INDEX_COUNT) {
+        return;
+    }
+    uint32_t bit = 1u << (index % 32);
+    portENTER_CRITICAL(&s_announce_lock);
+    bool pending = s_announce_state[index / 32] & bit;
+    if (pending) {
+        s_announce_stats.replaced++;
+    }
+    portEXIT_CRITICAL(&s_announce_lock);
+    // A state of this lamp already waits for the pump, which sends the shadow
+    // as it is then; this change is folded into it
+    if (pending) {
+        return;
+    }
+    if (!state_publish(index, topic, force)) {
+        // Refused: keep it as the one pending state of this lamp instead of
+        // queueing payloads that are stale by the time they go out
+        portENTER_CRITICAL(&s_announce_lock);
+        s_announce_state[index / 32] |= bit;
+        s_announce_stats.refused++;
+        portEXIT_CRITICAL(&s_announce_lock);
+        if (s_io.wake) {
+            s_io.wake();
+        }
+    }
+}
+
+// Function to render the discovery config of a lamp or group, returns its
+// length or -1 if the slot is empty
+static int announce_render(int index, char *config_topic, char *state_topic, size_t topic_size, char *payload)
+{
+    char topic[100];
+    const char *name;
+    uint16_t address;
+    LampInfo lamp_info;
+    GroupInfo group_info;
+
+    if (index >= MAX_LAMPS) {
+        if (!lamp_registry_group_get(index - MAX_LAMPS, &group_info)) {
+            return -1;
+        }
+        mqtt_group_topic(topic, sizeof(topic), &group_info, NULL);
+        mqtt_group_topic(config_topic, topic_size, &group_info, "config");
+        mqtt_group_topic(state_topic, topic_size, &group_info, "state");
+        name = group_info.name;
+        address = group_info.address;
+    } else {
+        if (!lamp_registry_get(index, &lamp_info)) {
+            return -1;
+        }
+        mqtt_lamp_topic(topic, sizeof(topic), &lamp_info, NULL);
+        mqtt_lamp_topic(config_topic, topic_size, &lamp_info, "config");
+        mqtt_lamp_topic(state_topic, topic_size, &lamp_info, "state");
+        name = lamp_info.name;
+        address = lamp_info.address;
+    }
+
+    // Unique id is the address; group addresses never collide with unicast addresses
+    char unique_id[8];
+    lamp_registry_unique_id(index, address, unique_id, sizeof(unique_id));
+    int len = ha_discovery_format(payload, HA_DISCOVERY_MAX_LEN, name, topic, unique_id);
+    if (len < 0) {
+        ESP_LOGE(TAG, "Discovery config for %s does not fit", name);
+    }
+    return len;
+}
+
+// Function to hash a config topic and payload (FNV-1a), never 0
+static uint32_t announce_hash(const char *topic, const char *payload, int len)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = topic; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    hash = (hash ^ 0) * 16777619u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)payload[i]) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+// Function to take the next lamp or group with something queued, round robin
+// from the cursor. Returns the index or -1, *config and *state get its bits
+// and *gen its generation.
+static int announce_next(bool *config, bool *state, uint8_t *gen)
+{
+    int index = -1;
+    portENTER_CRITICAL(&s_announce_lock);
+    for (int n = 0; n < MESH_TX_INDEX_COUNT; n++) {
+        int i = (s_announce_cursor + n) % MESH_TX_INDEX_COUNT;
+        uint32_t bit = 1u << (i % 32);
+        if ((s_announce_config[i / 32] | s_announce_state[i / 32]) & bit) {
+            *config = s_announce_config[i / 32] & bit;
+            *state = s_announce_state[i / 32] & bit;
+            *gen = s_announce_gen[i];
+            index = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_announce_lock);
+    return index;
+}
+
+// Function to clear a queued config or state bit, unless the slot was queued
+// or removed again since generation gen. Returns false in that case.
+static bool announce_clear(uint32_t *bits, int index, uint8_t gen)
+{
+    portENTER_CRITICAL(&s_announce_lock);
+    bool current = s_announce_gen[index] == gen;
+    if (current) {
+        bits[index / 32] &= ~(1u << (index % 32));
+    }
+    portEXIT_CRITICAL(&s_announce_lock);
+    return current;
+}
+
+// Function to publish a rendered config unless the slot was removed or queued
+// again since generation gen. Returns 1 once published, 0 for a stale render
+// and -1 if the publish was refused.
+static int announce_publish_config(int index, uint8_t gen, uint32_t hash, const char *topic, const char *payload, int len)
+{
+    int result = 0;
+    xSemaphoreTake(s_config_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&s_announce_lock);
+    bool stale = s_announce_gen[index] != gen;
+    portEXIT_CRITICAL(&s_announce_lock);
+    if (!stale) {
+        // Retained, so HA finds it on the broker after its own restart
+        result = s_io.publish(topic, payload, len, 1) < 0 ? -1 : 1;
+    }
+    if (result > 0) {
+        // Still under s_config_lock, so no removal reset the hash meanwhile;
+        // a bridge_announce() meanwhile keeps its bit for another round
+        portENTER_CRITICAL(&s_announce_lock);
+        s_config_hash[index] = hash;
+        if (s_announce_gen[index] == gen) {
+            s_announce_config[index / 32] &= ~(1u << (index % 32));
+        }
+        portEXIT_CRITICAL(&s_announce_lock);
+    }
+    xSemaphoreGive(s_config_lock);
+    return result;
+}
+
+// Function to take a token from the bucket, returns false if there is none yet
+static bool announce_take_token(void)
+{
+    if (s_announce_credit < ANNOUNCE_INTERVAL_US) {
+        s_announce_stats.deferred++;
+        return false;
+    }
+    s_announce_credit -= ANNOUNCE_INTERVAL_US;
+    return true;
+}
+
+// Function to return the ms until the bucket has the next token
+static uint32_t announce_token_wait_ms(void)
+{
+    return (uint32_t)((ANNOUNCE_INTERVAL_US - s_announce_credit + 999) / 1000);
+}
+
+// Function to queue a refused removal at the end of the list, once per
+// topic. Called with s_config_lock held.
+static void announce_queue_removal(const char *topic)
+{
+    announce_removal_t **tail = &s_removals;
+    for (; *tail != NULL; tail = &(*tail)->next) {
+        if (strcmp((*tail)->topic, topic) == 0) {
+            return;
+        }
+    }
+    size_t size = strlen(topic) + 1;
+    announce_removal_t *removal = malloc(sizeof(*removal) + size);
+    if (removal == NULL) {
+        ESP_LOGE(TAG, "No memory to retry the removal of %s", topic);
+        return;
+    }
+    removal->next = NULL;
+    memcpy(removal->topic, topic, size);
+    *tail = removal;
+    portENTER_CRITICAL(&s_announce_lock);
+    s_removal_count++;
+    portEXIT_CRITICAL(&s_announce_lock);
+}
+
+// Function to send the queued removals as far as the token bucket allows.
+// Returns 1 once all are out, 0 when out of tokens and -1 if one was refused.
+static int announce_send_removals(void)
+{
+    int result = 1;
+    xSemaphoreTake(s_config_lock, portMAX_DELAY);
+    while (s_removals != NULL) {
+        if (!announce_take_token()) {
+            result = 0;
+            break;
+        }
+        if (s_io.publish(s_removals->topic, "", 0, 1) < 0) {
+            result = -1;
+            break;
+        }
+        announce_removal_t *sent = s_removals;
+        s_removals = sent->next;
+        free(sent);
+        portENTER_CRITICAL(&s_announce_lock);
+        s_removal_count--;
+        s_announce_stats.removals++;
+        portEXIT_CRITICAL(&s_announce_lock);
+    }
+    xSemaphoreGive(s_config_lock);
+    return result;
+}
+
+void bridge_announce(int index)
+{
+    if (index < 0 || index >= MESH_TX_INDEX_COUNT) {
+        return;
+    }
+    portENTER_CRITICAL(&s_announce_lock);
+    s_announce_config[index / 32] |= 1u << (index % 32);
+    s_announce_state[index / 32] |= 1u << (index % 32);
+    s_announce_gen[index]++;
+    portEXIT_CRITICAL(&s_announce_lock);
+    if (s_io.wake) {
+        s_io.wake();
+    }
+}
+
+void bridge_announce_all(void)
+{
+    // Empty slots are skipped by the pump without costing a token
+    portENTER_CRITICAL(&s_announce_lock);
+    for (int i = 0; i < MESH_TX_INDEX_COUNT; i++) {
+        s_announce_config[i / 32] |= 1u << (i % 32);
+        s_announce_state[i / 32] |= 1u << (i % 32);
+        s_announce_gen[i]++;
+    }
+    portEXIT_CRITICAL(&s_announce_lock);
+    if (s_io.wake) {
+        s_io.wake();
+    }
+}
+
+void bridge_announce_reset(void)
+{
+    portENTER_CRITICAL(&s_announce_lock);
+    memset(s_config_hash, 0, sizeof(s_config_hash));
+    portEXIT_CRITICAL(&s_announce_lock);
+}
+
+uint32_t bridge_announce_pump(void)
+{
+    char config_topic[100];
+    char state_topic[100];
+    char payload[HA_DISCOVERY_MAX_LEN];
+    bool config;
+    bool state;
+    uint8_t gen;
+    int index;
+
+    int64_t now = esp_timer_get_time();
+    s_announce_credit += now - s_announce_refill;
+    if (s_announce_credit > ANNOUNCE_BURST_US) {
+        s_announce_credit = ANNOUNCE_BURST_US;
+    }
+    s_announce_refill = now;
+
+    int removals = announce_send_removals();
+    if (removals < 0) {
+        return ANNOUNCE_RETRY_MS;
+    }
+    if (removals == 0) {
+        return announce_token_wait_ms();
+    }
+
+    while ((index = announce_next(&config, &state, &gen)) >= 0) {
+        int len = announce_render(index, config_topic, state_topic, sizeof(config_topic), payload);
+        if (len < 0) {
+            // Removed since it was queued (or it does not fit), nothing to
+            // send; a slot queued again meanwhile is looked at once more
+            if (announce_clear(s_announce_config, index, gen)) {
+                announce_clear(s_announce_state, index, gen);
+            }
+            continue;
+        }
+        if (config) {
+            uint32_t hash = announce_hash(config_topic, payload, len);
+            portENTER_CRITICAL(&s_announce_lock);
+            bool unchanged = s_config_hash[index] == hash;
+            portEXIT_CRITICAL(&s_announce_lock);
+            if (unchanged) {
+                if (!announce_clear(s_announce_config, index, gen)) {
+                    continue;
+                }
+                s_announce_stats.unchanged++;
+            } else {
+                if (!announce_take_token()) {
+                    break;
+                }
+                // The lamp may have been removed (or renamed) by the HTTP
+                // task while it was rendered; such a config must not go out
+                // after the removal and bring the entity back
+                int result = announce_publish_config(index, gen, hash, config_topic, payload, len);
+                if (result < 0) {
+                    return ANNOUNCE_RETRY_MS;
+                }
+                if (result == 0) {
+                    continue;
+                }
+                s_announce_stats.configs++;
+            }
+        }
+        if (state) {
+            lamp_shadow_t shadow;
+            lamp_shadow_get(index, &shadow);
+            if (shadow.known) {
+                if (!announce_take_token()) {
+                    break;
+                }
+                if (!state_publish(index, state_topic, true)) {
+                    return ANNOUNCE_RETRY_MS;
+                }
+                s_announce_stats.states++;
+            }
+            if (!announce_clear(s_announce_state, index, gen)) {
+                continue;
+            }
+        }
+        s_announce_cursor = (index + 1) % MESH_TX_INDEX_COUNT;
+    }
+    if (index < 0) {
+        return UINT32_MAX;
+    }
+    // Out of tokens, run again when the next one is there
+    return announce_token_wait_ms();
+}
+
+uint32_t bridge_fade_run(void)
+{
+    xSemaphoreTake(s_submit_lock, portMAX_DELAY);
+    uint32_t wait_ms = light_fade_run(s_io.submit);
+    xSemaphoreGive(s_submit_lock);
+    return wait_ms;
+}
+
+void bridge_get_announce_stats(bridge_announce_stats_t *stats)
+{
+    *stats = s_announce_stats;
+    stats->pending = 0;
+    portENTER_CRITICAL(&s_announce_lock);
+    for (int i = 0; i < ANNOUNCE_WORDS; i++) {
+        stats->pending += __builtin_popcount(s_announce_config[i] | s_announce_state[i]);
+    }
+    stats->removals = s_announce_stats.removals;
+    stats->removals_refused = s_announce_stats.removals_refused;
+    stats->removals_pending = s_removal_count;
+    portEXIT_CRITICAL(&s_announce_lock);
+}
+
+void bridge_remove_discovery(int index, const char *config_topic)
+{
+    // Held across the publish: a config the pump rendered before this
+    // either went out before the removal or is dropped as stale
+    xSemaphoreTake(s_config_lock, portMAX_DELAY);
+    if (index >= 0 && index < MESH_TX_INDEX_COUNT) {
+        // A config queued before the removal must not bring it back, and the
+        // next config for this slot (rename, new lamp) has to be sent
+        portENTER_CRITICAL(&s_announce_lock);
+        s_announce_config[index / 32] &= ~(1u << (index % 32));
+        s_announce_state[index / 32] &= ~(1u << (index % 32));
+        s_config_hash[index] = 0;
+        s_announce_gen[index]++;
+        portEXIT_CRITICAL(&s_announce_lock);
+    }
+    // Retained so a config some earlier setup left on the broker goes as well
+    bool refused = s_io.publish(config_topic, "", 0, 1) < 0;
+    if (refused) {
+        // Offline or outbox full: without a retry HA would keep the entity
+        announce_queue_removal(config_topic);
+        portENTER_CRITICAL(&s_announce_lock);
+        s_announce_stats.removals_refused++;
+        portEXIT_CRITICAL(&s_announce_lock);
+    }
+    xSemaphoreGive(s_config_lock);
+    if (refused && s_io.wake) {
+        s_io.wake();
+    }
+}
+
+void bridge_lamp_status(uint16_t addr, const lamp_shadow_t *update)
+{
+    LampInfo lamp_info;
+    int index = lamp_registry_find_by_addr(addr, &lamp_info);
+    if (index < 0) {
+        ESP_LOGD(TAG, "Status from unknown device 0x%04X", addr);
+        return;
+    }
+    if (!lamp_shadow_merge(index, update)) {
+        return;
+    }
+    char topic_state[100];
+    mqtt_lamp_topic(topic_state, sizeof(topic_state), &lamp_info, "state");
+    bridge_publish_state(index, topic_state, false);
+}
+
+// Function to turn a Light Lightness or Light HSL status into a shadow update.
+// Lightness 0 only switches the lamp off, the brightness it had is kept.
+static void lightness_status_update(lamp_shadow_t *update, uint16_t lightness)
+{
+    update->onoff = lightness > 0;
+    update->known |= LAMP_SHADOW_ONOFF;
+    if (lightness > 0) {
+        update->lightness = lightness;
+        update->known |= LAMP_SHADOW_LIGHTNESS;
+    }
+}
+
+void bridge_lamp_status_message(uint16_t addr, const bridge_status_t *status)
+{
+    lamp_shadow_t update = {0};
+    uint32_t lightness;
+
+    switch (status->status_op) {
+    case BRIDGE_OP_GEN_ONOFF_STATUS:
+        update.onoff = status->op_en ? status->target_onoff : status->present_onoff;
+        update.known = LAMP_SHADOW_ONOFF;
+        break;
+    case BRIDGE_OP_LIGHT_LIGHTNESS_STATUS:
+        lightness_status_update(&update, status->op_en ? status->target_lightness : status->present_lightness);
+        break;
+    case BRIDGE_OP_LIGHT_HSL_STATUS:
+        // The HSL status has no target (that is the HSL Target status), see
+        // ble_mesh_send_gen_hsl_set() in main.c for the lightness scale
+        lightness = (uint32_t)status->hsl_lightness * 2;
+        lightness_status_update(&update, lightness > 0xFFFF ? 0xFFFF : lightness);
+        update.hue = status->hue;
+        update.saturation = status->saturation;
+        update.known |= LAMP_SHADOW_COLOR;
+        break;
+    default:
+        return;
+    }
+    bridge_lamp_status(addr, &update);
+}
+
+// Set opcodes per mesh_cmd_type_t, unacked and acked
+static const uint32_t s_set_opcodes[MESH_CMD_TYPE_COUNT][2] = {
+    [MESH_CMD_ONOFF] = { BRIDGE_OP_GEN_ONOFF_SET_UNACK, BRIDGE_OP_GEN_ONOFF_SET },
+    [MESH_CMD_LIGHTNESS] = { BRIDGE_OP_LIGHT_LIGHTNESS_SET_UNACK, BRIDGE_OP_LIGHT_LIGHTNESS_SET },
+    [MESH_CMD_HSL] = { BRIDGE_OP_LIGHT_HSL_SET_UNACK, BRIDGE_OP_LIGHT_HSL_SET },
+};
+
+uint32_t bridge_set_opcode(const mesh_cmd_t *cmd)
+{
+    if (cmd->type >= MESH_CMD_TYPE_COUNT) {
+        return 0;
+    }
+    return s_set_opcodes[cmd->type][(cmd->flags & MESH_CMD_FLAG_ACKED) ? 1 : 0];
+}
+
+// Function to apply a command that was sent to the shadow of its target
+static void shadow_apply(lamp_shadow_t *shadow, const mesh_cmd_t *cmd, uint16_t lightness)
+{
+    switch (cmd->type) {
+    case MESH_CMD_ONOFF:
+        shadow->onoff = cmd->onoff;
+        shadow->known |= LAMP_SHADOW_ONOFF;
+        break;
+    case MESH_CMD_HSL:
+        shadow->hue = cmd->hue;
+        shadow->saturation = cmd->saturation;
+        shadow->known |= LAMP_SHADOW_COLOR;
+        shadow->lightness = lightness;
+        shadow->onoff = lightness > 0;
+        shadow->known |= LAMP_SHADOW_LIGHTNESS | LAMP_SHADOW_ONOFF;
+        break;
+    case MESH_CMD_LIGHTNESS:
+        // Lightness 0 switches the lamp off (Light Lightness / OnOff binding)
+        shadow->lightness = lightness;
+        shadow->onoff = lightness > 0;
+        shadow->known |= LAMP_SHADOW_LIGHTNESS | LAMP_SHADOW_ONOFF;
+        break;
+    default:
+        break;
+    }
+}
+
+// Function to update the group shadow and those of its member lamps, then publish them
+static void update_group_state(int group_index, const mesh_cmd_t *cmd, uint16_t lightness)
+{
+    GroupInfo group_info;
+    lamp_shadow_t shadow;
+    char topic_state[100];
+
+    if (!lamp_registry_group_get(group_index, &group_info) || group_info.address != cmd->addr) {
+        return;
+    }
+    lamp_shadow_get(cmd->index, &shadow);
+    shadow_apply(&shadow, cmd, lightness);
+    lamp_shadow_set(cmd->index, &shadow);
+    mqtt_group_topic(topic_state, sizeof(topic_state), &group_info, "state");
+    bridge_publish_state(cmd->index, topic_state, false);
+
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        LampInfo lamp_info;
+        if (!group_has_member(&group_info, i) || !lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        lamp_shadow_get(i, &shadow);
+        shadow_apply(&shadow, cmd, lightness);
+        lamp_shadow_set(i, &shadow);
+        mqtt_lamp_topic(topic_state, sizeof(topic_state), &lamp_info, "state");
+        bridge_publish_state(i, topic_state, false);
+    }
+}
+
+void bridge_cmd_done(const mesh_cmd_t *cmd, bool delivered)
+{
+    // Only the last step of a fade is taken over, it is the command HA sent
+    if (cmd->flags & MESH_CMD_FLAG_FADE_STEP) {
+        return;
+    }
+    if (cmd->index >= MAX_LAMPS) {
+        if (delivered) {
+            update_group_state(cmd->index - MAX_LAMPS, cmd, cmd->lightness);
+        }
+        return;
+    }
+    if (delivered && (cmd->flags & MESH_CMD_FLAG_ACKED)) {
+        return;
+    }
+    // The lamp may have been removed or readdressed while the command was queued
+    LampInfo lamp_info;
+    if (!lamp_registry_get(cmd->index, &lamp_info) || lamp_info.address != cmd->addr) {
+        return;
+    }
+    if (delivered) {
+        lamp_shadow_t shadow;
+        lamp_shadow_get(cmd->index, &shadow);
+        shadow_apply(&shadow, cmd, cmd->lightness);
+        lamp_shadow_set(cmd->index, &shadow);
+    } else {
+        ESP_LOGW(TAG, "Lamp %s did not acknowledge the command", lamp_info.name);
+    }
+    char topic_state[100];
+    mqtt_lamp_topic(topic_state, sizeof(topic_state), &lamp_info, "state");
+    bridge_publish_state(cmd->index, topic_state, !delivered);
+}
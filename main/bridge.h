@@ -0,0 +1,140 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "mesh_tx.h"
+#include "mqtt_router.h"
+#include "lamp_shadow.h"
+
+/*
+ * Bridge core: the translation between Home Assistant and the mesh.
+ *
+ * MQTT commands become mesh_cmd_t records, mesh results and lamp status
+ * messages end up in the lamp shadows and are published as HA state. The
+ * core only works on the registry and the shadows and reaches MQTT and the
+ * mesh through bridge_io_t, so it has no ESP-IDF dependency besides the
+ * FreeRTOS locks and builds for Linux as well (host/).
+ *
+ * main.c wires the hooks to esp-mqtt and mesh_tx_submit(); the host
+ * benchmarks wire them to mocks.
+ *
+ * Announcements to HA (discovery configs and the states that go with them)
+ * are only queued, one bit per lamp or group, and sent by
+ * bridge_announce_pump() through a token bucket of CONFIG_HA_ANNOUNCE_RATE
+ * messages per second, so announcing hundreds of lamps after an HA restart
+ * does not flood the MQTT outbox. Configs are published retained and are
+ * rendered when they are sent; a hash of the last one published per lamp
+ * lets an unchanged config be skipped, e.g. when HA comes back and gets the
+ * retained configs from the broker anyway.
+ *
+ * The same queue holds states the publish hook refused (MQTT outbox over its
+ * budget or not connected): a lamp has at most one pending state, further
+ * changes are folded into it, and the pump sends the shadow as it is by then.
+ *
+ * An HA "transition" becomes the mesh Transition Time of the command. Lamps
+ * flagged LAMP_FLAG_FADE ignore it; they get a bridge fade instead
+ * (light_fade.h), whose steps bridge_fade_run() queues.
+ */
+
+// Mesh model opcodes the bridge sends and reads (Mesh Model specification
+// numbering, the values of ESP_BLE_MESH_MODEL_OP_*)
+#define BRIDGE_OP_GEN_ONOFF_SET             0x8202
+#define BRIDGE_OP_GEN_ONOFF_SET_UNACK       0x8203
+#define BRIDGE_OP_GEN_ONOFF_STATUS          0x8204
+#define BRIDGE_OP_LIGHT_LIGHTNESS_SET       0x824C
+#define BRIDGE_OP_LIGHT_LIGHTNESS_SET_UNACK 0x824D
+#define BRIDGE_OP_LIGHT_LIGHTNESS_STATUS    0x824E
+#define BRIDGE_OP_LIGHT_HSL_SET             0x8276
+#define BRIDGE_OP_LIGHT_HSL_SET_UNACK       0x8277
+#define BRIDGE_OP_LIGHT_HSL_STATUS          0x8278
+
+// Status message of a lamp, as the mesh client callbacks report it
+typedef struct {
+    uint32_t status_op;         /* BRIDGE_OP_*_STATUS */
+    bool op_en;                 /* In a transition, the target fields are set */
+    uint8_t present_onoff;      /* Generic OnOff */
+    uint8_t target_onoff;
+    uint16_t present_lightness; /* Light Lightness */
+    uint16_t target_lightness;
+    uint16_t hsl_lightness;     /* Light HSL, lightness 50% is full colour */
+    uint16_t hue;
+    uint16_t saturation;
+} bridge_status_t;
+
+typedef struct {
+    // Function to publish an MQTT message (QoS 0), returns the message id or -1
+    // if it was not sent (not connected, outbox full)
+    int (*publish)(const char *topic, const char *data, int len, int retain);
+    // Function to queue a mesh command (mesh_tx_submit on the target)
+    esp_err_t (*submit)(const mesh_cmd_t *cmd);
+    // Function to wake whatever runs bridge_announce_pump() and bridge_fade_run() (optional)
+    void (*wake)(void);
+} bridge_io_t;
+
+typedef struct {
+    uint32_t configs;           /* Discovery configs published */
+    uint32_t unchanged;         /* Configs skipped, the same one is already retained */
+    uint32_t states;            /* States published for announcements */
+    uint32_t deferred;          /* Times the pump ran out of tokens */
+    uint32_t refused;           /* State publishes refused (outbox full, offline), left pending */
+    uint32_t replaced;          /* State changes folded into a pending state */
+    uint32_t pending;           /* Lamps and groups with a queued config or state */
+    uint32_t removals;          /* Refused removals the pump sent later */
+    uint32_t removals_refused;  /* Removal publishes refused, queued for the pump */
+    uint32_t removals_pending;  /* Removals waiting for the pump */
+} bridge_announce_stats_t;
+
+// Function to set the MQTT and mesh hooks, before any other bridge call
+void bridge_init(const bridge_io_t *io);
+// Function to turn an HA command (payload not NUL-terminated) for a routed
+// lamp or group into a mesh command and queue it. t_recv is latency_now() at
+// the arrival of the message. Returns ESP_ERR_INVALID_ARG for a bad payload.
+esp_err_t bridge_handle_command(const mqtt_route_t *route, const char *data, int len, uint32_t t_recv);
+// Function to fill in what a command takes over from the shadow
+// (MESH_CMD_FLAG_KEEP_LIGHTNESS), called by the TX task right before sending
+void bridge_resolve_cmd(mesh_cmd_t *cmd);
+// Function to publish the shadow of a lamp or group to its state topic. Unless
+// forced, nothing is sent if the payload is the same as the last one published.
+// If the publish is refused, or a state of this lamp is still pending, the
+// state is left to bridge_announce_pump().
+void bridge_publish_state(int index, const char *topic, bool force);
+// Function to queue the announcement of a lamp or group (index like
+// mesh_cmd_t.index) to HA: its discovery config and, if known, its current state
+void bridge_announce(int index);
+// Function to queue the announcement of every lamp and group (HA came online)
+void bridge_announce_all(void);
+// Function to forget which configs were published, after a new MQTT
+// connection (the broker may not have kept them)
+void bridge_announce_reset(void);
+// Function to send queued announcements as far as the token bucket allows.
+// Returns the ms after which it should run again, UINT32_MAX if nothing is queued.
+uint32_t bridge_announce_pump(void);
+// Function to queue the fade steps that are due. Returns the ms after which
+// it should run again, UINT32_MAX if no fade is running.
+uint32_t bridge_fade_run(void);
+// Function to read the announcement counters
+void bridge_get_announce_stats(bridge_announce_stats_t *stats);
+// Function to make HA forget a lamp or group: an empty (retained) config on
+// its config topic, e.g. before a removal or a rename. Sent right away, or by
+// the pump before any further config if the publish is refused; a config the
+// pump rendered before the call is not published after it.
+void bridge_remove_discovery(int index, const char *config_topic);
+// Function to merge a state reported by a lamp into its shadow and publish it if it changed
+void bridge_lamp_status(uint16_t addr, const lamp_shadow_t *update);
+// Function to take over a status message of a lamp (bridge_lamp_status()).
+// During a transition the target is what HA should show.
+void bridge_lamp_status_message(uint16_t addr, const bridge_status_t *status);
+// Function to get the Set opcode of a command, acked if MESH_CMD_FLAG_ACKED is
+// set; 0 for an unknown type
+uint32_t bridge_set_opcode(const mesh_cmd_t *cmd);
+// Function to take over a command that is through (the mesh_tx done callback).
+// Unacked commands never get an answer, so their values are taken over as
+// sent. For acked ones the status in the answer has already updated the
+// shadow; if there was no answer the unchanged shadow is published again, so
+// Home Assistant falls back from its optimistic state.
+void bridge_cmd_done(const mesh_cmd_t *cmd, bool delivered);
+
+#endif /* BRIDGE_H */
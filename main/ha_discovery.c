@@ -0,0 +1,70 @@
+#include "ha_discovery.h"
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct {
+    char *p;
+    char *end;
+} discovery_writer_t;
+
+static bool put_str(discovery_writer_t *w, const char *s, size_t len)
+{
+    if ((size_t)(w->end - w->p) < len) {
+        return false;
+    }
+    memcpy(w->p, s, len);
+    w->p += len;
+    return true;
+}
+
+#define PUT_LITERAL(w, s) put_str(w, s, sizeof(s) - 1)
+
+// Function to write a JSON string value, quotes included
+static bool put_json_string(discovery_writer_t *w, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    if (!PUT_LITERAL(w, "\"")) {
+        return false;
+    }
+    for (; *s; s++) {
+        unsigned char c = *s;
+        bool ok;
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', c };
+            ok = put_str(w, esc, sizeof(esc));
+        } else if (c < 0x20) {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            ok = put_str(w, esc, sizeof(esc));
+        } else {
+            ok = put_str(w, (const char *)&c, 1);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return PUT_LITERAL(w, "\"");
+}
+
+int ha_discovery_format(char *buf, size_t size, const char *name, const char *base_topic, const char *unique_id)
+{
+    if (size == 0) {
+        return -1;
+    }
+    // Keep room for the terminator
+    discovery_writer_t w = { .p = buf, .end = buf + size - 1 };
+    bool ok = PUT_LITERAL(&w, "{\"name\":") && put_json_string(&w, name) &&
+              PUT_LITERAL(&w, ",\"~\":") && put_json_string(&w, base_topic) &&
+              PUT_LITERAL(&w, ",\"cmd_t\":\"~/set\",\"stat_t\":\"~/state\",\"schema\":\"json\""
+                              ",\"brightness\":true,\"color_mode\":true,\"bri_scl\":100"
+                              ",\"supported_color_modes\":[\"hs\"],\"pl_on\":\"ON\",\"pl_off\":\"OFF\""
+                              ",\"dev\":{\"ids\":[") && put_json_string(&w, unique_id) &&
+              PUT_LITERAL(&w, "],\"name\":\"Lamp\",\"mf\":\"BLE-Mesh\",\"mdl\":\"HSL-Light\"}"
+                              ",\"uniq_id\":") && put_json_string(&w, unique_id) &&
+              PUT_LITERAL(&w, "}");
+    if (!ok) {
+        buf[0] = '\0';
+        return -1;
+    }
+    *w.p = '\0';
+    return w.p - buf;
+}
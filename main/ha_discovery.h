@@ -0,0 +1,15 @@
+#ifndef HA_DISCOVERY_H
+#define HA_DISCOVERY_H
+
+#include <stddef.h>
+
+// Room for the discovery payload of a lamp with the longest (fully escaped) name
+#define HA_DISCOVERY_MAX_LEN    640
+
+// Function to write the HA MQTT discovery config of a JSON schema light with
+// brightness and hs colour into buf, without allocating. base_topic is the
+// "~" abbreviation (homeassistant/light/<slug>), unique_id also identifies
+// the device. Returns the payload length, or -1 if buf is too small.
+int ha_discovery_format(char *buf, size_t size, const char *name, const char *base_topic, const char *unique_id);
+
+#endif /* HA_DISCOVERY_H */
@@ -0,0 +1,279 @@
+#include "ha_json.h"
+#include <string.h>
+
+// Nesting limit for values that are skipped (unknown keys)
+#define HA_JSON_MAX_DEPTH 8
+
+typedef struct {
+    const char *p;
+    const char *end;
+} json_cursor_t;
+
+typedef struct {
+    const char *s;
+    size_t len;
+} json_span_t;
+
+static void skip_ws(json_cursor_t *c)
+{
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+        c->p++;
+    }
+}
+
+static bool consume(json_cursor_t *c, char ch)
+{
+    skip_ws(c);
+    if (c->p < c->end && *c->p == ch) {
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+static bool span_is(json_span_t span, const char *literal)
+{
+    size_t len = strlen(literal);
+    return span.len == len && memcmp(span.s, literal, len) == 0;
+}
+
+// Returns the raw string contents; escapes are skipped over, not decoded
+static bool parse_string(json_cursor_t *c, json_span_t *out)
+{
+    if (!consume(c, '"')) {
+        return false;
+    }
+    const char *start = c->p;
+    while (c->p < c->end) {
+        char ch = *c->p++;
+        if (ch == '\\') {
+            if (c->p >= c->end) {
+                return false;
+            }
+            c->p++;
+        } else if (ch == '"') {
+            out->s = start;
+            out->len = c->p - 1 - start;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_digit(char ch)
+{
+    return ch >= '0' && ch <= '9';
+}
+
+// strtod() needs a terminated buffer, so numbers are converted here
+static bool parse_number(json_cursor_t *c, float *out)
+{
+    skip_ws(c);
+    bool negative = false;
+    if (c->p < c->end && *c->p == '-') {
+        negative = true;
+        c->p++;
+    }
+    if (c->p >= c->end || !is_digit(*c->p)) {
+        return false;
+    }
+
+    float value = 0.0f;
+    while (c->p < c->end && is_digit(*c->p)) {
+        value = value * 10.0f + (*c->p++ - '0');
+    }
+    if (c->p < c->end && *c->p == '.') {
+        c->p++;
+        float scale = 0.1f;
+        if (c->p >= c->end || !is_digit(*c->p)) {
+            return false;
+        }
+        while (c->p < c->end && is_digit(*c->p)) {
+            value += (*c->p++ - '0') * scale;
+            scale *= 0.1f;
+        }
+    }
+    if (c->p < c->end && (*c->p == 'e' || *c->p == 'E')) {
+        c->p++;
+        bool negative_exp = false;
+        if (c->p < c->end && (*c->p == '+' || *c->p == '-')) {
+            negative_exp = *c->p++ == '-';
+        }
+        if (c->p >= c->end || !is_digit(*c->p)) {
+            return false;
+        }
+        int exp = 0;
+        while (c->p < c->end && is_digit(*c->p)) {
+            if (exp < 100) {
+                exp = exp * 10 + (*c->p - '0');
+            }
+            c->p++;
+        }
+        while (exp-- > 0) {
+            value = negative_exp ? value / 10.0f : value * 10.0f;
+        }
+    }
+
+    *out = negative ? -value : value;
+    return true;
+}
+
+static bool skip_literal(json_cursor_t *c, const char *literal)
+{
+    size_t len = strlen(literal);
+    if ((size_t)(c->end - c->p) < len || memcmp(c->p, literal, len) != 0) {
+        return false;
+    }
+    c->p += len;
+    return true;
+}
+
+static bool skip_value(json_cursor_t *c, int depth);
+
+static bool skip_container(json_cursor_t *c, char close, bool keyed, int depth)
+{
+    c->p++;
+    if (consume(c, close)) {
+        return true;
+    }
+    do {
+        if (keyed) {
+            json_span_t key;
+            if (!parse_string(c, &key) || !consume(c, ':')) {
+                return false;
+            }
+        }
+        if (!skip_value(c, depth + 1)) {
+            return false;
+        }
+    } while (consume(c, ','));
+    return consume(c, close);
+}
+
+static bool skip_value(json_cursor_t *c, int depth)
+{
+    if (depth > HA_JSON_MAX_DEPTH) {
+        return false;
+    }
+    skip_ws(c);
+    if (c->p >= c->end) {
+        return false;
+    }
+    switch (*c->p) {
+    case '"': {
+        json_span_t span;
+        return parse_string(c, &span);
+    }
+    case '{':
+        return skip_container(c, '}', true, depth);
+    case '[':
+        return skip_container(c, ']', false, depth);
+    case 't':
+        return skip_literal(c, "true");
+    case 'f':
+        return skip_literal(c, "false");
+    case 'n':
+        return skip_literal(c, "null");
+    default: {
+        float ignored;
+        return parse_number(c, &ignored);
+    }
+    }
+}
+
+static bool parse_color(json_cursor_t *c, ha_light_cmd_t *cmd)
+{
+    bool has_h = false;
+    bool has_s = false;
+
+    if (!consume(c, '{')) {
+        return false;
+    }
+    if (!consume(c, '}')) {
+        do {
+            json_span_t key;
+            if (!parse_string(c, &key) || !consume(c, ':')) {
+                return false;
+            }
+            if (span_is(key, "h")) {
+                has_h = parse_number(c, &cmd->hue);
+                if (!has_h) {
+                    return false;
+                }
+            } else if (span_is(key, "s")) {
+                has_s = parse_number(c, &cmd->saturation);
+                if (!has_s) {
+                    return false;
+                }
+            } else if (!skip_value(c, 1)) {
+                return false;
+            }
+        } while (consume(c, ','));
+        if (!consume(c, '}')) {
+            return false;
+        }
+    }
+    if (has_h && has_s) {
+        cmd->fields |= HA_CMD_COLOR;
+    }
+    return true;
+}
+
+esp_err_t ha_json_parse_light_cmd(const char *data, size_t len, ha_light_cmd_t *cmd)
+{
+    json_cursor_t c = { .p = data, .end = data + len };
+
+    memset(cmd, 0, sizeof(*cmd));
+    if (data == NULL || !consume(&c, '{')) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (consume(&c, '}')) {
+        return ESP_OK;
+    }
+
+    do {
+        json_span_t key;
+        if (!parse_string(&c, &key) || !consume(&c, ':')) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        skip_ws(&c);
+        if (span_is(key, "state")) {
+            json_span_t value;
+            if (!parse_string(&c, &value)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            if (span_is(value, "ON")) {
+                cmd->on = true;
+            } else if (span_is(value, "OFF")) {
+                cmd->on = false;
+            } else {
+                return ESP_ERR_INVALID_ARG;
+            }
+            cmd->fields |= HA_CMD_STATE;
+        } else if (span_is(key, "brightness")) {
+            float brightness;
+            if (!parse_number(&c, &brightness)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            // Clamped first, the cast is undefined out of range (1e99 parses as inf)
+            cmd->brightness = !(brightness > 0.0f) ? 0 : brightness > 255.0f ? 255 : (int)brightness;
+            cmd->fields |= HA_CMD_BRIGHTNESS;
+        } else if (span_is(key, "color")) {
+            if (!parse_color(&c, cmd)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        } else if (span_is(key, "transition")) {
+            if (!parse_number(&c, &cmd->transition)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            cmd->fields |= HA_CMD_TRANSITION;
+        } else if (!skip_value(&c, 0)) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    } while (consume(&c, ','));
+
+    if (!consume(&c, '}')) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,30 @@
+#ifndef HA_JSON_H
+#define HA_JSON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Fields present in a parsed command (ha_light_cmd_t.fields)
+#define HA_CMD_STATE        (1 << 0)
+#define HA_CMD_BRIGHTNESS   (1 << 1)
+#define HA_CMD_COLOR        (1 << 2)    /* Both color.h and color.s */
+#define HA_CMD_TRANSITION   (1 << 3)
+
+// Home Assistant JSON schema light command, e.g.
+// {"state":"ON","brightness":80,"color":{"h":30.5,"s":90},"transition":2}
+typedef struct {
+    uint8_t fields;         /* HA_CMD_* bits */
+    bool on;                /* "state" is "ON" */
+    int brightness;         /* 0-100 (bri_scl 100) */
+    float hue;              /* color.h, 0.0-360.0 */
+    float saturation;       /* color.s, 0.0-100.0 */
+    float transition;       /* Seconds */
+} ha_light_cmd_t;
+
+// Function to parse a command payload in a single pass without allocating.
+// The buffer does not need to be NUL-terminated. Unknown keys are skipped.
+esp_err_t ha_json_parse_light_cmd(const char *data, size_t len, ha_light_cmd_t *cmd);
+
+#endif /* HA_JSON_H */
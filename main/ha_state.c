@@ -0,0 +1,103 @@
+#include "ha_state.h"
+#include <string.h>
+
+typedef struct {
+    char *p;
+    char *end;
+} state_writer_t;
+
+static bool put_str(state_writer_t *w, const char *s, size_t len)
+{
+    if ((size_t)(w->end - w->p) < len) {
+        return false;
+    }
+    memcpy(w->p, s, len);
+    w->p += len;
+    return true;
+}
+
+#define PUT_LITERAL(w, s) put_str(w, s, sizeof(s) - 1)
+
+static bool put_uint(state_writer_t *w, uint32_t value)
+{
+    char digits[10];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    if ((size_t)(w->end - w->p) < n) {
+        return false;
+    }
+    while (n) {
+        *w->p++ = digits[--n];
+    }
+    return true;
+}
+
+// One decimal is all HA shows for hue and saturation
+static uint32_t to_tenths(float value)
+{
+    return value <= 0.0f ? 0 : (uint32_t)(value * 10.0f + 0.5f);
+}
+
+// Whole numbers are printed without the decimal
+static bool put_tenths(state_writer_t *w, float value)
+{
+    uint32_t tenths = to_tenths(value);
+    if (!put_uint(w, tenths / 10)) {
+        return false;
+    }
+    if (tenths % 10) {
+        char frac[2] = { '.', '0' + tenths % 10 };
+        return put_str(w, frac, sizeof(frac));
+    }
+    return true;
+}
+
+int ha_state_format(char *buf, size_t size, const ha_light_state_t *state)
+{
+    if (size == 0) {
+        return -1;
+    }
+    // Keep room for the terminator
+    state_writer_t w = { .p = buf, .end = buf + size - 1 };
+    bool ok = state->on ? PUT_LITERAL(&w, "{\"state\":\"ON\"")
+                        : PUT_LITERAL(&w, "{\"state\":\"OFF\"");
+
+    if (ok && (state->fields & HA_STATE_BRIGHTNESS)) {
+        ok = PUT_LITERAL(&w, ",\"brightness\":") && put_uint(&w, state->brightness);
+    }
+    if (ok && (state->fields & HA_STATE_COLOR)) {
+        ok = PUT_LITERAL(&w, ",\"color_mode\":\"hs\",\"color\":{\"h\":") &&
+             put_tenths(&w, state->hue) &&
+             PUT_LITERAL(&w, ",\"s\":") &&
+             put_tenths(&w, state->saturation) &&
+             PUT_LITERAL(&w, "}");
+    }
+    ok = ok && PUT_LITERAL(&w, "}");
+    if (!ok) {
+        buf[0] = '\0';
+        return -1;
+    }
+    *w.p = '\0';
+    return w.p - buf;
+}
+
+uint32_t ha_state_key(const ha_light_state_t *state)
+{
+    // Absent attributes get a value the field cannot otherwise take
+    uint32_t brightness = 0x7F;
+    uint32_t hue = 0xFFF;
+    uint32_t saturation = 0x3FF;
+    if (state->fields & HA_STATE_BRIGHTNESS) {
+        brightness = state->brightness < 0x7E ? state->brightness : 0x7E;
+    }
+    if (state->fields & HA_STATE_COLOR) {
+        hue = to_tenths(state->hue);
+        hue = hue < 0xFFE ? hue : 0xFFE;
+        saturation = to_tenths(state->saturation);
+        saturation = saturation < 0x3FE ? saturation : 0x3FE;
+    }
+    return HA_STATE_KEY_VALID | (uint32_t)state->on << 29 | brightness << 22 | hue << 10 | saturation;
+}
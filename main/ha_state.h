@@ -0,0 +1,36 @@
+#ifndef HA_STATE_H
+#define HA_STATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fields present in a state (ha_light_state_t.fields)
+#define HA_STATE_BRIGHTNESS (1 << 0)
+#define HA_STATE_COLOR      (1 << 1)
+
+// Longest payload ha_state_format() produces, including the terminator:
+// {"state":"OFF","brightness":100,"color_mode":"hs","color":{"h":360.0,"s":100.0}}
+#define HA_STATE_MAX_LEN    96
+
+// Home Assistant JSON schema light state
+typedef struct {
+    uint8_t fields;         /* HA_STATE_* bits */
+    bool on;
+    uint8_t brightness;     /* 0-100 (bri_scl 100) */
+    float hue;              /* 0.0-360.0 */
+    float saturation;       /* 0.0-100.0 */
+} ha_light_state_t;
+
+// Set in every ha_state_key(), so 0 can mean "no state"
+#define HA_STATE_KEY_VALID  (1u << 31)
+
+// Function to write the state JSON into buf from fixed templates, without
+// allocating. Returns the payload length, or -1 if buf is too small.
+int ha_state_format(char *buf, size_t size, const ha_light_state_t *state);
+// Function to reduce a state to 32 bits that are equal exactly when
+// ha_state_format() writes the same payload (brightness, hue and saturation
+// as printed), so the last published state can be kept per lamp cheaply
+uint32_t ha_state_key(const ha_light_state_t *state);
+
+#endif /* HA_STATE_H */
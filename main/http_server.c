@@ -1,93 +1,161 @@
 #include "http_server.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
-#include "cJSON.h"
 
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "bridge.h"
+#include "lamp_import.h"
 #include "lamp_nvs.h"
+#include "lamp_registry.h"
+#include "latency.h"
+#include "light_fade.h"
+#include "metrics.h"
+#include "mesh_tx.h"
+#include "mesh_poll.h"
+#include "mesh_persist.h"
+#include "mqtt_out.h"
 
 #define TAG "HTTP_SERVER"
-// Define the maximum number of lamps
-#define MAX_LAMPS 20
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
-/* An HTTP POST handler */
-esp_err_t add_lamp_post_handler(httpd_req_t *req)
+// Pages are sent in chunks of this size from a buffer on the handler's stack
+#define PAGE_CHUNK_SIZE 512
+
+static const char *s_redirect_home =
+    "<html><head>"
+    "<script>window.location.replace('/');</script>"
+    "</head></html>";
+
+// Output collected in a fixed buffer and sent with httpd_resp_send_chunk()
+// whenever it fills up, so a page costs the same RAM for any number of lamps.
+// Once a chunk could not be sent (client gone) everything else is dropped.
+typedef struct {
+    httpd_req_t *req;
+    char *buf;
+    size_t size;
+    size_t len;
+    bool failed;
+} chunk_writer_t;
+
+static void chunk_flush(chunk_writer_t *w)
 {
-    char content[100];
-    int ret, remaining = req->content_len;
+    if (w->len > 0 && !w->failed && httpd_resp_send_chunk(w->req, w->buf, w->len) != ESP_OK) {
+        ESP_LOGD(TAG, "Sending a chunk failed, dropping the rest of the response");
+        w->failed = true;
+    }
+    w->len = 0;
+}
 
-    if (remaining > sizeof(content)) {
-        /* Respond with 413 (Request Entity Too Large) */
-        httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "Content too long");
-        /* Return to close the connection */
-        return ESP_OK;
+static void chunk_write(chunk_writer_t *w, const char *data, size_t len)
+{
+    while (len > 0 && !w->failed) {
+        if (w->len == w->size) {
+            chunk_flush(w);
+            continue;
+        }
+        size_t n = MIN(len, w->size - w->len);
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
     }
+}
 
-    while (remaining > 0) {
-        /* Read the data for the request */
-        if ((ret = httpd_req_recv(req, content, MIN(remaining, sizeof(content)))) <= 0) {
+static void chunk_puts(chunk_writer_t *w, const char *str)
+{
+    chunk_write(w, str, strlen(str));
+}
+
+static void chunk_printf(chunk_writer_t *w, const char *fmt, ...)
+{
+    char line[200];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0 || len >= sizeof(line)) {
+        return;
+    }
+    chunk_write(w, line, len);
+}
+
+// Function to write text into HTML content or a quoted attribute value
+static void chunk_put_html(chunk_writer_t *w, const char *str)
+{
+    const char *start = str;
+    for (; *str; str++) {
+        const char *entity;
+        switch (*str) {
+        case '&': entity = "&amp;"; break;
+        case '<': entity = "&lt;"; break;
+        case '>': entity = "&gt;"; break;
+        case '"': entity = "&quot;"; break;
+        case '\'': entity = "&#39;"; break;
+        default: continue;
+        }
+        chunk_write(w, start, str - start);
+        chunk_puts(w, entity);
+        start = str + 1;
+    }
+    chunk_write(w, start, str - start);
+}
+
+// Function to send what is left and terminate the chunked response. Returns
+// ESP_FAIL if the response could not be sent, so the server closes the socket.
+static esp_err_t chunk_end(chunk_writer_t *w)
+{
+    chunk_flush(w);
+    if (w->failed || httpd_resp_send_chunk(w->req, NULL, 0) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+// Function to receive a whole urlencoded form body into buf (NUL-terminated).
+// On failure an error response has already been sent.
+static esp_err_t recv_form(httpd_req_t *req, char *buf, size_t size)
+{
+    int ret, received = 0;
+
+    if (req->content_len >= size) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Content too long");
+        return ESP_FAIL;
+    }
+    while (received < req->content_len) {
+        ret = httpd_req_recv(req, buf + received, req->content_len - received);
+        if (ret <= 0) {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-                /* Retry receiving if timeout occurred */
                 continue;
             }
-            /* In case of unrecoverable error, respond with 500 (Internal Server Error) */
             httpd_resp_send_500(req);
-            /* Return to close the connection */
             return ESP_FAIL;
         }
-        remaining -= ret;
-
-        // Parse received data
-        char lamp_name[50];
-        char lamp_address_str[8];
-        ESP_LOGI(TAG, "content %s", content);
-        sscanf(content, "lamp_name=%[^&]&lamp_address=%6s", lamp_name, lamp_address_str);
-        //int lamp_address = strtol(lamp_address_str, NULL, 16);
-        ESP_LOGI(TAG, "lamp adress %s", lamp_address_str);
-        ESP_LOGI(TAG, "lamp name %s", lamp_name);
-
-        int nextFreeNVSIndex = findNextFreeIndexInNVS();
-        // Add your logic here to add the new lamp
-
-        LampInfo lamp;
-        strcpy(lamp.name, lamp_name);
-        strcpy(lamp.address, lamp_address_str);
-        // Save lamp info
-        esp_err_t err = save_lamp_info(&lamp, nextFreeNVSIndex);
-        if (err != ESP_OK) {
-            printf("Failed to save lamp info: %d\n", err);
-        }
-
-        // Load all lamps info
-        printAllLampInfo();
-
+        received += ret;
     }
-
-    // After the lamp is successfully added, send a response with a JavaScript redirect
-    const char* resp_str =
-        "<html><head>"
-        "<script>window.location.replace('/');</script>"
-        "</head></html>";
-
-    httpd_resp_send(req, resp_str, strlen(resp_str));
+    buf[received] = '\0';
     return ESP_OK;
 }
 
-// HTTP POST handler for removing lamps
-esp_err_t remove_lamp_post_handler(httpd_req_t *req)
+// Function to receive a urlencoded form body pair by pair, for bodies that
+// grow with the lamp count (one checkbox per lamp). field() gets each
+// "key=value" NUL-terminated. On failure an error response has already been sent.
+static esp_err_t recv_form_fields(httpd_req_t *req, void (*field)(const char *pair, void *arg), void *arg)
 {
-    char content[100];
+    char buf[128];
+    char pair[160];
+    size_t pair_len = 0;
     int ret, remaining = req->content_len;
 
-    if (remaining > sizeof(content)) {
-        httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "Content too long");
-        return ESP_OK;
-    }
-
     while (remaining > 0) {
-        if ((ret = httpd_req_recv(req, content, MIN(remaining, sizeof(content)))) <= 0) {
+        if ((ret = httpd_req_recv(req, buf, MIN(remaining, sizeof(buf)))) <= 0) {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
                 continue;
             }
@@ -95,69 +163,130 @@ esp_err_t remove_lamp_post_handler(httpd_req_t *req)
             return ESP_FAIL;
         }
         remaining -= ret;
-
-        // Parse received data to get lamp name or address to remove
-        char lamp_name[50];
-        char lamp_address_str[8];
-        sscanf(content, "lamp_name=%[^&]&lamp_address=%6s", lamp_name, lamp_address_str);
-
-        // Add your logic here to remove the lamp
-        ESP_LOGI(TAG, "lamp adress %s", lamp_address_str);
-        ESP_LOGI(TAG, "lamp name %s", lamp_name);
-        // For example:
-        int index_to_remove = find_index_by_name_or_address(lamp_name, lamp_address_str);
-        if (index_to_remove >= 0) {
-            esp_err_t err = remove_lamp_info(index_to_remove);
-            if (err == ESP_OK) {
-                ESP_LOGI(TAG, "Lamp removed successfully");
-                // After the lamp is successfully added, send a response with a JavaScript redirect
-                const char* resp_str =
-                    "<html><head>"
-                    "<script>window.location.replace('/');</script>"
-                    "</head></html>";
-
-                httpd_resp_send(req, resp_str, strlen(resp_str));
+        for (int i = 0; i < ret; i++) {
+            if (buf[i] == '&') {
+                pair[pair_len] = '\0';
+                field(pair, arg);
+                pair_len = 0;
+            } else if (pair_len < sizeof(pair) - 1) {
+                pair[pair_len++] = buf[i];
             } else {
-                ESP_LOGE(TAG, "Failed to remove lamp: %d", err);
+                httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Form field too long");
+                return ESP_FAIL;
             }
-        } else {
-            ESP_LOGE(TAG, "Lamp not found for removal");
-            httpd_resp_sendstr(req, "No Lamp found with this name or address");
         }
     }
-
+    if (pair_len > 0) {
+        pair[pair_len] = '\0';
+        field(pair, arg);
+    }
     return ESP_OK;
 }
 
-// HTTP GET handler to retrieve all lamp information
-esp_err_t get_lamps_handler(httpd_req_t *req) {
-    // Retrieve all lamp information from NVS
-    cJSON *root = cJSON_CreateArray();
+/* An HTTP POST handler */
+esp_err_t add_lamp_post_handler(httpd_req_t *req)
+{
+    char content[160];
+    if (recv_form(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_OK;
+    }
 
-    // Iterate through all lamps
-    for (int i = 0; i < MAX_LAMPS; i++) {
-        LampInfo lamp_info;
-        esp_err_t err = load_lamp_info(&lamp_info, i);
-        if (err == ESP_OK) {
-            // Add lamp info to JSON array
-            cJSON *lamp_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(lamp_obj, "name", lamp_info.name);
-            cJSON_AddStringToObject(lamp_obj, "address", lamp_info.address);
-            cJSON_AddItemToArray(root, lamp_obj);        
-        }
+    // Parse received data
+    char lamp_name[50] = "";
+    char lamp_address_str[8] = "";
+    char checkbox[4];
+    httpd_query_key_value(content, "lamp_name", lamp_name, sizeof(lamp_name));
+    httpd_query_key_value(content, "lamp_address", lamp_address_str, sizeof(lamp_address_str));
+    ESP_LOGI(TAG, "lamp adress %s", lamp_address_str);
+    ESP_LOGI(TAG, "lamp name %s", lamp_name);
+
+    if (lamp_name[0] == '\0') {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Lamp name is required");
+        return ESP_OK;
+    }
+    uint16_t lamp_address = lamp_parse_address(lamp_address_str);
+    if (lamp_address == 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid lamp address");
+        return ESP_OK;
     }
 
-    // Convert cJSON object to a string
-    char *json_str = cJSON_Print(root);
+    // Names map to MQTT topic slugs, two lamps must not share one
+    if (find_index_by_name_or_address(lamp_name, 0) >= 0 ||
+        lamp_registry_group_find_by_name(lamp_name, NULL) >= 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "A lamp with this name already exists");
+        return ESP_OK;
+    }
+    // Status messages are matched to lamps by address, same check as the API
+    if (lamp_registry_find_by_addr(lamp_address, NULL) >= 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Another lamp has this address");
+        return ESP_OK;
+    }
 
-    // Send JSON string as the response
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_send(req, json_str, strlen(json_str));
+    int nextFreeNVSIndex = findNextFreeIndexInNVS();
 
-    // Free cJSON object and JSON string
-    cJSON_Delete(root);
-    free(json_str);
+    LampInfo lamp = { .address = lamp_address };
+    strcpy(lamp.name, lamp_name);
+    // Unticked checkboxes are not sent at all
+    if (httpd_query_key_value(content, "acked", checkbox, sizeof(checkbox)) == ESP_OK) {
+        lamp.flags |= LAMP_FLAG_ACKED;
+    }
+    if (httpd_query_key_value(content, "fade", checkbox, sizeof(checkbox)) == ESP_OK) {
+        lamp.flags |= LAMP_FLAG_FADE;
+    }
+    // Save lamp info
+    esp_err_t err = save_lamp_info(&lamp, nextFreeNVSIndex);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save lamp info: %d", err);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                            nextFreeNVSIndex < 0 ? "Lamp table is full" :
+                            err == ESP_ERR_NO_MEM ? "No room left for lamp names" : "Failed to save lamp");
+        return ESP_OK;
+    }
+    // Live right away: the set subscription is a wildcard, HA only needs the config
+    bridge_announce(nextFreeNVSIndex);
+
+    // Load all lamps info
+    printAllLampInfo();
+
+    // After the lamp is successfully added, send a response with a JavaScript redirect
+    httpd_resp_send(req, s_redirect_home, strlen(s_redirect_home));
+    return ESP_OK;
+}
+
+// HTTP POST handler for removing lamps
+esp_err_t remove_lamp_post_handler(httpd_req_t *req)
+{
+    char content[160];
+    if (recv_form(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_OK;
+    }
 
+    // Parse received data to get lamp name or address to remove
+    char lamp_name[50] = "";
+    char lamp_address_str[8] = "";
+    httpd_query_key_value(content, "lamp_name", lamp_name, sizeof(lamp_name));
+    httpd_query_key_value(content, "lamp_address", lamp_address_str, sizeof(lamp_address_str));
+    ESP_LOGI(TAG, "lamp adress %s", lamp_address_str);
+    ESP_LOGI(TAG, "lamp name %s", lamp_name);
+
+    int index_to_remove = find_index_by_name_or_address(lamp_name, lamp_parse_address(lamp_address_str));
+    LampInfo removed;
+    if (index_to_remove < 0 || !lamp_registry_get(index_to_remove, &removed)) {
+        ESP_LOGE(TAG, "Lamp not found for removal");
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No Lamp found with this name or address");
+        return ESP_OK;
+    }
+    esp_err_t err = remove_lamp_info(index_to_remove);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to remove lamp: %d", err);
+        httpd_resp_send_500(req);
+        return ESP_OK;
+    }
+    ESP_LOGI(TAG, "Lamp removed successfully");
+    char config_topic[100];
+    mqtt_lamp_topic(config_topic, sizeof(config_topic), &removed, "config");
+    bridge_remove_discovery(index_to_remove, config_topic);
+    httpd_resp_send(req, s_redirect_home, strlen(s_redirect_home));
     return ESP_OK;
 }
 
@@ -172,6 +301,10 @@ esp_err_t add_lamp_get_handler(httpd_req_t *req)
         "<input type=\"text\" id=\"lamp_name\" name=\"lamp_name\"><br><br>"
         "<label for=\"lamp_address\">Lamp Address:</label>"
         "<input type=\"text\" id=\"lamp_address\" name=\"lamp_address\"><br><br>"
+        "<input type=\"checkbox\" id=\"acked\" name=\"acked\" value=\"1\">"
+        "<label for=\"acked\">Acknowledged mode (retry until the lamp answers)</label><br><br>"
+        "<input type=\"checkbox\" id=\"fade\" name=\"fade\" value=\"1\">"
+        "<label for=\"fade\">Bridge fade (the lamp ignores transition times)</label><br><br>"
         "<input type=\"submit\" value=\"Add Lamp\">"
         "</form>"
         "<br><form action=\"/\" method=\"get\"><input type=\"submit\" value=\"Back\"></form>"
@@ -181,212 +314,906 @@ esp_err_t add_lamp_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+// Function to write a hidden form that posts or gets an action for one lamp
+static void overview_lamp_form(chunk_writer_t *w, const char *action, const char *method, const char *label,
+                               const LampInfo *lamp_info, const char *address)
+{
+    chunk_printf(w, "<form action=\"%s\" method=\"%s\"><input type=\"hidden\" name=\"lamp_name\" value=\"", action, method);
+    chunk_put_html(w, lamp_info->name);
+    chunk_printf(w, "\"><input type=\"hidden\" name=\"lamp_address\" value=\"%s\"><input type=\"submit\" value=\"%s\"></form>",
+                 address, label);
+}
+
+// HTTP GET handler for the overview page. Rows are read from the registry
+// and streamed as they are written, so the first bytes go out right away.
 esp_err_t get_lamps_get_handler(httpd_req_t *req)
 {
-    // Fetch lamp data from NVS and generate HTML content
-    char *lamps_html = malloc(MAX_LAMPS * 600); // Dynamically allocate memory
-    if (lamps_html == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for lamps_html");
-        return ESP_FAIL;
+    char buf[PAGE_CHUNK_SIZE];
+    chunk_writer_t w = { .req = req, .buf = buf, .size = sizeof(buf) };
+
+    chunk_puts(&w, "<html><body><h1>Lamp Overview</h1><table><tr><th>Name</th><th>Address</th><th>Mode</th><th>Actions</th></tr>");
+    for (int i = 0; i < MAX_LAMPS && !w.failed; i++) {
+        LampInfo lamp_info;
+        if (!lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        char address[8];
+        snprintf(address, sizeof(address), "0x%04X", lamp_info.address);
+        chunk_puts(&w, "<tr><td>");
+        chunk_put_html(&w, lamp_info.name);
+        chunk_printf(&w, "</td><td>%s</td><td>%s%s</td><td>", address,
+                     (lamp_info.flags & LAMP_FLAG_ACKED) ? "acked" : "unacked",
+                     (lamp_info.flags & LAMP_FLAG_FADE) ? ", bridge fade" : "");
+        overview_lamp_form(&w, "/remove_lamp", "post", "Remove", &lamp_info, address);
+        overview_lamp_form(&w, "/edit_lamp", "get", "Edit", &lamp_info, address);
+        chunk_puts(&w, "</td></tr>");
     }
-   
-    lamps_html[0] = '\0';
-    strncat(lamps_html, "<html><body><h1>Lamp Overview</h1><table><tr><th>Name</th><th>Address</th><th>Actions</th></tr>", MAX_LAMPS * 600 - 1);
+    chunk_puts(&w, "</table>");
 
-    for (int i = 0; i < MAX_LAMPS; i++) {
-    // Load lamp info from NVS
-    LampInfo lamp_info;
-    esp_err_t err = load_lamp_info(&lamp_info, i);
-    if (err == ESP_OK) {
-        // Append lamp data to HTML content
-        char row[600];
-        lamp_info.name[sizeof(lamp_info.name) - 1] = '\0';
-        ESP_LOGI(TAG, "Adding lamp to table: Name=%s, Address=%s", lamp_info.name, lamp_info.address);
-        snprintf(row, sizeof(row), "<tr><td>%s</td><td>%s</td><td><form action=\"/remove_lamp\" method=\"post\"><input type=\"hidden\" name=\"lamp_name\" value=\"%s\"><input type=\"hidden\" name=\"lamp_address\" value=\"%s\"><input type=\"submit\" value=\"Remove\"></form><form action=\"/edit_lamp\" method=\"get\"><input type=\"hidden\" name=\"lamp_name\" value=\"%s\"><input type=\"hidden\" name=\"lamp_address\" value=\"%s\"><input type=\"submit\" value=\"Edit\"></form></td></tr>", lamp_info.name, lamp_info.address, lamp_info.name, lamp_info.address,lamp_info.name,lamp_info.address);
-        if (strlen(lamps_html) + strlen(row) < MAX_LAMPS * 600) {
-            strncat(lamps_html, row, MAX_LAMPS * 600 - strlen(lamps_html) - 1);
-        } else {
-            ESP_LOGE(TAG, "Lamps HTML buffer full. Cannot append more rows.");
-            break;  // Exit the loop if the buffer is full
+    // Group table
+    chunk_puts(&w, "<h2>Groups</h2><table><tr><th>Name</th><th>Group Address</th><th>Lamps</th><th>Actions</th></tr>");
+    for (int i = 0; i < MAX_GROUPS && !w.failed; i++) {
+        GroupInfo group_info;
+        if (!lamp_registry_group_get(i, &group_info)) {
+            continue;
+        }
+        int members = 0;
+        for (int word = 0; word < GROUP_MEMBER_WORDS; word++) {
+            members += __builtin_popcount(group_info.members[word]);
         }
+        chunk_puts(&w, "<tr><td>");
+        chunk_put_html(&w, group_info.name);
+        chunk_printf(&w, "</td><td>0x%04X</td><td>%d</td><td><form action=\"/remove_group\" method=\"post\">"
+                         "<input type=\"hidden\" name=\"group_name\" value=\"", group_info.address, members);
+        chunk_put_html(&w, group_info.name);
+        chunk_puts(&w, "\"><input type=\"submit\" value=\"Remove\"></form></td></tr>");
     }
+    chunk_puts(&w, "</table>");
+
+    chunk_puts(&w, "<br><form action=\"/add_group_page\" method=\"get\"><input type=\"submit\" value=\"Add Group\"></form>"
+                   "<br><form action=\"/add_lamp_page\" method=\"get\"><input type=\"submit\" value=\"Add\"></form>"
+                   "<br><form action=\"/restart\" method=\"get\"><input type=\"submit\" value=\"Restart\"></form>"
+                   "</body></html>");
+    return chunk_end(&w);
+}
+
+// HTTP GET handler for the edit lamp page. The query carries the lamp_name and
+// lamp_address of the overview row; the name arrives URL-encoded, so the lamp
+// is looked up by its address and the form is filled from the registry.
+esp_err_t edit_lamp_get_handler(httpd_req_t *req)
+{
+    char query[200];
+    char lamp_address_str[8];
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+        httpd_query_key_value(query, "lamp_address", lamp_address_str, sizeof(lamp_address_str)) != ESP_OK) {
+        ESP_LOGE(TAG, "lamp_address parameter not found in the URI");
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Lamp address is required");
+        return ESP_OK;
     }
 
-    // Close table and HTML tags
-    strncat(lamps_html, "</table>", MAX_LAMPS * 600 - strlen(lamps_html) - 1);
+    LampInfo lamp_info;
+    uint16_t lamp_address = lamp_parse_address(lamp_address_str);
+    if (lamp_address == 0 || lamp_registry_find_by_addr(lamp_address, &lamp_info) < 0) {
+        ESP_LOGE(TAG, "No lamp at address %s", lamp_address_str);
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Lamp not found");
+        return ESP_OK;
+    }
 
-    // Add "Add" button
-    strncat(lamps_html, "<br><form action=\"/add_lamp_page\" method=\"get\"><input type=\"submit\" value=\"Add\"></form>", MAX_LAMPS * 600 - strlen(lamps_html) - 1);
+    char buf[PAGE_CHUNK_SIZE];
+    chunk_writer_t w = { .req = req, .buf = buf, .size = sizeof(buf) };
+    chunk_puts(&w,
+        "<html><body>"
+        "<h1>Edit Lamp</h1>"
+        "<form action=\"/update_lamp\" method=\"post\">"
+        "<label for=\"lamp_name\">Lamp Name:</label>"
+        "<input type=\"text\" id=\"lamp_name\" name=\"lamp_name\" value=\"");
+    chunk_put_html(&w, lamp_info.name);
+    chunk_printf(&w,
+        "\"><br><br>"
+        "<label for=\"lamp_address\">Lamp Address:</label>"
+        "<input type=\"text\" id=\"lamp_address\" name=\"lamp_address\" value=\"0x%04X\"><br><br>",
+        lamp_info.address);
+    chunk_printf(&w,
+        "<input type=\"checkbox\" id=\"acked\" name=\"acked\" value=\"1\"%s>"
+        "<label for=\"acked\">Acknowledged mode (retry until the lamp answers)</label><br><br>",
+        (lamp_info.flags & LAMP_FLAG_ACKED) ? " checked" : "");
+    chunk_printf(&w,
+        "<input type=\"checkbox\" id=\"fade\" name=\"fade\" value=\"1\"%s>"
+        "<label for=\"fade\">Bridge fade (the lamp ignores transition times)</label><br><br>",
+        (lamp_info.flags & LAMP_FLAG_FADE) ? " checked" : "");
+    chunk_puts(&w,
+        "<input type=\"submit\" value=\"Update Lamp\">"
+        "</form>"
+        "</body></html>");
+    return chunk_end(&w);
+}
 
-    // Add "Restart" button
-    strncat(lamps_html, "<br><form action=\"/restart\" method=\"get\"><input type=\"submit\" value=\"Restart\"></form>", MAX_LAMPS * 600 - strlen(lamps_html) - 1);
 
-    // Close  HTML tags
-    strncat(lamps_html, "</body></html>", MAX_LAMPS * 600 - strlen(lamps_html) - 1);
+esp_err_t update_lamp_post_handler(httpd_req_t *req)
+{
+    char content[160];
+    if (recv_form(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_OK;
+    }
 
-    // Send HTTP response with lamp overview HTML content
-    httpd_resp_send(req, lamps_html, strlen(lamps_html));
+    // Parse received data to get lamp name and address to update
+    char lamp_name[50] = "";
+    char lamp_address_str[8] = "";
+    char checkbox[4];
+    httpd_query_key_value(content, "lamp_name", lamp_name, sizeof(lamp_name));
+    httpd_query_key_value(content, "lamp_address", lamp_address_str, sizeof(lamp_address_str));
+    ESP_LOGI(TAG, "Lamp Name: %s", lamp_name);
+    ESP_LOGI(TAG, "Lamp Address: %s", lamp_address_str);
 
-    // Free dynamically allocated memory
-    free(lamps_html);
+    // Find the index of the lamp to be updated
+    uint16_t lamp_address = lamp_parse_address(lamp_address_str);
+    if (lamp_address == 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid lamp address");
+        return ESP_OK;
+    }
+    int index_to_update = find_index_by_name_or_address(lamp_name, lamp_address);
+    if (index_to_update < 0) {
+        ESP_LOGE(TAG, "Lamp not found for update");
+        httpd_resp_sendstr(req, "Lamp not found for update");
+        return ESP_OK;
+    }
+    int other = lamp_registry_find_by_addr(lamp_address, NULL);
+    if (other >= 0 && other != index_to_update) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Another lamp has this address");
+        return ESP_OK;
+    }
 
+    LampInfo updated_lamp = { .address = lamp_address };
+    strncpy(updated_lamp.name, lamp_name, sizeof(updated_lamp.name) - 1);
+    if (httpd_query_key_value(content, "acked", checkbox, sizeof(checkbox)) == ESP_OK) {
+        updated_lamp.flags |= LAMP_FLAG_ACKED;
+    }
+    if (httpd_query_key_value(content, "fade", checkbox, sizeof(checkbox)) == ESP_OK) {
+        updated_lamp.flags |= LAMP_FLAG_FADE;
+    }
+    LampInfo previous;
+    lamp_registry_get(index_to_update, &previous);
+    esp_err_t err = save_lamp_info(&updated_lamp, index_to_update);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to update lamp: %d", err);
+        httpd_resp_sendstr(req, err == ESP_ERR_NO_MEM ? "No room left for lamp names" : "Failed to update lamp");
+        return ESP_OK;
+    }
+    // A new name moves the lamp to another topic, a new address changes its
+    // unique id: HA has to drop the old entity before it gets the new config
+    if (strcmp(previous.name, updated_lamp.name) != 0 || previous.address != updated_lamp.address) {
+        char config_topic[100];
+        mqtt_lamp_topic(config_topic, sizeof(config_topic), &previous, "config");
+        bridge_remove_discovery(index_to_update, config_topic);
+        bridge_announce(index_to_update);
+    }
+    ESP_LOGI(TAG, "Lamp updated successfully");
+    httpd_resp_send(req, s_redirect_home, strlen(s_redirect_home));
     return ESP_OK;
 }
-// HTTP GET handler for the edit lamp page
-esp_err_t edit_lamp_get_handler(httpd_req_t *req) {
-    char lamp_name[100];  // Increase buffer size for lamp name
-    char lamp_address[100];  // Increase buffer size for lamp address
 
-    // Log the URI for debugging
-    ESP_LOGI(TAG, "URI: %s", req->uri);
+// HTTP GET handler for the add group page, one checkbox per lamp
+esp_err_t add_group_get_handler(httpd_req_t *req)
+{
+    char buf[PAGE_CHUNK_SIZE];
+    chunk_writer_t w = { .req = req, .buf = buf, .size = sizeof(buf) };
 
-    // Parse query parameters to get lamp name and address
-    char* query = strchr(req->uri, '?'); // Find the start of the query parameters
-    if (query == NULL) {
-        ESP_LOGE(TAG, "No query parameters found in the URI");
-        httpd_resp_send_500(req);
-        return ESP_FAIL;
+    chunk_puts(&w,
+        "<html><body>"
+        "<h1>Add New Group</h1>"
+        "<p>The lamps must already be subscribed to the group address.</p>"
+        "<form action=\"/add_group\" method=\"post\">"
+        "<label for=\"group_name\">Group Name:</label>"
+        "<input type=\"text\" id=\"group_name\" name=\"group_name\"><br><br>"
+        "<label for=\"group_address\">Group Address (0xC000-0xFEFF):</label>"
+        "<input type=\"text\" id=\"group_address\" name=\"group_address\"><br><br>");
+
+    for (int i = 0; i < MAX_LAMPS && !w.failed; i++) {
+        LampInfo lamp_info;
+        if (!lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        chunk_printf(&w, "<input type=\"checkbox\" id=\"m%d\" name=\"m%d\" value=\"1\"><label for=\"m%d\">", i, i, i);
+        chunk_put_html(&w, lamp_info.name);
+        chunk_printf(&w, " (0x%04X)</label><br>", lamp_info.address);
+    }
+
+    chunk_puts(&w,
+        "<br><input type=\"submit\" value=\"Add Group\">"
+        "</form>"
+        "<br><form action=\"/\" method=\"get\"><input type=\"submit\" value=\"Back\"></form>"
+        "</body></html>");
+    return chunk_end(&w);
+}
+
+// Add group form as it is received: name, address and the ticked lamps
+typedef struct {
+    GroupInfo group;
+    char address_str[8];
+    bool has_name;
+    bool has_address;
+} group_form_t;
+
+// Function to take one field of the add group form, a member checkbox is "m<slot>=1"
+static void group_form_field(const char *pair, void *arg)
+{
+    group_form_t *form = arg;
+    int member, n;
+
+    if (sscanf(pair, "m%d%n", &member, &n) == 1 && pair[n] == '=') {
+        if (member >= 0 && member < MAX_LAMPS && lamp_registry_get(member, NULL)) {
+            group_set_member(&form->group, member, true);
+        }
+    } else if (httpd_query_key_value(pair, "group_name", form->group.name, sizeof(form->group.name)) == ESP_OK) {
+        form->has_name = form->group.name[0] != '\0';
+    } else if (httpd_query_key_value(pair, "group_address", form->address_str, sizeof(form->address_str)) == ESP_OK) {
+        form->has_address = true;
     }
+}
 
-    // Move to the start of the query parameters
-    query++;
+// HTTP POST handler for adding a group. The body has a field per ticked lamp,
+// so it is parsed as it arrives instead of being collected first.
+esp_err_t add_group_post_handler(httpd_req_t *req)
+{
+    group_form_t form = {0};
+    if (recv_form_fields(req, group_form_field, &form) != ESP_OK) {
+        return ESP_OK;
+    }
 
-    // Parse lamp name
-    char* lamp_name_start = strstr(query, "lamp_name=");
-    if (lamp_name_start == NULL) {
-        ESP_LOGE(TAG, "lamp_name parameter not found in the URI");
+    GroupInfo group = form.group;
+    if (!form.has_name || !form.has_address) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Group name and address are required");
+        return ESP_OK;
+    }
+    group.address = lamp_parse_address(form.address_str);
+    if (group.address < GROUP_ADDR_MIN || group.address > GROUP_ADDR_MAX) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid group address");
+        return ESP_OK;
+    }
+    // Groups and lamps share the homeassistant/light/<slug> namespace
+    if (lamp_registry_group_find_by_name(group.name, NULL) >= 0 ||
+        lamp_registry_find_by_name(group.name, NULL) >= 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "A lamp or group with this name already exists");
+        return ESP_OK;
+    }
+    if (lamp_registry_group_find_by_addr(group.address, NULL) >= 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "A group with this address already exists");
+        return ESP_OK;
+    }
+
+    int index = lamp_registry_group_next_free();
+    if (index < 0) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Group table is full");
+        return ESP_OK;
+    }
+    esp_err_t err = save_group_info(&group, index);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save group: %d", err);
         httpd_resp_send_500(req);
-        return ESP_FAIL;
+        return ESP_OK;
     }
-    lamp_name_start += strlen("lamp_name="); // Move past "lamp_name="
+    ESP_LOGI(TAG, "Group %s (0x%04X) added", group.name, group.address);
+    bridge_announce(MESH_TX_GROUP_INDEX(index));
 
-    char* lamp_name_end = strchr(lamp_name_start, '&');
-    if (lamp_name_end == NULL) {
-        ESP_LOGE(TAG, "lamp_name parameter not terminated properly");
+    httpd_resp_send(req, s_redirect_home, strlen(s_redirect_home));
+    return ESP_OK;
+}
+
+// HTTP POST handler for removing a group
+esp_err_t remove_group_post_handler(httpd_req_t *req)
+{
+    char content[128];
+    if (recv_form(req, content, sizeof(content)) != ESP_OK) {
+        return ESP_OK;
+    }
+
+    char group_name[50];
+    if (httpd_query_key_value(content, "group_name", group_name, sizeof(group_name)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Group name is required");
+        return ESP_OK;
+    }
+    GroupInfo group;
+    int index = lamp_registry_group_find_by_name(group_name, &group);
+    if (index < 0) {
+        httpd_resp_sendstr(req, "No group found with this name");
+        return ESP_OK;
+    }
+    esp_err_t err = remove_group_info(index);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to remove group: %d", err);
         httpd_resp_send_500(req);
-        return ESP_FAIL;
+        return ESP_OK;
+    }
+    char config_topic[100];
+    mqtt_group_topic(config_topic, sizeof(config_topic), &group, "config");
+    bridge_remove_discovery(MESH_TX_GROUP_INDEX(index), config_topic);
+
+    httpd_resp_send(req, s_redirect_home, strlen(s_redirect_home));
+    return ESP_OK;
+}
+
+esp_err_t restart_handler(httpd_req_t *req) {
+    // Send response to the client
+    const char* resp_str = "ESP32 is restarting...";
+    httpd_resp_send(req, resp_str, strlen(resp_str));
+
+    // Delay to ensure the response is sent before the restart
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+
+    // Restart the ESP32
+    esp_restart();
+
+    return ESP_OK;
+}
+
+// Function to append one latency line: name, samples, p50/p95/p99 in ms
+static void send_latency_row(httpd_req_t *req, const char *name, latency_stage_t stage, int lamp_index)
+{
+    char row[120];
+    uint32_t count = latency_count(stage, lamp_index);
+    if (count == 0) {
+        return;
+    }
+    snprintf(row, sizeof(row), "%-28s %-6s %8" PRIu32 " %9.1f %9.1f %9.1f\n", name, latency_stage_name(stage), count,
+             latency_percentile(stage, lamp_index, 50) / 1000.0,
+             latency_percentile(stage, lamp_index, 95) / 1000.0,
+             latency_percentile(stage, lamp_index, 99) / 1000.0);
+    httpd_resp_sendstr_chunk(req, row);
+}
+
+// HTTP GET handler for the command latency percentiles, as plain text
+esp_err_t latency_get_handler(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_sendstr_chunk(req, "# Command latency since boot, in ms\n"
+                                  "# parse: MQTT receive to queued, queue: queued to mesh send, send: mesh API call,\n"
+                                  "# ack: first send to the lamp's answer (acknowledged mode), total: MQTT receive to sent/answered\n"
+                                  "name                         stage     count       p50       p95       p99\n");
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        send_latency_row(req, "all", stage, -1);
+    }
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        LampInfo lamp_info;
+        if (!lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        send_latency_row(req, lamp_info.name, LATENCY_ACK, i);
+        send_latency_row(req, lamp_info.name, LATENCY_TOTAL, i);
+    }
+    httpd_resp_sendstr_chunk(req, NULL);
+    return ESP_OK;
+}
+
+// /metrics is sent in chunks of this size. httpd runs all handlers in one
+// task, so a single static buffer is enough.
+#define METRICS_CHUNK_SIZE 1024
+
+static char s_metrics_buf[METRICS_CHUNK_SIZE];
+
+static void metrics_header(chunk_writer_t *w, const char *name, const char *type, const char *help)
+{
+    chunk_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_value(chunk_writer_t *w, const char *name, const char *type, const char *help, uint32_t value)
+{
+    metrics_header(w, name, type, help);
+    chunk_printf(w, "%s %" PRIu32 "\n", name, value);
+}
+
+// Function to copy a lamp name into a label value, escaping \ " and newlines
+static void metrics_label(char *out, size_t size, const char *value)
+{
+    size_t n = 0;
+    for (; *value && n + 2 < size; value++) {
+        if (*value == '\\' || *value == '"' || *value == '\n') {
+            out[n++] = '\\';
+            out[n++] = *value == '\n' ? 'n' : *value;
+        } else {
+            out[n++] = *value;
+        }
+    }
+    out[n] = '\0';
+}
+
+static void metrics_latency(chunk_writer_t *w, const char *labels, latency_stage_t stage, int lamp_index)
+{
+    static const int quantiles[] = { 50, 95, 99 };
+    uint32_t count = latency_count(stage, lamp_index);
+    if (count == 0) {
+        return;
+    }
+    for (int q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        chunk_printf(w, "command_latency_seconds{%sstage=\"%s\",quantile=\"0.%02d\"} %.6f\n", labels,
+                     latency_stage_name(stage), quantiles[q],
+                     latency_percentile(stage, lamp_index, quantiles[q]) / 1e6);
+    }
+    chunk_printf(w, "command_latency_seconds_count{%sstage=\"%s\"} %" PRIu32 "\n", labels,
+                 latency_stage_name(stage), count);
+}
+
+// HTTP GET handler for /metrics in the Prometheus text format. Everything is
+// read from counters the hot paths keep anyway, nothing is locked for long.
+esp_err_t metrics_get_handler(httpd_req_t *req)
+{
+    chunk_writer_t writer = { .req = req, .buf = s_metrics_buf, .size = sizeof(s_metrics_buf) };
+    chunk_writer_t *w = &writer;
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    metrics_value(w, "esp_heap_free_bytes", "gauge", "Free heap", esp_get_free_heap_size());
+    metrics_value(w, "esp_heap_min_free_bytes", "gauge", "Lowest free heap since boot", esp_get_minimum_free_heap_size());
+    metrics_value(w, "esp_heap_largest_free_block_bytes", "gauge", "Largest allocatable block",
+                  heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    metrics_value(w, "esp_uptime_seconds", "counter", "Time since boot", (uint32_t)(esp_timer_get_time() / 1000000));
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        metrics_header(w, "wifi_rssi_dbm", "gauge", "Signal strength of the access point");
+        chunk_printf(w, "wifi_rssi_dbm %d\n", ap.rssi);
+    }
+
+    metrics_value(w, "mqtt_received_total", "counter", "MQTT messages received", metrics_get(METRIC_MQTT_RECEIVED));
+    metrics_value(w, "mqtt_published_total", "counter", "MQTT messages published", metrics_get(METRIC_MQTT_PUBLISHED));
+    metrics_value(w, "mqtt_publish_failed_total", "counter", "MQTT publishes the client refused",
+                  metrics_get(METRIC_MQTT_PUBLISH_FAILED));
+    metrics_value(w, "mqtt_outbox_full_total", "counter", "MQTT publishes refused, outbox over its byte budget",
+                  metrics_get(METRIC_MQTT_OUTBOX_FULL));
+    metrics_value(w, "mqtt_offline_total", "counter", "MQTT publishes refused while not connected",
+                  metrics_get(METRIC_MQTT_OFFLINE));
+    mqtt_out_stats_t out;
+    mqtt_out_get_stats(&out);
+    metrics_value(w, "mqtt_outbox_bytes", "gauge", "Bytes waiting in the MQTT outbox", out.outbox_bytes);
+    metrics_value(w, "mqtt_outbox_max_bytes", "gauge", "Most bytes in the MQTT outbox at once", out.outbox_max_bytes);
+    metrics_value(w, "mqtt_connected", "gauge", "Connected to the broker", out.connected);
+
+    bridge_announce_stats_t announce;
+    bridge_get_announce_stats(&announce);
+    metrics_value(w, "ha_discovery_published_total", "counter", "Discovery configs published", announce.configs);
+    metrics_value(w, "ha_discovery_unchanged_total", "counter", "Discovery configs skipped as unchanged",
+                  announce.unchanged);
+    metrics_value(w, "ha_announce_states_total", "counter", "States published with an announcement", announce.states);
+    metrics_value(w, "ha_announce_deferred_total", "counter", "Times announcements waited for the rate limit",
+                  announce.deferred);
+    metrics_value(w, "ha_state_refused_total", "counter", "States refused by MQTT, left pending", announce.refused);
+    metrics_value(w, "ha_state_replaced_total", "counter", "State changes folded into a pending state",
+                  announce.replaced);
+    metrics_value(w, "ha_announce_pending", "gauge", "Lamps and groups with a pending config or state",
+                  announce.pending);
+    metrics_value(w, "ha_removal_refused_total", "counter", "Discovery removals refused by MQTT, queued for retry",
+                  announce.removals_refused);
+    metrics_value(w, "ha_removal_retried_total", "counter", "Queued discovery removals sent later",
+                  announce.removals);
+    metrics_value(w, "ha_removal_pending", "gauge", "Discovery removals waiting for a retry",
+                  announce.removals_pending);
+
+    static const struct {
+        const char *name;
+        const char *help;
+    } mesh_events[METRIC_MESH_EVENT_COUNT] = {
+        [METRIC_MESH_SENT] = { "mesh_sent_total", "Mesh messages accepted by the stack" },
+        [METRIC_MESH_ERROR] = { "mesh_send_errors_total", "Mesh messages refused by the stack" },
+        [METRIC_MESH_TIMEOUT] = { "mesh_timeouts_total", "Mesh messages without answer" },
+    };
+    for (int event = 0; event < METRIC_MESH_EVENT_COUNT && !w->failed; event++) {
+        metrics_header(w, mesh_events[event].name, "counter", mesh_events[event].help);
+        for (int op = 0; op < metrics_mesh_op_count(); op++) {
+            chunk_printf(w, "%s{opcode=\"%s\"} %" PRIu32 "\n", mesh_events[event].name,
+                         metrics_mesh_op_name(op), metrics_mesh_get(op, event));
+        }
+    }
+
+    mesh_tx_stats_t tx;
+    mesh_tx_get_stats(&tx);
+    metrics_value(w, "mesh_tx_queued_total", "counter", "Commands queued", tx.queued);
+    metrics_value(w, "mesh_tx_dropped_total", "counter", "Commands dropped on a full queue", tx.dropped);
+    metrics_value(w, "mesh_tx_coalesced_total", "counter", "Commands replaced by a newer one", tx.coalesced);
+    metrics_value(w, "mesh_tx_retries_total", "counter", "Retransmissions of acked messages", tx.retries);
+    metrics_value(w, "mesh_tx_delivered_total", "counter", "Acked messages answered", tx.delivered);
+    metrics_value(w, "mesh_tx_gave_up_total", "counter", "Acked messages out of retries", tx.gave_up);
+    metrics_value(w, "mesh_tx_queue_depth", "gauge", "Commands waiting", tx.depth);
+    metrics_value(w, "mesh_tx_queue_max_depth", "gauge", "Most commands waiting at once", tx.max_depth);
+    metrics_value(w, "mesh_tx_inflight", "gauge", "Acked messages waiting for an answer", tx.inflight);
+
+    light_fade_stats_t fade;
+    light_fade_get_stats(&fade);
+    metrics_value(w, "fade_started_total", "counter", "Bridge fades started", fade.started);
+    metrics_value(w, "fade_steps_total", "counter", "Bridge fade steps queued", fade.steps);
+    metrics_value(w, "fade_skipped_total", "counter", "Bridge fade steps the TX queue refused", fade.skipped);
+    metrics_value(w, "fade_cancelled_total", "counter", "Bridge fades cut short by a newer command", fade.cancelled);
+    metrics_value(w, "fade_busy_total", "counter", "Transitions done at once, all fade slots in use", fade.busy);
+    metrics_value(w, "fade_active", "gauge", "Bridge fades running", fade.active);
+
+    mesh_poll_stats_t poll;
+    mesh_poll_get_stats(&poll);
+    metrics_value(w, "mesh_poll_total", "counter", "State polls sent", poll.polls);
+    metrics_value(w, "mesh_poll_answered_total", "counter", "State polls answered", poll.answered);
+    metrics_value(w, "mesh_poll_timeouts_total", "counter", "State polls without answer", poll.timeouts);
+    metrics_value(w, "mesh_poll_outstanding", "gauge", "State polls waiting for an answer", poll.outstanding);
+
+    mesh_persist_stats_t persist;
+    mesh_persist_get_stats(&persist);
+    metrics_value(w, "nvs_reads_total", "counter", "NVS reads", metrics_get(METRIC_NVS_READS));
+    metrics_value(w, "nvs_writes_total", "counter", "NVS writes", metrics_get(METRIC_NVS_WRITES));
+    metrics_value(w, "nvs_errors_total", "counter", "NVS reads and writes that failed", metrics_get(METRIC_NVS_ERRORS));
+    metrics_value(w, "mesh_state_changes_total", "counter", "Mesh client state changes (write-behind)", persist.marked);
+
+    metrics_header(w, "command_latency_seconds", "summary", "Command latency per stage");
+    for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+        metrics_latency(w, "", stage, -1);
+    }
+    for (int i = 0; i < MAX_LAMPS && !w->failed; i++) {
+        LampInfo lamp_info;
+        if (!lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        char name[80];
+        char labels[100];
+        metrics_label(name, sizeof(name), lamp_info.name);
+        snprintf(labels, sizeof(labels), "lamp=\"%s\",", name);
+        metrics_latency(w, labels, LATENCY_ACK, i);
+        metrics_latency(w, labels, LATENCY_TOTAL, i);
     }
 
-    // Copy lamp name
-    int lamp_name_len = lamp_name_end - lamp_name_start;
-    strncpy(lamp_name, lamp_name_start, lamp_name_len);
-    lamp_name[lamp_name_len] = '\0'; // Null-terminate the string
-    // Parse lamp address
-    const char *lamp_address_ptr = strstr(query, "lamp_address=");
-    if (lamp_address_ptr == NULL) {
-        ESP_LOGE(TAG, "lamp_address parameter not found in URI");
+    return chunk_end(w);
+}
+
+// JSON API under /api/lamps. Lamps are addressed by their topic slug, e.g.
+// /api/lamps/Living_Room; requests and answers use the GET object format.
+
+#define API_LAMPS_PATH "/api/lamps"
+
+// Function to write a string as a quoted JSON string
+static void chunk_put_json(chunk_writer_t *w, const char *str)
+{
+    chunk_puts(w, "\"");
+    const char *start = str;
+    for (; *str; str++) {
+        if (*str != '"' && *str != '\\' && (uint8_t)*str >= 0x20) {
+            continue;
+        }
+        chunk_write(w, start, str - start);
+        if (*str == '"' || *str == '\\') {
+            chunk_printf(w, "\\%c", *str);
+        } else {
+            chunk_printf(w, "\\u%04x", (uint8_t)*str);
+        }
+        start = str + 1;
+    }
+    chunk_write(w, start, str - start);
+    chunk_puts(w, "\"");
+}
+
+// Function to write a CSV field, quoted if it holds a comma or a quote
+static void chunk_put_csv(chunk_writer_t *w, const char *str)
+{
+    if (strpbrk(str, ",\"") == NULL) {
+        chunk_puts(w, str);
+        return;
+    }
+    chunk_puts(w, "\"");
+    for (const char *quote; (quote = strchr(str, '"')) != NULL; str = quote + 1) {
+        chunk_write(w, str, quote + 1 - str);
+        chunk_puts(w, "\"");
+    }
+    chunk_puts(w, str);
+    chunk_puts(w, "\"");
+}
+
+static void api_put_lamp(chunk_writer_t *w, int index, const LampInfo *lamp_info)
+{
+    chunk_printf(w, "{\"index\":%d,\"name\":", index);
+    chunk_put_json(w, lamp_info->name);
+    chunk_printf(w, ",\"address\":\"0x%04X\",\"acked\":%s,\"fade\":%s}", lamp_info->address,
+                 (lamp_info->flags & LAMP_FLAG_ACKED) ? "true" : "false",
+                 (lamp_info->flags & LAMP_FLAG_FADE) ? "true" : "false");
+}
+
+// Function to answer with a single lamp object
+static esp_err_t api_send_lamp(httpd_req_t *req, const char *status, int index, const LampInfo *lamp_info)
+{
+    char buf[PAGE_CHUNK_SIZE];
+    chunk_writer_t w = { .req = req, .buf = buf, .size = sizeof(buf) };
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "application/json");
+    api_put_lamp(&w, index, lamp_info);
+    chunk_puts(&w, "\n");
+    return chunk_end(&w);
+}
+
+// Function to answer with {"error":"..."}
+static esp_err_t api_send_error(httpd_req_t *req, const char *status, const char *message)
+{
+    char buf[PAGE_CHUNK_SIZE];
+    chunk_writer_t w = { .req = req, .buf = buf, .size = sizeof(buf) };
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "application/json");
+    chunk_puts(&w, "{\"error\":");
+    chunk_put_json(&w, message);
+    chunk_puts(&w, "}\n");
+    return chunk_end(&w);
+}
+
+// Function to get the part of the path after /api/lamps/ (without the query),
+// returns false for /api/lamps itself
+static bool api_lamp_slug(httpd_req_t *req, const char **slug, size_t *slug_len)
+{
+    const char *path = req->uri + strlen(API_LAMPS_PATH);
+    size_t len = strcspn(path, "?");
+    if (len > 0 && path[0] == '/') {
+        path++;
+        len--;
+    }
+    *slug = path;
+    *slug_len = len;
+    return len > 0;
+}
+
+// Function to find the lamp a request path names. On failure the error
+// response has already been sent.
+static int api_find_lamp(httpd_req_t *req, LampInfo *lamp_info)
+{
+    const char *slug;
+    size_t slug_len;
+    int index = -1;
+    if (api_lamp_slug(req, &slug, &slug_len)) {
+        index = lamp_registry_find_by_slug(slug, slug_len, lamp_info);
+    }
+    if (index < 0) {
+        api_send_error(req, HTTPD_404, "No lamp with this name");
+    }
+    return index;
+}
+
+// Function to receive and parse a lamp object. On failure the error response
+// has already been sent.
+static esp_err_t api_recv_lamp(httpd_req_t *req, LampInfo *lamp_info, uint8_t *fields)
+{
+    char content[LAMP_IMPORT_RECORD_MAX];
+    if (recv_form(req, content, sizeof(content)) != ESP_OK) {
         return ESP_FAIL;
     }
-    lamp_address_ptr += strlen("lamp_address=");  // Move pointer to the start of the address value
-    size_t address_length = strlen(lamp_address_ptr);  // Find the length of the address value until the end of the string
-    if (address_length >= sizeof(lamp_address)) {
-        ESP_LOGE(TAG, "lamp_address parameter value too long");
+    esp_err_t err = lamp_import_parse_json(content, strlen(content), lamp_info, fields);
+    if (err != ESP_OK) {
+        api_send_error(req, HTTPD_400, err == ESP_ERR_INVALID_SIZE ? "Name too long" : "Invalid lamp object");
         return ESP_FAIL;
     }
-    // Copy lamp address
-    strncpy(lamp_address, lamp_address_ptr, address_length);  // Copy the address value
-    lamp_address[address_length] = '\0';  // Null-terminate the address string
-
-    // Log the lamp name and address for debugging
-    ESP_LOGI(TAG, "Lamp Name: %s, Lamp Address: %s", lamp_name, lamp_address);
-    // Respond with a simple message for testing
-    // Generate HTML content for the edit lamp form
-    char edit_page[600];
-    snprintf(edit_page, sizeof(edit_page),
-             "<html><body>"
-             "<h1>Edit Lamp</h1>"
-             "<form action=\"/update_lamp\" method=\"post\">"
-             "<label for=\"lamp_name\">Lamp Name:</label>"
-             "<input type=\"text\" id=\"lamp_name\" name=\"lamp_name\" value=\"%s\"><br><br>"
-             "<label for=\"lamp_address\">Lamp Address:</label>"
-             "<input type=\"text\" id=\"lamp_address\" name=\"lamp_address\" value=\"%s\"><br><br>"
-             "<input type=\"submit\" value=\"Update Lamp\">"
-             "</form>"
-             "</body></html>",
-             lamp_name, lamp_address);
-
-    // Send HTTP response with the edit lamp form
-    httpd_resp_send(req, edit_page, strlen(edit_page));
+    return ESP_OK;
+}
 
+// Function to check and store a lamp from the API, then update HA. previous
+// is NULL for a new lamp. On failure the error response has already been sent.
+static esp_err_t api_save_lamp(httpd_req_t *req, int index, const LampInfo *previous, LampInfo *lamp_info)
+{
+    if (lamp_info->name[0] == '\0') {
+        api_send_error(req, HTTPD_400, "Missing name");
+        return ESP_FAIL;
+    }
+    if (lamp_info->address == 0) {
+        api_send_error(req, HTTPD_400, "Invalid lamp address");
+        return ESP_FAIL;
+    }
+    int other = lamp_registry_find_by_name(lamp_info->name, NULL);
+    if ((other >= 0 && other != index) || lamp_registry_group_find_by_name(lamp_info->name, NULL) >= 0) {
+        api_send_error(req, "409 Conflict", "A lamp or group with this name already exists");
+        return ESP_FAIL;
+    }
+    other = lamp_registry_find_by_addr(lamp_info->address, NULL);
+    if (other >= 0 && other != index) {
+        api_send_error(req, "409 Conflict", "Another lamp has this address");
+        return ESP_FAIL;
+    }
+    if (index < 0) {
+        api_send_error(req, "507 Insufficient Storage", "Lamp table is full");
+        return ESP_FAIL;
+    }
+    esp_err_t err = save_lamp_info(lamp_info, index);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save lamp info: %d", err);
+        if (err == ESP_ERR_NO_MEM) {
+            api_send_error(req, "507 Insufficient Storage", "No room left for lamp names");
+        } else {
+            api_send_error(req, HTTPD_500, "Failed to save lamp");
+        }
+        return ESP_FAIL;
+    }
+    // Same as the edit page: HA drops the old entity before it gets the new config
+    bool changed = previous == NULL || strcmp(previous->name, lamp_info->name) != 0 ||
+                   previous->address != lamp_info->address;
+    if (previous && changed) {
+        char config_topic[100];
+        mqtt_lamp_topic(config_topic, sizeof(config_topic), previous, "config");
+        bridge_remove_discovery(index, config_topic);
+    }
+    if (changed) {
+        bridge_announce(index);
+    }
     return ESP_OK;
 }
 
+// Function to answer with every lamp as a JSON array or CSV. Streamed like
+// the overview page, the output grows with the lamp table.
+static esp_err_t api_send_lamps(httpd_req_t *req, bool csv)
+{
+    LampInfo lamp_info;
+    char buf[PAGE_CHUNK_SIZE];
+    chunk_writer_t w = { .req = req, .buf = buf, .size = sizeof(buf) };
+    httpd_resp_set_type(req, csv ? "text/csv" : "application/json");
+    chunk_puts(&w, csv ? "name,address,acked,fade\n" : "[");
+    bool first = true;
+    for (int i = 0; i < MAX_LAMPS && !w.failed; i++) {
+        if (!lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        if (csv) {
+            chunk_put_csv(&w, lamp_info.name);
+            chunk_printf(&w, ",0x%04X,%d,%d\n", lamp_info.address, (lamp_info.flags & LAMP_FLAG_ACKED) ? 1 : 0,
+                         (lamp_info.flags & LAMP_FLAG_FADE) ? 1 : 0);
+        } else {
+            chunk_puts(&w, first ? "\n" : ",\n");
+            api_put_lamp(&w, i, &lamp_info);
+        }
+        first = false;
+    }
+    if (!csv) {
+        chunk_puts(&w, "\n]\n");
+    }
+    return chunk_end(&w);
+}
 
-esp_err_t update_lamp_post_handler(httpd_req_t *req)
+// HTTP GET handler for /api/lamps (all lamps, JSON or ?format=csv) and /api/lamps/<slug>
+esp_err_t api_lamps_get_handler(httpd_req_t *req)
 {
-    char content[100];
-    int ret, remaining = req->content_len;
+    const char *slug;
+    size_t slug_len;
+    LampInfo lamp_info;
+    if (api_lamp_slug(req, &slug, &slug_len)) {
+        int index = api_find_lamp(req, &lamp_info);
+        return index < 0 ? ESP_OK : api_send_lamp(req, HTTPD_200, index, &lamp_info);
+    }
 
-    if (remaining > sizeof(content)) {
-        httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, "Content too long");
-        return ESP_OK;
+    char query[32];
+    char format[8] = "";
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        httpd_query_key_value(query, "format", format, sizeof(format));
     }
+    return api_send_lamps(req, strcmp(format, "csv") == 0);
+}
 
-    while (remaining > 0) {
-        if ((ret = httpd_req_recv(req, content, MIN(remaining, sizeof(content)))) <= 0) {
+// HTTP GET handler for the old /get_lamps, the same JSON array as /api/lamps
+esp_err_t get_lamps_handler(httpd_req_t *req)
+{
+    return api_send_lamps(req, false);
+}
+
+// Handler for POST /api/lamps/import: the body is parsed while it is
+// received and stored in one batch, see lamp_import.h
+static esp_err_t api_lamps_import(httpd_req_t *req)
+{
+    char query[32];
+    char replace[4] = "";
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+        httpd_query_key_value(query, "replace", replace, sizeof(replace));
+    }
+    lamp_import_t *import = lamp_import_begin(req->content_len, strcmp(replace, "1") == 0);
+    if (import == NULL) {
+        return api_send_error(req, HTTPD_500, "No memory for the import");
+    }
+
+    char buf[PAGE_CHUNK_SIZE];
+    int ret, remaining = req->content_len;
+    esp_err_t err = ESP_OK;
+    while (remaining > 0 && err == ESP_OK) {
+        if ((ret = httpd_req_recv(req, buf, MIN(remaining, sizeof(buf)))) <= 0) {
             if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
                 continue;
             }
+            lamp_import_free(import);
             httpd_resp_send_500(req);
             return ESP_FAIL;
         }
         remaining -= ret;
-
-        // Parse received data to get lamp name and address to update
-        char lamp_name[50];
-        char lamp_address_str[8];
-        sscanf(content, "lamp_name=%[^&]&lamp_address=%6s", lamp_name, lamp_address_str);
-
-        // Add your logic here to update the lamp
-        ESP_LOGI(TAG, "Lamp Name: %s", lamp_name);
-        ESP_LOGI(TAG, "Lamp Address: %s", lamp_address_str);
-        
-        // Find the index of the lamp to be updated
-        int index_to_update = find_index_by_name_or_address(lamp_name, lamp_address_str);
-        if (index_to_update >= 0) {
-            // Perform the update operation, such as updating lamp information in NVS or elsewhere
-            // For example:
-            LampInfo updated_lamp;
-            strncpy(updated_lamp.name, lamp_name, sizeof(updated_lamp.name));
-            strncpy(updated_lamp.address, lamp_address_str, sizeof(updated_lamp.address));
-            esp_err_t err = save_lamp_info(&updated_lamp, index_to_update);
-            if (err == ESP_OK) {
-                 ESP_LOGI(TAG, "Lamp updated successfully");
-                 // Send a response indicating success
-                 const char* resp_str =
-                    "<html><head>"
-                    "<script>window.location.replace('/');</script>"
-                    "</head></html>";
-
-                httpd_resp_send(req, resp_str, strlen(resp_str));
-             } else {
-                 ESP_LOGE(TAG, "Failed to update lamp: %d", err);
-                 // Send a response indicating failure
-                 httpd_resp_sendstr(req, "Failed to update lamp");
-             }
-        } else {
-            // If the lamp to be updated is not found, send a response indicating failure
-            ESP_LOGE(TAG, "Lamp not found for update");
-            httpd_resp_sendstr(req, "Lamp not found for update");
-        }
+        err = lamp_import_feed(import, buf, ret);
+    }
+    if (err == ESP_OK) {
+        err = lamp_import_finish(import);
+    }
+    lamp_import_stats_t stats;
+    if (err == ESP_OK) {
+        err = lamp_import_commit(import, &stats);
     }
 
-    // Send a response indicating success after processing all received data
-    httpd_resp_sendstr(req, "Update operation completed successfully");
+    if (err != ESP_OK) {
+        const char *status = err == ESP_ERR_INVALID_ARG ? HTTPD_400 :
+                             err == ESP_ERR_INVALID_STATE ? "409 Conflict" :
+                             err == ESP_ERR_NO_MEM ? "507 Insufficient Storage" : HTTPD_500;
+        api_send_error(req, status, lamp_import_error(import));
+    } else {
+        char body[100];
+        snprintf(body, sizeof(body), "{\"added\":%d,\"updated\":%d,\"unchanged\":%d,\"removed\":%d}\n",
+                 stats.added, stats.updated, stats.unchanged, stats.removed);
+        httpd_resp_set_type(req, "application/json");
+        httpd_resp_sendstr(req, body);
+    }
+    lamp_import_free(import);
     return ESP_OK;
 }
 
-esp_err_t restart_handler(httpd_req_t *req) {
-    // Send response to the client
-    const char* resp_str = "ESP32 is restarting...";
-    httpd_resp_send(req, resp_str, strlen(resp_str));
+// HTTP POST handler for /api/lamps (add a lamp) and /api/lamps/import
+esp_err_t api_lamps_post_handler(httpd_req_t *req)
+{
+    const char *slug;
+    size_t slug_len;
+    if (api_lamp_slug(req, &slug, &slug_len)) {
+        if (slug_len == strlen("import") && strncmp(slug, "import", slug_len) == 0) {
+            return api_lamps_import(req);
+        }
+        return api_send_error(req, "405 Method Not Allowed", "Use PUT to change a lamp");
+    }
 
-    // Delay to ensure the response is sent before the restart
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    LampInfo lamp_info;
+    uint8_t fields;
+    if (api_recv_lamp(req, &lamp_info, &fields) != ESP_OK) {
+        return ESP_OK;
+    }
+    if (!(fields & LAMP_FIELD_ADDRESS)) {
+        return api_send_error(req, HTTPD_400, "Missing address");
+    }
+    int index = lamp_registry_next_free();
+    if (api_save_lamp(req, index, NULL, &lamp_info) == ESP_OK) {
+        api_send_lamp(req, "201 Created", index, &lamp_info);
+    }
+    return ESP_OK;
+}
 
-    // Restart the ESP32
-    esp_restart();
+// HTTP PUT handler for /api/lamps/<slug>: fields missing from the body keep their value
+esp_err_t api_lamps_put_handler(httpd_req_t *req)
+{
+    LampInfo previous;
+    int index = api_find_lamp(req, &previous);
+    if (index < 0) {
+        return ESP_OK;
+    }
+    LampInfo update;
+    uint8_t fields;
+    if (api_recv_lamp(req, &update, &fields) != ESP_OK) {
+        return ESP_OK;
+    }
+    LampInfo lamp_info = previous;
+    if (fields & LAMP_FIELD_NAME) {
+        strcpy(lamp_info.name, update.name);
+    }
+    if (fields & LAMP_FIELD_ADDRESS) {
+        lamp_info.address = update.address;
+    }
+    if (fields & LAMP_FIELD_ACKED) {
+        lamp_info.flags = (lamp_info.flags & ~LAMP_FLAG_ACKED) | (update.flags & LAMP_FLAG_ACKED);
+    }
+    if (fields & LAMP_FIELD_FADE) {
+        lamp_info.flags = (lamp_info.flags & ~LAMP_FLAG_FADE) | (update.flags & LAMP_FLAG_FADE);
+    }
+    if (api_save_lamp(req, index, &previous, &lamp_info) == ESP_OK) {
+        api_send_lamp(req, HTTPD_200, index, &lamp_info);
+    }
+    return ESP_OK;
+}
 
+// HTTP DELETE handler for /api/lamps/<slug>
+esp_err_t api_lamps_delete_handler(httpd_req_t *req)
+{
+    LampInfo removed;
+    int index = api_find_lamp(req, &removed);
+    if (index < 0) {
+        return ESP_OK;
+    }
+    esp_err_t err = remove_lamp_info(index);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to remove lamp: %d", err);
+        return api_send_error(req, HTTPD_500, "Failed to remove lamp");
+    }
+    char config_topic[100];
+    mqtt_lamp_topic(config_topic, sizeof(config_topic), &removed, "config");
+    bridge_remove_discovery(index, config_topic);
+    httpd_resp_set_status(req, HTTPD_204);
+    httpd_resp_send(req, NULL, 0);
     return ESP_OK;
 }
 
@@ -433,6 +1260,61 @@ httpd_uri_t restart_uri = {
     .handler   = restart_handler,
     .user_ctx  = NULL
 };
+httpd_uri_t add_group_get_uri = {
+    .uri       = "/add_group_page",
+    .method    = HTTP_GET,
+    .handler   = add_group_get_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t add_group_uri = {
+    .uri       = "/add_group",
+    .method    = HTTP_POST,
+    .handler   = add_group_post_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t remove_group_uri = {
+    .uri       = "/remove_group",
+    .method    = HTTP_POST,
+    .handler   = remove_group_post_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t latency_uri = {
+    .uri       = "/latency",
+    .method    = HTTP_GET,
+    .handler   = latency_get_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t metrics_uri = {
+    .uri       = "/metrics",
+    .method    = HTTP_GET,
+    .handler   = metrics_get_handler,
+    .user_ctx  = NULL
+};
+// The lamp API: "/?*" also matches /api/lamps itself (httpd_uri_match_wildcard)
+httpd_uri_t api_lamps_get_uri = {
+    .uri       = API_LAMPS_PATH "/?*",
+    .method    = HTTP_GET,
+    .handler   = api_lamps_get_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t api_lamps_post_uri = {
+    .uri       = API_LAMPS_PATH "/?*",
+    .method    = HTTP_POST,
+    .handler   = api_lamps_post_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t api_lamps_put_uri = {
+    .uri       = API_LAMPS_PATH "/*",
+    .method    = HTTP_PUT,
+    .handler   = api_lamps_put_handler,
+    .user_ctx  = NULL
+};
+httpd_uri_t api_lamps_delete_uri = {
+    .uri       = API_LAMPS_PATH "/*",
+    .method    = HTTP_DELETE,
+    .handler   = api_lamps_delete_handler,
+    .user_ctx  = NULL
+};
 // Add overview_uri as the default URI handler
 httpd_uri_t default_uri = {
     .uri       = "/",
@@ -445,6 +1327,10 @@ httpd_handle_t start_webserver(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     httpd_handle_t server = NULL;
+    // The default of 8 handlers is already used by the lamp pages
+    config.max_uri_handlers = 20;
+    // For the /api/lamps/<slug> paths; the other URIs have no wildcard and still match exactly
+    config.uri_match_fn = httpd_uri_match_wildcard;
 
     // Start the httpd server
     if (httpd_start(&server, &config) == ESP_OK) {
@@ -457,7 +1343,15 @@ httpd_handle_t start_webserver(void)
         httpd_register_uri_handler(server, &default_uri);
         httpd_register_uri_handler(server, &edit_lamp_uri);
         httpd_register_uri_handler(server, &update_lamp_post_uri);
-        
+        httpd_register_uri_handler(server, &add_group_get_uri);
+        httpd_register_uri_handler(server, &add_group_uri);
+        httpd_register_uri_handler(server, &remove_group_uri);
+        httpd_register_uri_handler(server, &latency_uri);
+        httpd_register_uri_handler(server, &metrics_uri);
+        httpd_register_uri_handler(server, &api_lamps_get_uri);
+        httpd_register_uri_handler(server, &api_lamps_post_uri);
+        httpd_register_uri_handler(server, &api_lamps_put_uri);
+        httpd_register_uri_handler(server, &api_lamps_delete_uri);
     }
 
     // Return the server handle
@@ -0,0 +1,931 @@
+#include "lamp_import.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "esp_log.h"
+
+#include "bridge.h"
+#include "lamp_registry.h"
+#include "mqtt_router.h"
+
+#define TAG "LAMP_IMPORT"
+
+#define LAMP_NAME_SIZE sizeof(((LampInfo *)0)->name)
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+typedef enum {
+    ITEM_NEW,
+    ITEM_UPDATE,
+    ITEM_SAME,          /* Already stored like this, not written again */
+    ITEM_REMOVE,        /* Missing from a replace import */
+} import_item_kind_t;
+
+// One staged lamp; the names are stored back to back in lamp_import.names
+typedef struct {
+    uint32_t slug_hash;
+    uint32_t name_off;
+    int16_t index;          /* Target slot, -1 for new lamps until lamp_import_finish() */
+    uint16_t address;
+    uint16_t prev_address;  /* ITEM_UPDATE */
+    uint8_t name_len;
+    uint8_t flags;          /* LAMP_FLAG_* */
+    uint8_t kind;           /* import_item_kind_t */
+} import_item_t;
+
+typedef enum {
+    FORMAT_UNKNOWN,
+    FORMAT_JSON,
+    FORMAT_CSV,
+} import_format_t;
+
+// Where the JSON scanner is in the outer array
+typedef enum {
+    JSON_OPEN,          /* Before the '[' */
+    JSON_FIRST,         /* After '[': an object or ']' */
+    JSON_VALUE,         /* After ',': an object */
+    JSON_OBJECT,        /* Inside an object, collected into record */
+    JSON_NEXT,          /* After an object: ',' or ']' */
+    JSON_DONE,          /* After ']': only whitespace */
+} json_state_t;
+
+struct lamp_import {
+    bool replace;
+    bool failed;
+    esp_err_t err;
+    uint8_t format;         /* import_format_t */
+    uint8_t json_state;     /* json_state_t */
+    bool in_string;
+    bool escape;
+    int depth;
+    int records;            /* JSON objects or CSV lines seen so far */
+    bool header_checked;
+    char record[LAMP_IMPORT_RECORD_MAX];
+    size_t record_len;
+
+    import_item_t *items;
+    int count;
+    int capacity;
+    int16_t *by_address;    /* Open addressing index of the body's lamps by address, -1 if empty */
+    int16_t *by_slug;       /* The same by slug_hash */
+    uint32_t hash_mask;     /* Index size - 1; the indexes are at most half full */
+    int edits;              /* Items that change something, sorted to the front on commit */
+    char *names;
+    size_t names_len;
+    size_t names_limit;     /* For the lamps of the body, the rest is for removed lamps */
+    size_t names_size;
+    uint32_t targets[GROUP_MEMBER_WORDS];   /* Slots the import writes */
+    char error[120];
+};
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Function to stop the import with an error; the message gets the record number
+static void import_fail(lamp_import_t *imp, esp_err_t err, const char *fmt, ...)
+{
+    int len = 0;
+    if (imp->records > 0) {
+        len = snprintf(imp->error, sizeof(imp->error), "%s %d: ",
+                       imp->format == FORMAT_CSV ? "Line" : "Record", imp->records);
+    }
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(imp->error + len, sizeof(imp->error) - len, fmt, args);
+    va_end(args);
+    imp->failed = true;
+    imp->err = err;
+    ESP_LOGW(TAG, "Import failed: %s", imp->error);
+}
+
+static bool target_has(const lamp_import_t *imp, int index)
+{
+    return (imp->targets[index / 32] >> (index % 32)) & 1;
+}
+
+static void target_set(lamp_import_t *imp, int index)
+{
+    imp->targets[index / 32] |= 1u << (index % 32);
+}
+
+// Function to copy the name of a staged lamp into a LampInfo
+static void item_to_info(const lamp_import_t *imp, const import_item_t *item, LampInfo *lamp_info)
+{
+    memcpy(lamp_info->name, imp->names + item->name_off, item->name_len);
+    lamp_info->name[item->name_len] = '\0';
+    lamp_info->address = item->address;
+    lamp_info->flags = item->flags;
+}
+
+// FNV-1a of the topic slug of a name, to find duplicates without comparing every pair of names
+static uint32_t slug_hash(const char *slug)
+{
+    uint32_t h = 2166136261u;
+    for (; *slug; slug++) {
+        h ^= (uint8_t)*slug;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_slot(const lamp_import_t *imp, uint32_t key)
+{
+    return ((key * 2654435761u) >> 16) & imp->hash_mask;
+}
+
+// Function to find the index entry of the staged lamp with an address, or the
+// empty entry for it
+static int16_t *find_address(lamp_import_t *imp, uint16_t address)
+{
+    for (uint32_t h = hash_slot(imp, address);; h = (h + 1) & imp->hash_mask) {
+        int16_t *entry = &imp->by_address[h];
+        if (*entry < 0 || imp->items[*entry].address == address) {
+            return entry;
+        }
+    }
+}
+
+// Function to find the index entry of the staged lamp with a slug, or the
+// empty entry for it
+static int16_t *find_slug(lamp_import_t *imp, const char *slug, uint32_t hash)
+{
+    for (uint32_t h = hash_slot(imp, hash);; h = (h + 1) & imp->hash_mask) {
+        int16_t *entry = &imp->by_slug[h];
+        if (*entry < 0) {
+            return entry;
+        }
+        const import_item_t *other = &imp->items[*entry];
+        if (other->slug_hash == hash) {
+            LampInfo other_info;
+            char other_slug[LAMP_NAME_SIZE];
+            item_to_info(imp, other, &other_info);
+            lamp_slugify(other_info.name, other_slug, sizeof(other_slug));
+            if (strcmp(slug, other_slug) == 0) {
+                return entry;
+            }
+        }
+    }
+}
+
+// Function to check and stage one lamp of the body
+static void stage_lamp(lamp_import_t *imp, const LampInfo *lamp_info)
+{
+    size_t len = strlen(lamp_info->name);
+    if (len == 0) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "missing name");
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if ((uint8_t)lamp_info->name[i] < 0x20) {
+            import_fail(imp, ESP_ERR_INVALID_ARG, "control character in name");
+            return;
+        }
+    }
+    if (lamp_info->address == 0) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "invalid address for %s", lamp_info->name);
+        return;
+    }
+    if (imp->count >= MAX_LAMPS) {
+        import_fail(imp, ESP_ERR_NO_MEM, "more than %d lamps", MAX_LAMPS);
+        return;
+    }
+    if (imp->names_len + len > imp->names_limit) {
+        import_fail(imp, ESP_ERR_NO_MEM, "no room left for lamp names");
+        return;
+    }
+    if (lamp_registry_group_find_by_name(lamp_info->name, NULL) >= 0) {
+        import_fail(imp, ESP_ERR_INVALID_STATE, "%s is the name of a group", lamp_info->name);
+        return;
+    }
+
+    char slug[LAMP_NAME_SIZE];
+    lamp_slugify(lamp_info->name, slug, sizeof(slug));
+    uint32_t hash = slug_hash(slug);
+    int16_t *by_address = find_address(imp, lamp_info->address);
+    if (*by_address >= 0) {
+        import_fail(imp, ESP_ERR_INVALID_STATE, "address 0x%04X is listed twice", lamp_info->address);
+        return;
+    }
+    int16_t *by_slug = find_slug(imp, slug, hash);
+    if (*by_slug >= 0) {
+        import_fail(imp, ESP_ERR_INVALID_STATE, "%s is listed twice", lamp_info->name);
+        return;
+    }
+
+    import_item_t *item = &imp->items[imp->count];
+    *item = (import_item_t) {
+        .slug_hash = hash,
+        .name_off = imp->names_len,
+        .index = -1,
+        .address = lamp_info->address,
+        .name_len = len,
+        .flags = lamp_info->flags,
+        .kind = ITEM_NEW,
+    };
+    LampInfo existing;
+    int index = lamp_registry_find_by_slug(slug, strlen(slug), &existing);
+    if (index >= 0) {
+        item->index = index;
+        item->prev_address = existing.address;
+        bool same = strcmp(existing.name, lamp_info->name) == 0 &&
+                    existing.address == lamp_info->address && existing.flags == lamp_info->flags;
+        item->kind = same ? ITEM_SAME : ITEM_UPDATE;
+        target_set(imp, index);
+    }
+    memcpy(imp->names + imp->names_len, lamp_info->name, len);
+    imp->names_len += len;
+    *by_address = imp->count;
+    *by_slug = imp->count;
+    imp->count++;
+}
+
+typedef struct {
+    const char *p;
+    const char *end;
+} json_cursor_t;
+
+typedef enum {
+    STRING_OK,
+    STRING_TOO_LONG,    /* Valid, but did not fit (still consumed) */
+    STRING_BAD,
+} string_result_t;
+
+static void skip_ws(json_cursor_t *c)
+{
+    while (c->p < c->end && is_space(*c->p)) {
+        c->p++;
+    }
+}
+
+static bool consume(json_cursor_t *c, char ch)
+{
+    skip_ws(c);
+    if (c->p < c->end && *c->p == ch) {
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// Function to append a decoded character to a string value, if it fits
+static void string_put(char *out, size_t size, size_t *len, const char *bytes, size_t n)
+{
+    if (out && *len + n < size) {
+        memcpy(out + *len, bytes, n);
+    }
+    *len += n;
+}
+
+// Function to parse a string value into out (NUL-terminated, out may be NULL
+// to skip it). Escapes are decoded, \u escapes to UTF-8; control characters
+// and surrogate pairs are not accepted.
+static string_result_t parse_string(json_cursor_t *c, char *out, size_t size)
+{
+    size_t len = 0;
+    if (!consume(c, '"')) {
+        return STRING_BAD;
+    }
+    while (c->p < c->end) {
+        char ch = *c->p++;
+        if (ch == '"') {
+            if (out && size > 0) {
+                out[MIN(len, size - 1)] = '\0';
+            }
+            return (out && len >= size) ? STRING_TOO_LONG : STRING_OK;
+        }
+        if ((uint8_t)ch < 0x20) {
+            return STRING_BAD;
+        }
+        if (ch != '\\') {
+            string_put(out, size, &len, &ch, 1);
+            continue;
+        }
+        if (c->p >= c->end) {
+            return STRING_BAD;
+        }
+        char esc = *c->p++;
+        if (esc == '"' || esc == '\\' || esc == '/') {
+            string_put(out, size, &len, &esc, 1);
+        } else if (esc == 'u') {
+            if (c->end - c->p < 4) {
+                return STRING_BAD;
+            }
+            uint32_t cp = 0;
+            for (int i = 0; i < 4; i++) {
+                int v = hex_value(*c->p++);
+                if (v < 0) {
+                    return STRING_BAD;
+                }
+                cp = cp << 4 | v;
+            }
+            if (cp < 0x20 || (cp >= 0xD800 && cp <= 0xDFFF)) {
+                return STRING_BAD;
+            }
+            char utf8[3];
+            size_t n;
+            if (cp < 0x80) {
+                utf8[0] = cp;
+                n = 1;
+            } else if (cp < 0x800) {
+                utf8[0] = 0xC0 | (cp >> 6);
+                utf8[1] = 0x80 | (cp & 0x3F);
+                n = 2;
+            } else {
+                utf8[0] = 0xE0 | (cp >> 12);
+                utf8[1] = 0x80 | ((cp >> 6) & 0x3F);
+                utf8[2] = 0x80 | (cp & 0x3F);
+                n = 3;
+            }
+            string_put(out, size, &len, utf8, n);
+        } else {
+            // \b \f \n \r \t would put control characters into a name
+            return STRING_BAD;
+        }
+    }
+    return STRING_BAD;
+}
+
+// Function to skip a value of an unknown key
+static bool skip_value(json_cursor_t *c)
+{
+    skip_ws(c);
+    if (c->p >= c->end) {
+        return false;
+    }
+    if (*c->p == '"') {
+        return parse_string(c, NULL, 0) == STRING_OK;
+    }
+    if (*c->p == '{' || *c->p == '[') {
+        int depth = 0;
+        do {
+            char ch = *c->p;
+            if (ch == '"') {
+                if (parse_string(c, NULL, 0) != STRING_OK) {
+                    return false;
+                }
+                continue;
+            }
+            if (ch == '{' || ch == '[') {
+                depth++;
+            } else if (ch == '}' || ch == ']') {
+                depth--;
+            }
+            c->p++;
+        } while (depth > 0 && c->p < c->end);
+        return depth == 0;
+    }
+    // Number or literal
+    const char *start = c->p;
+    while (c->p < c->end && !is_space(*c->p) && *c->p != ',' && *c->p != '}' && *c->p != ']') {
+        c->p++;
+    }
+    return c->p > start;
+}
+
+// Function to parse a literal (true, false) at the cursor
+static bool parse_literal(json_cursor_t *c, const char *literal)
+{
+    size_t len = strlen(literal);
+    skip_ws(c);
+    if ((size_t)(c->end - c->p) < len || memcmp(c->p, literal, len) != 0) {
+        return false;
+    }
+    c->p += len;
+    return true;
+}
+
+// Function to parse an address, a string like "0x0013" or a plain number
+static bool parse_address(json_cursor_t *c, uint16_t *address)
+{
+    skip_ws(c);
+    if (c->p < c->end && *c->p == '"') {
+        char str[12];
+        string_result_t res = parse_string(c, str, sizeof(str));
+        if (res == STRING_BAD) {
+            return false;
+        }
+        *address = res == STRING_OK ? lamp_parse_address(str) : 0;
+        return true;
+    }
+    uint32_t value = 0;
+    const char *start = c->p;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+        value = value * 10 + (*c->p++ - '0');
+        if (value > 0xFFFF) {
+            value = 0x10000;
+        }
+    }
+    if (c->p == start) {
+        return false;
+    }
+    *address = value <= 0xFFFF ? value : 0;
+    return true;
+}
+
+esp_err_t lamp_import_parse_json(const char *data, size_t len, LampInfo *lamp_info, uint8_t *fields)
+{
+    json_cursor_t c = { .p = data, .end = data + len };
+    memset(lamp_info, 0, sizeof(*lamp_info));
+    *fields = 0;
+
+    if (!consume(&c, '{')) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!consume(&c, '}')) {
+        do {
+            char key[16];
+            string_result_t res = parse_string(&c, key, sizeof(key));
+            if (res == STRING_BAD || !consume(&c, ':')) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            if (res == STRING_OK && strcmp(key, "name") == 0) {
+                res = parse_string(&c, lamp_info->name, sizeof(lamp_info->name));
+                if (res != STRING_OK) {
+                    return res == STRING_TOO_LONG ? ESP_ERR_INVALID_SIZE : ESP_ERR_INVALID_ARG;
+                }
+                *fields |= LAMP_FIELD_NAME;
+            } else if (res == STRING_OK && strcmp(key, "address") == 0) {
+                if (!parse_address(&c, &lamp_info->address)) {
+                    return ESP_ERR_INVALID_ARG;
+                }
+                *fields |= LAMP_FIELD_ADDRESS;
+            } else if (res == STRING_OK && strcmp(key, "acked") == 0) {
+                if (parse_literal(&c, "true")) {
+                    lamp_info->flags |= LAMP_FLAG_ACKED;
+                } else if (!parse_literal(&c, "false")) {
+                    return ESP_ERR_INVALID_ARG;
+                }
+                *fields |= LAMP_FIELD_ACKED;
+            } else if (res == STRING_OK && strcmp(key, "fade") == 0) {
+                if (parse_literal(&c, "true")) {
+                    lamp_info->flags |= LAMP_FLAG_FADE;
+                } else if (!parse_literal(&c, "false")) {
+                    return ESP_ERR_INVALID_ARG;
+                }
+                *fields |= LAMP_FIELD_FADE;
+            } else if (!skip_value(&c)) {
+                return ESP_ERR_INVALID_ARG;
+            }
+        } while (consume(&c, ','));
+        if (!consume(&c, '}')) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    skip_ws(&c);
+    return c.p == c.end ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static void record_put(lamp_import_t *imp, char c)
+{
+    if (imp->record_len >= sizeof(imp->record) - 1) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "longer than %d bytes", LAMP_IMPORT_RECORD_MAX - 1);
+        return;
+    }
+    imp->record[imp->record_len++] = c;
+}
+
+// Function to stage the JSON object collected in record
+static void json_record(lamp_import_t *imp)
+{
+    LampInfo lamp_info;
+    uint8_t fields;
+    esp_err_t err = lamp_import_parse_json(imp->record, imp->record_len, &lamp_info, &fields);
+    if (err != ESP_OK) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, err == ESP_ERR_INVALID_SIZE ? "name too long" : "invalid lamp object");
+        return;
+    }
+    if (!(fields & LAMP_FIELD_ADDRESS)) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "missing address");
+        return;
+    }
+    stage_lamp(imp, &lamp_info);
+}
+
+// Function to scan one character of a JSON array; the objects are collected
+// in record one at a time and parsed when they are complete
+static void json_feed(lamp_import_t *imp, char c)
+{
+    switch (imp->json_state) {
+    case JSON_OPEN:
+        // The format was detected on the '['
+        imp->json_state = JSON_FIRST;
+        break;
+    case JSON_FIRST:
+    case JSON_VALUE:
+        if (is_space(c)) {
+            break;
+        }
+        if (c == ']' && imp->json_state == JSON_FIRST) {
+            imp->json_state = JSON_DONE;
+        } else if (c == '{') {
+            imp->records++;
+            imp->record_len = 0;
+            imp->depth = 1;
+            imp->in_string = false;
+            imp->escape = false;
+            imp->json_state = JSON_OBJECT;
+            record_put(imp, c);
+        } else {
+            imp->records++;
+            import_fail(imp, ESP_ERR_INVALID_ARG, "expected a lamp object");
+        }
+        break;
+    case JSON_OBJECT:
+        record_put(imp, c);
+        if (imp->in_string) {
+            if (imp->escape) {
+                imp->escape = false;
+            } else if (c == '\\') {
+                imp->escape = true;
+            } else if (c == '"') {
+                imp->in_string = false;
+            }
+        } else if (c == '"') {
+            imp->in_string = true;
+        } else if (c == '{' || c == '[') {
+            imp->depth++;
+        } else if ((c == '}' || c == ']') && --imp->depth == 0) {
+            imp->json_state = JSON_NEXT;
+            json_record(imp);
+        }
+        break;
+    case JSON_NEXT:
+        if (c == ',') {
+            imp->json_state = JSON_VALUE;
+        } else if (c == ']') {
+            imp->json_state = JSON_DONE;
+        } else if (!is_space(c)) {
+            import_fail(imp, ESP_ERR_INVALID_ARG, "expected ',' or ']' after the object");
+        }
+        break;
+    case JSON_DONE:
+        if (!is_space(c)) {
+            imp->records = 0;
+            import_fail(imp, ESP_ERR_INVALID_ARG, "Data after the end of the array");
+        }
+        break;
+    }
+}
+
+// Function to split a CSV line into fields in place. Fields may be quoted to
+// hold commas, with "" for a quote. Returns the number of fields or -1.
+static int csv_split(char *line, char **fields, int max)
+{
+    int count = 0;
+    char *p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (count == max) {
+            return -1;
+        }
+        char *out = p;
+        fields[count++] = out;
+        if (*p == '"') {
+            p++;
+            for (;;) {
+                if (*p == '\0') {
+                    return -1;
+                }
+                if (*p == '"' && p[1] == '"') {
+                    *out++ = '"';
+                    p += 2;
+                } else if (*p == '"') {
+                    p++;
+                    break;
+                } else {
+                    *out++ = *p++;
+                }
+            }
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if (*p != ',' && *p != '\0') {
+                return -1;
+            }
+        } else {
+            while (*p != ',' && *p != '\0') {
+                p++;
+            }
+            out = p;
+            while (out > fields[count - 1] && (out[-1] == ' ' || out[-1] == '\t')) {
+                out--;
+            }
+        }
+        bool last = *p == '\0';
+        *out = '\0';
+        if (last) {
+            return count;
+        }
+        p++;
+    }
+}
+
+// Function to parse the acked and fade columns: empty, 0/1, false/true or no/yes
+static bool csv_flag(const char *value, bool *flag)
+{
+    static const char *const on[] = { "1", "true", "yes" };
+    static const char *const off[] = { "", "0", "false", "no" };
+    for (int i = 0; i < sizeof(on) / sizeof(on[0]); i++) {
+        if (strcasecmp(value, on[i]) == 0) {
+            *flag = true;
+            return true;
+        }
+    }
+    for (int i = 0; i < sizeof(off) / sizeof(off[0]); i++) {
+        if (strcasecmp(value, off[i]) == 0) {
+            *flag = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to stage the CSV line collected in record
+static void csv_record(lamp_import_t *imp)
+{
+    imp->records++;
+    if (imp->record_len > 0 && imp->record[imp->record_len - 1] == '\r') {
+        imp->record_len--;
+    }
+    imp->record[imp->record_len] = '\0';
+    imp->record_len = 0;
+
+    char *p = imp->record;
+    while (is_space(*p)) {
+        p++;
+    }
+    if (*p == '\0') {
+        return;
+    }
+    char *fields[4];
+    int count = csv_split(p, fields, 4);
+    bool header = !imp->header_checked && count >= 1 && strcasecmp(fields[0], "name") == 0;
+    imp->header_checked = true;
+    if (header) {
+        return;
+    }
+    if (count < 2) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "expected name,address[,acked[,fade]]");
+        return;
+    }
+    LampInfo lamp_info = { .address = lamp_parse_address(fields[1]) };
+    if (strlen(fields[0]) >= sizeof(lamp_info.name)) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "name too long");
+        return;
+    }
+    strcpy(lamp_info.name, fields[0]);
+    bool acked = false;
+    bool fade = false;
+    if (count >= 3 && !csv_flag(fields[2], &acked)) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "acked must be 0/1, true/false or yes/no");
+        return;
+    }
+    if (count == 4 && !csv_flag(fields[3], &fade)) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "fade must be 0/1, true/false or yes/no");
+        return;
+    }
+    if (acked) {
+        lamp_info.flags |= LAMP_FLAG_ACKED;
+    }
+    if (fade) {
+        lamp_info.flags |= LAMP_FLAG_FADE;
+    }
+    stage_lamp(imp, &lamp_info);
+}
+
+static void csv_feed(lamp_import_t *imp, char c)
+{
+    if (c == '\n') {
+        csv_record(imp);
+    } else {
+        record_put(imp, c);
+    }
+}
+
+lamp_import_t *lamp_import_begin(size_t content_len, bool replace)
+{
+    // Removed lamps are staged too (for their discovery configs), with their names
+    int capacity = MAX_LAMPS + (replace ? lamp_registry_count() : 0);
+    size_t names_limit = MIN(content_len, LAMP_NAME_POOL_SIZE);
+    size_t names_size = names_limit + (replace ? lamp_registry_name_bytes(NULL) : 0);
+    // The body has at most MAX_LAMPS lamps
+    uint32_t hash_size = 1;
+    while (hash_size < 2 * MAX_LAMPS) {
+        hash_size *= 2;
+    }
+
+    lamp_import_t *imp = malloc(sizeof(*imp) + capacity * sizeof(import_item_t) +
+                                2 * hash_size * sizeof(int16_t) + names_size);
+    if (imp == NULL) {
+        ESP_LOGE(TAG, "No memory to import %u bytes", (unsigned)content_len);
+        return NULL;
+    }
+    memset(imp, 0, sizeof(*imp));
+    imp->replace = replace;
+    imp->items = (import_item_t *)(imp + 1);
+    imp->capacity = capacity;
+    imp->by_address = (int16_t *)(imp->items + capacity);
+    imp->by_slug = imp->by_address + hash_size;
+    imp->hash_mask = hash_size - 1;
+    memset(imp->by_address, 0xFF, 2 * hash_size * sizeof(int16_t));
+    imp->names = (char *)(imp->by_slug + hash_size);
+    imp->names_limit = names_limit;
+    imp->names_size = names_size;
+    return imp;
+}
+
+esp_err_t lamp_import_feed(lamp_import_t *imp, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && !imp->failed; i++) {
+        char c = data[i];
+        if (imp->format == FORMAT_UNKNOWN) {
+            if (is_space(c)) {
+                continue;
+            }
+            imp->format = c == '[' ? FORMAT_JSON : FORMAT_CSV;
+        }
+        if (imp->format == FORMAT_JSON) {
+            json_feed(imp, c);
+        } else {
+            csv_feed(imp, c);
+        }
+    }
+    return imp->failed ? imp->err : ESP_OK;
+}
+
+esp_err_t lamp_import_finish(lamp_import_t *imp)
+{
+    if (!imp->failed && imp->format == FORMAT_CSV && imp->record_len > 0) {
+        // Last line without a newline
+        csv_record(imp);
+    }
+    if (imp->failed) {
+        return imp->err;
+    }
+    imp->records = 0;
+    if (imp->format == FORMAT_UNKNOWN) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "The import is empty");
+        return imp->err;
+    }
+    if (imp->format == FORMAT_JSON && imp->json_state != JSON_DONE) {
+        import_fail(imp, ESP_ERR_INVALID_ARG, "The JSON array is not complete");
+        return imp->err;
+    }
+
+    // Addresses stay unique: a lamp the import leaves alone must not have one of them
+    for (int i = 0; i < imp->count && !imp->replace; i++) {
+        const import_item_t *item = &imp->items[i];
+        int owner = lamp_registry_find_by_addr(item->address, NULL);
+        if (owner >= 0 && owner != item->index && !target_has(imp, owner)) {
+            LampInfo lamp_info;
+            item_to_info(imp, item, &lamp_info);
+            import_fail(imp, ESP_ERR_INVALID_STATE, "Address 0x%04X of %s belongs to another lamp",
+                        item->address, lamp_info.name);
+            return imp->err;
+        }
+    }
+
+    // New lamps take the free slots; slots of removed lamps are not reused, so
+    // a new lamp never inherits the group memberships of a removed one
+    int slot = 0;
+    for (int i = 0; i < imp->count; i++) {
+        import_item_t *item = &imp->items[i];
+        if (item->kind != ITEM_NEW) {
+            continue;
+        }
+        while (slot < MAX_LAMPS && (target_has(imp, slot) || lamp_registry_get(slot, NULL))) {
+            slot++;
+        }
+        if (slot == MAX_LAMPS) {
+            import_fail(imp, ESP_ERR_NO_MEM, "The lamp table is full (%d lamps)", MAX_LAMPS);
+            return imp->err;
+        }
+        item->index = slot;
+        target_set(imp, slot);
+    }
+
+    for (int i = 0; i < MAX_LAMPS && imp->replace; i++) {
+        LampInfo lamp_info;
+        if (target_has(imp, i) || !lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        size_t len = strlen(lamp_info.name);
+        if (imp->count >= imp->capacity || imp->names_len + len > imp->names_size) {
+            // Only the HTTP task edits the table, so this cannot happen
+            import_fail(imp, ESP_ERR_NO_MEM, "The lamp table changed during the import");
+            return imp->err;
+        }
+        imp->items[imp->count++] = (import_item_t) {
+            .name_off = imp->names_len,
+            .index = i,
+            .address = lamp_info.address,
+            .name_len = len,
+            .kind = ITEM_REMOVE,
+        };
+        memcpy(imp->names + imp->names_len, lamp_info.name, len);
+        imp->names_len += len;
+    }
+    return ESP_OK;
+}
+
+// Edit function over the items that change something
+static bool import_edit(void *ctx, int n, lamp_registry_edit_t *edit)
+{
+    const lamp_import_t *imp = ctx;
+    if (n >= imp->edits) {
+        return false;
+    }
+    const import_item_t *item = &imp->items[n];
+    edit->index = item->index;
+    edit->remove = item->kind == ITEM_REMOVE;
+    item_to_info(imp, item, &edit->info);
+    return true;
+}
+
+esp_err_t lamp_import_commit(lamp_import_t *imp, lamp_import_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (imp->failed) {
+        return imp->err;
+    }
+
+    // Unchanged lamps go to the back, they are neither written nor announced again
+    imp->edits = 0;
+    for (int i = 0; i < imp->count; i++) {
+        if (imp->items[i].kind != ITEM_SAME) {
+            import_item_t item = imp->items[i];
+            imp->items[i] = imp->items[imp->edits];
+            imp->items[imp->edits++] = item;
+        }
+    }
+    if (imp->edits > 0) {
+        esp_err_t err = save_lamp_batch(import_edit, imp);
+        if (err != ESP_OK) {
+            import_fail(imp, err, err == ESP_ERR_NO_MEM ? "No room left for lamp names" : "Failed to save the lamp table");
+            return imp->err;
+        }
+    }
+
+    for (int i = 0; i < imp->count; i++) {
+        const import_item_t *item = &imp->items[i];
+        LampInfo lamp_info;
+        char config_topic[100];
+        item_to_info(imp, item, &lamp_info);
+        switch (item->kind) {
+        case ITEM_NEW:
+            bridge_announce(item->index);
+            stats->added++;
+            break;
+        case ITEM_UPDATE:
+            // The name keeps its topic, but a new address changes the unique id
+            if (item->prev_address != item->address) {
+                mqtt_lamp_topic(config_topic, sizeof(config_topic), &lamp_info, "config");
+                bridge_remove_discovery(item->index, config_topic);
+            }
+            bridge_announce(item->index);
+            stats->updated++;
+            break;
+        case ITEM_SAME:
+            stats->unchanged++;
+            break;
+        case ITEM_REMOVE:
+            mqtt_lamp_topic(config_topic, sizeof(config_topic), &lamp_info, "config");
+            bridge_remove_discovery(item->index, config_topic);
+            stats->removed++;
+            break;
+        }
+    }
+    ESP_LOGI(TAG, "Imported lamps: %d added, %d updated, %d unchanged, %d removed",
+             stats->added, stats->updated, stats->unchanged, stats->removed);
+    return ESP_OK;
+}
+
+const char *lamp_import_error(const lamp_import_t *imp)
+{
+    return imp->error;
+}
+
+void lamp_import_free(lamp_import_t *imp)
+{
+    free(imp);
+}
@@ -0,0 +1,71 @@
+#ifndef LAMP_IMPORT_H
+#define LAMP_IMPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "lamp_nvs.h"
+
+/*
+ * Bulk lamp import (POST /api/lamps/import).
+ *
+ * The request body is fed in as it arrives, in pieces of any size. It is
+ * either a JSON array of lamp objects, the same format GET /api/lamps serves:
+ *
+ *   [{"name":"Kitchen","address":"0x0013","acked":true}, ...]
+ *
+ * or CSV lines name,address[,acked[,fade]] with an optional "name,..." header line.
+ * Only one record is buffered at a time (LAMP_IMPORT_RECORD_MAX). Each one is
+ * checked and staged in a compact table on the heap; nothing changes until
+ * lamp_import_commit() stores all lamps as one batch, with one registry
+ * update and one write of the lamp table.
+ *
+ * Lamps are matched by name (topic slug): a known name updates that lamp, a
+ * new one takes a free slot. With replace, lamps missing from the import are
+ * removed.
+ *
+ * Errors are ESP_ERR_INVALID_ARG for a malformed record, ESP_ERR_INVALID_STATE
+ * for a name or address clash and ESP_ERR_NO_MEM when the table or the name
+ * pool is full; lamp_import_error() has the message.
+ */
+
+// Longest JSON object or CSV line of a single lamp
+#define LAMP_IMPORT_RECORD_MAX 256
+
+// Fields found by lamp_import_parse_json()
+#define LAMP_FIELD_NAME     (1 << 0)
+#define LAMP_FIELD_ADDRESS  (1 << 1)
+#define LAMP_FIELD_ACKED    (1 << 2)
+#define LAMP_FIELD_FADE     (1 << 3)
+
+typedef struct {
+    int added;
+    int updated;
+    int unchanged;
+    int removed;
+} lamp_import_stats_t;
+
+typedef struct lamp_import lamp_import_t;
+
+// Function to start an import of a body of content_len bytes, returns NULL if out of memory
+lamp_import_t *lamp_import_begin(size_t content_len, bool replace);
+// Function to feed the next piece of the body
+esp_err_t lamp_import_feed(lamp_import_t *import, const char *data, size_t len);
+// Function to check the end of the body and assign slots to the new lamps
+esp_err_t lamp_import_finish(lamp_import_t *import);
+// Function to store the staged lamps and update their discovery configs in HA
+esp_err_t lamp_import_commit(lamp_import_t *import, lamp_import_stats_t *stats);
+// Function to get the message of the error that stopped the import
+const char *lamp_import_error(const lamp_import_t *import);
+// Function to free an import
+void lamp_import_free(lamp_import_t *import);
+
+// Function to parse a single lamp object (not NUL-terminated), e.g.
+// {"name":"Kitchen","address":"0x0013","acked":true,"fade":false}. fields gets the
+// LAMP_FIELD_* present; an address that is present but invalid is 0.
+// Unknown keys, like "index" in the GET output, are skipped.
+esp_err_t lamp_import_parse_json(const char *data, size_t len, LampInfo *lamp_info, uint8_t *fields);
+
+#endif /* LAMP_IMPORT_H */
@@ -2,257 +2,824 @@
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include <stdlib.h>
 #include <string.h>
 
-// Define the maximum number of lamps
-#define MAX_LAMPS 20
+#include "lamp_registry.h"
+#include "lamp_shadow.h"
+#include "latency.h"
+#include "metrics.h"
 
 #define TAG "LAMP_NVS"
 
-// Function to save lamp information to NVS
-esp_err_t save_lamp_info(LampInfo *lamp_info, int index) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+/*
+ * The whole lamp table is stored as one blob under LAMP_TABLE_KEY:
+ *
+ *   LampTableHeader | record | record | ...
+ *
+ * Each record is a LampTableRecord followed by name_len bytes of name (not
+ * NUL-terminated). The CRC covers all record bytes, so a torn or corrupted
+ * write is detected at boot instead of producing a half-written lamp.
+ */
+#define LAMP_NAMESPACE      "lamps"
+#define LAMP_TABLE_KEY      "lamp_table"
+#define LAMP_TABLE_MAGIC    0x544C  /* "LT" */
+#define LAMP_TABLE_VERSION  1
+
+// Groups use the same header in a second blob; each group record is followed
+// by its name and then member_count uint16_t lamp slots
+#define GROUP_TABLE_KEY     "group_table"
+#define GROUP_TABLE_MAGIC   0x4754  /* "GT" */
+#define GROUP_TABLE_VERSION 1
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t  version;
+    uint8_t  reserved;
+    uint16_t count;     /* Number of records */
+    uint16_t length;    /* Record bytes following the header */
+    uint32_t crc;       /* CRC32 over the record bytes */
+} LampTableHeader;
+
+typedef struct __attribute__((packed)) {
+    uint16_t index;     /* Registry slot */
+    uint16_t address;   /* Unicast address */
+    uint8_t  flags;     /* LAMP_FLAG_* */
+    uint8_t  name_len;
+} LampTableRecord;
+
+typedef struct __attribute__((packed)) {
+    uint16_t index;         /* Group slot */
+    uint16_t address;       /* Group address */
+    uint16_t member_count;
+    uint8_t  name_len;
+} GroupTableRecord;
+
+// HA unique ids of lamps migrated from the legacy layout whose address text
+// was not already "0x%04X": an array of LegacyIdRecord, written once by the
+// migration and never changed
+#define LEGACY_ID_KEY       "legacy_ids"
+
+typedef struct __attribute__((packed)) {
+    uint8_t  index;     /* Registry slot */
+    uint16_t address;   /* Address the lamp was migrated with */
+    char     unique_id[LAMP_LEGACY_ID_SIZE];
+} LegacyIdRecord;
+
+#define LAMP_NAME_MAX       (sizeof(((LampInfo *)0)->name) - 1)
+
+// Largest table blobs: every slot used, full name pool, every group with
+// the longest name and all lamps as members
+#define LAMP_TABLE_MAX_BYTES  (MAX_LAMPS * sizeof(LampTableRecord) + LAMP_NAME_POOL_SIZE)
+#define GROUP_TABLE_MAX_BYTES (MAX_GROUPS * (sizeof(GroupTableRecord) + LAMP_NAME_MAX + MAX_LAMPS * sizeof(uint16_t)))
+
+// The header counts the record bytes in 16 bits
+_Static_assert(LAMP_TABLE_MAX_BYTES <= UINT16_MAX, "lamp table blob too large for MAX_LAMPS");
+_Static_assert(GROUP_TABLE_MAX_BYTES <= UINT16_MAX, "group table blob too large for MAX_LAMPS");
+
+// Size of the nvs partition in partitions.csv. NVS stores a blob in 32 byte
+// entries, 126 per 4 KB page, and keeps the old copy until the new one is
+// written, so both tables may be there twice. One page stays free for NVS
+// itself and the rest is left to the BLE Mesh stack, Wi-Fi and the mesh state.
+#define LAMP_NVS_PARTITION_SIZE (144 * 1024)
+#define NVS_PAGE_SIZE           4096
+#define NVS_ENTRY_SIZE          32
+#define NVS_PAGE_ENTRIES        126
+#define LAMP_NVS_OTHERS_SIZE    (24 * 1024)
+// Entries of a blob, one more per page for the chunk header, plus the index entry
+#define BLOB_ENTRIES(bytes) \
+    (((sizeof(LampTableHeader) + (bytes)) + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE + \
+     ((sizeof(LampTableHeader) + (bytes)) / (NVS_ENTRY_SIZE * (NVS_PAGE_ENTRIES - 1)) + 1) + 1)
+#define LAMP_NVS_WORST_ENTRIES  (2 * (BLOB_ENTRIES(LAMP_TABLE_MAX_BYTES) + BLOB_ENTRIES(GROUP_TABLE_MAX_BYTES)))
+
+_Static_assert(LAMP_NVS_WORST_ENTRIES * NVS_ENTRY_SIZE + NVS_PAGE_SIZE + LAMP_NVS_OTHERS_SIZE <=
+               LAMP_NVS_PARTITION_SIZE / NVS_PAGE_SIZE * NVS_PAGE_ENTRIES * NVS_ENTRY_SIZE,
+               "lamp and group tables do not fit the nvs partition for MAX_LAMPS");
+
+// Blobs are serialized into a heap buffer of the exact size for the write
+// and freed again, so the tables cost no RAM between edits and the HTTP task
+// needs no large stack.
+
+// Function to finish a blob: fills in the header for the record bytes written
+static size_t finish_table(uint8_t *blob, uint16_t magic, uint8_t version, uint16_t count, size_t size)
+{
+    LampTableHeader header = {
+        .magic = magic,
+        .version = version,
+        .count = count,
+        .length = size - sizeof(header),
+    };
+    header.crc = esp_rom_crc32_le(0, blob + sizeof(header), header.length);
+    memcpy(blob, &header, sizeof(header));
+    return size;
+}
 
-    // Open NVS namespace
-    err = nvs_open("lamps", NVS_READWRITE, &nvs_handle);
+// Function to validate the header and CRC of a blob
+static esp_err_t check_table(const uint8_t *blob, uint16_t magic, uint8_t version, size_t size, LampTableHeader *header)
+{
+    if (size < sizeof(*header)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(header, blob, sizeof(*header));
+    if (header->magic != magic) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (header->version != version) {
+        ESP_LOGE(TAG, "Unsupported table version %u", header->version);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (header->length != size - sizeof(*header)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (esp_rom_crc32_le(0, blob + sizeof(*header), header->length) != header->crc) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+// Function to serialize the registry into a new buffer (freed by the caller),
+// returns the blob size, 0 if out of memory
+static size_t serialize_lamp_table(uint8_t **blob)
+{
+    uint16_t count = 0;
+    size_t offset = sizeof(LampTableHeader);
+    size_t size = offset + lamp_registry_count() * sizeof(LampTableRecord) + lamp_registry_name_bytes(NULL);
+
+    *blob = malloc(size);
+    if (*blob == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        LampInfo lamp_info;
+        if (!lamp_registry_get(i, &lamp_info)) {
+            continue;
+        }
+        LampTableRecord record = {
+            .index = i,
+            .address = lamp_info.address,
+            .flags = lamp_info.flags,
+            .name_len = strnlen(lamp_info.name, LAMP_NAME_MAX),
+        };
+        if (offset + sizeof(record) + record.name_len > size) {
+            // Only the HTTP task edits the table, so this cannot happen
+            break;
+        }
+        memcpy(*blob + offset, &record, sizeof(record));
+        offset += sizeof(record);
+        memcpy(*blob + offset, lamp_info.name, record.name_len);
+        offset += record.name_len;
+        count++;
+    }
+    return finish_table(*blob, LAMP_TABLE_MAGIC, LAMP_TABLE_VERSION, count, offset);
+}
+
+// Function to validate a lamp blob and load its records into the registry
+static esp_err_t deserialize_lamp_table(const uint8_t *blob, size_t size)
+{
+    LampTableHeader header;
+    esp_err_t err = check_table(blob, LAMP_TABLE_MAGIC, LAMP_TABLE_VERSION, size, &header);
     if (err != ESP_OK) {
         return err;
     }
 
-    // Write lamp info to NVS
-    char key[20];
-    snprintf(key, sizeof(key), "lamp%d_name", index);
-    err = nvs_set_str(nvs_handle, key, lamp_info->name);
+    size_t offset = sizeof(header);
+    for (int n = 0; n < header.count; n++) {
+        LampTableRecord record;
+        if (offset + sizeof(record) > size) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(&record, blob + offset, sizeof(record));
+        offset += sizeof(record);
+        if (offset + record.name_len > size || record.name_len > LAMP_NAME_MAX) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        LampInfo lamp_info = { .address = record.address, .flags = record.flags };
+        memcpy(lamp_info.name, blob + offset, record.name_len);
+        lamp_info.name[record.name_len] = '\0';
+        offset += record.name_len;
+        if (record.index >= MAX_LAMPS) {
+            ESP_LOGW(TAG, "Dropping lamp %s stored in slot %u", lamp_info.name, record.index);
+            continue;
+        }
+        if (lamp_registry_set(record.index, &lamp_info) != ESP_OK) {
+            ESP_LOGW(TAG, "Dropping lamp %s, the name pool is full", lamp_info.name);
+        }
+    }
+    return ESP_OK;
+}
+
+// Function to serialize the groups into a new buffer (freed by the caller),
+// returns the blob size, 0 if out of memory
+static size_t serialize_group_table(uint8_t **blob)
+{
+    uint16_t count = 0;
+    size_t offset = sizeof(LampTableHeader);
+    size_t size = offset;
+
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        GroupInfo group_info;
+        if (!lamp_registry_group_get(i, &group_info)) {
+            continue;
+        }
+        size += sizeof(GroupTableRecord) + strnlen(group_info.name, LAMP_NAME_MAX);
+        for (int w = 0; w < GROUP_MEMBER_WORDS; w++) {
+            size += __builtin_popcount(group_info.members[w]) * sizeof(uint16_t);
+        }
+    }
+    *blob = malloc(size);
+    if (*blob == NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        GroupInfo group_info;
+        if (!lamp_registry_group_get(i, &group_info)) {
+            continue;
+        }
+        GroupTableRecord record = {
+            .index = i,
+            .address = group_info.address,
+            .name_len = strnlen(group_info.name, LAMP_NAME_MAX),
+        };
+        if (offset + sizeof(record) + record.name_len > size) {
+            break;
+        }
+        size_t record_offset = offset;
+        offset += sizeof(record);
+        memcpy(*blob + offset, group_info.name, record.name_len);
+        offset += record.name_len;
+        for (uint16_t lamp = 0; lamp < MAX_LAMPS && offset + sizeof(lamp) <= size; lamp++) {
+            if (group_has_member(&group_info, lamp)) {
+                memcpy(*blob + offset, &lamp, sizeof(lamp));
+                offset += sizeof(lamp);
+                record.member_count++;
+            }
+        }
+        memcpy(*blob + record_offset, &record, sizeof(record));
+        count++;
+    }
+    return finish_table(*blob, GROUP_TABLE_MAGIC, GROUP_TABLE_VERSION, count, offset);
+}
+
+// Function to validate a group blob and load it into the registry
+static esp_err_t deserialize_group_table(const uint8_t *blob, size_t size)
+{
+    LampTableHeader header;
+    esp_err_t err = check_table(blob, GROUP_TABLE_MAGIC, GROUP_TABLE_VERSION, size, &header);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
         return err;
     }
 
-    snprintf(key, sizeof(key), "lamp%d_address", index);
-    err = nvs_set_str(nvs_handle, key, lamp_info->address);
+    size_t offset = sizeof(header);
+    for (int n = 0; n < header.count; n++) {
+        GroupTableRecord record;
+        if (offset + sizeof(record) > size) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(&record, blob + offset, sizeof(record));
+        offset += sizeof(record);
+        if (record.name_len > LAMP_NAME_MAX ||
+            offset + record.name_len + record.member_count * sizeof(uint16_t) > size) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        GroupInfo group_info = { .address = record.address };
+        memcpy(group_info.name, blob + offset, record.name_len);
+        group_info.name[record.name_len] = '\0';
+        offset += record.name_len;
+        for (int m = 0; m < record.member_count; m++) {
+            uint16_t lamp;
+            memcpy(&lamp, blob + offset, sizeof(lamp));
+            offset += sizeof(lamp);
+            if (lamp < MAX_LAMPS) {
+                group_set_member(&group_info, lamp, true);
+            }
+        }
+        if (record.index >= MAX_GROUPS) {
+            ESP_LOGW(TAG, "Dropping group %s stored in slot %u", group_info.name, record.index);
+            continue;
+        }
+        lamp_registry_group_set(record.index, &group_info);
+    }
+    return ESP_OK;
+}
+
+// Function to store one serialized table as one blob under an open handle and free it
+static esp_err_t set_table(nvs_handle_t nvs_handle, const char *key, uint8_t *blob, size_t size)
+{
+    if (blob == NULL) {
+        ESP_LOGE(TAG, "No memory to serialize %s", key);
+        metrics_inc(METRIC_NVS_ERRORS);
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = nvs_set_blob(nvs_handle, key, blob, size);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        return err;
+        ESP_LOGE(TAG, "Error writing %s: %s", key, esp_err_to_name(err));
     }
-    // Commit changes
-    err = nvs_commit(nvs_handle);
+    metrics_inc(err == ESP_OK ? METRIC_NVS_WRITES : METRIC_NVS_ERRORS);
+    free(blob);
+    return err;
+}
+
+// Function to write the lamp table and, if groups is set, the group table
+// with a single commit. NVS replaces each blob atomically but not the pair:
+// the groups go first, so an interruption in between at worst drops the
+// memberships of a removed lamp early, and never leaves one for a slot that
+// a new lamp takes over.
+static esp_err_t write_tables(bool lamps, bool groups)
+{
+    nvs_handle_t nvs_handle;
+    uint8_t *blob;
+    size_t size;
+
+    esp_err_t err = nvs_open(LAMP_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
+        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
         return err;
     }
-
-    // Close NVS handle
+    if (groups) {
+        size = serialize_group_table(&blob);
+        err = set_table(nvs_handle, GROUP_TABLE_KEY, blob, size);
+    }
+    if (err == ESP_OK && lamps) {
+        size = serialize_lamp_table(&blob);
+        err = set_table(nvs_handle, LAMP_TABLE_KEY, blob, size);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(nvs_handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Error committing the lamp tables: %s", esp_err_to_name(err));
+        }
+    }
     nvs_close(nvs_handle);
+    return err;
+}
 
-    return ESP_OK;
+// Function to write the current lamp registry contents to NVS
+static esp_err_t write_lamp_table(void)
+{
+    return write_tables(true, false);
 }
 
-// Function to load lamp information from NVS
-esp_err_t load_lamp_info(LampInfo *lamp_info, int index) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+// Function to write the current groups to NVS
+static esp_err_t write_group_table(void)
+{
+    return write_tables(false, true);
+}
 
-    // Open NVS namespace
-    err = nvs_open("lamps", NVS_READONLY, &nvs_handle);
+// Function to read a blob of any size into a new buffer (freed by the caller)
+static esp_err_t read_table(nvs_handle_t nvs_handle, const char *key, uint8_t **blob, size_t *size)
+{
+    *blob = NULL;
+    esp_err_t err = nvs_get_blob(nvs_handle, key, NULL, size);
     if (err != ESP_OK) {
         return err;
     }
-    //ESP_LOGI(TAG, "Loading lamp info");
-    // Read lamp info from NVS
+    *blob = malloc(*size > 0 ? *size : 1);
+    if (*blob == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    err = nvs_get_blob(nvs_handle, key, *blob, size);
+    metrics_inc(METRIC_NVS_READS);
+    if (err != ESP_OK) {
+        free(*blob);
+        *blob = NULL;
+    }
+    return err;
+}
+
+// Function to read the keys of one lamp in the legacy per-key layout. The
+// address text as stored is the lamp's HA unique id, it goes to unique_id.
+static esp_err_t read_legacy_lamp_keys(nvs_handle_t nvs_handle, LampInfo *lamp_info, int index, char *unique_id)
+{
+    esp_err_t err;
     char key[20];
+
     snprintf(key, sizeof(key), "lamp%d_name", index);
     size_t size = sizeof(lamp_info->name);
     err = nvs_get_str(nvs_handle, key, lamp_info->name, &size);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-    //    ESP_LOGE(TAG, "Loading lamp info failed for name");
         return err;
     }
     snprintf(key, sizeof(key), "lamp%d_address", index);
-    size = sizeof(lamp_info->address);
-    err = nvs_get_str(nvs_handle, key, lamp_info->address, &size);
+    size = LAMP_LEGACY_ID_SIZE;
+    err = nvs_get_str(nvs_handle, key, unique_id, &size);
     if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-    //    ESP_LOGE(TAG, "Loading lamp info failed for address");
+        ESP_LOGW(TAG, "Lamp %s has no readable address (%s)", lamp_info->name, esp_err_to_name(err));
         return err;
     }
-
-    // Close NVS handle
-    nvs_close(nvs_handle);
-    //ESP_LOGI(TAG, "Loading done");
+    lamp_info->address = lamp_parse_address(unique_id);
+    lamp_info->flags = 0;
+    if (lamp_info->address == 0) {
+        ESP_LOGW(TAG, "Lamp %s has the invalid address \"%s\"", lamp_info->name, unique_id);
+        return ESP_ERR_INVALID_ARG;
+    }
     return ESP_OK;
 }
 
-// Function to find the next free index in the NVS store
-int findNextFreeIndexInNVS() {
-    nvs_handle_t nvs_handle;
+// Function to convert the legacy "lamp%d_name"/"lamp%d_address" keys into the blob format
+static esp_err_t migrate_legacy_lamps(nvs_handle_t nvs_handle)
+{
+    LegacyIdRecord ids[LAMP_LEGACY_SLOTS];
+    int id_count = 0;
+    uint32_t migrated = 0;
     esp_err_t err;
 
-    // Open NVS namespace
-    err = nvs_open("lamps", NVS_READONLY, &nvs_handle);
+    _Static_assert(LAMP_LEGACY_SLOTS <= 32, "migrated slots are one bitmap word");
+    for (int i = 0; i < MAX_LAMPS && i < LAMP_LEGACY_SLOTS; i++) {
+        LampInfo lamp_info;
+        LegacyIdRecord id = { .index = i };
+        if (read_legacy_lamp_keys(nvs_handle, &lamp_info, i, id.unique_id) != ESP_OK ||
+            lamp_registry_set(i, &lamp_info) != ESP_OK) {
+            continue;
+        }
+        migrated |= 1u << i;
+        // HA knows the lamp by the address text the old firmware published
+        char canonical[8];
+        snprintf(canonical, sizeof(canonical), "0x%04X", lamp_info.address);
+        if (strcmp(id.unique_id, canonical) != 0) {
+            id.address = lamp_info.address;
+            lamp_registry_set_legacy_id(i, id.address, id.unique_id);
+            ids[id_count++] = id;
+        }
+    }
+    if (migrated == 0) {
+        return ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "Migrating %d lamps from the legacy NVS layout", __builtin_popcount(migrated));
+    if (id_count > 0) {
+        err = nvs_set_blob(nvs_handle, LEGACY_ID_KEY, ids, id_count * sizeof(ids[0]));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs_handle);
+        }
+        if (err != ESP_OK) {
+            // Keep the legacy keys, the migration is retried on the next boot
+            ESP_LOGE(TAG, "Error writing %s: %s", LEGACY_ID_KEY, esp_err_to_name(err));
+            return err;
+        }
+    }
+    err = write_lamp_table();
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return -1;
+        return err;
     }
 
-    // Iterate through the indices and check for gaps
-    int nextFreeIndex = -1;
-    for (int i = 0; i < MAX_LAMPS; i++) {
+    // The blob is committed, the keys of the migrated lamps can go. Those of
+    // a lamp that could not be migrated stay, so it can still be recovered.
+    for (int i = 0; i < LAMP_LEGACY_SLOTS; i++) {
+        if (!((migrated >> i) & 1)) {
+            continue;
+        }
         char key[20];
         snprintf(key, sizeof(key), "lamp%d_name", i);
-        size_t required_size;
-        err = nvs_get_str(nvs_handle, key, NULL, &required_size);
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            // Free index found
-            nextFreeIndex = i;
-            ESP_LOGI(TAG, "Free index found in NVS: %d", nextFreeIndex);
-            break;
-        } else if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error reading NVS: %s", esp_err_to_name(err));
-            // Error handling, return a negative value
-            nextFreeIndex = -1;
-            break;
-        }
+        nvs_erase_key(nvs_handle, key);
+        snprintf(key, sizeof(key), "lamp%d_address", i);
+        nvs_erase_key(nvs_handle, key);
     }
+    return nvs_commit(nvs_handle);
+}
 
-    // Close the NVS handle
-    nvs_close(nvs_handle);
+// Edit function that clears every slot
+static bool clear_all_edit(void *ctx, int n, lamp_registry_edit_t *edit)
+{
+    if (n >= MAX_LAMPS) {
+        return false;
+    }
+    edit->index = n;
+    edit->remove = true;
+    return true;
+}
 
-    return nextFreeIndex;
+// Function to load the HA unique ids kept from the legacy layout, if any
+static void load_legacy_ids(nvs_handle_t nvs_handle)
+{
+    LegacyIdRecord ids[LAMP_LEGACY_SLOTS];
+    size_t size = sizeof(ids);
+
+    esp_err_t err = nvs_get_blob(nvs_handle, LEGACY_ID_KEY, ids, &size);
+    if (err != ESP_OK) {
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGE(TAG, "Error reading %s: %s", LEGACY_ID_KEY, esp_err_to_name(err));
+        }
+        return;
+    }
+    for (size_t n = 0; n < size / sizeof(ids[0]); n++) {
+        ids[n].unique_id[LAMP_LEGACY_ID_SIZE - 1] = '\0';
+        lamp_registry_set_legacy_id(ids[n].index, ids[n].address, ids[n].unique_id);
+    }
 }
 
-// Function to remove lamp information from NVS
-esp_err_t remove_lamp_info(int index) {
+// Function to warn if the nvs partition on the flash is smaller than the
+// build expects, e.g. a new build flashed without its partition table
+static void check_nvs_room(void)
+{
+    nvs_stats_t stats;
+    if (nvs_get_stats(NULL, &stats) != ESP_OK) {
+        return;
+    }
+    size_t needed = LAMP_NVS_WORST_ENTRIES + (NVS_PAGE_SIZE + LAMP_NVS_OTHERS_SIZE) / NVS_ENTRY_SIZE;
+    if (stats.total_entries < needed) {
+        ESP_LOGE(TAG, "NVS partition has %u entries, %u lamps may need %u; flash the partition table (README)",
+                 (unsigned)stats.total_entries, MAX_LAMPS, (unsigned)needed);
+    }
+}
+
+// Function to load the lamp table from NVS into the lamp registry
+esp_err_t lamp_nvs_init(void) {
     nvs_handle_t nvs_handle;
     esp_err_t err;
 
+    lamp_registry_init();
+    check_nvs_room();
+
     // Open NVS namespace
-    err = nvs_open("lamps", NVS_READWRITE, &nvs_handle);
+    err = nvs_open(LAMP_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGI(TAG, "Error opening NVS: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
         return err;
     }
 
-    // Delete lamp info from NVS
-    char key[20];
-    snprintf(key, sizeof(key), "lamp%d_name", index);
-    err = nvs_erase_key(nvs_handle, key);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        nvs_close(nvs_handle);
-        ESP_LOGE(TAG, "Error deleting lamp name from NVS: %s", esp_err_to_name(err));
-        return err;
+    uint8_t *blob;
+    size_t size;
+    err = read_table(nvs_handle, LAMP_TABLE_KEY, &blob, &size);
+    if (err == ESP_OK) {
+        err = deserialize_lamp_table(blob, size);
+        free(blob);
+        if (err != ESP_OK) {
+            // The records before the bad one are loaded already, drop them too
+            // rather than run with an arbitrary part of the table
+            lamp_registry_apply(clear_all_edit, NULL);
+            ESP_LOGE(TAG, "Lamp table is corrupt (%s), starting with an empty table", esp_err_to_name(err));
+        }
+        load_legacy_ids(nvs_handle);
+    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        // First boot with the blob format
+        err = migrate_legacy_lamps(nvs_handle);
+    } else {
+        ESP_LOGE(TAG, "Error reading lamp table: %s", esp_err_to_name(err));
     }
 
-    snprintf(key, sizeof(key), "lamp%d_address", index);
-    err = nvs_erase_key(nvs_handle, key);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        nvs_close(nvs_handle);
-        ESP_LOGE(TAG, "Error deleting lamp address from NVS: %s", esp_err_to_name(err));
-        return err;
+    esp_err_t group_err = read_table(nvs_handle, GROUP_TABLE_KEY, &blob, &size);
+    if (group_err == ESP_OK) {
+        group_err = deserialize_group_table(blob, size);
+        free(blob);
+        if (group_err != ESP_OK) {
+            ESP_LOGE(TAG, "Group table is corrupt (%s), starting without groups", esp_err_to_name(group_err));
+        }
+    } else if (group_err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGE(TAG, "Error reading group table: %s", esp_err_to_name(group_err));
     }
 
-    // Commit changes
-    err = nvs_commit(nvs_handle);
-    if (err != ESP_OK) {
-        nvs_close(nvs_handle);
-        ESP_LOGE(TAG, "Error committing NVS changes: %s", esp_err_to_name(err));
-        return err;
+    nvs_close(nvs_handle);
+    size_t pool_size;
+    size_t name_bytes = lamp_registry_name_bytes(&pool_size);
+    ESP_LOGI(TAG, "Loaded %d of %d lamps from NVS, names use %u of %u bytes",
+             lamp_registry_count(), MAX_LAMPS, (unsigned)name_bytes, (unsigned)pool_size);
+    return err;
+}
+
+// Function to save lamp information to NVS
+esp_err_t save_lamp_info(LampInfo *lamp_info, int index) {
+    if (index < 0 || index >= MAX_LAMPS) {
+        return ESP_ERR_INVALID_ARG;
     }
 
-    // Close NVS handle
-    nvs_close(nvs_handle);
+    LampInfo previous;
+    bool existed = lamp_registry_get(index, &previous);
 
+    esp_err_t err = lamp_registry_set(index, lamp_info);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = write_lamp_table();
+    if (err != ESP_OK) {
+        // Roll the registry back so RAM and flash stay consistent
+        if (existed) {
+            lamp_registry_set(index, &previous);
+        } else {
+            lamp_registry_remove(index);
+        }
+        return err;
+    }
+    // A new or readdressed lamp starts with an unknown state and no latencies
+    if (!existed || previous.address != lamp_info->address) {
+        lamp_shadow_clear(index);
+        latency_reset_lamp(index);
+    }
     return ESP_OK;
 }
 
-// Function to find the index of a lamp by its name or address
-int find_index_by_name_or_address(const char *name, const char *address) {
+// Function to load the registry from the lamp table and, if groups is set,
+// the group table in NVS again, after a batch that was applied in RAM could
+// not be written
+static void reload_tables(bool groups)
+{
     nvs_handle_t nvs_handle;
-    esp_err_t err;
+    uint8_t *blob;
+    size_t size;
 
-    // Open NVS namespace
-    err = nvs_open("lamps", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return -1;
+    lamp_registry_apply(clear_all_edit, NULL);
+    for (int i = 0; i < MAX_GROUPS && groups; i++) {
+        lamp_registry_group_remove(i);
+    }
+    if (nvs_open(LAMP_NAMESPACE, NVS_READONLY, &nvs_handle) != ESP_OK) {
+        return;
+    }
+    if (read_table(nvs_handle, LAMP_TABLE_KEY, &blob, &size) == ESP_OK) {
+        deserialize_lamp_table(blob, size);
+        free(blob);
+    }
+    if (groups && read_table(nvs_handle, GROUP_TABLE_KEY, &blob, &size) == ESP_OK) {
+        deserialize_group_table(blob, size);
+        free(blob);
     }
+    nvs_close(nvs_handle);
+}
 
-    // Iterate through all lamps
+// Function to save a batch of lamp edits with a single commit of the lamp
+// table and, if removed lamps leave groups, the group table
+esp_err_t save_lamp_batch(lamp_registry_edit_fn next, void *ctx) {
+    // Slots that lose their state, and removed slots that also leave their groups
+    uint32_t reset[GROUP_MEMBER_WORDS] = {0};
+    uint32_t removed[GROUP_MEMBER_WORDS] = {0};
+    lamp_registry_edit_t edit;
+
+    for (int n = 0; next(ctx, n, &edit); n++) {
+        if (edit.index < 0 || edit.index >= MAX_LAMPS) {
+            return ESP_ERR_INVALID_ARG;
+        }
+        LampInfo previous;
+        bool existed = lamp_registry_get(edit.index, &previous);
+        uint32_t bit = 1u << (edit.index % 32);
+        if (edit.remove ? existed : (!existed || previous.address != edit.info.address)) {
+            reset[edit.index / 32] |= bit;
+        }
+        if (edit.remove && existed) {
+            removed[edit.index / 32] |= bit;
+        }
+    }
+
+    esp_err_t err = lamp_registry_apply(next, ctx);
+    if (err != ESP_OK) {
+        return err;
+    }
+    bool groups_changed = false;
     for (int i = 0; i < MAX_LAMPS; i++) {
-        LampInfo lamp_info;
-        err = load_lamp_info(&lamp_info, i);
-        if (err != ESP_OK) {
-            continue; // Skip if error loading lamp info
+        if ((removed[i / 32] >> (i % 32)) & 1) {
+            groups_changed |= lamp_registry_group_drop_member(i);
         }
+    }
+    err = write_tables(true, groups_changed);
+    if (err != ESP_OK) {
+        // NVS holds the tables from before the batch, or at worst already the
+        // new groups without the removed lamps (see write_tables())
+        reload_tables(groups_changed);
+        return err;
+    }
 
-        // Check if name or address matches
-        if ((name && strcmp(lamp_info.name, name) == 0) || (address && strcmp(lamp_info.address, address) == 0)) {
-            nvs_close(nvs_handle);
-            return i; // Return the index if found
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        if ((reset[i / 32] >> (i % 32)) & 1) {
+            lamp_shadow_clear(i);
+            latency_reset_lamp(i);
         }
     }
+    return ESP_OK;
+}
 
-    nvs_close(nvs_handle);
-    return -1; // Return -1 if not found
+// Function to load lamp information (served from the in-RAM registry)
+esp_err_t load_lamp_info(LampInfo *lamp_info, int index) {
+    if (!lamp_registry_get(index, lamp_info)) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return ESP_OK;
 }
 
-// Function to print all lamp information to console
-void printAllLampInfo() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
+// Function to find the next free index in the NVS store
+int findNextFreeIndexInNVS() {
+    int nextFreeIndex = lamp_registry_next_free();
+    if (nextFreeIndex >= 0) {
+        ESP_LOGI(TAG, "Free index found in NVS: %d", nextFreeIndex);
+    }
+    return nextFreeIndex;
+}
 
-    // Open NVS namespace
-    err = nvs_open("lamps", NVS_READONLY, &nvs_handle);
+// Function to remove lamp information from NVS
+esp_err_t remove_lamp_info(int index) {
+    LampInfo previous;
+    if (!lamp_registry_get(index, &previous)) {
+        return ESP_OK;
+    }
+
+    // The slot may be reused by a new lamp, which must not inherit group
+    // memberships or state. Lamp and groups are written in one step, so a
+    // failure means the lamp is still there with its memberships.
+    uint32_t member_of = 0;
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        GroupInfo group_info;
+        if (lamp_registry_group_get(i, &group_info) && group_has_member(&group_info, index)) {
+            member_of |= 1u << i;
+        }
+    }
+    lamp_registry_remove(index);
+    lamp_registry_group_drop_member(index);
+    esp_err_t err = write_tables(true, member_of != 0);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return;
+        ESP_LOGE(TAG, "Error deleting lamp from NVS: %s", esp_err_to_name(err));
+        lamp_registry_set(index, &previous);
+        for (int i = 0; i < MAX_GROUPS; i++) {
+            GroupInfo group_info;
+            if (((member_of >> i) & 1) && lamp_registry_group_get(i, &group_info)) {
+                group_set_member(&group_info, index, true);
+                lamp_registry_group_set(i, &group_info);
+            }
+        }
+        if (member_of != 0) {
+            // The groups are written first and may already be through
+            write_group_table();
+        }
+        return err;
+    }
+    lamp_shadow_clear(index);
+    latency_reset_lamp(index);
+    return ESP_OK;
+}
+
+// Function to find the index of a lamp by its name or address
+int find_index_by_name_or_address(const char *name, uint16_t address) {
+    int index = -1;
+    if (name) {
+        index = lamp_registry_find_by_name(name, NULL);
+    }
+    if (index < 0) {
+        index = lamp_registry_find_by_addr(address, NULL);
     }
+    return index;
+}
 
+// Function to print all lamp information to console
+void printAllLampInfo() {
     // Iterate through all lamps
     for (int i = 0; i < MAX_LAMPS; i++) {
-        // Load lamp information from NVS
         LampInfo lamp_info;
-        err = load_lamp_info(&lamp_info, i);
-        if (err != ESP_OK) {
-            // If lamp not found or other error, skip to next lamp
+        if (!lamp_registry_get(i, &lamp_info)) {
             continue;
         }
-          // Print lamp name and address
-        ESP_LOGI(TAG, "Lamp %d - Name: %s, Address: %s", i, lamp_info.name, lamp_info.address);
+        // Print lamp name and address
+        ESP_LOGI(TAG, "Lamp %d - Name: %s, Address: 0x%04X", i, lamp_info.name, lamp_info.address);
     }
-
-    // Close NVS handle
-    nvs_close(nvs_handle);
 }
 
 int getCurrentNumberOfLamps() {
-    nvs_handle_t nvs_handle;
-    esp_err_t err;
-    // Open NVS namespace
-    err = nvs_open("lamps", NVS_READONLY, &nvs_handle);
+    return lamp_registry_count();
+}
+
+// Function to save group information to NVS
+esp_err_t save_group_info(GroupInfo *group_info, int index) {
+    if (index < 0 || index >= MAX_GROUPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    GroupInfo previous;
+    bool existed = lamp_registry_group_get(index, &previous);
+
+    lamp_registry_group_set(index, group_info);
+    esp_err_t err = write_group_table();
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
-        return -1; // Return -1 to indicate error
+        if (existed) {
+            lamp_registry_group_set(index, &previous);
+        } else {
+            lamp_registry_group_remove(index);
+        }
+        return err;
     }
-    // Iterate through the indices and count the number of lamps
-    int count = 0;
-    for (int i = 0; i < MAX_LAMPS; i++) {
-        LampInfo lamp_info;
-        err = load_lamp_info(&lamp_info, i);
-        if (err == ESP_OK) {
-            count++;
-        //} else if (err == ESP_ERR_NVS_NOT_FOUND) {
-            // No more lamps found, break the loop
-        //    break;
-        //} else {
-        //    ESP_LOGE(TAG, "Error loading lamp info: %s", esp_err_to_name(err));
-        //    nvs_close(nvs_handle);
-        //    return -1; // Return -1 to indicate error
-        }
-    }
-    
-    // Close the NVS handle
-    nvs_close(nvs_handle);
-    return count;
+    if (!existed || previous.address != group_info->address) {
+        lamp_shadow_clear(MESH_TX_GROUP_INDEX(index));
+    }
+    return ESP_OK;
+}
+
+// Function to load group information (served from the in-RAM registry)
+esp_err_t load_group_info(GroupInfo *group_info, int index) {
+    if (!lamp_registry_group_get(index, group_info)) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+// Function to remove group information from NVS
+esp_err_t remove_group_info(int index) {
+    GroupInfo previous;
+    if (!lamp_registry_group_get(index, &previous)) {
+        return ESP_OK;
+    }
+
+    lamp_registry_group_remove(index);
+    esp_err_t err = write_group_table();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error deleting group from NVS: %s", esp_err_to_name(err));
+        lamp_registry_group_set(index, &previous);
+        return err;
+    }
+    lamp_shadow_clear(MESH_TX_GROUP_INDEX(index));
+    return ESP_OK;
 }
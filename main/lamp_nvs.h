@@ -1,25 +1,85 @@
 #ifndef LAMP_NVS_H
 #define LAMP_NVS_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "esp_err.h"
+#include "sdkconfig.h"
+
+// Define the maximum number of lamps (the host benchmarks build with larger tables)
+#ifndef MAX_LAMPS
+#define MAX_LAMPS CONFIG_MAX_LAMPS
+#endif
+
+// Lamp answers acked Set messages; they are tracked and retried (mesh_tx.h)
+#define LAMP_FLAG_ACKED (1 << 0)
+// Lamp ignores the mesh transition time, the bridge fades it in steps (light_fade.h)
+#define LAMP_FLAG_FADE  (1 << 1)
 
 typedef struct {
     char name[50];
-    char address[8];
+    uint16_t address;   /* Unicast address, 0 if unassigned */
+    uint8_t flags;      /* LAMP_FLAG_* */
 } LampInfo;
 
+// Define the maximum number of mesh groups
+#define MAX_GROUPS 8
+
+// Group addresses usable for lamp groups (0xFF00 and up are fixed groups)
+#define GROUP_ADDR_MIN 0xC000
+#define GROUP_ADDR_MAX 0xFEFF
+
+#define GROUP_MEMBER_WORDS ((MAX_LAMPS + 31) / 32)
+
+// A mesh group is driven with one message to its group address. The member
+// lamps must already subscribe to that address (set up by the provisioner);
+// the member list is used to keep their HA state in sync.
+typedef struct {
+    char name[50];
+    uint16_t address;                       /* Group address */
+    uint32_t members[GROUP_MEMBER_WORDS];   /* One bit per lamp slot */
+} GroupInfo;
+
+static inline bool group_has_member(const GroupInfo *group, int lamp_index)
+{
+    return (group->members[lamp_index / 32] >> (lamp_index % 32)) & 1;
+}
+
+static inline void group_set_member(GroupInfo *group, int lamp_index, bool member)
+{
+    if (member) {
+        group->members[lamp_index / 32] |= 1u << (lamp_index % 32);
+    } else {
+        group->members[lamp_index / 32] &= ~(1u << (lamp_index % 32));
+    }
+}
+
+// Function to load the lamp table from NVS into the lamp registry (call once at boot)
+esp_err_t lamp_nvs_init(void);
 // Function to save lamp information to NVS
 esp_err_t save_lamp_info(LampInfo *lamp_info, int index);
 // Function to load lamp information from NVS
 esp_err_t load_lamp_info(LampInfo *lamp_info, int index);
 // Function to remove a lamp from NVS by index
 esp_err_t remove_lamp_info(int index);
+// Function to save a batch of lamp edits (lamp_registry_edit_fn, lamp_registry.h)
+// with one registry update and one write of the lamp table. New, readdressed
+// and removed lamps lose their state, removed ones their group memberships.
+struct lamp_registry_edit;
+esp_err_t save_lamp_batch(bool (*next)(void *ctx, int n, struct lamp_registry_edit *edit), void *ctx);
 // Function to find the next free index in the NVS store
 int findNextFreeIndexInNVS();
 // Function to find the index of a lamp by its name or address
-int find_index_by_name_or_address(const char *name, const char *address);
+int find_index_by_name_or_address(const char *name, uint16_t address);
 void printAllLampInfo();
 // Function to get the current number of lamps
 int getCurrentNumberOfLamps();
 
+// Function to save group information to NVS
+esp_err_t save_group_info(GroupInfo *group_info, int index);
+// Function to load group information
+esp_err_t load_group_info(GroupInfo *group_info, int index);
+// Function to remove a group from NVS by index
+esp_err_t remove_group_info(int index);
+
 #endif /* LAMP_NVS_H */
@@ -0,0 +1,540 @@
+#include "lamp_registry.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TAG "LAMP_REGISTRY"
+
+// Open addressing hash tables, sized to stay at most half full
+#if MAX_LAMPS <= 32
+#define LAMP_INDEX_SIZE 64
+#elif MAX_LAMPS <= 128
+#define LAMP_INDEX_SIZE 256
+#elif MAX_LAMPS <= 512
+#define LAMP_INDEX_SIZE 1024
+#else
+#define LAMP_INDEX_SIZE 4096
+#endif
+#define LAMP_INDEX_EMPTY -1
+
+_Static_assert(LAMP_INDEX_SIZE >= 2 * MAX_LAMPS, "lamp index too small for MAX_LAMPS");
+_Static_assert((LAMP_INDEX_SIZE & (LAMP_INDEX_SIZE - 1)) == 0, "lamp index size must be a power of two");
+
+#define LAMP_NAME_SIZE sizeof(((LampInfo *)0)->name)
+
+_Static_assert(LAMP_NAME_POOL_SIZE <= UINT16_MAX, "name pool offsets are 16 bit");
+
+// Slot in use; kept in LampEntry.flags next to the LAMP_FLAG_* bits
+#define LAMP_ENTRY_USED 0x80
+
+_Static_assert(((LAMP_FLAG_ACKED | LAMP_FLAG_FADE) & LAMP_ENTRY_USED) == 0, "LAMP_ENTRY_USED clashes with a lamp flag");
+
+typedef struct {
+    uint16_t address;
+    uint16_t name_off;      /* Start of the name in s_names */
+    uint8_t name_len;
+    uint8_t flags;          /* LAMP_FLAG_* and LAMP_ENTRY_USED */
+} LampEntry;
+
+_Static_assert(sizeof(LampEntry) == 6, "LampEntry should stay 6 bytes");
+
+typedef struct {
+    GroupInfo info;
+    bool used;
+} GroupEntry;
+
+static LampEntry s_lamps[MAX_LAMPS];
+// Names of the used slots in slot order, without gaps or terminators
+static char s_names[LAMP_NAME_POOL_SIZE];
+static size_t s_names_used;
+// Only a handful of groups, they are searched linearly
+static GroupEntry s_groups[MAX_GROUPS];
+static int16_t s_slug_index[LAMP_INDEX_SIZE];
+static int16_t s_addr_index[LAMP_INDEX_SIZE];
+static int s_count;
+
+// Legacy HA unique ids, see lamp_registry_set_legacy_id(). An empty id means none.
+#define LEGACY_SLOTS (MAX_LAMPS < LAMP_LEGACY_SLOTS ? MAX_LAMPS : LAMP_LEGACY_SLOTS)
+typedef struct {
+    uint16_t address;
+    char unique_id[LAMP_LEGACY_ID_SIZE];
+} LegacyId;
+static LegacyId s_legacy_ids[LEGACY_SLOTS];
+
+static SemaphoreHandle_t s_lock;
+static StaticSemaphore_t s_lock_buf;
+
+static void registry_lock(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+}
+
+static void registry_unlock(void)
+{
+    xSemaphoreGive(s_lock);
+}
+
+static char slug_char(char c)
+{
+    bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                 (c >= '0' && c <= '9') || c == '_' || c == '-';
+    return valid ? c : '_';
+}
+
+// FNV-1a over the slug of a length-delimited name (a slug hashes to itself)
+static uint32_t hash_slug(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)slug_char(name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Function to compare the slug of a stored name with a slug
+static bool slug_equals(const char *name, size_t name_len, const char *slug, size_t slug_len)
+{
+    if (name_len != slug_len) {
+        return false;
+    }
+    for (size_t i = 0; i < slug_len; i++) {
+        if (slug_char(name[i]) != slug[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t hash_addr(uint16_t addr)
+{
+    return (uint32_t)addr * 2654435761u >> 16;
+}
+
+static void index_insert(int16_t *table, uint32_t hash, int index)
+{
+    uint32_t pos = hash & (LAMP_INDEX_SIZE - 1);
+    while (table[pos] != LAMP_INDEX_EMPTY) {
+        pos = (pos + 1) & (LAMP_INDEX_SIZE - 1);
+    }
+    table[pos] = index;
+}
+
+// Removal from a linear probing table would need tombstones; edits are rare,
+// so both indexes are simply rebuilt from the slot array instead.
+static void rebuild_indexes(void)
+{
+    memset(s_slug_index, 0xff, sizeof(s_slug_index));
+    memset(s_addr_index, 0xff, sizeof(s_addr_index));
+    s_count = 0;
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        const LampEntry *entry = &s_lamps[i];
+        if (!(entry->flags & LAMP_ENTRY_USED)) {
+            continue;
+        }
+        s_count++;
+        index_insert(s_slug_index, hash_slug(s_names + entry->name_off, entry->name_len), i);
+        if (entry->address != 0) {
+            index_insert(s_addr_index, hash_addr(entry->address), i);
+        }
+    }
+}
+
+// Function to put the name of a slot into the pool (len 0 and used false to
+// drop it). Names are kept in slot order, so an edit moves the names of the
+// later slots instead of leaving a gap. Returns false if the pool is full.
+static bool names_replace(int index, const char *name, size_t len, bool used)
+{
+    LampEntry *entry = &s_lamps[index];
+    size_t old_len = (entry->flags & LAMP_ENTRY_USED) ? entry->name_len : 0;
+    if (s_names_used - old_len + len > sizeof(s_names)) {
+        return false;
+    }
+
+    // An unused slot has no name yet, it goes right after the previous used one
+    size_t off = 0;
+    if (entry->flags & LAMP_ENTRY_USED) {
+        off = entry->name_off;
+    } else {
+        for (int i = index - 1; i >= 0; i--) {
+            if (s_lamps[i].flags & LAMP_ENTRY_USED) {
+                off = s_lamps[i].name_off + s_lamps[i].name_len;
+                break;
+            }
+        }
+    }
+    memmove(s_names + off + len, s_names + off + old_len, s_names_used - off - old_len);
+    memcpy(s_names + off, name, len);
+    s_names_used = s_names_used - old_len + len;
+    for (int i = index + 1; i < MAX_LAMPS; i++) {
+        if (s_lamps[i].flags & LAMP_ENTRY_USED) {
+            s_lamps[i].name_off = s_lamps[i].name_off - old_len + len;
+        }
+    }
+    entry->name_off = off;
+    entry->name_len = len;
+    entry->flags = used ? LAMP_ENTRY_USED : 0;
+    return true;
+}
+
+// Function to copy a slot out of the packed table. Called with the lock held.
+static void entry_to_info(const LampEntry *entry, LampInfo *lamp_info)
+{
+    memcpy(lamp_info->name, s_names + entry->name_off, entry->name_len);
+    lamp_info->name[entry->name_len] = '\0';
+    lamp_info->address = entry->address;
+    lamp_info->flags = entry->flags & ~LAMP_ENTRY_USED;
+}
+
+esp_err_t lamp_registry_init(void)
+{
+    s_lock = xSemaphoreCreateMutexStatic(&s_lock_buf);
+    memset(s_lamps, 0, sizeof(s_lamps));
+    memset(s_groups, 0, sizeof(s_groups));
+    s_names_used = 0;
+    rebuild_indexes();
+    return ESP_OK;
+}
+
+void lamp_slugify(const char *name, char *slug, size_t slug_size)
+{
+    size_t i = 0;
+    for (; name[i] != '\0' && i + 1 < slug_size; i++) {
+        slug[i] = slug_char(name[i]);
+    }
+    slug[i] = '\0';
+}
+
+uint16_t lamp_parse_address(const char *address)
+{
+    char *endptr;
+    long value = strtol(address, &endptr, 0);
+    if (endptr == address || *endptr != '\0' || value <= 0 || value > 0xFFFF) {
+        return 0;
+    }
+    return (uint16_t)value;
+}
+
+// Function to store a lamp in a slot whose name is known to fit the pool.
+// Called with the lock held; the indexes still have to be rebuilt.
+static void entry_store(int index, const LampInfo *lamp_info, size_t len)
+{
+    names_replace(index, lamp_info->name, len, true);
+    LampEntry *entry = &s_lamps[index];
+    entry->address = lamp_info->address;
+    entry->flags |= lamp_info->flags & ~LAMP_ENTRY_USED;
+    if (entry->address == 0) {
+        ESP_LOGW(TAG, "Lamp %.*s has no valid address", (int)len, lamp_info->name);
+    }
+}
+
+// Function to clear a slot. Called with the lock held.
+static void entry_clear(int index)
+{
+    names_replace(index, "", 0, false);
+    s_lamps[index].address = 0;
+}
+
+esp_err_t lamp_registry_set(int index, const LampInfo *lamp_info)
+{
+    if (index < 0 || index >= MAX_LAMPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t len = strnlen(lamp_info->name, LAMP_NAME_SIZE - 1);
+    registry_lock();
+    size_t old_len = (s_lamps[index].flags & LAMP_ENTRY_USED) ? s_lamps[index].name_len : 0;
+    if (s_names_used - old_len + len > sizeof(s_names)) {
+        registry_unlock();
+        ESP_LOGE(TAG, "No room for the name of lamp %.*s (%u of %u name bytes used)",
+                 (int)len, lamp_info->name, (unsigned)s_names_used, (unsigned)sizeof(s_names));
+        return ESP_ERR_NO_MEM;
+    }
+    entry_store(index, lamp_info, len);
+    rebuild_indexes();
+    registry_unlock();
+    return ESP_OK;
+}
+
+void lamp_registry_remove(int index)
+{
+    if (index < 0 || index >= MAX_LAMPS) {
+        return;
+    }
+    registry_lock();
+    entry_clear(index);
+    rebuild_indexes();
+    registry_unlock();
+}
+
+esp_err_t lamp_registry_apply(lamp_registry_edit_fn next, void *ctx)
+{
+    lamp_registry_edit_t edit;
+
+    registry_lock();
+    // Every slot occurs once, so the pool use after the batch is known up front
+    size_t names_used = s_names_used;
+    for (int n = 0; next(ctx, n, &edit); n++) {
+        if (edit.index < 0 || edit.index >= MAX_LAMPS) {
+            registry_unlock();
+            return ESP_ERR_INVALID_ARG;
+        }
+        const LampEntry *entry = &s_lamps[edit.index];
+        names_used -= (entry->flags & LAMP_ENTRY_USED) ? entry->name_len : 0;
+        names_used += edit.remove ? 0 : strnlen(edit.info.name, LAMP_NAME_SIZE - 1);
+    }
+    if (names_used > sizeof(s_names)) {
+        registry_unlock();
+        ESP_LOGE(TAG, "No room for the names of the batch (%u of %u name bytes needed)",
+                 (unsigned)names_used, (unsigned)sizeof(s_names));
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int n = 0; next(ctx, n, &edit); n++) {
+        if (edit.remove) {
+            entry_clear(edit.index);
+        } else {
+            entry_store(edit.index, &edit.info, strnlen(edit.info.name, LAMP_NAME_SIZE - 1));
+        }
+    }
+    rebuild_indexes();
+    registry_unlock();
+    return ESP_OK;
+}
+
+bool lamp_registry_get(int index, LampInfo *lamp_info)
+{
+    if (index < 0 || index >= MAX_LAMPS) {
+        return false;
+    }
+    registry_lock();
+    bool used = s_lamps[index].flags & LAMP_ENTRY_USED;
+    if (used && lamp_info) {
+        entry_to_info(&s_lamps[index], lamp_info);
+    }
+    registry_unlock();
+    return used;
+}
+
+int lamp_registry_find_by_slug(const char *slug, size_t slug_len, LampInfo *lamp_info)
+{
+    int found = -1;
+    if (slug_len >= LAMP_NAME_SIZE) {
+        return -1;
+    }
+    registry_lock();
+    uint32_t pos = hash_slug(slug, slug_len) & (LAMP_INDEX_SIZE - 1);
+    while (s_slug_index[pos] != LAMP_INDEX_EMPTY) {
+        const LampEntry *entry = &s_lamps[s_slug_index[pos]];
+        if (slug_equals(s_names + entry->name_off, entry->name_len, slug, slug_len)) {
+            found = s_slug_index[pos];
+            if (lamp_info) {
+                entry_to_info(entry, lamp_info);
+            }
+            break;
+        }
+        pos = (pos + 1) & (LAMP_INDEX_SIZE - 1);
+    }
+    registry_unlock();
+    return found;
+}
+
+// Names that only differ in characters replaced by the slug share a topic,
+// so they are treated as the same lamp
+int lamp_registry_find_by_name(const char *name, LampInfo *lamp_info)
+{
+    char slug[LAMP_NAME_SIZE];
+    lamp_slugify(name, slug, sizeof(slug));
+    return lamp_registry_find_by_slug(slug, strlen(slug), lamp_info);
+}
+
+int lamp_registry_find_by_addr(uint16_t addr, LampInfo *lamp_info)
+{
+    int found = -1;
+    if (addr == 0) {
+        return -1;
+    }
+    registry_lock();
+    uint32_t pos = hash_addr(addr) & (LAMP_INDEX_SIZE - 1);
+    while (s_addr_index[pos] != LAMP_INDEX_EMPTY) {
+        const LampEntry *entry = &s_lamps[s_addr_index[pos]];
+        if (entry->address == addr) {
+            found = s_addr_index[pos];
+            if (lamp_info) {
+                entry_to_info(entry, lamp_info);
+            }
+            break;
+        }
+        pos = (pos + 1) & (LAMP_INDEX_SIZE - 1);
+    }
+    registry_unlock();
+    return found;
+}
+
+void lamp_registry_set_legacy_id(int index, uint16_t address, const char *unique_id)
+{
+    if (index < 0 || index >= LEGACY_SLOTS) {
+        return;
+    }
+    s_legacy_ids[index].address = address;
+    snprintf(s_legacy_ids[index].unique_id, sizeof(s_legacy_ids[index].unique_id), "%s", unique_id);
+}
+
+void lamp_registry_unique_id(int index, uint16_t address, char *unique_id, size_t size)
+{
+    // A readdressed lamp or a new one in the slot is a new entity in HA anyway
+    if (index >= 0 && index < LEGACY_SLOTS && s_legacy_ids[index].unique_id[0] != '\0' &&
+        s_legacy_ids[index].address == address) {
+        snprintf(unique_id, size, "%s", s_legacy_ids[index].unique_id);
+        return;
+    }
+    snprintf(unique_id, size, "0x%04X", address);
+}
+
+int lamp_registry_next_free(void)
+{
+    int free_index = -1;
+    registry_lock();
+    for (int i = 0; i < MAX_LAMPS; i++) {
+        if (!(s_lamps[i].flags & LAMP_ENTRY_USED)) {
+            free_index = i;
+            break;
+        }
+    }
+    registry_unlock();
+    return free_index;
+}
+
+int lamp_registry_count(void)
+{
+    registry_lock();
+    int count = s_count;
+    registry_unlock();
+    return count;
+}
+
+size_t lamp_registry_name_bytes(size_t *pool_size)
+{
+    registry_lock();
+    size_t used = s_names_used;
+    registry_unlock();
+    if (pool_size) {
+        *pool_size = sizeof(s_names);
+    }
+    return used;
+}
+
+void lamp_registry_group_set(int index, const GroupInfo *group_info)
+{
+    if (index < 0 || index >= MAX_GROUPS) {
+        return;
+    }
+    registry_lock();
+    GroupEntry *entry = &s_groups[index];
+    entry->info = *group_info;
+    entry->info.name[sizeof(entry->info.name) - 1] = '\0';
+    entry->used = true;
+    registry_unlock();
+}
+
+void lamp_registry_group_remove(int index)
+{
+    if (index < 0 || index >= MAX_GROUPS) {
+        return;
+    }
+    registry_lock();
+    memset(&s_groups[index], 0, sizeof(s_groups[index]));
+    registry_unlock();
+}
+
+bool lamp_registry_group_get(int index, GroupInfo *group_info)
+{
+    if (index < 0 || index >= MAX_GROUPS) {
+        return false;
+    }
+    registry_lock();
+    bool used = s_groups[index].used;
+    if (used && group_info) {
+        *group_info = s_groups[index].info;
+    }
+    registry_unlock();
+    return used;
+}
+
+int lamp_registry_group_find_by_slug(const char *slug, size_t slug_len, GroupInfo *group_info)
+{
+    int found = -1;
+    if (slug_len >= LAMP_NAME_SIZE) {
+        return -1;
+    }
+    registry_lock();
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        const GroupEntry *entry = &s_groups[i];
+        if (entry->used && slug_equals(entry->info.name, strlen(entry->info.name), slug, slug_len)) {
+            found = i;
+            if (group_info) {
+                *group_info = entry->info;
+            }
+            break;
+        }
+    }
+    registry_unlock();
+    return found;
+}
+
+int lamp_registry_group_find_by_name(const char *name, GroupInfo *group_info)
+{
+    char slug[LAMP_NAME_SIZE];
+    lamp_slugify(name, slug, sizeof(slug));
+    return lamp_registry_group_find_by_slug(slug, strlen(slug), group_info);
+}
+
+int lamp_registry_group_find_by_addr(uint16_t addr, GroupInfo *group_info)
+{
+    int found = -1;
+    registry_lock();
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        if (s_groups[i].used && s_groups[i].info.address == addr) {
+            found = i;
+            if (group_info) {
+                *group_info = s_groups[i].info;
+            }
+            break;
+        }
+    }
+    registry_unlock();
+    return found;
+}
+
+int lamp_registry_group_next_free(void)
+{
+    int free_index = -1;
+    registry_lock();
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        if (!s_groups[i].used) {
+            free_index = i;
+            break;
+        }
+    }
+    registry_unlock();
+    return free_index;
+}
+
+bool lamp_registry_group_drop_member(int lamp_index)
+{
+    bool changed = false;
+    if (lamp_index < 0 || lamp_index >= MAX_LAMPS) {
+        return false;
+    }
+    registry_lock();
+    for (int i = 0; i < MAX_GROUPS; i++) {
+        if (s_groups[i].used && group_has_member(&s_groups[i].info, lamp_index)) {
+            group_set_member(&s_groups[i].info, lamp_index, false);
+            changed = true;
+        }
+    }
+    registry_unlock();
+    return changed;
+}
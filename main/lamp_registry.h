@@ -0,0 +1,99 @@
+#ifndef LAMP_REGISTRY_H
+#define LAMP_REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "lamp_nvs.h"
+
+// In-RAM copy of the lamp table. It is filled once from NVS at boot and kept
+// in sync by the lamp_nvs.c save/remove functions, so lookups on the MQTT and
+// mesh paths never touch flash. Slots are 6 bytes, names live in a shared
+// pool, and slug and address lookups go through hash indexes.
+
+// Lamp names are stored back to back in one pool instead of a 50 byte array
+// per slot, sized for 24 characters on average; a single name may still use
+// the full LampInfo.name length
+#ifndef LAMP_NAME_POOL_SIZE
+#define LAMP_NAME_POOL_SIZE (MAX_LAMPS * 24)
+#endif
+
+// The legacy per-key layout had 20 slots and kept addresses as up to 6 characters
+#define LAMP_LEGACY_SLOTS       20
+#define LAMP_LEGACY_ID_SIZE     7
+
+// Function to initialize the (empty) registry
+esp_err_t lamp_registry_init(void);
+// Function to store a lamp in a slot, replacing whatever was there. Returns
+// ESP_ERR_NO_MEM (and leaves the slot as it was) if the name pool is full.
+esp_err_t lamp_registry_set(int index, const LampInfo *lamp_info);
+// Function to clear a slot
+void lamp_registry_remove(int index);
+
+// One change of a lamp_registry_apply() batch
+typedef struct lamp_registry_edit {
+    int index;          /* Slot, each slot at most once per batch */
+    bool remove;        /* Clear the slot, info is ignored */
+    LampInfo info;
+} lamp_registry_edit_t;
+
+// Function to produce the n-th edit of a batch (n counts up from 0), returns
+// false after the last one. It is called with the registry locked and must
+// not use the registry itself.
+typedef bool (*lamp_registry_edit_fn)(void *ctx, int n, lamp_registry_edit_t *edit);
+
+// Function to apply a batch of edits under one lock with a single index
+// rebuild. The edits are walked twice, first to check that the names fit:
+// returns ESP_ERR_NO_MEM (and changes nothing) if they do not.
+esp_err_t lamp_registry_apply(lamp_registry_edit_fn next, void *ctx);
+// Function to copy the lamp in a slot, returns false if the slot is empty
+bool lamp_registry_get(int index, LampInfo *lamp_info);
+// Function to find a lamp by name, returns -1 if not found
+int lamp_registry_find_by_name(const char *name, LampInfo *lamp_info);
+// Function to find a lamp by its topic slug (not necessarily NUL-terminated), returns -1 if not found
+int lamp_registry_find_by_slug(const char *slug, size_t slug_len, LampInfo *lamp_info);
+// Function to find a lamp by its unicast address, returns -1 if not found
+int lamp_registry_find_by_addr(uint16_t addr, LampInfo *lamp_info);
+// Function to get the first free slot, returns -1 if the table is full
+int lamp_registry_next_free(void);
+// Function to set the HA unique id a lamp had under the legacy per-key layout,
+// which used the address text as the user typed it ("19", "0x13"). Only the
+// slots of the legacy table have one; set at boot before any other task runs.
+void lamp_registry_set_legacy_id(int index, uint16_t address, const char *unique_id);
+// Function to get the HA unique id of a lamp: its legacy one while the lamp
+// keeps the address it was migrated with, else the address as "0x%04X"
+void lamp_registry_unique_id(int index, uint16_t address, char *unique_id, size_t size);
+// Function to get the number of configured lamps
+int lamp_registry_count(void);
+// Function to get the bytes used in the name pool, and optionally its size
+size_t lamp_registry_name_bytes(size_t *pool_size);
+
+// Groups live next to the lamps; their names share the slug namespace
+// because both are exposed as homeassistant/light/<slug>
+
+// Function to store a group in a slot, replacing whatever was there
+void lamp_registry_group_set(int index, const GroupInfo *group_info);
+// Function to clear a group slot
+void lamp_registry_group_remove(int index);
+// Function to copy the group in a slot, returns false if the slot is empty
+bool lamp_registry_group_get(int index, GroupInfo *group_info);
+// Function to find a group by name, returns -1 if not found
+int lamp_registry_group_find_by_name(const char *name, GroupInfo *group_info);
+// Function to find a group by its topic slug (not necessarily NUL-terminated), returns -1 if not found
+int lamp_registry_group_find_by_slug(const char *slug, size_t slug_len, GroupInfo *group_info);
+// Function to find a group by its group address, returns -1 if not found
+int lamp_registry_group_find_by_addr(uint16_t addr, GroupInfo *group_info);
+// Function to get the first free group slot, returns -1 if the table is full
+int lamp_registry_group_next_free(void);
+// Function to drop a lamp slot from every group, returns true if any group changed
+bool lamp_registry_group_drop_member(int lamp_index);
+
+// Function to derive the MQTT topic segment of a lamp name: every character
+// outside [A-Za-z0-9_-] becomes '_', so the slug is a single valid topic level
+void lamp_slugify(const char *name, char *slug, size_t slug_size);
+// Function to parse a lamp address string ("0x0013" or "19"), returns 0 if invalid
+uint16_t lamp_parse_address(const char *address);
+
+#endif /* LAMP_REGISTRY_H */
@@ -0,0 +1,58 @@
+#include "lamp_shadow.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+
+static lamp_shadow_t s_shadow[MESH_TX_INDEX_COUNT];
+// Entries are 8 bytes, a spinlock is cheaper than a mutex for copying them
+static portMUX_TYPE s_shadow_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void lamp_shadow_get(int index, lamp_shadow_t *shadow)
+{
+    if (index < 0 || index >= MESH_TX_INDEX_COUNT) {
+        memset(shadow, 0, sizeof(*shadow));
+        return;
+    }
+    portENTER_CRITICAL(&s_shadow_lock);
+    *shadow = s_shadow[index];
+    portEXIT_CRITICAL(&s_shadow_lock);
+}
+
+void lamp_shadow_set(int index, const lamp_shadow_t *shadow)
+{
+    if (index < 0 || index >= MESH_TX_INDEX_COUNT) {
+        return;
+    }
+    portENTER_CRITICAL(&s_shadow_lock);
+    s_shadow[index] = *shadow;
+    portEXIT_CRITICAL(&s_shadow_lock);
+}
+
+bool lamp_shadow_merge(int index, const lamp_shadow_t *update)
+{
+    if (index < 0 || index >= MESH_TX_INDEX_COUNT) {
+        return false;
+    }
+    portENTER_CRITICAL(&s_shadow_lock);
+    lamp_shadow_t *shadow = &s_shadow[index];
+    lamp_shadow_t before = *shadow;
+    if (update->known & LAMP_SHADOW_ONOFF) {
+        shadow->onoff = update->onoff;
+    }
+    if (update->known & LAMP_SHADOW_LIGHTNESS) {
+        shadow->lightness = update->lightness;
+    }
+    if (update->known & LAMP_SHADOW_COLOR) {
+        shadow->hue = update->hue;
+        shadow->saturation = update->saturation;
+    }
+    shadow->known |= update->known;
+    bool changed = memcmp(&before, shadow, sizeof(before)) != 0;
+    portEXIT_CRITICAL(&s_shadow_lock);
+    return changed;
+}
+
+void lamp_shadow_clear(int index)
+{
+    const lamp_shadow_t empty = {0};
+    lamp_shadow_set(index, &empty);
+}
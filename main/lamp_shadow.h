@@ -0,0 +1,37 @@
+#ifndef LAMP_SHADOW_H
+#define LAMP_SHADOW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mesh_tx.h"
+
+// Last known light state per lamp and group, in mesh units. Indexed like
+// mesh_cmd_t.index: lamp slots first, then MESH_TX_GROUP_INDEX(group).
+
+// Attributes with a known value (lamp_shadow_t.known)
+#define LAMP_SHADOW_ONOFF       (1 << 0)
+#define LAMP_SHADOW_LIGHTNESS   (1 << 1)
+#define LAMP_SHADOW_COLOR       (1 << 2)    /* hue and saturation */
+
+typedef struct {
+    uint16_t lightness;     /* 0-65535, the HA brightness (not the HSL lightness) */
+    uint16_t hue;           /* 0-65535 */
+    uint16_t saturation;    /* 0-65535 */
+    uint8_t onoff;
+    uint8_t known;          /* LAMP_SHADOW_* bits */
+} lamp_shadow_t;
+
+_Static_assert(sizeof(lamp_shadow_t) == 8, "lamp_shadow_t should stay 8 bytes");
+
+// Function to copy the shadow of a lamp or group (all zero if out of range)
+void lamp_shadow_get(int index, lamp_shadow_t *shadow);
+// Function to replace the shadow of a lamp or group
+void lamp_shadow_set(int index, const lamp_shadow_t *shadow);
+// Function to take over the attributes flagged in update->known, e.g. from a
+// status message. Returns true if any value changed or became known.
+bool lamp_shadow_merge(int index, const lamp_shadow_t *update);
+// Function to forget everything known about a lamp or group
+void lamp_shadow_clear(int index);
+
+#endif /* LAMP_SHADOW_H */
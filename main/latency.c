@@ -0,0 +1,179 @@
+#include "latency.h"
+#include <string.h>
+
+#include "lamp_nvs.h"
+
+// Stages kept per lamp, index into s_lamp_hist
+#define LATENCY_LAMP_STAGES 2
+// Lamp histograms have one bucket per power of two (four fine buckets each),
+// bucket 0 below 16 us and the last one from 4.2 s
+#define LATENCY_LAMP_BUCKETS (1 + (LATENCY_BUCKETS - 2) / 4 + 1)
+
+static volatile uint32_t s_hist[LATENCY_STAGE_COUNT][LATENCY_BUCKETS];
+static volatile uint8_t s_lamp_hist[MAX_LAMPS][LATENCY_LAMP_STAGES][LATENCY_LAMP_BUCKETS];
+
+static const char *s_stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_PARSE] = "parse",
+    [LATENCY_QUEUE] = "queue",
+    [LATENCY_SEND] = "send",
+    [LATENCY_ACK] = "ack",
+    [LATENCY_TOTAL] = "total",
+};
+
+static int lamp_stage(latency_stage_t stage)
+{
+    switch (stage) {
+    case LATENCY_ACK:
+        return 0;
+    case LATENCY_TOTAL:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static int bucket_of(uint32_t us)
+{
+    if (us < 16) {
+        return 0;
+    }
+    int exp = 31 - __builtin_clz(us);
+    int sub = (us >> (exp - 2)) & 3;
+    int bucket = 1 + (exp - 4) * 4 + sub;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+static uint32_t bucket_low(int bucket)
+{
+    if (bucket == 0) {
+        return 0;
+    }
+    int exp = 4 + (bucket - 1) / 4;
+    int sub = (bucket - 1) % 4;
+    return (uint32_t)(4 + sub) << (exp - 2);
+}
+
+static int lamp_bucket_of(int bucket)
+{
+    return bucket == 0 ? 0 : 1 + (bucket - 1) / 4;
+}
+
+static uint32_t lamp_bucket_low(int bucket)
+{
+    return bucket == 0 ? 0 : 16u << (bucket - 1);
+}
+
+uint32_t latency_bucket_limit(int bucket)
+{
+    return bucket >= LATENCY_BUCKETS - 1 ? UINT32_MAX : bucket_low(bucket + 1);
+}
+
+void latency_record(latency_stage_t stage, int lamp_index, uint32_t us)
+{
+    if (stage >= LATENCY_STAGE_COUNT) {
+        return;
+    }
+    int bucket = bucket_of(us);
+    s_hist[stage][bucket]++;
+
+    int slot = lamp_stage(stage);
+    if (lamp_index < 0 || lamp_index >= MAX_LAMPS || slot < 0) {
+        return;
+    }
+    volatile uint8_t *hist = s_lamp_hist[lamp_index][slot];
+    bucket = lamp_bucket_of(bucket);
+    if (hist[bucket] == UINT8_MAX) {
+        for (int i = 0; i < LATENCY_LAMP_BUCKETS; i++) {
+            hist[i] /= 2;
+        }
+    }
+    hist[bucket]++;
+}
+
+void latency_reset_lamp(int lamp_index)
+{
+    if (lamp_index < 0 || lamp_index >= MAX_LAMPS) {
+        return;
+    }
+    for (int slot = 0; slot < LATENCY_LAMP_STAGES; slot++) {
+        for (int i = 0; i < LATENCY_LAMP_BUCKETS; i++) {
+            s_lamp_hist[lamp_index][slot][i] = 0;
+        }
+    }
+}
+
+void latency_buckets(latency_stage_t stage, uint32_t counts[LATENCY_BUCKETS])
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = stage < LATENCY_STAGE_COUNT ? s_hist[stage][i] : 0;
+    }
+}
+
+// Function to copy the counts of a bridge (lamp_index -1) or lamp histogram,
+// returns the number of buckets, 0 if the stage is not kept
+static int copy_counts(latency_stage_t stage, int lamp_index, uint32_t counts[LATENCY_BUCKETS])
+{
+    if (stage >= LATENCY_STAGE_COUNT || lamp_index >= MAX_LAMPS) {
+        return 0;
+    }
+    if (lamp_index < 0) {
+        latency_buckets(stage, counts);
+        return LATENCY_BUCKETS;
+    }
+    int slot = lamp_stage(stage);
+    if (slot < 0) {
+        return 0;
+    }
+    for (int i = 0; i < LATENCY_LAMP_BUCKETS; i++) {
+        counts[i] = s_lamp_hist[lamp_index][slot][i];
+    }
+    return LATENCY_LAMP_BUCKETS;
+}
+
+uint32_t latency_count(latency_stage_t stage, int lamp_index)
+{
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t total = 0;
+    int buckets = copy_counts(stage, lamp_index, counts);
+    for (int i = 0; i < buckets; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+uint32_t latency_percentile(latency_stage_t stage, int lamp_index, int percent)
+{
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t total = 0;
+    int buckets = copy_counts(stage, lamp_index, counts);
+    for (int i = 0; i < buckets; i++) {
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    // Rank of the sample, rounded up so p100 is the last sample
+    uint64_t rank = ((uint64_t)total * percent + 99) / 100;
+    uint64_t below = 0;
+    for (int i = 0; i < buckets; i++) {
+        if (below + counts[i] < rank) {
+            below += counts[i];
+            continue;
+        }
+        bool fine = buckets == LATENCY_BUCKETS;
+        uint32_t low = fine ? bucket_low(i) : lamp_bucket_low(i);
+        // The open last bucket is reported at its lower bound
+        if (i == buckets - 1) {
+            return low;
+        }
+        uint32_t high = fine ? latency_bucket_limit(i) : lamp_bucket_low(i + 1);
+        return low + (uint32_t)((uint64_t)(high - low) * (rank - below) / counts[i]);
+    }
+    return 0;
+}
+
+const char *latency_stage_name(latency_stage_t stage)
+{
+    return stage < LATENCY_STAGE_COUNT ? s_stage_names[stage] : "unknown";
+}
@@ -0,0 +1,61 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_timer.h"
+
+/*
+ * Command latency histograms.
+ *
+ * Every command carries the time it was received from MQTT and queued
+ * (mesh_cmd_t). The stages are recorded into fixed buckets, four per power
+ * of two (at most 25% wide), so recording is an increment and reading a
+ * percentile is one pass over LATENCY_BUCKETS counters. Each histogram has a
+ * single writer (PARSE the MQTT task, the rest the mesh TX task), so no
+ * locking is needed. Bridge fade steps are not commands and are not
+ * recorded; the fade's target counts from its MQTT receive.
+ *
+ * ACK and TOTAL are also kept per lamp slot, they are the stages in which
+ * lamps differ; the other stages only depend on the bridge itself. To stay
+ * small with hundreds of lamps the lamp histograms have one bucket per power
+ * of two and 8 bit counters that are halved when one would overflow, so they
+ * keep their shape and favour recent samples.
+ */
+
+typedef enum {
+    LATENCY_PARSE,      /* MQTT receive to queued: routing, JSON parse, validation */
+    LATENCY_QUEUE,      /* Queued to the start of the mesh send (includes coalescing waits) */
+    LATENCY_SEND,       /* Duration of the esp_ble_mesh_*_set_state call */
+    LATENCY_ACK,        /* First send to the lamp's answer (acked mode, includes retries) */
+    LATENCY_TOTAL,      /* MQTT receive to sent (unacked) or answered (acked) */
+    LATENCY_STAGE_COUNT,
+} latency_stage_t;
+
+// Bucket 0 is below 16 us, then four buckets per power of two up to 2^23 us;
+// the last one holds everything from 7.3 s
+#define LATENCY_BUCKETS 77
+
+// Microsecond timestamp for the stage arithmetic; wraps after 71 minutes, differences stay correct
+static inline uint32_t latency_now(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+// Function to add a sample; lamp_index is the lamp slot, or -1 (groups, bridge-only stages)
+void latency_record(latency_stage_t stage, int lamp_index, uint32_t us);
+// Function to get the number of samples of a stage, for one lamp if lamp_index >= 0
+uint32_t latency_count(latency_stage_t stage, int lamp_index);
+// Function to estimate a percentile (1-100) in us, interpolated within its bucket; 0 without samples
+uint32_t latency_percentile(latency_stage_t stage, int lamp_index, int percent);
+// Function to clear the histograms of a lamp slot when it gets another lamp.
+// A sample the TX task records at the same moment may survive.
+void latency_reset_lamp(int lamp_index);
+// Function to copy the bucket counts of the bridge-wide histogram
+void latency_buckets(latency_stage_t stage, uint32_t counts[LATENCY_BUCKETS]);
+// Function to get the upper bound of a bucket in us (UINT32_MAX for the last one)
+uint32_t latency_bucket_limit(int bucket);
+// Function to get the short name of a stage ("parse", "queue", ...)
+const char *latency_stage_name(latency_stage_t stage);
+
+#endif /* LATENCY_H */
@@ -0,0 +1,217 @@
+#include "light_fade.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "sdkconfig.h"
+
+
+#define TAG "FADE"
+
+#define LIGHT_FADE_STEP_MS      CONFIG_LIGHT_FADE_STEP_MS
+#define LIGHT_FADE_MAX_STEPS    CONFIG_LIGHT_FADE_MAX_STEPS
+#define LIGHT_FADE_MAX_ACTIVE   CONFIG_LIGHT_FADE_MAX_ACTIVE
+
+typedef struct {
+    mesh_cmd_t target;          /* Sent as the last step */
+    uint16_t from_lightness;
+    uint16_t from_hue;
+    uint16_t from_saturation;
+    uint16_t to_lightness;      /* 0 for a fade to off */
+    uint32_t start_ms;
+    uint32_t duration_ms;
+    uint8_t steps;              /* Including the last one */
+    uint8_t done;               /* Steps queued so far */
+    uint8_t gen;                /* Bumped on every start and cancel */
+    bool active;
+} fade_slot_t;
+
+static fade_slot_t s_slots[LIGHT_FADE_MAX_ACTIVE];
+static light_fade_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t fade_now_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+// Function to find the slot fading a lamp, -1 if none. Called with the lock held.
+static int slot_find(int index)
+{
+    for (int i = 0; i < LIGHT_FADE_MAX_ACTIVE; i++) {
+        if (s_slots[i].active && s_slots[i].target.index == index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool light_fade_start(const mesh_cmd_t *target, const lamp_shadow_t *from, uint32_t duration_ms)
+{
+    uint32_t steps = duration_ms / LIGHT_FADE_STEP_MS;
+    if (steps > LIGHT_FADE_MAX_STEPS) {
+        steps = LIGHT_FADE_MAX_STEPS;
+    }
+
+    // Without a known start (e.g. not polled since a reboot) a fade would
+    // start from a guess and jump first, the caller sends the target instead
+    bool known_off = (from->known & LAMP_SHADOW_ONOFF) && !from->onoff;
+    if (!(from->known & LAMP_SHADOW_ONOFF) || (!known_off && !(from->known & LAMP_SHADOW_LIGHTNESS))) {
+        light_fade_cancel(target->index);
+        return false;
+    }
+
+    fade_slot_t fade = {
+        .target = *target,
+        .from_lightness = known_off ? 0 : from->lightness,
+        .from_hue = target->hue,
+        .from_saturation = target->saturation,
+        .to_lightness = target->type == MESH_CMD_ONOFF ? 0 : target->lightness,
+        .duration_ms = duration_ms,
+        .steps = steps,
+        .active = true,
+    };
+    // Without a known colour only the lightness fades
+    if (target->type == MESH_CMD_HSL && (from->known & LAMP_SHADOW_COLOR)) {
+        fade.from_hue = from->hue;
+        fade.from_saturation = from->saturation;
+    }
+    bool moves = fade.from_lightness != fade.to_lightness || fade.from_hue != target->hue ||
+                 fade.from_saturation != target->saturation;
+    if (steps < 2 || !moves) {
+        light_fade_cancel(target->index);
+        return false;
+    }
+
+    bool started = false;
+    portENTER_CRITICAL(&s_lock);
+    int slot = slot_find(target->index);
+    for (int i = 0; slot < 0 && i < LIGHT_FADE_MAX_ACTIVE; i++) {
+        if (!s_slots[i].active) {
+            slot = i;
+        }
+    }
+    if (slot >= 0) {
+        fade.start_ms = fade_now_ms();
+        fade.gen = s_slots[slot].gen + 1;
+        s_slots[slot] = fade;
+        s_stats.started++;
+        started = true;
+    } else {
+        s_stats.busy++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return started;
+}
+
+void light_fade_cancel(int index)
+{
+    portENTER_CRITICAL(&s_lock);
+    int slot = slot_find(index);
+    if (slot >= 0) {
+        s_slots[slot].active = false;
+        s_slots[slot].gen++;
+        s_stats.cancelled++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+bool light_fade_active(void)
+{
+    bool active = false;
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < LIGHT_FADE_MAX_ACTIVE && !active; i++) {
+        active = s_slots[i].active;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return active;
+}
+
+// Function to build step k (1..steps) of a fade, the last one is the target
+static void fade_step(const fade_slot_t *fade, int k, mesh_cmd_t *cmd)
+{
+    *cmd = fade->target;
+    if (k == fade->steps) {
+        return;
+    }
+    cmd->type = fade->target.type == MESH_CMD_HSL ? MESH_CMD_HSL : MESH_CMD_LIGHTNESS;
+    cmd->flags = (cmd->flags & ~MESH_CMD_FLAG_ACKED) | MESH_CMD_FLAG_FADE_STEP;
+    cmd->lightness = fade->from_lightness + ((int32_t)fade->to_lightness - fade->from_lightness) * k / fade->steps;
+    if (cmd->type == MESH_CMD_HSL) {
+        // The hue wraps around, the short way is the 16 bit difference taken as signed
+        int16_t hue_diff = (int16_t)(uint16_t)(fade->target.hue - fade->from_hue);
+        cmd->hue = (uint16_t)(fade->from_hue + (int32_t)hue_diff * k / fade->steps);
+        cmd->saturation = fade->from_saturation +
+                          ((int32_t)fade->target.saturation - fade->from_saturation) * k / fade->steps;
+    }
+}
+
+uint32_t light_fade_run(esp_err_t (*submit)(const mesh_cmd_t *cmd))
+{
+    mesh_cmd_t cmds[LIGHT_FADE_MAX_ACTIVE];
+    uint8_t slots[LIGHT_FADE_MAX_ACTIVE];
+    uint8_t gens[LIGHT_FADE_MAX_ACTIVE];
+    int count = 0;
+    uint32_t wait_ms = UINT32_MAX;
+    uint32_t now = fade_now_ms();
+
+    // Pick the due steps under the lock, submit them after it (the caller keeps
+    // newer commands out until then, see light_fade.h)
+    portENTER_CRITICAL(&s_lock);
+    for (int i = 0; i < LIGHT_FADE_MAX_ACTIVE; i++) {
+        fade_slot_t *fade = &s_slots[i];
+        if (!fade->active) {
+            continue;
+        }
+        uint32_t elapsed = now - fade->start_ms;
+        uint32_t due = elapsed >= fade->duration_ms ? fade->steps
+                                                    : (uint64_t)elapsed * fade->steps / fade->duration_ms;
+        if (due > fade->done) {
+            fade_step(fade, due, &cmds[count]);
+            slots[count] = i;
+            gens[count] = fade->gen;
+            count++;
+            fade->done = due;
+            fade->active = due < fade->steps;
+        }
+        if (fade->active) {
+            uint32_t next = fade->start_ms + (uint64_t)(fade->done + 1) * fade->duration_ms / fade->steps;
+            uint32_t wait = next - now;
+            wait_ms = wait < wait_ms ? wait : wait_ms;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    for (int i = 0; i < count; i++) {
+        esp_err_t err = submit(&cmds[i]);
+        bool last = !(cmds[i].flags & MESH_CMD_FLAG_FADE_STEP);
+        portENTER_CRITICAL(&s_lock);
+        fade_slot_t *fade = &s_slots[slots[i]];
+        if (err == ESP_OK) {
+            s_stats.steps += !last;
+        } else {
+            s_stats.skipped++;
+            // The target must get through, try again unless a newer command took over
+            if (last && fade->gen == gens[i] && slot_find(cmds[i].index) < 0) {
+                fade->active = true;
+                fade->done = fade->steps - 1;
+                wait_ms = wait_ms < LIGHT_FADE_STEP_MS ? wait_ms : LIGHT_FADE_STEP_MS;
+            }
+        }
+        portEXIT_CRITICAL(&s_lock);
+        if (err != ESP_OK) {
+            ESP_LOGD(TAG, "Fade step for 0x%04X not queued", cmds[i].addr);
+        }
+    }
+    return wait_ms;
+}
+
+void light_fade_get_stats(light_fade_stats_t *stats)
+{
+    portENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    stats->active = 0;
+    for (int i = 0; i < LIGHT_FADE_MAX_ACTIVE; i++) {
+        stats->active += s_slots[i].active;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,64 @@
+#ifndef LIGHT_FADE_H
+#define LIGHT_FADE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#include "mesh_tx.h"
+#include "lamp_shadow.h"
+
+/*
+ * Bridge-side fades for lamps that ignore the mesh Transition Time
+ * (LAMP_FLAG_FADE).
+ *
+ * A fade is a series of ordinary unacked Set commands, interpolated from the
+ * lamp's shadow to the target: lightness linearly, hue the short way round.
+ * The last step is the target command itself. The bridge limits what a fade
+ * costs:
+ *
+ * - one lamp gets a step at most every CONFIG_LIGHT_FADE_STEP_MS,
+ * - a fade has at most CONFIG_LIGHT_FADE_MAX_STEPS steps, longer fades get
+ *   longer steps,
+ * - at most CONFIG_LIGHT_FADE_MAX_ACTIVE lamps fade at once; beyond that,
+ *   and for transitions too short for two steps, the target is sent at once.
+ *
+ * Steps are due by the clock, so a step that is late (busy TX task) is not
+ * caught up. The one due next is sent instead. Steps are flagged
+ * MESH_CMD_FLAG_FADE_STEP and never reach the shadow or HA, only the target
+ * does. A step still in the TX queue is replaced by the next one like any
+ * other command.
+ *
+ * Started and cancelled from the MQTT task, run from the bridge task. The
+ * caller serializes light_fade_run() with the commands that start or cancel
+ * fades (bridge.c holds one lock around both): a step picked just before a
+ * newer command must not be queued after it, where it would overwrite the
+ * command in the TX queue and, being a step, never reach the shadow.
+ */
+
+typedef struct {
+    uint32_t started;       /* Fades started */
+    uint32_t steps;         /* Intermediate steps queued */
+    uint32_t skipped;       /* Steps the TX queue refused */
+    uint32_t cancelled;     /* Fades cut short by a newer command */
+    uint32_t busy;          /* Transitions sent at once, every fade slot in use */
+    uint32_t active;        /* Fades running now */
+} light_fade_stats_t;
+
+// Function to start fading a lamp from its shadow to target (MESH_CMD_LIGHTNESS,
+// MESH_CMD_HSL with a resolved lightness, or MESH_CMD_ONOFF off) over
+// duration_ms. A running fade of the lamp is replaced. Returns false if the
+// fade is too short, the shadow does not know the lamp's on/off state and
+// lightness, or no slot is free; the caller then sends target itself.
+bool light_fade_start(const mesh_cmd_t *target, const lamp_shadow_t *from, uint32_t duration_ms);
+// Function to stop the fade of a lamp, if any, without sending its target
+void light_fade_cancel(int index);
+// Function to check if any fade is running
+bool light_fade_active(void);
+// Function to queue the steps that are due through submit. Returns the ms
+// until the next step, UINT32_MAX if no fade is running.
+uint32_t light_fade_run(esp_err_t (*submit)(const mesh_cmd_t *cmd));
+// Function to read the fade counters
+void light_fade_get_stats(light_fade_stats_t *stats);
+
+#endif /* LIGHT_FADE_H */
@@ -0,0 +1,63 @@
+#ifndef LIGHT_SCALE_H
+#define LIGHT_SCALE_H
+
+#include <stdint.h>
+
+// Conversions between Home Assistant units and mesh-native 16 bit state values
+
+// Function to convert a percentage (0-100) to a mesh level (0-65535)
+static inline uint16_t light_percent_to_mesh(float percent)
+{
+    if (percent <= 0.0f) {
+        return 0;
+    }
+    if (percent >= 100.0f) {
+        return 0xFFFF;
+    }
+    return (uint16_t)(percent * 65535.0f / 100.0f + 0.5f);
+}
+
+// Function to convert a mesh level (0-65535) to a percentage (0-100)
+static inline float light_mesh_to_percent(uint16_t value)
+{
+    return value * 100.0f / 65535.0f;
+}
+
+// Function to convert a hue in degrees (0-360) to a mesh hue (0-65535)
+static inline uint16_t light_hue_to_mesh(float degrees)
+{
+    if (degrees <= 0.0f) {
+        return 0;
+    }
+    if (degrees >= 360.0f) {
+        return 0xFFFF;
+    }
+    return (uint16_t)(degrees * 65535.0f / 360.0f + 0.5f);
+}
+
+// Function to convert a mesh hue (0-65535) to degrees (0-360)
+static inline float light_mesh_to_hue(uint16_t value)
+{
+    return value * 360.0f / 65535.0f;
+}
+
+// Function to convert a transition in seconds to the mesh Transition Time
+// format: 6 bit number of steps, 2 bit step resolution (100 ms, 1 s, 10 s,
+// 10 min). Rounded to the nearest step, 0 is instant, at most 620 minutes.
+static inline uint8_t light_transition_to_mesh(float seconds)
+{
+    static const uint32_t resolution_ms[] = { 100, 1000, 10000, 600000 };
+    if (seconds <= 0.0f) {
+        return 0;
+    }
+    uint32_t ms = seconds >= 37200.0f ? 37200000 : (uint32_t)(seconds * 1000.0f + 0.5f);
+    for (int i = 0; i < 4; i++) {
+        uint32_t steps = (ms + resolution_ms[i] / 2) / resolution_ms[i];
+        if (steps <= 62) {
+            return (uint8_t)(i << 6 | steps);
+        }
+    }
+    return 3 << 6 | 62;
+}
+
+#endif /* LIGHT_SCALE_H */
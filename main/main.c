@@ -10,8 +10,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
-#include <math.h>
-#include "cJSON.h"
 
 #include "esp_log.h"
 #include "nvs_flash.h"
@@ -47,12 +45,20 @@
 #include "esp_http_server.h"
 
 #include "lamp_nvs.h"
+#include "lamp_registry.h"
+#include "mqtt_router.h"
+#include "mqtt_out.h"
+#include "mesh_tx.h"
+#include "mesh_poll.h"
+#include "latency.h"
+#include "metrics.h"
+#include "mesh_persist.h"
+#include "lamp_shadow.h"
 #include "http_server.h"
+#include "bridge.h"
 
 // Define web server URI
 #define EXAMPLE_URI "/control"
-// Define the maximum number of lamps
-#define MAX_LAMPS 20
 
 #define ESP_WIFI_SSID      CONFIG_ESP_WIFI_SSID
 #define ESP_WIFI_PASS      CONFIG_ESP_WIFI_PASSWORD
@@ -98,33 +104,53 @@ static int s_retry_num = 0;
 
 static uint8_t dev_uuid[16] = { 0xcc, 0xcc };
 
-esp_mqtt_client_handle_t mqtt_client;
 
+// Light values are kept per lamp in lamp_shadow, the store only holds what
+// the client itself needs to send
 static struct example_info_store {
     // Mesh-Netzwerk Parameter
     uint16_t net_idx;    /* NetKey Index */
     uint16_t app_idx;    /* AppKey Index */
-    
-    // Gerätestatus
-    uint8_t  onoff;      /* Remote OnOff */
     uint8_t  tid;        /* Message TID */
-    
-    // Lichtwerte
-    float    hue;        /* 0.0-360.0 Grad */
-    float    saturation; /* 0.0-100.0 % */
-    float    lightness;  /* 0.0-100.0 % (ersetzt brightness) */
-} __attribute__((packed)) store = {
+} store = {
     .net_idx = ESP_BLE_MESH_KEY_UNUSED,
     .app_idx = ESP_BLE_MESH_KEY_UNUSED,
-    .onoff = LED_OFF,
     .tid = 0x0,
-    .hue = 0.0f,
-    .saturation = 0.0f,
-    .lightness = 0.0f,  // Früher 'brightness'
 };
 
+// Layout written under NVS_LEGACY_KEY before the per-lamp shadow existed
+struct example_info_store_legacy {
+    uint16_t net_idx;
+    uint16_t app_idx;
+    uint8_t  onoff;
+    uint8_t  tid;
+    float    hue;
+    float    saturation;
+    float    lightness;
+} __attribute__((packed));
+
+/* The mesh TX task owns tid, the mesh stack callbacks
+ * only write net_idx/app_idx. Multi-field updates and the NVS snapshot are
+ * taken under s_store_lock so mesh_info_store() never sees a torn struct.
+ */
+static portMUX_TYPE s_store_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void store_lock(void)
+{
+    portENTER_CRITICAL(&s_store_lock);
+}
+
+static void store_unlock(void)
+{
+    portEXIT_CRITICAL(&s_store_lock);
+}
+
+// TID skip after a reboot, see mesh_info_restore()
+#define MESH_TID_BOOT_ADVANCE 64
+
 static nvs_handle_t NVS_HANDLE;
-static const char * NVS_KEY = "onoff_client";
+static const char * NVS_KEY = "mesh_client";
+static const char * NVS_LEGACY_KEY = "onoff_client";
 
 static esp_ble_mesh_client_t onoff_client;
 static esp_ble_mesh_client_t level_client;
@@ -187,24 +213,53 @@ static esp_ble_mesh_prov_t provision = {
 #endif
 };
 
-static void mesh_info_store(void)
+// Write callback of mesh_persist, commands only mark the store dirty
+static esp_err_t mesh_info_store(void)
 {
-    ble_mesh_nvs_store(NVS_HANDLE, NVS_KEY, &store, sizeof(store));
+    struct example_info_store snapshot;
+
+    store_lock();
+    snapshot = store;
+    store_unlock();
+    esp_err_t err = ble_mesh_nvs_store(NVS_HANDLE, NVS_KEY, &snapshot, sizeof(snapshot));
+    metrics_inc(err == ESP_OK ? METRIC_NVS_WRITES : METRIC_NVS_ERRORS);
+    return err;
 }
 
 static void mesh_info_restore(void)
 {
     esp_err_t err = ESP_OK;
     bool exist = false;
+    struct example_info_store restored;
 
-    err = ble_mesh_nvs_restore(NVS_HANDLE, NVS_KEY, &store, sizeof(store), &exist);
+    err = ble_mesh_nvs_restore(NVS_HANDLE, NVS_KEY, &restored, sizeof(restored), &exist);
+    metrics_inc(err == ESP_OK ? METRIC_NVS_READS : METRIC_NVS_ERRORS);
     if (err != ESP_OK) {
         return;
     }
+    if (!exist) {
+        // Older firmware stored a packed struct with one global light state
+        struct example_info_store_legacy legacy;
+        err = ble_mesh_nvs_restore(NVS_HANDLE, NVS_LEGACY_KEY, &legacy, sizeof(legacy), &exist);
+        if (err == ESP_OK && exist) {
+            restored.net_idx = legacy.net_idx;
+            restored.app_idx = legacy.app_idx;
+            restored.tid = legacy.tid;
+            if (ble_mesh_nvs_store(NVS_HANDLE, NVS_KEY, &restored, sizeof(restored)) == ESP_OK) {
+                ble_mesh_nvs_erase(NVS_HANDLE, NVS_LEGACY_KEY);
+            }
+        }
+    }
 
     if (exist) {
-        ESP_LOGI(TAG, "Restore, net_idx 0x%04x, app_idx 0x%04x, onoff %u, tid 0x%02x, brightness %f",
-            store.net_idx, store.app_idx, store.onoff, store.tid, store.lightness);
+        // The stored TID can be up to one staleness period old; skip ahead so
+        // the first messages after a reboot are not taken as retransmissions
+        restored.tid += MESH_TID_BOOT_ADVANCE;
+        store_lock();
+        store = restored;
+        store_unlock();
+        ESP_LOGI(TAG, "Restore, net_idx 0x%04x, app_idx 0x%04x, tid 0x%02x",
+            store.net_idx, store.app_idx, store.tid);
     }
 }
 
@@ -214,7 +269,9 @@ static void prov_complete(uint16_t net_idx, uint16_t addr, uint8_t flags, uint32
     ESP_LOGI(TAG, "flags: 0x%02x, iv_index: 0x%08" PRIx32, flags, iv_index);
     board_led_operation(GPIO_NUM_2, 0);
     ESP_LOGW(TAG, "LEDs_OFF provisioning completed");
+    store_lock();
     store.net_idx = net_idx;
+    store_unlock();
     /* mesh_info_store() shall not be invoked here, because if the device
      * is restarted and goes into a provisioned state, then the following events
      * will come:
@@ -260,6 +317,32 @@ static void example_ble_mesh_provisioning_cb(esp_ble_mesh_prov_cb_event_t event,
     }
 }
 
+#define BRIDGE_STACK_SIZE   4096
+#define BRIDGE_PRIORITY     4
+
+static TaskHandle_t s_bridge_task;
+
+// Task to send the queued HA announcements at the paced rate and the steps of bridge fades
+static void bridge_task(void *arg)
+{
+    for (;;) {
+        uint32_t wait_ms = bridge_announce_pump();
+        uint32_t fade_ms = bridge_fade_run();
+        if (fade_ms < wait_ms) {
+            wait_ms = fade_ms;
+        }
+        ulTaskNotifyTake(pdTRUE, wait_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(wait_ms) + 1);
+    }
+}
+
+// Wake hook of the bridge core, an announcement or a fade was queued
+static void bridge_wake(void)
+{
+    if (s_bridge_task != NULL) {
+        xTaskNotifyGive(s_bridge_task);
+    }
+}
+
 void ble_mesh_get_gen_onoff_status(uint16_t a_addr)
 {
     esp_ble_mesh_generic_client_get_state_t get = {0};
@@ -277,6 +360,7 @@ void ble_mesh_get_gen_onoff_status(uint16_t a_addr)
     common.msg_role = ROLE_NODE;
 
     err = esp_ble_mesh_generic_client_get_state(&common, &get);
+    metrics_mesh_op(common.opcode, err ? METRIC_MESH_ERROR : METRIC_MESH_SENT);
     if (err) {
         ESP_LOGE(TAG, "Get Generic OnOff State failed");
         return;
@@ -285,13 +369,41 @@ void ble_mesh_get_gen_onoff_status(uint16_t a_addr)
     // Handle the response in the callback function registered for the Generic OnOff Client model.
 }
 
-void ble_mesh_send_gen_onoff_set(int a_state, uint16_t a_addr)
+// Function to ask a lamp for its Light Lightness or Light HSL state
+esp_err_t ble_mesh_send_light_get(uint32_t a_opcode, uint16_t a_addr)
+{
+    esp_ble_mesh_light_client_get_state_t get = {0};
+    esp_ble_mesh_client_common_param_t common = {0};
+    esp_err_t err = ESP_OK;
+
+    common.opcode = a_opcode;
+    common.model = a_opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET ? hsl_client.model : light_client.model;
+    common.ctx.net_idx = store.net_idx;
+    common.ctx.app_idx = store.app_idx;
+    common.ctx.addr = a_addr;
+    common.ctx.send_ttl = 10;
+    common.ctx.send_rel = true;
+    common.msg_timeout = 0;     /* 0 indicates that timeout value from menuconfig will be used */
+    common.msg_role = ROLE_NODE;
+
+    err = esp_ble_mesh_light_client_get_state(&common, &get);
+    metrics_mesh_op(common.opcode, err ? METRIC_MESH_ERROR : METRIC_MESH_SENT);
+    if (err) {
+        ESP_LOGE(TAG, "Get Light State failed");
+        return err;
+    }
+    // The answer arrives in example_ble_mesh_light_client_cb()
+    return ESP_OK;
+}
+
+esp_err_t ble_mesh_send_gen_onoff_set(uint8_t a_state, uint16_t a_addr, uint32_t a_opcode, uint8_t a_tid,
+                                      bool a_trans_en, uint8_t a_trans_time)
 {
     esp_ble_mesh_generic_client_set_state_t set = {0};
     esp_ble_mesh_client_common_param_t common = {0};
     esp_err_t err = ESP_OK;
 
-    common.opcode = ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET;
+    common.opcode = a_opcode;
     common.model = onoff_client.model;
     common.ctx.net_idx = store.net_idx;
     common.ctx.app_idx = store.app_idx;
@@ -301,26 +413,30 @@ void ble_mesh_send_gen_onoff_set(int a_state, uint16_t a_addr)
     common.msg_timeout = 0;     /* 0 indicates that timeout value from menuconfig will be used */
     common.msg_role = ROLE_NODE;
 
-    set.onoff_set.op_en = false;
+    // Transition Time and Delay are optional, a lamp without a transition applies its default
+    set.onoff_set.op_en = a_trans_en || a_trans_time != 0;
     set.onoff_set.onoff = a_state;
-    set.onoff_set.tid = store.tid++;
+    set.onoff_set.tid = a_tid;
+    set.onoff_set.trans_time = a_trans_time;
+    set.onoff_set.delay = 0;
 
     err = esp_ble_mesh_generic_client_set_state(&common, &set);
+    metrics_mesh_op(common.opcode, err ? METRIC_MESH_ERROR : METRIC_MESH_SENT);
     if (err) {
-        ESP_LOGE(TAG, "Send Generic OnOff Set Unack failed");
-        return;
+        ESP_LOGE(TAG, "Send Generic OnOff Set failed");
+        return err;
     }
+    return ESP_OK;
 }
 
-void ble_mesh_send_gen_brightness_set(int a_brightness, uint16_t a_addr, esp_mqtt_client_handle_t a_client, char* a_topic)
+esp_err_t ble_mesh_send_gen_brightness_set(uint16_t a_lightness, uint16_t a_addr, uint32_t a_opcode, uint8_t a_tid,
+                                           bool a_trans_en, uint8_t a_trans_time)
 {
     esp_ble_mesh_light_client_set_state_t set = {0};
     esp_ble_mesh_client_common_param_t common = {0};
     esp_err_t err = ESP_OK;
 
-    cJSON *root = cJSON_CreateObject();
-
-    common.opcode = ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET_UNACK;
+    common.opcode = a_opcode;
     common.model = light_client.model;
     common.ctx.net_idx = store.net_idx;
     common.ctx.app_idx = store.app_idx;
@@ -330,55 +446,37 @@ void ble_mesh_send_gen_brightness_set(int a_brightness, uint16_t a_addr, esp_mqt
     common.msg_timeout = 0;     /* 0 indicates that timeout value from menuconfig will be used */
     common.msg_role = ROLE_NODE;
 
-    set.lightness_set.op_en = false;
-    set.lightness_set.lightness = (uint16_t)(a_brightness * 65535.0 / 100.0);
-    set.lightness_set.tid = store.tid++;
+    set.lightness_set.op_en = a_trans_en || a_trans_time != 0;
+    set.lightness_set.lightness = a_lightness;
+    set.lightness_set.tid = a_tid;
+    set.lightness_set.trans_time = a_trans_time;
+    set.lightness_set.delay = 0;
 
     err = esp_ble_mesh_light_client_set_state(&common, &set);
+    metrics_mesh_op(common.opcode, err ? METRIC_MESH_ERROR : METRIC_MESH_SENT);
     if (err) {
-        ESP_LOGE(TAG, "Send Light Lightness Set Unack failed");
-        return;
+        ESP_LOGE(TAG, "Send Light Lightness Set failed");
+        return err;
     }
-    //ble_mesh_get_gen_onoff_status(a_addr);
-    // build JSON for home assistant
-    cJSON_AddItemToObject(root, "state", cJSON_CreateString("ON"));
-    cJSON_AddItemToObject(root, "brightness", cJSON_CreateNumber(a_brightness));
-    char *string = cJSON_PrintUnformatted(root);
-    //printf("JSON: %s\n", string);
-    esp_mqtt_client_publish(a_client, a_topic, string, 0, 0, 0);
-    ESP_LOGI(TAG, "Set brightness successful %d", a_brightness);
-
-    store.lightness = a_brightness;
-   // store.onoff = !store.onoff;
-    mesh_info_store(); /* Store proper mesh info */
+    ESP_LOGI(TAG, "Set lightness successful %u", a_lightness);
+    return ESP_OK;
 }
 
-void ble_mesh_send_gen_hsl_set(float hsl_hue, float hsl_saturation, float hsl_lightness, uint16_t a_addr, esp_mqtt_client_handle_t a_client, char* a_topic)
+// Lightness is the HA brightness in mesh units; HSL lightness 50% is full color, so it is halved here
+esp_err_t ble_mesh_send_gen_hsl_set(uint16_t a_hue, uint16_t a_saturation, uint16_t a_lightness, uint16_t a_addr,
+                                    uint32_t a_opcode, uint8_t a_tid, bool a_trans_en, uint8_t a_trans_time)
 {
     esp_ble_mesh_light_client_set_state_t set = {0};
     esp_ble_mesh_client_common_param_t common = {0};
     esp_err_t err = ESP_OK;
 
-    // 1. Werteskalierung in BLE-Mesh-Format
-    uint16_t hsl_hue_scaled = (uint16_t)(hsl_hue * 65535.0 / 360.0);
-    uint16_t hsl_saturation_scaled = (uint16_t)(hsl_saturation* 65535.0 / 100.0);
-    uint16_t hsl_lightness_scaled = (uint16_t)(hsl_lightness * 65535.0 / 100.0 / 2);
-    ESP_LOGI(TAG, "Values to lamp: Hue: %d Saturation: %d Lightness: %d", hsl_hue_scaled, hsl_saturation_scaled, hsl_lightness_scaled);
-    set.hsl_set.hsl_hue = hsl_hue_scaled;
-    set.hsl_set.hsl_saturation = hsl_saturation_scaled;
-    set.hsl_set.hsl_lightness = hsl_lightness_scaled;
-
-    // 2. Parameter validieren
-    if (hsl_hue < 0 || hsl_hue > 360 || 
-        hsl_saturation < 0 || hsl_saturation > 100 ||
-        hsl_lightness < 0 || hsl_lightness > 100) {
-        ESP_LOGE(TAG, "Invalid HSL values: H=%.1f S=%.1f L=%.1f", 
-                hsl_hue, hsl_saturation, hsl_lightness);
-        return;
-    }
+    set.hsl_set.hsl_hue = a_hue;
+    set.hsl_set.hsl_saturation = a_saturation;
+    set.hsl_set.hsl_lightness = a_lightness / 2;
+    ESP_LOGI(TAG, "Values to lamp: Hue: %u Saturation: %u Lightness: %u",
+        set.hsl_set.hsl_hue, set.hsl_set.hsl_saturation, set.hsl_set.hsl_lightness);
 
-    // 3. BLE-Mesh-Konfiguration (wie ursprünglich)
-    common.opcode = ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK;
+    common.opcode = a_opcode;
     common.model = hsl_client.model;
     common.ctx.net_idx = store.net_idx;
     common.ctx.app_idx = store.app_idx;
@@ -388,33 +486,74 @@ void ble_mesh_send_gen_hsl_set(float hsl_hue, float hsl_saturation, float hsl_li
     common.msg_timeout = 0;
     common.msg_role = ROLE_NODE;
 
-    set.hsl_set.tid = store.tid++;
+    set.hsl_set.tid = a_tid;
+    set.hsl_set.op_en = a_trans_en || a_trans_time != 0;
+    set.hsl_set.trans_time = a_trans_time;
+    set.hsl_set.delay = 0;
 
-    // 4. Befehl senden
-    ESP_LOGI(TAG, "Try to set HSL");
     err = esp_ble_mesh_light_client_set_state(&common, &set);
+    metrics_mesh_op(common.opcode, err ? METRIC_MESH_ERROR : METRIC_MESH_SENT);
     if (err) {
-        ESP_LOGE(TAG, "Send Light HSL Set Unack failed");
-        return;
+        ESP_LOGE(TAG, "Send Light HSL Set failed");
+        return err;
     }
+    return ESP_OK;
+}
 
-    // 5. MQTT-Status mit Original-Float-Werten
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "state", cJSON_CreateString("ON"));
-    cJSON_AddItemToObject(root, "color", cJSON_CreateObject());
-    cJSON_AddNumberToObject(cJSON_GetObjectItem(root, "color"), "h", hsl_hue);
-    cJSON_AddNumberToObject(cJSON_GetObjectItem(root, "color"), "s", hsl_saturation);
-    cJSON_AddNumberToObject(root, "lightness", hsl_lightness);
-    
-    char *string = cJSON_PrintUnformatted(root);
-    esp_mqtt_client_publish(a_client, a_topic, string, 0, 0, 0);
-    cJSON_Delete(root);
-
-    // 6. Speicherung als Float (für spätere Abfragen)
-    store.hue = hsl_hue;
-    store.saturation = hsl_saturation;
-    store.lightness = hsl_lightness;
-    mesh_info_store();
+// The bridge core picks opcodes without the mesh headers
+_Static_assert(BRIDGE_OP_GEN_ONOFF_SET == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET &&
+               BRIDGE_OP_GEN_ONOFF_SET_UNACK == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK &&
+               BRIDGE_OP_GEN_ONOFF_STATUS == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS &&
+               BRIDGE_OP_LIGHT_LIGHTNESS_SET == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET &&
+               BRIDGE_OP_LIGHT_LIGHTNESS_SET_UNACK == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET_UNACK &&
+               BRIDGE_OP_LIGHT_LIGHTNESS_STATUS == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_STATUS &&
+               BRIDGE_OP_LIGHT_HSL_SET == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET &&
+               BRIDGE_OP_LIGHT_HSL_SET_UNACK == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK &&
+               BRIDGE_OP_LIGHT_HSL_STATUS == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS,
+               "bridge opcodes differ from the mesh stack");
+
+// Function run by the mesh TX task to send a command. A retransmission keeps
+// the TID of the first attempt so the lamp treats it as the same message.
+static esp_err_t mesh_tx_send(mesh_cmd_t *cmd, mesh_tx_attempt_t *attempt)
+{
+    if (cmd->type >= MESH_CMD_TYPE_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!attempt->retry) {
+        store_lock();
+        attempt->tid = store.tid++;
+        store_unlock();
+        mesh_persist_mark_dirty(); /* TID changed */
+    }
+    attempt->opcode = bridge_set_opcode(cmd);
+    bool trans_en = cmd->flags & MESH_CMD_FLAG_TRANSITION;
+
+    switch (cmd->type) {
+    case MESH_CMD_ONOFF:
+        return ble_mesh_send_gen_onoff_set(cmd->onoff, cmd->addr, attempt->opcode, attempt->tid, trans_en,
+                                           cmd->trans_time);
+    case MESH_CMD_LIGHTNESS:
+        return ble_mesh_send_gen_brightness_set(cmd->lightness, cmd->addr, attempt->opcode, attempt->tid,
+                                                trans_en, cmd->trans_time);
+    default:
+        bridge_resolve_cmd(cmd);
+        return ble_mesh_send_gen_hsl_set(cmd->hue, cmd->saturation, cmd->lightness, cmd->addr,
+                                         attempt->opcode, attempt->tid, trans_en, cmd->trans_time);
+    }
+}
+
+// Function run by the poll scheduler (in the TX task) to ask a lamp for its state.
+// Colour lamps are asked for HSL, which carries the brightness as well.
+static esp_err_t mesh_poll_get(int index, uint16_t addr)
+{
+    if (store.app_idx == ESP_BLE_MESH_KEY_UNUSED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    lamp_shadow_t shadow;
+    lamp_shadow_get(index, &shadow);
+    uint32_t opcode = (shadow.known & LAMP_SHADOW_COLOR) ? ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET
+                                                         : ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_GET;
+    return ble_mesh_send_light_get(opcode, addr);
 }
 
 static void example_ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_event_t event,
@@ -425,71 +564,84 @@ static void example_ble_mesh_generic_client_cb(esp_ble_mesh_generic_client_cb_ev
 
     switch (event) {
     case ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT:
-        ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_GET_STATE_EVT");
-        if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET) {
-            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET, onoff %d", param->status_cb.onoff_status.present_onoff);
-        }
-        break;
     case ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT:
-        ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT");
-        if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET) {
-            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET, onoff %d", param->status_cb.onoff_status.present_onoff);
-        }
-        break;
     case ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT:
-        ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_PUBLISH_EVT");
+        // Answers to Get/Set and status messages the lamp publishes on its
+        // own all carry the current state; recv_op is the status opcode
         if (param->params->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS) {
-            ESP_LOGI(TAG, "ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS, onoff %d", param->status_cb.onoff_status.present_onoff);
-            // Get the address of the device that sent the response
-            uint16_t sender_addr = param->params->ctx.addr;
-            cJSON *root = cJSON_CreateObject();
-            // Extract and handle the response as needed
-            uint8_t onoff_state = param->status_cb.onoff_status.present_onoff;
-            ESP_LOGI(TAG, "Received Generic OnOff Get response from device 0x%X. OnOff State: %d", sender_addr, onoff_state);
-
-            cJSON_AddItemToObject(root, "state", cJSON_CreateNumber(onoff_state));
-            
-            char topic_state[100];
-            char *ha_topic = "test";
-            bool found = false;
-
-            // Iterate through all lamps in NVS
-            for (int i = 0; i < MAX_LAMPS; i++) {
-                LampInfo lamp_info;
-                esp_err_t err = load_lamp_info(&lamp_info, i);
-                if (err == ESP_OK) {
-                    // Compare lamp address with sender address
-                    if (lamp_info.address == sender_addr) {
-                        // Match found, set appropriate topic
-                        snprintf(topic_state, sizeof(topic_state), "homeassistant/light/%s/state", lamp_info.name);
-                        ha_topic = topic_state;
-                        found = true;
-                        break;  // Exit loop once a match is found
-                    }
-                }
-            }
-
-            if (!found) {
-                // Unknown sender address or no matching lamp found
-                ESP_LOGW(TAG, "Received Generic OnOff Get response from unknown device");
-                return;
-            }
-            
-            // Access the global MQTT client instance
-            if (mqtt_client == NULL) {
-                ESP_LOGE(TAG, "MQTT client not initialized!");
-                return;
-            }
-            char *string = cJSON_PrintUnformatted(root);
-            cJSON_Delete(root);
-            esp_mqtt_client_publish(mqtt_client, ha_topic, string, 0, 0, 0);
+            const esp_ble_mesh_gen_onoff_status_cb_t *status = &param->status_cb.onoff_status;
+            ESP_LOGI(TAG, "Generic OnOff Status from 0x%04X, onoff %d", param->params->ctx.addr, status->present_onoff);
+            bridge_status_t msg = {
+                .status_op = BRIDGE_OP_GEN_ONOFF_STATUS,
+                .op_en = status->op_en,
+                .present_onoff = status->present_onoff,
+                .target_onoff = status->target_onoff,
+            };
+            bridge_lamp_status_message(param->params->ctx.addr, &msg);
+        }
+        if (event == ESP_BLE_MESH_GENERIC_CLIENT_SET_STATE_EVT &&
+            param->params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET) {
+            mesh_tx_acked(param->params->ctx.addr, param->params->opcode);
         }
         break;
     case ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT:
         ESP_LOGI(TAG, "ESP_BLE_MESH_GENERIC_CLIENT_TIMEOUT_EVT");
+        metrics_mesh_op(param->params->opcode, METRIC_MESH_TIMEOUT);
         if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET) {
-            /* If failed to get the response of Generic OnOff Set, resend Generic OnOff Set  */
-            //ble_mesh_send_gen_onoff_set(store.onoff, 0xFFFF);
+            /* The TX task resends Generic OnOff Set with the same TID */
+            mesh_tx_timed_out(param->params->ctx.addr, param->params->opcode);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void example_ble_mesh_light_client_cb(esp_ble_mesh_light_client_cb_event_t event,
+                                             esp_ble_mesh_light_client_cb_param_t *param)
+{
+    ESP_LOGI(TAG, "Light client, event %u, error code %d, opcode is 0x%04" PRIx32,
+        event, param->error_code, param->params->opcode);
+
+    switch (event) {
+    case ESP_BLE_MESH_LIGHT_CLIENT_GET_STATE_EVT:
+    case ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT:
+    case ESP_BLE_MESH_LIGHT_CLIENT_PUBLISH_EVT: {
+        bridge_status_t msg = { .status_op = param->params->ctx.recv_op };
+        if (param->params->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_STATUS) {
+            const esp_ble_mesh_light_lightness_status_cb_t *status = &param->status_cb.lightness_status;
+            ESP_LOGI(TAG, "Light Lightness Status from 0x%04X, lightness %u", param->params->ctx.addr, status->present_lightness);
+            msg.op_en = status->op_en;
+            msg.present_lightness = status->present_lightness;
+            msg.target_lightness = status->target_lightness;
+        } else if (param->params->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_STATUS) {
+            const esp_ble_mesh_light_hsl_status_cb_t *status = &param->status_cb.hsl_status;
+            ESP_LOGI(TAG, "Light HSL Status from 0x%04X, H %u S %u L %u", param->params->ctx.addr,
+                status->hsl_hue, status->hsl_saturation, status->hsl_lightness);
+            msg.hsl_lightness = status->hsl_lightness;
+            msg.hue = status->hsl_hue;
+            msg.saturation = status->hsl_saturation;
+        }
+        bridge_lamp_status_message(param->params->ctx.addr, &msg);
+        if (event == ESP_BLE_MESH_LIGHT_CLIENT_GET_STATE_EVT) {
+            mesh_poll_answered(param->params->ctx.addr);
+        }
+        if (event == ESP_BLE_MESH_LIGHT_CLIENT_SET_STATE_EVT &&
+            (param->params->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET ||
+             param->params->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET)) {
+            mesh_tx_acked(param->params->ctx.addr, param->params->opcode);
+        }
+        break;
+    }
+    case ESP_BLE_MESH_LIGHT_CLIENT_TIMEOUT_EVT:
+        ESP_LOGI(TAG, "ESP_BLE_MESH_LIGHT_CLIENT_TIMEOUT_EVT");
+        metrics_mesh_op(param->params->opcode, METRIC_MESH_TIMEOUT);
+        if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET ||
+            param->params->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET) {
+            mesh_tx_timed_out(param->params->ctx.addr, param->params->opcode);
+        } else if (param->params->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_GET ||
+                   param->params->opcode == ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET) {
+            mesh_poll_timed_out(param->params->ctx.addr);
         }
         break;
     default:
@@ -518,8 +670,12 @@ static void example_ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t
                 param->value.state_change.mod_app_bind.model_id);
             if (param->value.state_change.mod_app_bind.company_id == 0xFFFF &&
                 param->value.state_change.mod_app_bind.model_id == ESP_BLE_MESH_MODEL_ID_GEN_ONOFF_CLI) {
+                store_lock();
                 store.app_idx = param->value.state_change.mod_app_bind.app_idx;
-                mesh_info_store(); /* Store proper mesh info */
+                store_unlock();
+                // Rare configuration change, written right away
+                mesh_persist_mark_dirty();
+                mesh_persist_flush(); /* Store proper mesh info */
             }
             break;
         default:
@@ -534,6 +690,7 @@ static esp_err_t ble_mesh_init(void)
 
     esp_ble_mesh_register_prov_callback(example_ble_mesh_provisioning_cb);
     esp_ble_mesh_register_generic_client_callback(example_ble_mesh_generic_client_cb);
+    esp_ble_mesh_register_light_client_callback(example_ble_mesh_light_client_cb);
     esp_ble_mesh_register_config_server_callback(example_ble_mesh_config_server_cb);
 
     err = esp_ble_mesh_init(&provision, &composition);
@@ -555,87 +712,29 @@ static esp_err_t ble_mesh_init(void)
     return err;
 }
 
-typedef struct {
-    const char *topic;
-    char *payload; // Dynamic payload
-} MqttMessage;
-
-// Function to create MQTT payload dynamically using cJSON
-char *createPayload(const char *variable1, const char *variable2, const char *variable3) {
-    cJSON *root = cJSON_CreateObject();
-    if (root == NULL) {
-        fprintf(stderr, "Failed to create cJSON object\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Grundlegende Light-Konfiguration
-    cJSON_AddItemToObject(root, "name", cJSON_CreateString(variable1));
-    cJSON_AddItemToObject(root, "~", cJSON_CreateString(variable2));
-    cJSON_AddItemToObject(root, "cmd_t", cJSON_CreateString("~/set"));
-    cJSON_AddItemToObject(root, "stat_t", cJSON_CreateString("~/state"));
-    cJSON_AddItemToObject(root, "schema", cJSON_CreateString("json"));
-    
-    // Farb- und Helligkeitseinstellungen
-    cJSON_AddItemToObject(root, "brightness", cJSON_CreateBool(true));
-    cJSON_AddItemToObject(root, "color_mode", cJSON_CreateBool(true));
-    cJSON_AddItemToObject(root, "bri_scl", cJSON_CreateNumber(100));  // 0-100% Skalierung
-    
-    // Unterstützte Farbmodi (HSL)
-    cJSON *color_modes = cJSON_CreateArray();
-    cJSON_AddItemToArray(color_modes, cJSON_CreateString("hs"));
-    cJSON_AddItemToObject(root, "supported_color_modes", color_modes);
-
-    // Payload-Vorlagen
-    cJSON_AddItemToObject(root, "pl_on", cJSON_CreateString("ON"));
-    cJSON_AddItemToObject(root, "pl_off", cJSON_CreateString("OFF"));
-    
-    // Geräteinformationen
-    cJSON *dev = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "dev", dev);
-    
-    cJSON *ids = cJSON_CreateArray();
-    cJSON_AddItemToArray(ids, cJSON_CreateString(variable3));
-    cJSON_AddItemToObject(dev, "ids", ids);
-    cJSON_AddItemToObject(dev, "name", cJSON_CreateString("Lamp"));
-    cJSON_AddItemToObject(dev, "mf", cJSON_CreateString("BLE-Mesh"));
-    cJSON_AddItemToObject(dev, "mdl", cJSON_CreateString("HSL-Light"));
-
-    // Unique ID für Home Assistant
-    cJSON_AddItemToObject(root, "uniq_id", cJSON_CreateString(variable3));
-
-    char *string = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    
-    return string;
-}
-
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
+    uint32_t t_recv = latency_now();    /* Start of the command latency, before any logging */
     ESP_LOGI(TAG, "Event dispatched from event loop" );
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
-    mqtt_client = event->client;
     int msg_id;
     switch ((esp_mqtt_event_id_t)event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-            msg_id = esp_mqtt_client_subscribe(client, "homeassistant/status", 0);
-            ESP_LOGI(TAG, "Subscribed to homeassistant/status, msg_id=%d", msg_id);
-            // Load lamp names from NVS and subscribe to corresponding MQTT topics
-            for (int i = 0; i < MAX_LAMPS; i++) {
-                LampInfo lamp_info;
-                esp_err_t err = load_lamp_info(&lamp_info, i);
-                if (err == ESP_OK) {
-                    char topic[100];
-                    snprintf(topic, sizeof(topic), "homeassistant/light/%s/set", lamp_info.name);
-                    int msg_id = esp_mqtt_client_subscribe(client, topic, 0);
-                    ESP_LOGI(TAG, "Subscribed to %s, msg_id=%d", topic, msg_id);
-                }
-            }
-            esp_mqtt_client_publish(client, "homeassistant/status", "", 0, 0, 0);
+            mqtt_out_set_client(client, true);
+            msg_id = esp_mqtt_client_subscribe(client, HA_STATUS_TOPIC, 0);
+            ESP_LOGI(TAG, "Subscribed to " HA_STATUS_TOPIC ", msg_id=%d", msg_id);
+            // A single wildcard subscription covers every lamp, current and future
+            msg_id = esp_mqtt_client_subscribe(client, HA_SET_SUBSCRIPTION, 0);
+            ESP_LOGI(TAG, "Subscribed to " HA_SET_SUBSCRIPTION ", msg_id=%d", msg_id);
+            // The broker may have lost the retained configs while we were away
+            bridge_announce_reset();
+            bridge_announce_all();
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            mqtt_out_set_client(client, false);
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -648,136 +747,25 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+            metrics_inc(METRIC_MQTT_RECEIVED);
                             
-            bool setMessage = 0;
-            uint16_t net_addr = 0xFFFF;
-            char *ha_topic = "abc";
-            ESP_LOGI(TAG, "Found lamps %d", g_num_lamps);
-            // Iterate through all lamps in NVS
-            for (int i = 0; i < MAX_LAMPS; i++) {
-                ESP_LOGI(TAG, "Found lamps %d", i);
-                LampInfo lamp_info;
-                esp_err_t err = load_lamp_info(&lamp_info, i);
-                if (err == ESP_OK) {
-                    // Dynamically generate MQTT topics based on lamp names
-                    char topic_set[100];
-                    snprintf(topic_set, sizeof(topic_set), "homeassistant/light/%s/set", lamp_info.name);
-
-                    // Compare MQTT topic with dynamically generated topics
-                    if (strncmp(topic_set, event->topic, strlen(topic_set)) == 0) {
-                        // Match found, set appropriate values
-                        char *endptr;
-                        net_addr = (uint16_t)strtol(lamp_info.address, &endptr, 0);
-                        if (*endptr != '\0') {
-                            // Handle conversion error
-                            ESP_LOGE("TAG", "Failed to convert lamp_info.address to integer");
-                            // Optionally, you can set a default value for net_addr or handle the error in another way
-                        }
-                        char topic_state[100];
-                        snprintf(topic_state, sizeof(topic_state), "homeassistant/light/%s/state", lamp_info.name);
-                        ha_topic = topic_state;
-                        setMessage = true;
-                        ESP_LOGI(TAG, "Found msg to %s, %s, %d", lamp_info.name, topic_state, net_addr);
-                        break;  // Exit loop once a match is found
-                    }
-                }
-            }
-            
-           if (setMessage){
-                //parse received json data
-                ESP_LOGI(TAG, "Within set message block");
-                cJSON *json = cJSON_Parse(event->data);
-                if (json == NULL) 
-                {
-                    const char *error_ptr = cJSON_GetErrorPtr();
-                    if (error_ptr != NULL) {
-                        fprintf(stderr, "Error before: %s\n", error_ptr);
-                    } 
-                    break;                   
-                }
-                // Extract json data
-                cJSON *brightness = cJSON_GetObjectItemCaseSensitive(json, "brightness");
-                cJSON *actstate = cJSON_GetObjectItemCaseSensitive(json, "state");
-                cJSON *color = cJSON_GetObjectItemCaseSensitive(json, "color");
-                if (color) {
-                    cJSON *h = cJSON_GetObjectItemCaseSensitive(color, "h");   // "h" statt "hue"
-                    cJSON *s = cJSON_GetObjectItemCaseSensitive(color, "s");   // "s" statt "saturation"
-                    if (cJSON_IsNumber(h) && cJSON_IsNumber(s)) {
-                        double hue = h->valuedouble;        // 0.0-360.0 Grad
-                        double saturation = s->valuedouble; // 0.0-100.0 %
-                        
-                        // Lightness (Helligkeit) aus root-Objekt
-                        cJSON *brightness = cJSON_GetObjectItemCaseSensitive(json, "brightness");
-                        double lightness = (cJSON_IsNumber(brightness)) ? brightness->valuedouble : store.lightness;
-
-                        // Validierung
-                        if (hue < 0.0 || hue > 360.0 || saturation < 0.0 || saturation > 100.0 || lightness < 0.0 || lightness > 100.0) {
-                            ESP_LOGE(TAG, "Ungültige HSL-Werte: H=%.1f S=%.1f L=%.1f", hue, saturation, lightness);
-                            return;
-                        }
-
-                        // Befehl senden
-                        ble_mesh_send_gen_hsl_set(hue, saturation, lightness, net_addr, client, ha_topic);
-                    }
-                }
-
-                //printf("State: %s\n", actstate->valuestring);
-                // HSL-Befehl verarbeiten
-
-                else if (cJSON_IsNumber(brightness)) {
-                    ESP_LOGI(TAG, "MQTT Message is for brightness");
-                    //printf("brightness: %d\n", brightness->valueint);
-                    int bright = brightness->valueint;
-                    ble_mesh_send_gen_brightness_set(bright, net_addr, client, ha_topic);
-                }
-                else if(strncmp("ON",actstate->valuestring,2)==0){
-                    ble_mesh_send_gen_onoff_set(1, net_addr);
-                    esp_mqtt_client_publish(client, ha_topic, "{\"state\":\"ON\"}", 0, 0, 0);
-                }
-                else if(strncmp("OFF",actstate->valuestring,3)==0){
-                    ble_mesh_send_gen_onoff_set(0, net_addr);
-                    esp_mqtt_client_publish(client, ha_topic, "{\"state\":\"OFF\"}", 0, 0, 0);
-                }
-                //printf("DATA=%.*s\r\n", event->data_len, event->data); 
-                cJSON_Delete(json);
-            }
-            
-
-            if (strncmp("homeassistant/status", event->topic, 20) == 0) 
-            {
-                // Fetch lamp data from NVS and generate MQTT messages
-                for (int i = 0; i < MAX_LAMPS; i++) {
-                ESP_LOGI(TAG, "Found lamps %d", i);
-                        
-                // Load lamp info from NVS
-                LampInfo lamp_info;
-                esp_err_t err = load_lamp_info(&lamp_info, i);
-                if (err == ESP_OK) {
-                    // Generate MQTT message for this lamp
-                    char topic[100];
-                    char config_topic[100];
-                    char payload[500];  // Adjust size as needed
-                
-                    // Create unique topic for this lamp (adjust as per your requirement)
-                    snprintf(topic, sizeof(topic), "homeassistant/light/%s", lamp_info.name);
-
-                    // Create config topic for this lamp (adjust as per your requirement)
-                    snprintf(config_topic, sizeof(config_topic), "homeassistant/light/%s/config", lamp_info.name);
-
-                    // Create payload for this lamp
-                    snprintf(payload, sizeof(payload), createPayload(lamp_info.name, topic, lamp_info.address));
-                    
-                    // Publish each message
-                    printf("Publishing to topic: %s, payload: %s\n", config_topic, payload);
-                    // Call your MQTT publishing function here passing messages[i].topic and payload_str
-                    esp_mqtt_client_publish(client, config_topic, payload, 0, 0, 0);
-                } else {
-                    // Failed to load lamp info, break loop
+            mqtt_route_t route;
+            mqtt_route(event->topic, event->topic_len, &route);
+            if (route.type == MQTT_ROUTE_LAMP_SET || route.type == MQTT_ROUTE_GROUP_SET) {
+                // Commands are small, a payload split over several events is not a valid command
+                if (event->current_data_offset != 0 || event->data_len != event->total_data_len) {
+                    ESP_LOGW(TAG, "Ignoring fragmented command for %s",
+                             route.type == MQTT_ROUTE_GROUP_SET ? route.group.name : route.lamp.name);
                     break;
                 }
+                bridge_handle_command(&route, event->data, event->data_len, t_recv);
             }
-                //get current status of all lights
-                //ble_mesh_get_gen_onoff_status(0xFFFF);
+
+            if (route.type == MQTT_ROUTE_HA_STATUS && event->data_len == 6 && memcmp(event->data, "online", 6) == 0) {
+                // HA (re)started: it forgot all states. The configs are retained, unchanged
+                // ones are skipped. Groups are exposed as lights of their own.
+                bridge_announce_all();
+                // Lamp states are refreshed one lamp at a time by the poll scheduler
             }
             break;
         case MQTT_EVENT_ERROR:
@@ -935,6 +923,12 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(err);
 
+    // Load the lamp table into RAM once, all later lookups are served from the registry
+    err = lamp_nvs_init();
+    if (err) {
+        ESP_LOGE(TAG, "Loading lamp table failed (err %d)", err);
+    }
+
     ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
     wifi_init_sta();
 
@@ -952,6 +946,32 @@ void app_main(void)
 
     ble_mesh_get_dev_uuid(dev_uuid);
 
+    err = mesh_persist_init(mesh_info_store);
+    if (err) {
+        ESP_LOGE(TAG, "Mesh state persistence init failed (err %d)", err);
+    }
+
+    const bridge_io_t bridge_io = {
+        .publish = mqtt_out_publish,
+        .submit = mesh_tx_submit,
+        .wake = bridge_wake,
+    };
+    bridge_init(&bridge_io);
+    if (xTaskCreate(bridge_task, "bridge", BRIDGE_STACK_SIZE, NULL, BRIDGE_PRIORITY, &s_bridge_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create bridge task");
+    }
+
+    // Start the TX task before MQTT so no command arrives without a consumer.
+    // It polls the lamp states in between commands.
+    mesh_poll_init(mesh_poll_get);
+    mesh_tx_set_idle_handler(mesh_poll_run);
+    mesh_tx_set_busy_check(mesh_poll_waiting);
+    err = mesh_tx_init(mesh_tx_send, bridge_cmd_done);
+    if (err) {
+        ESP_LOGE(TAG, "Mesh TX task init failed (err %d)", err);
+        return;
+    }
+
     /* Initialize the Bluetooth Mesh Subsystem */
     err = ble_mesh_init();
     if (err) {
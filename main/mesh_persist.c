@@ -0,0 +1,131 @@
+#include "mesh_persist.h"
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#define TAG "MESH_PERSIST"
+
+#define MESH_PERSIST_STALENESS_US ((uint64_t)CONFIG_MESH_STATE_MAX_STALENESS_MS * 1000)
+#define MESH_PERSIST_STACK_SIZE   3072
+#define MESH_PERSIST_PRIORITY     2
+
+static mesh_persist_write_t s_write;
+static esp_timer_handle_t s_timer;
+static TaskHandle_t s_task;
+static volatile bool s_dirty;
+static portMUX_TYPE s_dirty_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Serializes flushes, so an older snapshot never overwrites a newer one
+static SemaphoreHandle_t s_flush_lock;
+static StaticSemaphore_t s_flush_lock_buf;
+
+static volatile uint32_t s_marked;
+static volatile uint32_t s_writes;
+static volatile uint32_t s_failed;
+
+// Task that does the timed flushes. A flash write can block for tens to
+// hundreds of ms, too long for the esp_timer task that BLE and Wi-Fi share.
+static void persist_task(void *arg)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        mesh_persist_flush();
+    }
+}
+
+static void flush_timer_cb(void *arg)
+{
+    xTaskNotifyGive(s_task);
+}
+
+static void shutdown_handler(void)
+{
+    mesh_persist_flush();
+}
+
+esp_err_t mesh_persist_init(mesh_persist_write_t write)
+{
+    s_write = write;
+    s_flush_lock = xSemaphoreCreateMutexStatic(&s_flush_lock_buf);
+    if (xTaskCreate(persist_task, "mesh_persist", MESH_PERSIST_STACK_SIZE, NULL, MESH_PERSIST_PRIORITY,
+                    &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create flush task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = flush_timer_cb,
+        .name = "mesh_persist",
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_timer);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create flush timer: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = esp_register_shutdown_handler(shutdown_handler);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register shutdown handler: %s", esp_err_to_name(err));
+    }
+    return ESP_OK;
+}
+
+void mesh_persist_mark_dirty(void)
+{
+    bool arm;
+
+    portENTER_CRITICAL(&s_dirty_lock);
+    arm = !s_dirty;
+    s_dirty = true;
+    s_marked++;
+    portEXIT_CRITICAL(&s_dirty_lock);
+
+    // The timer runs from the first change, later changes ride along, so no
+    // change stays in RAM longer than the staleness bound
+    if (arm && s_timer != NULL && !esp_timer_is_active(s_timer)) {
+        esp_timer_start_once(s_timer, MESH_PERSIST_STALENESS_US);
+    }
+}
+
+esp_err_t mesh_persist_flush(void)
+{
+    esp_err_t err = ESP_OK;
+
+    if (s_write == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_flush_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&s_dirty_lock);
+    bool dirty = s_dirty;
+    s_dirty = false;
+    portEXIT_CRITICAL(&s_dirty_lock);
+
+    if (dirty) {
+        err = s_write();
+        s_writes++;
+        if (err != ESP_OK) {
+            s_failed++;
+            ESP_LOGE(TAG, "Writing mesh state failed: %s", esp_err_to_name(err));
+            // Keep it dirty and retry after another staleness period
+            portENTER_CRITICAL(&s_dirty_lock);
+            s_dirty = true;
+            portEXIT_CRITICAL(&s_dirty_lock);
+            if (!esp_timer_is_active(s_timer)) {
+                esp_timer_start_once(s_timer, MESH_PERSIST_STALENESS_US);
+            }
+        }
+    }
+    xSemaphoreGive(s_flush_lock);
+    return err;
+}
+
+void mesh_persist_get_stats(mesh_persist_stats_t *stats)
+{
+    stats->marked = s_marked;
+    stats->writes = s_writes;
+    stats->failed = s_failed;
+}
@@ -0,0 +1,36 @@
+#ifndef MESH_PERSIST_H
+#define MESH_PERSIST_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/*
+ * Write-behind persistence for the mesh client state.
+ *
+ * The command path only marks the state dirty. The state is written to flash
+ * by mesh_persist_flush(): at the latest CONFIG_MESH_STATE_MAX_STALENESS_MS
+ * after the first change (a timer wakes a small task of its own for the
+ * write), on low-frequency events that call it directly, and from a shutdown
+ * handler before esp_restart(). A burst of commands results in a single
+ * flash write.
+ */
+
+typedef struct {
+    uint32_t marked;        /* Changes reported with mesh_persist_mark_dirty() */
+    uint32_t writes;        /* Flash writes */
+    uint32_t failed;        /* Flash writes that returned an error */
+} mesh_persist_stats_t;
+
+// Function that writes the current state to flash
+typedef esp_err_t (*mesh_persist_write_t)(void);
+
+// Function to set up the flush timer and task and the shutdown handler
+esp_err_t mesh_persist_init(mesh_persist_write_t write);
+// Function to note a change that has to reach flash within the staleness bound
+void mesh_persist_mark_dirty(void);
+// Function to write the state now if it is dirty
+esp_err_t mesh_persist_flush(void);
+// Function to read the write counters
+void mesh_persist_get_stats(mesh_persist_stats_t *stats);
+
+#endif /* MESH_PERSIST_H */
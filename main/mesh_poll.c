@@ -0,0 +1,245 @@
+#include "mesh_poll.h"
+#include <stdbool.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "lamp_registry.h"
+
+#define TAG "MESH_POLL"
+
+// Spacing between two Gets that keeps the total within the budget
+#define MESH_POLL_GAP_US            (60000000LL / CONFIG_MESH_POLL_BUDGET_PER_MIN)
+#define MESH_POLL_MAX_OUTSTANDING   CONFIG_MESH_POLL_MAX_OUTSTANDING
+// A lamp that keeps missing is polled every 2^4 = 16 intervals
+#define MESH_POLL_MAX_BACKOFF_SHIFT 4
+// A Get whose timeout event got lost is written off after this long
+#define MESH_POLL_STALE_US          (30 * 1000000LL)
+
+// Per lamp schedule. Due times are kept in whole seconds, which is plenty
+// for intervals of seconds to hours and keeps a slot at 8 bytes.
+typedef struct {
+    uint32_t next_due;      /* esp_timer time in s of the next Get, 0 for right away */
+    uint16_t addr;          /* Address the state below belongs to */
+    uint8_t misses;         /* Gets without answer in a row */
+} poll_lamp_t;
+
+// Get waiting for an answer; only MESH_POLL_MAX_OUTSTANDING at a time, so
+// answers and timeouts look here instead of through every lamp
+typedef struct {
+    int64_t sent_at;
+    int16_t index;          /* Lamp slot */
+    uint16_t addr;          /* 0 if the entry is free */
+} poll_get_t;
+
+static mesh_poll_get_t s_get;
+static poll_lamp_t s_lamps[MAX_LAMPS];
+static poll_get_t s_outstanding[MESH_POLL_MAX_OUTSTANDING];
+// The TX task owns the cursor and the budget, the callbacks only resolve outstanding Gets
+static int s_cursor;
+static int64_t s_next_slot;
+static portMUX_TYPE s_poll_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static volatile uint32_t s_polls;
+static volatile uint32_t s_answered;
+static volatile uint32_t s_timeouts;
+static volatile uint32_t s_failed;
+
+static TickType_t us_to_ticks(int64_t us)
+{
+    return pdMS_TO_TICKS(us / 1000) + 1;
+}
+
+static uint32_t to_seconds(int64_t us)
+{
+    return (uint32_t)(us / 1000000);
+}
+
+static uint32_t backoff_interval_s(uint8_t misses)
+{
+    uint8_t shift = misses < MESH_POLL_MAX_BACKOFF_SHIFT ? misses : MESH_POLL_MAX_BACKOFF_SHIFT;
+    return (uint32_t)CONFIG_MESH_POLL_INTERVAL_S << shift;
+}
+
+// Function to mark a Get as unanswered and push the lamp back. Called with s_poll_lock held.
+static void poll_miss(poll_get_t *get, int64_t now)
+{
+    poll_lamp_t *lamp = &s_lamps[get->index];
+    // The lamp may have been readdressed meanwhile, that one starts afresh
+    if (lamp->addr == get->addr) {
+        if (lamp->misses < UINT8_MAX) {
+            lamp->misses++;
+        }
+        lamp->next_due = to_seconds(now) + backoff_interval_s(lamp->misses);
+    }
+    get->addr = 0;
+    s_timeouts++;
+}
+
+// Function to count the Gets still waiting, writing off stale ones
+static int poll_outstanding(int64_t now)
+{
+    int count = 0;
+    portENTER_CRITICAL(&s_poll_lock);
+    for (int i = 0; i < MESH_POLL_MAX_OUTSTANDING; i++) {
+        poll_get_t *get = &s_outstanding[i];
+        if (get->addr != 0 && now - get->sent_at > MESH_POLL_STALE_US) {
+            poll_miss(get, now);
+        }
+        count += get->addr != 0;
+    }
+    portEXIT_CRITICAL(&s_poll_lock);
+    return count;
+}
+
+// Function to find the Get waiting for a lamp slot. Called with s_poll_lock held.
+static poll_get_t *find_slot(int index)
+{
+    for (int i = 0; i < MESH_POLL_MAX_OUTSTANDING; i++) {
+        if (s_outstanding[i].addr != 0 && s_outstanding[i].index == index) {
+            return &s_outstanding[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to find the Get waiting for an address, or a free entry for 0.
+// Called with s_poll_lock held.
+static poll_get_t *find_outstanding(uint16_t addr)
+{
+    for (int i = 0; i < MESH_POLL_MAX_OUTSTANDING; i++) {
+        if (s_outstanding[i].addr == addr) {
+            return &s_outstanding[i];
+        }
+    }
+    return NULL;
+}
+
+void mesh_poll_init(mesh_poll_get_t get)
+{
+    if (CONFIG_MESH_POLL_INTERVAL_S == 0) {
+        ESP_LOGI(TAG, "State polling disabled");
+        return;
+    }
+    s_get = get;
+}
+
+TickType_t mesh_poll_run(void)
+{
+    if (s_get == NULL) {
+        return portMAX_DELAY;
+    }
+    int64_t now = esp_timer_get_time();
+    if (now < s_next_slot) {
+        return us_to_ticks(s_next_slot - now);
+    }
+    if (poll_outstanding(now) >= MESH_POLL_MAX_OUTSTANDING) {
+        // Answers do not wake the TX task, look again after one gap
+        return us_to_ticks(MESH_POLL_GAP_US);
+    }
+
+    // Lamps added later are picked up within one interval
+    uint32_t now_s = to_seconds(now);
+    uint32_t earliest = now_s + CONFIG_MESH_POLL_INTERVAL_S;
+    for (int n = 0; n < MAX_LAMPS; n++) {
+        int index = (s_cursor + n) % MAX_LAMPS;
+        LampInfo lamp_info;
+        if (!lamp_registry_get(index, &lamp_info) || lamp_info.address == 0) {
+            continue;
+        }
+
+        portENTER_CRITICAL(&s_poll_lock);
+        poll_lamp_t *lamp = &s_lamps[index];
+        if (lamp->addr != lamp_info.address) {
+            // New or readdressed lamp, poll it on this round
+            *lamp = (poll_lamp_t) { .addr = lamp_info.address };
+        }
+        poll_get_t *get = NULL;
+        bool waiting = find_slot(index) != NULL;
+        bool due = !waiting && lamp->next_due <= now_s;
+        if (due) {
+            // There is a free entry, poll_outstanding() counted them
+            get = find_outstanding(0);
+            *get = (poll_get_t) { .sent_at = now, .index = index, .addr = lamp_info.address };
+            lamp->next_due = now_s + backoff_interval_s(lamp->misses);
+        } else if (!waiting && lamp->next_due < earliest) {
+            earliest = lamp->next_due;
+        }
+        portEXIT_CRITICAL(&s_poll_lock);
+        if (!due) {
+            continue;
+        }
+
+        if (s_get(index, lamp_info.address) == ESP_OK) {
+            s_polls++;
+        } else {
+            // e.g. not provisioned yet; try again next interval
+            portENTER_CRITICAL(&s_poll_lock);
+            get->addr = 0;
+            portEXIT_CRITICAL(&s_poll_lock);
+            s_failed++;
+        }
+        s_cursor = (index + 1) % MAX_LAMPS;
+        s_next_slot = now + MESH_POLL_GAP_US;
+        return us_to_ticks(MESH_POLL_GAP_US);
+    }
+    return us_to_ticks((int64_t)earliest * 1000000 - now);
+}
+
+bool mesh_poll_waiting(uint16_t addr)
+{
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_poll_lock);
+    poll_get_t *get = addr != 0 ? find_outstanding(addr) : NULL;
+    if (get != NULL && now - get->sent_at > MESH_POLL_STALE_US) {
+        // Its timeout event got lost, do not hold commands for it any longer
+        poll_miss(get, now);
+        get = NULL;
+    }
+    portEXIT_CRITICAL(&s_poll_lock);
+    return get != NULL;
+}
+
+void mesh_poll_answered(uint16_t addr)
+{
+    portENTER_CRITICAL(&s_poll_lock);
+    poll_get_t *get = addr != 0 ? find_outstanding(addr) : NULL;
+    if (get != NULL) {
+        poll_lamp_t *lamp = &s_lamps[get->index];
+        if (lamp->addr == addr) {
+            lamp->misses = 0;
+            lamp->next_due = to_seconds(esp_timer_get_time()) + CONFIG_MESH_POLL_INTERVAL_S;
+        }
+        get->addr = 0;
+        s_answered++;
+    }
+    portEXIT_CRITICAL(&s_poll_lock);
+}
+
+void mesh_poll_timed_out(uint16_t addr)
+{
+    portENTER_CRITICAL(&s_poll_lock);
+    poll_get_t *get = addr != 0 ? find_outstanding(addr) : NULL;
+    if (get != NULL) {
+        poll_miss(get, esp_timer_get_time());
+    }
+    portEXIT_CRITICAL(&s_poll_lock);
+    if (get != NULL) {
+        ESP_LOGD(TAG, "No answer from 0x%04x", addr);
+    }
+}
+
+void mesh_poll_get_stats(mesh_poll_stats_t *stats)
+{
+    stats->polls = s_polls;
+    stats->answered = s_answered;
+    stats->timeouts = s_timeouts;
+    stats->failed = s_failed;
+    stats->outstanding = 0;
+    portENTER_CRITICAL(&s_poll_lock);
+    for (int i = 0; i < MESH_POLL_MAX_OUTSTANDING; i++) {
+        stats->outstanding += s_outstanding[i].addr != 0;
+    }
+    portEXIT_CRITICAL(&s_poll_lock);
+}
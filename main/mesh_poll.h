@@ -0,0 +1,55 @@
+#ifndef MESH_POLL_H
+#define MESH_POLL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+/*
+ * Background state polling.
+ *
+ * Changes made outside HA (wall switches, the LEDVANCE app, power cycles)
+ * only show up if the lamp is asked. Instead of one broadcast Get that makes
+ * every lamp answer at once, lamps are polled one at a time, round-robin:
+ *
+ * - each lamp at most once per CONFIG_MESH_POLL_INTERVAL_S,
+ * - at most CONFIG_MESH_POLL_BUDGET_PER_MIN Gets per minute in total,
+ * - at most CONFIG_MESH_POLL_MAX_OUTSTANDING Gets waiting for an answer,
+ * - a lamp that does not answer is polled less often (interval doubled per
+ *   miss, up to 16 intervals) until it answers again.
+ *
+ * The scheduler runs in the mesh TX task, which only calls it when no user
+ * command is queued or in flight and the last one is a moment ago, so polls
+ * never compete with interactive traffic. A command that arrives while a Get
+ * to its lamp is outstanding is held by the TX task until the Get resolves
+ * (mesh_poll_waiting()).
+ */
+
+typedef struct {
+    uint32_t polls;         /* Gets sent */
+    uint32_t answered;      /* Gets the lamp answered */
+    uint32_t timeouts;      /* Gets without an answer */
+    uint32_t failed;        /* Gets the mesh stack refused */
+    uint32_t outstanding;   /* Gets currently waiting for an answer */
+} mesh_poll_stats_t;
+
+// Function that sends a Get to the lamp in registry slot index
+typedef esp_err_t (*mesh_poll_get_t)(int index, uint16_t addr);
+
+// Function to set up the scheduler, polling stays off if CONFIG_MESH_POLL_INTERVAL_S is 0
+void mesh_poll_init(mesh_poll_get_t get);
+// Function run by the TX task when it is idle. Sends at most one Get and
+// returns how long the task may sleep before calling it again.
+TickType_t mesh_poll_run(void);
+// Function to check whether a Get to addr still waits for its answer (the TX
+// task's busy check, see mesh_tx_set_busy_check())
+bool mesh_poll_waiting(uint16_t addr);
+// Function to report the answer to a Get (from the mesh client callbacks)
+void mesh_poll_answered(uint16_t addr);
+// Function to report a Get without answer (from the mesh client callbacks)
+void mesh_poll_timed_out(uint16_t addr);
+// Function to read the poll counters
+void mesh_poll_get_stats(mesh_poll_stats_t *stats);
+
+#endif /* MESH_POLL_H */
@@ -0,0 +1,623 @@
+#include "mesh_tx.h"
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "latency.h"
+#include "lamp_registry.h"
+
+#define TAG "MESH_TX"
+
+#define MESH_TX_QUEUE_SIZE  CONFIG_MESH_TX_QUEUE_SIZE
+#define MESH_TX_STACK_SIZE  4096
+#define MESH_TX_PRIORITY    5
+
+// Empty coalescing slot
+#define MESH_TX_NO_RECORD   0xFF
+
+_Static_assert(MESH_TX_QUEUE_SIZE < MESH_TX_NO_RECORD, "record numbers are 8 bit");
+
+#define MESH_ACK_MAX_INFLIGHT   CONFIG_MESH_ACK_MAX_INFLIGHT
+#define MESH_ACK_MAX_RETRIES    CONFIG_MESH_ACK_MAX_RETRIES
+#define MESH_ACK_BACKOFF_MS     CONFIG_MESH_ACK_BACKOFF_MS
+// Upper bound for the retry backoff
+#define MESH_ACK_BACKOFF_MAX_MS 5000
+// While acked messages are outstanding the TX task checks them at this interval
+#define MESH_TX_POLL_MS         10
+// Idle time after the last command before the idle function runs
+#define MESH_TX_IDLE_QUIET_MS   2000
+// Acked commands that may wait for a free in-flight entry at once
+#define MESH_TX_HELD_MAX        (2 * MESH_ACK_MAX_INFLIGHT)
+
+typedef enum {
+    INFLIGHT_FREE,
+    INFLIGHT_WAITING,       /* Sent, no answer yet */
+    INFLIGHT_ACKED,         /* Answered, done() not called yet */
+    INFLIGHT_TIMED_OUT,     /* Resend at retry_at */
+    INFLIGHT_PARKED,        /* cmd was parked behind the previous message, not sent yet */
+} inflight_state_t;
+
+// Outstanding acked message. The TX task owns everything except state and
+// retry_at, which the mesh callbacks change under s_inflight_lock.
+typedef struct {
+    mesh_cmd_t cmd;
+    mesh_cmd_t parked;      /* Next command for the same address */
+    bool has_parked;
+    uint8_t state;          /* inflight_state_t */
+    uint8_t tid;
+    uint8_t retries;
+    uint32_t opcode;
+    int64_t retry_at;       /* esp_timer_get_time() */
+    uint32_t sent_at;       /* latency_now() of the first attempt */
+    uint32_t answered_at;   /* latency_now() when the answer was reported */
+} mesh_inflight_t;
+
+static QueueHandle_t s_queue;
+static StaticQueue_t s_queue_buf;
+static uint8_t s_queue_storage[MESH_TX_QUEUE_SIZE * sizeof(uint8_t)];
+static mesh_tx_send_t s_send;
+static mesh_tx_done_t s_done;
+static mesh_tx_idle_t s_idle;
+static mesh_tx_busy_t s_busy;
+static int64_t s_last_send;     /* esp_timer time of the last command or retry */
+
+// Queued commands. The queue only carries the record number, so a newer
+// command can still overwrite a queued one in place. There is one record per
+// queue entry, so a free record means the queue has room.
+static mesh_cmd_t s_records[MESH_TX_QUEUE_SIZE];
+static uint16_t s_record_seq[MESH_TX_QUEUE_SIZE];   /* Submit order, see after_barrier() */
+static uint8_t s_free_records[MESH_TX_QUEUE_SIZE];
+static int s_free_count;
+
+// Per lamp and group: the queued record a newer command of that type may
+// overwrite (MESH_TX_NO_RECORD if none), and the type of the newest queued
+// command (-1 if none). Four bytes per lamp, the commands stay in s_records.
+static uint8_t s_slots[MESH_TX_INDEX_COUNT][MESH_CMD_TYPE_COUNT];
+static int8_t s_last_type[MESH_TX_INDEX_COUNT];
+static uint16_t s_next_seq = 1;
+// Submit order of the newest lamp and group command. Group members are not
+// known here, so nothing queued for a lamp may be overwritten past a later
+// group command and vice versa.
+static uint16_t s_lamp_barrier;
+static uint16_t s_group_barrier;
+static portMUX_TYPE s_slot_lock = portMUX_INITIALIZER_UNLOCKED;
+// Held by mesh_tx_submit() from taking a record until its queue entry is
+// sent, so records enter the queue in submit order (the order the barriers
+// assume) when more than one task submits. xQueueSend() may not be called
+// inside the s_slot_lock critical section.
+static SemaphoreHandle_t s_submit_lock;
+static StaticSemaphore_t s_submit_lock_buf;
+
+static mesh_inflight_t s_inflight[MESH_ACK_MAX_INFLIGHT];
+static portMUX_TYPE s_inflight_lock = portMUX_INITIALIZER_UNLOCKED;
+// Acked commands waiting for a free in-flight entry or for another acked
+// message to their address (a state poll) to finish, at most one per address,
+// oldest first. Later commands for a held address are merged into it.
+static mesh_cmd_t s_held[MESH_TX_HELD_MAX];
+static int s_held_count;
+// Dequeued command that may not go past the held ones (the held table is full,
+// or a group command has a held member). It stops the queue until it is sent.
+static mesh_cmd_t s_blocked;
+static bool s_blocked_valid;
+
+// queued/dropped/coalesced/max_depth are written by the submitting tasks
+// (MQTT and the bridge fade steps) under s_submit_lock with atomic adds, all
+// others only by the TX task
+static volatile uint32_t s_queued;
+static volatile uint32_t s_dropped;
+static volatile uint32_t s_coalesced;
+static volatile uint32_t s_sent;
+static volatile uint32_t s_failed;
+static volatile uint32_t s_max_depth;
+static volatile uint32_t s_merged;
+static volatile uint32_t s_acked_sent;
+static volatile uint32_t s_retries;
+static volatile uint32_t s_delivered;
+static volatile uint32_t s_gave_up;
+
+static bool slot_valid(const mesh_cmd_t *cmd)
+{
+    return cmd->index >= 0 && cmd->index < MESH_TX_INDEX_COUNT && cmd->type < MESH_CMD_TYPE_COUNT;
+}
+
+// Function to check that a queued record was submitted after a barrier. A
+// queued record is at most MESH_TX_QUEUE_SIZE submits old, so comparing the
+// distances back from s_next_seq is exact for it even across the 16 bit
+// wrap; a barrier so old that it wrapped at worst prevents a coalesce.
+// Called with s_slot_lock held.
+static bool after_barrier(uint16_t seq, uint16_t barrier)
+{
+    return (uint16_t)(s_next_seq - seq) < (uint16_t)(s_next_seq - barrier);
+}
+
+// Function to take a dequeued record: copy out the command with the latest
+// value written into it and return the record to the free list
+static void take_record(uint8_t record, mesh_cmd_t *cmd)
+{
+    portENTER_CRITICAL(&s_slot_lock);
+    *cmd = s_records[record];
+    if (slot_valid(cmd) && s_slots[cmd->index][cmd->type] == record) {
+        s_slots[cmd->index][cmd->type] = MESH_TX_NO_RECORD;
+    }
+    s_free_records[s_free_count++] = record;
+    portEXIT_CRITICAL(&s_slot_lock);
+}
+
+static int64_t backoff_us(uint8_t retries)
+{
+    uint32_t ms = MESH_ACK_BACKOFF_MS;
+    for (uint8_t i = 0; i < retries && ms < MESH_ACK_BACKOFF_MAX_MS; i++) {
+        ms *= 2;
+    }
+    if (ms > MESH_ACK_BACKOFF_MAX_MS) {
+        ms = MESH_ACK_BACKOFF_MAX_MS;
+    }
+    return (int64_t)ms * 1000;
+}
+
+static uint8_t inflight_state(mesh_inflight_t *entry)
+{
+    portENTER_CRITICAL(&s_inflight_lock);
+    uint8_t state = entry->state;
+    portEXIT_CRITICAL(&s_inflight_lock);
+    return state;
+}
+
+static void inflight_set_state(mesh_inflight_t *entry, uint8_t state, int64_t retry_at)
+{
+    portENTER_CRITICAL(&s_inflight_lock);
+    entry->state = state;
+    entry->retry_at = retry_at;
+    portEXIT_CRITICAL(&s_inflight_lock);
+}
+
+// Only the TX task allocates entries, so a FREE entry stays free here
+static mesh_inflight_t *inflight_find(uint16_t addr, bool free)
+{
+    for (int i = 0; i < MESH_ACK_MAX_INFLIGHT; i++) {
+        bool used = inflight_state(&s_inflight[i]) != INFLIGHT_FREE;
+        if (free ? !used : (used && s_inflight[i].cmd.addr == addr)) {
+            return &s_inflight[i];
+        }
+    }
+    return NULL;
+}
+
+static int inflight_count(void)
+{
+    int count = 0;
+    for (int i = 0; i < MESH_ACK_MAX_INFLIGHT; i++) {
+        if (inflight_state(&s_inflight[i]) != INFLIGHT_FREE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Function to merge a newer command into a waiting one for the same address.
+// Only the latest state matters, but an HSL or brightness command keeps the
+// part of the waiting one it does not set itself.
+static void merge_cmd(mesh_cmd_t *waiting, const mesh_cmd_t *cmd)
+{
+    s_merged++;
+    if (cmd->type == MESH_CMD_ONOFF && cmd->onoff && waiting->type != MESH_CMD_ONOFF) {
+        // Lightness and HSL switch the lamp on anyway
+        return;
+    }
+    if (cmd->type == MESH_CMD_LIGHTNESS && waiting->type == MESH_CMD_HSL) {
+        waiting->lightness = cmd->lightness;
+        waiting->flags &= ~MESH_CMD_FLAG_KEEP_LIGHTNESS;
+        return;
+    }
+    if (cmd->type == MESH_CMD_HSL && (cmd->flags & MESH_CMD_FLAG_KEEP_LIGHTNESS) &&
+        waiting->type == MESH_CMD_LIGHTNESS) {
+        uint16_t lightness = waiting->lightness;
+        *waiting = *cmd;
+        waiting->lightness = lightness;
+        waiting->flags &= ~MESH_CMD_FLAG_KEEP_LIGHTNESS;
+        return;
+    }
+    *waiting = *cmd;
+}
+
+// Function to park a command behind the one in flight for its address
+static void inflight_park(mesh_inflight_t *entry, const mesh_cmd_t *cmd)
+{
+    if (inflight_state(entry) == INFLIGHT_PARKED) {
+        // The entry's own command is not sent yet, the newer one goes with it
+        merge_cmd(&entry->cmd, cmd);
+        return;
+    }
+    if (!entry->has_parked) {
+        entry->parked = *cmd;
+        entry->has_parked = true;
+        return;
+    }
+    merge_cmd(&entry->parked, cmd);
+}
+
+static int lamp_of(const mesh_cmd_t *cmd)
+{
+    return cmd->index < MAX_LAMPS ? cmd->index : -1;
+}
+
+// Function to send a command for the first time. Acked commands need an
+// in-flight entry: entry, or else a free one the caller checked for.
+static void transmit(mesh_cmd_t *cmd, mesh_inflight_t *entry)
+{
+    mesh_tx_attempt_t attempt = { .retry = false };
+    uint32_t start = latency_now();
+    esp_err_t err = s_send(cmd, &attempt);
+    uint32_t end = latency_now();
+    s_last_send = esp_timer_get_time();
+    // Fade steps are no MQTT commands of their own, only the target is measured
+    bool measured = !(cmd->flags & MESH_CMD_FLAG_FADE_STEP);
+    if (measured) {
+        latency_record(LATENCY_QUEUE, -1, start - cmd->t_submit);
+        latency_record(LATENCY_SEND, -1, end - start);
+    }
+
+    if (!(cmd->flags & MESH_CMD_FLAG_ACKED)) {
+        if (err == ESP_OK) {
+            s_sent++;
+            if (measured) {
+                latency_record(LATENCY_TOTAL, lamp_of(cmd), end - cmd->t_recv);
+            }
+            ESP_LOGD(TAG, "0x%04x tid %u sent after %" PRIu32 " us", cmd->addr, attempt.tid, end - cmd->t_recv);
+            s_done(cmd, true);
+        } else {
+            s_failed++;
+        }
+        return;
+    }
+
+    if (entry == NULL) {
+        entry = inflight_find(0, true);
+    }
+    entry->cmd = *cmd;
+    entry->has_parked = false;
+    entry->tid = attempt.tid;
+    entry->opcode = attempt.opcode;
+    entry->retries = 0;
+    entry->sent_at = start;
+    if (err == ESP_OK) {
+        s_sent++;
+        s_acked_sent++;
+        // The answer may arrive before this, the callbacks ignore FREE entries
+        inflight_set_state(entry, INFLIGHT_WAITING, 0);
+    } else {
+        // e.g. the stack still has a message to this address outstanding
+        s_failed++;
+        inflight_set_state(entry, INFLIGHT_TIMED_OUT, esp_timer_get_time() + backoff_us(0));
+    }
+}
+
+// Function to finish an entry. A command parked behind it takes the entry
+// over and is sent by inflight_service() like a held one, once no other acked
+// message to the address (a state poll) is outstanding; sending it right here
+// would be refused by the stack and end up in retry backoff.
+static void inflight_release(mesh_inflight_t *entry, bool delivered)
+{
+    s_done(&entry->cmd, delivered);
+    if (!entry->has_parked) {
+        inflight_set_state(entry, INFLIGHT_FREE, 0);
+        return;
+    }
+    entry->cmd = entry->parked;
+    entry->has_parked = false;
+    inflight_set_state(entry, INFLIGHT_PARKED, 0);
+}
+
+static void inflight_service(void)
+{
+    for (int i = 0; i < MESH_ACK_MAX_INFLIGHT; i++) {
+        mesh_inflight_t *entry = &s_inflight[i];
+
+        portENTER_CRITICAL(&s_inflight_lock);
+        uint8_t state = entry->state;
+        int64_t retry_at = entry->retry_at;
+        portEXIT_CRITICAL(&s_inflight_lock);
+
+        if (state == INFLIGHT_PARKED) {
+            if (s_busy == NULL || !s_busy(entry->cmd.addr)) {
+                mesh_cmd_t cmd = entry->cmd;
+                transmit(&cmd, entry);
+            }
+        } else if (state == INFLIGHT_ACKED) {
+            s_delivered++;
+            uint32_t ack_us = entry->answered_at - entry->sent_at;
+            uint32_t total_us = entry->answered_at - entry->cmd.t_recv;
+            latency_record(LATENCY_ACK, lamp_of(&entry->cmd), ack_us);
+            latency_record(LATENCY_TOTAL, lamp_of(&entry->cmd), total_us);
+            ESP_LOGD(TAG, "0x%04x tid %u answered, ack %" PRIu32 " us, total %" PRIu32 " us",
+                     entry->cmd.addr, entry->tid, ack_us, total_us);
+            inflight_release(entry, true);
+        } else if (state == INFLIGHT_TIMED_OUT && esp_timer_get_time() >= retry_at) {
+            if (entry->retries >= MESH_ACK_MAX_RETRIES) {
+                s_gave_up++;
+                ESP_LOGW(TAG, "No answer from 0x%04x after %d retries", entry->cmd.addr, entry->retries);
+                inflight_release(entry, false);
+                continue;
+            }
+            entry->retries++;
+            s_retries++;
+            mesh_tx_attempt_t attempt = { .retry = true, .tid = entry->tid };
+            mesh_cmd_t cmd = entry->cmd;
+            inflight_set_state(entry, INFLIGHT_WAITING, 0);
+            s_last_send = esp_timer_get_time();
+            uint32_t start = latency_now();
+            esp_err_t err = s_send(&cmd, &attempt);
+            latency_record(LATENCY_SEND, -1, latency_now() - start);
+            if (err != ESP_OK) {
+                s_failed++;
+                inflight_set_state(entry, INFLIGHT_TIMED_OUT, esp_timer_get_time() + backoff_us(entry->retries));
+            } else {
+                entry->opcode = attempt.opcode;
+            }
+        }
+    }
+}
+
+static mesh_cmd_t *held_find(uint16_t addr)
+{
+    for (int i = 0; i < s_held_count; i++) {
+        if (s_held[i].addr == addr) {
+            return &s_held[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to check whether a group command would overtake a held command for
+// one of its members
+static bool held_conflicts(const mesh_cmd_t *cmd)
+{
+    GroupInfo group;
+
+    if (s_held_count == 0 || !lamp_registry_group_get(cmd->index - MAX_LAMPS, &group)) {
+        return false;
+    }
+    for (int i = 0; i < s_held_count; i++) {
+        if (s_held[i].index >= 0 && s_held[i].index < MAX_LAMPS && group_has_member(&group, s_held[i].index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to check whether an acked message to addr has to wait: the stack
+// refuses it while another one to the same address is outstanding
+static bool must_hold(uint16_t addr)
+{
+    return inflight_find(0, true) == NULL || (s_busy != NULL && s_busy(addr));
+}
+
+// Function to send held commands, oldest first, once they may go out
+static void held_service(void)
+{
+    int kept = 0;
+
+    for (int i = 0; i < s_held_count; i++) {
+        if ((s_held[i].flags & MESH_CMD_FLAG_ACKED) && must_hold(s_held[i].addr)) {
+            s_held[kept++] = s_held[i];
+        } else {
+            transmit(&s_held[i], NULL);
+        }
+    }
+    s_held_count = kept;
+}
+
+// Function to send a dequeued command, or to hold it while the in-flight table
+// is full or a poll to its address is outstanding. Returns false if it cannot be placed and has to stop the queue.
+static bool dispatch(mesh_cmd_t *cmd)
+{
+    if (cmd->index >= MAX_LAMPS) {
+        if (held_conflicts(cmd)) {
+            return false;
+        }
+        transmit(cmd, NULL);
+        return true;
+    }
+    mesh_cmd_t *held = held_find(cmd->addr);
+    if (held != NULL) {
+        // Keeps the order for this address, acked or not
+        merge_cmd(held, cmd);
+        return true;
+    }
+    if (cmd->flags & MESH_CMD_FLAG_ACKED) {
+        mesh_inflight_t *entry = inflight_find(cmd->addr, false);
+        if (entry != NULL) {
+            inflight_park(entry, cmd);
+            return true;
+        }
+        if (must_hold(cmd->addr)) {
+            if (s_held_count == MESH_TX_HELD_MAX) {
+                return false;
+            }
+            s_held[s_held_count++] = *cmd;
+            return true;
+        }
+    }
+    transmit(cmd, NULL);
+    return true;
+}
+
+// Function to pick how long to wait for the next command
+static TickType_t next_wait(void)
+{
+    if (inflight_count() > 0 || s_held_count > 0 || s_blocked_valid) {
+        return pdMS_TO_TICKS(MESH_TX_POLL_MS);
+    }
+    if (s_idle == NULL || uxQueueMessagesWaiting(s_queue) > 0) {
+        return portMAX_DELAY;
+    }
+    int64_t quiet_left = s_last_send + MESH_TX_IDLE_QUIET_MS * 1000LL - esp_timer_get_time();
+    if (quiet_left > 0) {
+        return pdMS_TO_TICKS(quiet_left / 1000) + 1;
+    }
+    return s_idle();
+}
+
+static void mesh_tx_task(void *arg)
+{
+    uint8_t record;
+    mesh_cmd_t cmd;
+
+    for (;;) {
+        inflight_service();
+        held_service();
+        if (s_blocked_valid) {
+            if (!dispatch(&s_blocked)) {
+                vTaskDelay(pdMS_TO_TICKS(MESH_TX_POLL_MS));
+                continue;
+            }
+            s_blocked_valid = false;
+        }
+        if (xQueueReceive(s_queue, &record, next_wait()) != pdTRUE) {
+            continue;
+        }
+        take_record(record, &cmd);
+        if (!dispatch(&cmd)) {
+            s_blocked = cmd;
+            s_blocked_valid = true;
+        }
+    }
+}
+
+void mesh_tx_set_idle_handler(mesh_tx_idle_t idle)
+{
+    s_idle = idle;
+}
+
+void mesh_tx_set_busy_check(mesh_tx_busy_t busy)
+{
+    s_busy = busy;
+}
+
+esp_err_t mesh_tx_init(mesh_tx_send_t send, mesh_tx_done_t done)
+{
+    s_send = send;
+    s_done = done;
+    memset(s_slots, MESH_TX_NO_RECORD, sizeof(s_slots));
+    memset(s_last_type, -1, sizeof(s_last_type));
+    for (int i = 0; i < MESH_TX_QUEUE_SIZE; i++) {
+        s_free_records[i] = i;
+    }
+    s_free_count = MESH_TX_QUEUE_SIZE;
+    s_submit_lock = xSemaphoreCreateMutexStatic(&s_submit_lock_buf);
+    s_queue = xQueueCreateStatic(MESH_TX_QUEUE_SIZE, sizeof(uint8_t), s_queue_storage, &s_queue_buf);
+    if (s_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(mesh_tx_task, "mesh_tx", MESH_TX_STACK_SIZE, NULL, MESH_TX_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create mesh TX task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t mesh_tx_submit(const mesh_cmd_t *in)
+{
+    mesh_cmd_t cmd = *in;
+    cmd.t_submit = latency_now();
+
+    bool coalescable = slot_valid(&cmd);
+    bool is_group = cmd.index >= MAX_LAMPS;
+    uint8_t record;
+
+    xSemaphoreTake(s_submit_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&s_slot_lock);
+    if (coalescable) {
+        record = s_slots[cmd.index][cmd.type];
+        if (record != MESH_TX_NO_RECORD && s_last_type[cmd.index] == cmd.type &&
+            after_barrier(s_record_seq[record], is_group ? s_lamp_barrier : s_group_barrier)) {
+            // Still queued and nothing newer for this lamp: overwrite in place
+            s_records[record] = cmd;
+            portEXIT_CRITICAL(&s_slot_lock);
+            __atomic_fetch_add(&s_coalesced, 1, __ATOMIC_RELAXED);
+            xSemaphoreGive(s_submit_lock);
+            return ESP_OK;
+        }
+    }
+    if (s_free_count == 0) {
+        portEXIT_CRITICAL(&s_slot_lock);
+        __atomic_fetch_add(&s_dropped, 1, __ATOMIC_RELAXED);
+        xSemaphoreGive(s_submit_lock);
+        ESP_LOGW(TAG, "Queue full, dropping command for 0x%04x", cmd.addr);
+        return ESP_ERR_NO_MEM;
+    }
+    record = s_free_records[--s_free_count];
+    s_records[record] = cmd;
+    s_record_seq[record] = s_next_seq;
+    if (coalescable) {
+        s_slots[cmd.index][cmd.type] = record;
+        s_last_type[cmd.index] = cmd.type;
+        if (is_group) {
+            s_group_barrier = s_next_seq;
+        } else {
+            s_lamp_barrier = s_next_seq;
+        }
+    }
+    s_next_seq++;
+    portEXIT_CRITICAL(&s_slot_lock);
+
+    // A record is taken before its queue entry and freed after it, so there is room
+    xQueueSend(s_queue, &record, 0);
+    __atomic_fetch_add(&s_queued, 1, __ATOMIC_RELAXED);
+    uint32_t depth = uxQueueMessagesWaiting(s_queue);
+    // Only raised under s_submit_lock, the store just has to be whole
+    if (depth > __atomic_load_n(&s_max_depth, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&s_max_depth, depth, __ATOMIC_RELAXED);
+    }
+    xSemaphoreGive(s_submit_lock);
+    return ESP_OK;
+}
+
+// The message is matched by address and opcode: the stack allows only one
+// outstanding acked message per address, so the TID is not needed here
+static void inflight_report(uint16_t addr, uint32_t opcode, bool acked)
+{
+    portENTER_CRITICAL(&s_inflight_lock);
+    for (int i = 0; i < MESH_ACK_MAX_INFLIGHT; i++) {
+        mesh_inflight_t *entry = &s_inflight[i];
+        if (entry->state == INFLIGHT_WAITING && entry->cmd.addr == addr && entry->opcode == opcode) {
+            entry->state = acked ? INFLIGHT_ACKED : INFLIGHT_TIMED_OUT;
+            entry->answered_at = latency_now();
+            entry->retry_at = acked ? 0 : esp_timer_get_time() + backoff_us(entry->retries);
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_inflight_lock);
+}
+
+void mesh_tx_acked(uint16_t addr, uint32_t opcode)
+{
+    inflight_report(addr, opcode, true);
+}
+
+void mesh_tx_timed_out(uint16_t addr, uint32_t opcode)
+{
+    inflight_report(addr, opcode, false);
+}
+
+void mesh_tx_get_stats(mesh_tx_stats_t *stats)
+{
+    stats->queued = s_queued;
+    stats->dropped = s_dropped;
+    stats->coalesced = s_coalesced + s_merged;
+    stats->sent = s_sent;
+    stats->failed = s_failed;
+    stats->depth = s_queue ? uxQueueMessagesWaiting(s_queue) : 0;
+    stats->max_depth = s_max_depth;
+    stats->acked_sent = s_acked_sent;
+    stats->retries = s_retries;
+    stats->delivered = s_delivered;
+    stats->gave_up = s_gave_up;
+    stats->inflight = inflight_count();
+}
@@ -0,0 +1,136 @@
+#ifndef MESH_TX_H
+#define MESH_TX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include "lamp_nvs.h"
+
+/*
+ * Mesh transmit task.
+ *
+ * The MQTT handler only parses commands and queues compact records; a single
+ * task drains the queue and performs every esp_ble_mesh_*_set_state call, so a
+ * slow mesh send never stalls MQTT keepalives or other lamps' commands.
+ *
+ * Brightness and colour sliders send a stream of intermediate values. While a
+ * command for a lamp is still queued, a newer command of the same type for
+ * that lamp overwrites it in place instead of taking another queue slot, so
+ * only the latest value goes out. A command is only overwritten if nothing
+ * else was queued for the lamp after it, so the order between e.g. an OFF and
+ * a brightness change is kept. A group command is ordered against every lamp.
+ *
+ * Lamps in acknowledged mode get the acked Set opcodes. Each such message is
+ * kept in a small in-flight table (address, opcode, TID) until the lamp
+ * answers, and is retransmitted with the same TID and an exponential backoff
+ * when the stack reports a timeout. At most CONFIG_MESH_ACK_MAX_INFLIGHT
+ * messages are outstanding; while the table is full, further acked commands
+ * are held per address (latest wins) and unacked lamps and groups are still
+ * sent. Only a group command with a held member, or more held addresses than
+ * the hold table takes, stops the queue. A command for an address that is
+ * still in flight is parked in its entry (latest wins) and sent once the
+ * entry resolves; it keeps the entry until then. An acked command, parked or
+ * not, is also held while the busy function reports another acked message to
+ * its address, e.g. a state poll Get, since the stack would refuse it and
+ * push the command into retry backoff.
+ *
+ * When nothing is queued or in flight and the last command went out at least
+ * MESH_TX_IDLE_QUIET_MS ago, the task runs the idle function (the state
+ * poller, mesh_poll.h) instead of sleeping.
+ *
+ * Ownership: the TX task is the only writer of the message TID and makes all
+ * send and done calls. The mesh callbacks only report acks and timeouts.
+ * mesh_tx_submit() may be called from several tasks (the MQTT handler and the
+ * bridge fade steps); a submit lock keeps their records in the queue in the
+ * same order as the coalescing barriers see them.
+ */
+
+typedef enum {
+    MESH_CMD_ONOFF,
+    MESH_CMD_LIGHTNESS,
+    MESH_CMD_HSL,
+    MESH_CMD_TYPE_COUNT,
+} mesh_cmd_type_t;
+
+// Command index of a group; lamps use their registry slot directly
+#define MESH_TX_GROUP_INDEX(group)  (MAX_LAMPS + (group))
+#define MESH_TX_INDEX_COUNT         (MAX_LAMPS + MAX_GROUPS)
+
+// HSL command without a brightness, the send function fills in the last lightness
+#define MESH_CMD_FLAG_KEEP_LIGHTNESS (1 << 0)
+// Lamp in acknowledged mode: acked opcode, tracked and retried until it answers
+#define MESH_CMD_FLAG_ACKED          (1 << 1)
+// Intermediate step of a bridge fade (light_fade.h), not taken over into the shadow
+#define MESH_CMD_FLAG_FADE_STEP      (1 << 2)
+// The command gave a transition, trans_time is sent even if it is 0 (instant);
+// without it the lamp applies its own default transition
+#define MESH_CMD_FLAG_TRANSITION     (1 << 3)
+
+typedef struct {
+    uint16_t addr;          /* Destination unicast or group address */
+    int16_t index;          /* Lamp slot or MESH_TX_GROUP_INDEX(), used for the state publish */
+    uint8_t type;           /* mesh_cmd_type_t */
+    uint8_t flags;          /* MESH_CMD_FLAG_* */
+    uint8_t onoff;          /* MESH_CMD_ONOFF */
+    uint8_t trans_time;     /* Mesh Transition Time (light_transition_to_mesh), 0 = instant */
+    uint16_t lightness;     /* 0-65535, MESH_CMD_LIGHTNESS and MESH_CMD_HSL */
+    uint16_t hue;           /* 0-65535, MESH_CMD_HSL */
+    uint16_t saturation;    /* 0-65535, MESH_CMD_HSL */
+    uint32_t t_recv;        /* latency_now() when the MQTT message arrived, set by the caller */
+    uint32_t t_submit;      /* latency_now() when queued, set by mesh_tx_submit() */
+} mesh_cmd_t;
+
+typedef struct {
+    uint32_t queued;        /* Commands accepted into the queue */
+    uint32_t dropped;       /* Commands rejected because the queue was full */
+    uint32_t coalesced;     /* Commands overwritten by a newer one before sending */
+    uint32_t sent;          /* Commands handed to the mesh stack */
+    uint32_t failed;        /* Commands the mesh stack refused */
+    uint32_t depth;         /* Commands currently waiting */
+    uint32_t max_depth;     /* Highest depth seen */
+    uint32_t acked_sent;    /* Acked messages sent (first attempts) */
+    uint32_t retries;       /* Retransmissions of acked messages */
+    uint32_t delivered;     /* Acked messages the lamp answered */
+    uint32_t gave_up;       /* Acked messages that ran out of retries */
+    uint32_t inflight;      /* Acked messages currently outstanding */
+} mesh_tx_stats_t;
+
+// One transmission of a command
+typedef struct {
+    bool retry;             /* Retransmission, tid holds the TID of the first attempt */
+    uint8_t tid;            /* Set by the send function on the first attempt */
+    uint32_t opcode;        /* Set by the send function */
+} mesh_tx_attempt_t;
+
+// Function called by the TX task to send a command. It may resolve values in
+// cmd (e.g. MESH_CMD_FLAG_KEEP_LIGHTNESS), done() then sees the resolved command.
+typedef esp_err_t (*mesh_tx_send_t)(mesh_cmd_t *cmd, mesh_tx_attempt_t *attempt);
+// Function called by the TX task once a command is through: right after sending
+// for unacked commands, on the answer or after the last retry for acked ones
+typedef void (*mesh_tx_done_t)(const mesh_cmd_t *cmd, bool delivered);
+// Function called by the TX task when it has nothing to send, returns how
+// many ticks the task may wait for the next command before calling it again
+typedef TickType_t (*mesh_tx_idle_t)(void);
+// Function called by the TX task before an acked send, returns true while
+// another acked message to addr is outstanding outside mesh_tx
+typedef bool (*mesh_tx_busy_t)(uint16_t addr);
+
+// Function to create the queue and start the TX task
+esp_err_t mesh_tx_init(mesh_tx_send_t send, mesh_tx_done_t done);
+// Function to set the idle function, before mesh_tx_init()
+void mesh_tx_set_idle_handler(mesh_tx_idle_t idle);
+// Function to set the busy check for acked sends, before mesh_tx_init()
+void mesh_tx_set_busy_check(mesh_tx_busy_t busy);
+// Function to queue a command without blocking, or to replace a still queued
+// command of the same type for the same lamp. Returns ESP_ERR_NO_MEM if the queue is full
+esp_err_t mesh_tx_submit(const mesh_cmd_t *cmd);
+// Function to report the answer to an acked message (from the mesh client callbacks)
+void mesh_tx_acked(uint16_t addr, uint32_t opcode);
+// Function to report a timed out acked message (from the mesh client callbacks)
+void mesh_tx_timed_out(uint16_t addr, uint32_t opcode);
+// Function to read the queue counters
+void mesh_tx_get_stats(mesh_tx_stats_t *stats);
+
+#endif /* MESH_TX_H */
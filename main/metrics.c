@@ -0,0 +1,50 @@
+#include "metrics.h"
+#include "esp_ble_mesh_defs.h"
+
+typedef struct {
+    uint32_t opcode;
+    const char *name;
+} mesh_op_t;
+
+// Every opcode the bridge sends
+static const mesh_op_t s_mesh_ops[] = {
+    { ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET, "gen_onoff_set" },
+    { ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK, "gen_onoff_set_unack" },
+    { ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET, "gen_onoff_get" },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET, "light_lightness_set" },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_SET_UNACK, "light_lightness_set_unack" },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_LIGHTNESS_GET, "light_lightness_get" },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET, "light_hsl_set" },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_SET_UNACK, "light_hsl_set_unack" },
+    { ESP_BLE_MESH_MODEL_OP_LIGHT_HSL_GET, "light_hsl_get" },
+};
+
+#define MESH_OP_COUNT (sizeof(s_mesh_ops) / sizeof(s_mesh_ops[0]))
+
+volatile uint32_t g_metrics[METRIC_COUNT];
+static volatile uint32_t s_mesh_counts[MESH_OP_COUNT][METRIC_MESH_EVENT_COUNT];
+
+void metrics_mesh_op(uint32_t opcode, metric_mesh_event_t event)
+{
+    for (int i = 0; i < MESH_OP_COUNT; i++) {
+        if (s_mesh_ops[i].opcode == opcode) {
+            __atomic_fetch_add(&s_mesh_counts[i][event], 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+int metrics_mesh_op_count(void)
+{
+    return MESH_OP_COUNT;
+}
+
+const char *metrics_mesh_op_name(int op)
+{
+    return s_mesh_ops[op].name;
+}
+
+uint32_t metrics_mesh_get(int op, metric_mesh_event_t event)
+{
+    return s_mesh_counts[op][event];
+}
@@ -0,0 +1,57 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Counters shared by several tasks (MQTT, mesh TX, mesh callbacks, HTTP).
+ *
+ * They are bumped with a relaxed atomic add, which on the ESP32 is a single
+ * compare-and-set loop without any lock, and read with a plain load when
+ * /metrics is scraped. Counters with a single writer stay in their modules
+ * (mesh_tx, mesh_poll, mesh_persist) and are collected through their
+ * *_get_stats() functions at scrape time.
+ */
+
+typedef enum {
+    METRIC_MQTT_RECEIVED,       /* MQTT_EVENT_DATA events */
+    METRIC_MQTT_PUBLISHED,      /* Messages handed to the MQTT client */
+    METRIC_MQTT_PUBLISH_FAILED, /* Publishes the MQTT client refused */
+    METRIC_MQTT_OUTBOX_FULL,    /* Publishes refused, the outbox was over its byte budget */
+    METRIC_MQTT_OFFLINE,        /* Publishes refused while not connected */
+    METRIC_NVS_READS,
+    METRIC_NVS_WRITES,
+    METRIC_NVS_ERRORS,
+    METRIC_COUNT,
+} metric_id_t;
+
+// Per opcode mesh events
+typedef enum {
+    METRIC_MESH_SENT,           /* Accepted by the mesh stack */
+    METRIC_MESH_ERROR,          /* Refused by the mesh stack */
+    METRIC_MESH_TIMEOUT,        /* Acked message or Get without answer */
+    METRIC_MESH_EVENT_COUNT,
+} metric_mesh_event_t;
+
+extern volatile uint32_t g_metrics[METRIC_COUNT];
+
+static inline void metrics_inc(metric_id_t id)
+{
+    __atomic_fetch_add(&g_metrics[id], 1, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t metrics_get(metric_id_t id)
+{
+    return g_metrics[id];
+}
+
+// Function to count a mesh event for an opcode; opcodes the bridge does not send are ignored
+void metrics_mesh_op(uint32_t opcode, metric_mesh_event_t event);
+// Function to get the number of opcodes that are counted
+int metrics_mesh_op_count(void);
+// Function to get the name of a counted opcode (e.g. "light_hsl_set_unack")
+const char *metrics_mesh_op_name(int op);
+// Function to read a per opcode counter
+uint32_t metrics_mesh_get(int op, metric_mesh_event_t event);
+
+#endif /* METRICS_H */
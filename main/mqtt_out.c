@@ -0,0 +1,52 @@
+#include "mqtt_out.h"
+#include <string.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "metrics.h"
+
+#define TAG "MQTT_OUT"
+
+#define MQTT_OUTBOX_BUDGET  CONFIG_MQTT_OUTBOX_BUDGET
+// Fixed header, topic length and some slack of the outbox entry
+#define MQTT_OUT_OVERHEAD   16
+
+static esp_mqtt_client_handle_t s_client;
+static volatile bool s_connected;
+static volatile uint32_t s_outbox_max;
+
+void mqtt_out_set_client(esp_mqtt_client_handle_t client, bool connected)
+{
+    s_client = client;
+    s_connected = connected;
+}
+
+int mqtt_out_publish(const char *topic, const char *data, int len, int retain)
+{
+    if (s_client == NULL || !s_connected) {
+        // Enqueued now it would only go out stale after the reconnect, which announces everything anyway
+        metrics_inc(METRIC_MQTT_OFFLINE);
+        return -1;
+    }
+    int outbox = esp_mqtt_client_get_outbox_size(s_client);
+    int size = len + (int)strlen(topic) + MQTT_OUT_OVERHEAD;
+    if (outbox + size > MQTT_OUTBOX_BUDGET) {
+        ESP_LOGD(TAG, "Outbox full (%d bytes), refused %s", outbox, topic);
+        metrics_inc(METRIC_MQTT_OUTBOX_FULL);
+        return -1;
+    }
+    // QoS 0 messages are only kept until the MQTT task has written them
+    int msg_id = esp_mqtt_client_enqueue(s_client, topic, data, len, 0, retain, true);
+    metrics_inc(msg_id < 0 ? METRIC_MQTT_PUBLISH_FAILED : METRIC_MQTT_PUBLISHED);
+    if (msg_id >= 0 && (uint32_t)(outbox + size) > s_outbox_max) {
+        s_outbox_max = outbox + size;
+    }
+    return msg_id;
+}
+
+void mqtt_out_get_stats(mqtt_out_stats_t *stats)
+{
+    stats->outbox_bytes = s_client != NULL ? esp_mqtt_client_get_outbox_size(s_client) : 0;
+    stats->outbox_max_bytes = s_outbox_max;
+    stats->connected = s_connected;
+}
@@ -0,0 +1,37 @@
+#ifndef MQTT_OUT_H
+#define MQTT_OUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+
+/*
+ * Outbound MQTT publishes.
+ *
+ * Publishes are put into the esp-mqtt outbox (esp_mqtt_client_enqueue) and
+ * sent by the MQTT task, so a slow broker or a Wi-Fi hiccup never blocks the
+ * mesh TX task or the HTTP server on a TCP write. The outbox lives on the
+ * heap, so it gets a byte budget (CONFIG_MQTT_OUTBOX_BUDGET): a publish
+ * that would take it over the budget is refused, like one while the client
+ * is disconnected. The bridge keeps a refused state as pending, at most one
+ * per lamp, and sends the lamp's current state once the outbox has room
+ * again (see bridge.h), so nothing stale piles up.
+ *
+ * Several tasks publish at once, so the budget is checked without a lock
+ * and may be overshot by a message per task.
+ */
+
+typedef struct {
+    uint32_t outbox_bytes;      /* Bytes in the outbox now */
+    uint32_t outbox_max_bytes;  /* Most bytes in the outbox since boot */
+    bool connected;
+} mqtt_out_stats_t;
+
+// Function to hand over the client and its connection state (MQTT_EVENT_CONNECTED/DISCONNECTED)
+void mqtt_out_set_client(esp_mqtt_client_handle_t client, bool connected);
+// Function to publish a message (QoS 0), returns the message id or -1 if it was refused
+int mqtt_out_publish(const char *topic, const char *data, int len, int retain);
+// Function to read the outbox state
+void mqtt_out_get_stats(mqtt_out_stats_t *stats);
+
+#endif /* MQTT_OUT_H */
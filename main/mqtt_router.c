@@ -0,0 +1,67 @@
+#include "mqtt_router.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "lamp_registry.h"
+
+#define LITERAL_LEN(s) (sizeof(s) - 1)
+
+mqtt_route_type_t mqtt_route(const char *topic, int topic_len, mqtt_route_t *route)
+{
+    static const char set_suffix[] = "/set";
+
+    route->type = MQTT_ROUTE_NONE;
+    route->index = -1;
+    if (topic == NULL || topic_len <= 0) {
+        return route->type;
+    }
+    size_t len = topic_len;
+
+    if (len == LITERAL_LEN(HA_STATUS_TOPIC) && memcmp(topic, HA_STATUS_TOPIC, len) == 0) {
+        route->type = MQTT_ROUTE_HA_STATUS;
+        return route->type;
+    }
+
+    // homeassistant/light/<slug>/set, the slug is a single topic level
+    if (len <= LITERAL_LEN(HA_TOPIC_PREFIX) + LITERAL_LEN(set_suffix) ||
+        memcmp(topic, HA_TOPIC_PREFIX, LITERAL_LEN(HA_TOPIC_PREFIX)) != 0 ||
+        memcmp(topic + len - LITERAL_LEN(set_suffix), set_suffix, LITERAL_LEN(set_suffix)) != 0) {
+        return route->type;
+    }
+    const char *slug = topic + LITERAL_LEN(HA_TOPIC_PREFIX);
+    size_t slug_len = len - LITERAL_LEN(HA_TOPIC_PREFIX) - LITERAL_LEN(set_suffix);
+    if (memchr(slug, '/', slug_len) != NULL) {
+        return route->type;
+    }
+
+    route->index = lamp_registry_find_by_slug(slug, slug_len, &route->lamp);
+    if (route->index >= 0) {
+        route->type = MQTT_ROUTE_LAMP_SET;
+        return route->type;
+    }
+    route->index = lamp_registry_group_find_by_slug(slug, slug_len, &route->group);
+    if (route->index >= 0) {
+        route->type = MQTT_ROUTE_GROUP_SET;
+    }
+    return route->type;
+}
+
+static int name_topic(char *buf, size_t size, const char *name, const char *suffix)
+{
+    char slug[sizeof(((LampInfo *)0)->name)];
+    lamp_slugify(name, slug, sizeof(slug));
+    if (suffix) {
+        return snprintf(buf, size, HA_TOPIC_PREFIX "%s/%s", slug, suffix);
+    }
+    return snprintf(buf, size, HA_TOPIC_PREFIX "%s", slug);
+}
+
+int mqtt_lamp_topic(char *buf, size_t size, const LampInfo *lamp, const char *suffix)
+{
+    return name_topic(buf, size, lamp->name, suffix);
+}
+
+int mqtt_group_topic(char *buf, size_t size, const GroupInfo *group, const char *suffix)
+{
+    return name_topic(buf, size, group->name, suffix);
+}
@@ -0,0 +1,34 @@
+#ifndef MQTT_ROUTER_H
+#define MQTT_ROUTER_H
+
+#include <stddef.h>
+
+#include "lamp_nvs.h"
+
+#define HA_TOPIC_PREFIX         "homeassistant/light/"
+#define HA_STATUS_TOPIC         "homeassistant/status"
+// One wildcard subscription covers the command topic of every lamp
+#define HA_SET_SUBSCRIPTION     HA_TOPIC_PREFIX "+/set"
+
+typedef enum {
+    MQTT_ROUTE_NONE,        /* Not for us (or an unknown lamp) */
+    MQTT_ROUTE_LAMP_SET,    /* homeassistant/light/<slug>/set */
+    MQTT_ROUTE_GROUP_SET,   /* homeassistant/light/<group slug>/set */
+    MQTT_ROUTE_HA_STATUS,   /* homeassistant/status */
+} mqtt_route_type_t;
+
+typedef struct {
+    mqtt_route_type_t type;
+    int index;              /* Registry slot of the lamp or group */
+    LampInfo lamp;          /* Copy of the lamp for MQTT_ROUTE_LAMP_SET */
+    GroupInfo group;        /* Copy of the group for MQTT_ROUTE_GROUP_SET */
+} mqtt_route_t;
+
+// Function to resolve an incoming topic (not NUL-terminated) to its handler
+mqtt_route_type_t mqtt_route(const char *topic, int topic_len, mqtt_route_t *route);
+// Function to build "homeassistant/light/<slug>[/<suffix>]" for a lamp, returns the snprintf result
+int mqtt_lamp_topic(char *buf, size_t size, const LampInfo *lamp, const char *suffix);
+// Function to build "homeassistant/light/<slug>[/<suffix>]" for a group, returns the snprintf result
+int mqtt_group_topic(char *buf, size_t size, const GroupInfo *group, const char *suffix);
+
+#endif /* MQTT_ROUTER_H */